@@ -0,0 +1,205 @@
+/**
+ * @file crono_numa_bench.cpp
+ * @brief Measures the cost of DMA buffers on a remote NUMA node without
+ * hardware: allocates buffers with `CRONO_KERNEL_AllocDeviceLocalBuffer` for a
+ * device on the local node and for one on a remote node, then times the first
+ * touch and memcpy of each from a thread pinned by
+ * `CRONO_KERNEL_SetThreadDeviceAffinity` to the local node.
+ *
+ * Usage: `crono_numa_bench [size_mib] [reps] [local_node] [remote_node]`,
+ * defaults to 256 MiB, 5 repetitions, the node of the calling CPU, and the
+ * first other node having memory. The benchmark is skipped if the system has
+ * no remote node.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_userspace.h"
+#include <chrono>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <vector>
+
+/**
+ * Parses a sysfs list, e.g. "0-7,16-23", of the file at `path` into `items`.
+ */
+static int crono_bench_read_list(const char *path, std::vector<int> &items) {
+        char list[4096];
+        char *cursor = list;
+        char *end;
+        FILE *file;
+
+        items.clear();
+        file = fopen(path, "r");
+        if (NULL == file) {
+                return errno;
+        }
+        if (NULL == fgets(list, sizeof(list), file)) {
+                fclose(file);
+                return -EINVAL;
+        }
+        fclose(file);
+        while (*cursor != '\0' && *cursor != '\n') {
+                long first, last;
+
+                first = strtol(cursor, &end, 10);
+                if (end == cursor) {
+                        return -EINVAL;
+                }
+                last = first;
+                cursor = end;
+                if (*cursor == '-') {
+                        cursor++;
+                        last = strtol(cursor, &end, 10);
+                        if (end == cursor || last < first) {
+                                return -EINVAL;
+                        }
+                        cursor = end;
+                }
+                for (long item = first; item <= last; item++) {
+                        items.push_back(item);
+                }
+                if (*cursor == ',') {
+                        cursor++;
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Sets up `pDevice` as a device attached to `node`.
+ */
+static int crono_bench_device_on_node(PCRONO_KERNEL_DEVICE pDevice, int node) {
+        char path[PATH_MAX];
+        std::vector<int> cpus;
+        int ret;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        ret = crono_bench_read_list(path, cpus);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        pDevice->dwDeviceId = 1;
+        pDevice->numa_node = node;
+        CPU_ZERO(&pDevice->local_cpus);
+        for (int cpu : cpus) {
+                if (cpu < CPU_SETSIZE) {
+                        CPU_SET(cpu, &pDevice->local_cpus);
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Allocates `size` bytes for `pDevice`, and times the first touch and `reps`
+ * copies to `dst`, printed in GiB/s.
+ */
+static int crono_bench_node(PCRONO_KERNEL_DEVICE pDevice, const char *name,
+                            size_t size, uint32_t reps, uint8_t *dst) {
+        std::chrono::steady_clock::time_point start;
+        std::chrono::duration<double> touch, copy;
+        void *buf;
+        int ret;
+
+        ret = CRONO_KERNEL_AllocDeviceLocalBuffer(pDevice, size, &buf);
+        if (CRONO_SUCCESS != ret) {
+                printf("Error allocating on node <%d>: %d\n",
+                       pDevice->numa_node, ret);
+                return ret;
+        }
+        start = std::chrono::steady_clock::now();
+        memset(buf, 1, size);
+        touch = std::chrono::steady_clock::now() - start;
+
+        // Once untimed, so both buffers are copied with `dst` warm
+        memcpy(dst, buf, size);
+        start = std::chrono::steady_clock::now();
+        for (uint32_t irep = 0; irep < reps; irep++) {
+                memcpy(dst, buf, size);
+        }
+        copy = std::chrono::steady_clock::now() - start;
+
+        printf("%-7s node <%d>: touch <%6.2f> GiB/s, memcpy <%6.2f> GiB/s\n",
+               name, pDevice->numa_node,
+               size / touch.count() / (1 << 30),
+               (double)size * reps / copy.count() / (1 << 30));
+        return CRONO_KERNEL_FreeDeviceLocalBuffer(buf, size);
+}
+
+int main(int argc, char *argv[]) {
+        size_t size = (argc > 1 ? strtoul(argv[1], NULL, 0) : 256) << 20;
+        uint32_t reps = argc > 2 ? strtoul(argv[2], NULL, 0) : 5;
+        CRONO_KERNEL_DEVICE local = {};
+        CRONO_KERNEL_DEVICE remote = {};
+        std::vector<int> nodes;
+        int local_node, remote_node = -1;
+        unsigned cpu, node;
+        uint8_t *dst;
+        int ret;
+
+        if (0 == size || 0 == reps) {
+                printf("Usage: %s [size_mib] [reps] [local_node] "
+                       "[remote_node]\n",
+                       argv[0]);
+                return -EINVAL;
+        }
+        ret = crono_bench_read_list("/sys/devices/system/node/has_memory",
+                                    nodes);
+        if (CRONO_SUCCESS != ret) {
+                // Kernel without NUMA support
+                printf("No NUMA nodes found, skipped.\n");
+                return CRONO_SUCCESS;
+        }
+        if (0 != syscall(SYS_getcpu, &cpu, &node, NULL)) {
+                node = nodes[0];
+        }
+        local_node = argc > 3 ? atoi(argv[3]) : node;
+        if (argc > 4) {
+                remote_node = atoi(argv[4]);
+        } else {
+                for (int candidate : nodes) {
+                        if (candidate != local_node) {
+                                remote_node = candidate;
+                                break;
+                        }
+                }
+        }
+        if (remote_node < 0) {
+                printf("No remote NUMA node, node <%d> is the only one with "
+                       "memory, skipped.\n",
+                       local_node);
+                return CRONO_SUCCESS;
+        }
+
+        ret = crono_bench_device_on_node(&local, local_node);
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_bench_device_on_node(&remote, remote_node);
+        }
+        if (CRONO_SUCCESS != ret) {
+                printf("Error reading the CPUs of the nodes: %d\n", ret);
+                return ret;
+        }
+
+        // Copy on the local node, as the thread consuming the DMA data would
+        ret = CRONO_KERNEL_SetThreadDeviceAffinity(&local);
+        if (CRONO_SUCCESS != ret) {
+                printf("Error pinning the thread to node <%d>: %d\n",
+                       local_node, ret);
+                return ret;
+        }
+        dst = (uint8_t *)malloc(size);
+        CRONO_RET_ERR_CODE_IF_NULL(dst, -ENOMEM);
+        memset(dst, 0, size);
+
+        printf("Buffer <%zu> MiB, <%u> copies, thread on node <%d>\n",
+               size >> 20, reps, local_node);
+        ret = crono_bench_node(&local, "Local", size, reps, dst);
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_bench_node(&remote, "Remote", size, reps, dst);
+        }
+        free(dst);
+        return ret;
+}
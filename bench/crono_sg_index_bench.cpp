@@ -0,0 +1,168 @@
+/**
+ * @file crono_sg_index_bench.cpp
+ * @brief Measures the SG buffer address translation of a device without
+ * hardware: indexes a synthetic buffer of `pages` 4 KiB pages, physically
+ * contiguous in runs of `run_pages` pages, then times random lookups through
+ * the index against the linear scan of `CRONO_KERNEL_DMA_SG::Page`.
+ *
+ * Usage: `crono_sg_index_bench [pages] [run_pages] [lookups]`, defaults to
+ * 1M pages (4 GiB) in runs of 4 pages, and 1M lookups.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#define CRONO_BENCH_PAGE_SIZE 4096
+#define CRONO_BENCH_LINEAR_LOOKUPS 1000 // The scan is too slow for more
+
+static double crono_bench_ns(std::chrono::steady_clock::time_point start,
+                             uint64_t count) {
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        return elapsed.count() / count;
+}
+
+/**
+ * Translates `phys` by scanning the pages, as done without the index.
+ */
+static void *crono_bench_linear(const CRONO_KERNEL_DMA_SG *pDma,
+                                DMA_ADDR phys) {
+        for (uint32_t ipage = 0; ipage < pDma->dwPages; ipage++) {
+                const CRONO_KERNEL_DMA_PAGE *page = &pDma->Page[ipage];
+                if (phys >= page->pPhysicalAddr &&
+                    phys - page->pPhysicalAddr < page->dwBytes) {
+                        return (uint8_t *)pDma->pUserAddr +
+                               (uint64_t)ipage * CRONO_BENCH_PAGE_SIZE +
+                               (phys - page->pPhysicalAddr);
+                }
+        }
+        return NULL;
+}
+
+int main(int argc, char *argv[]) {
+        uint32_t pages = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+        uint32_t run_pages = argc > 2 ? strtoul(argv[2], NULL, 0) : 4;
+        uint32_t lookups = argc > 3 ? strtoul(argv[3], NULL, 0) : 1 << 20;
+        CRONO_KERNEL_DEVICE device = {};
+        CRONO_KERNEL_DMA_SG dma = {};
+        std::vector<CRONO_KERNEL_DMA_PAGE> page_list;
+        std::vector<uint32_t> order;
+        std::vector<DMA_ADDR> phys;
+        std::vector<void *> virt;
+        std::mt19937_64 rng(1);
+        std::chrono::steady_clock::time_point start;
+        uint32_t not_found = 0;
+        void *pUserAddr;
+        DMA_ADDR physAddr;
+        volatile uint64_t check = 0; // Keeps the lookups from being elided
+        int ret;
+
+        if (0 == pages || 0 == run_pages || 0 == lookups) {
+                printf("Usage: %s [pages] [run_pages] [lookups]\n", argv[0]);
+                return -EINVAL;
+        }
+
+        // Place the runs at shuffled physical addresses, with a gap between
+        // each, so no two runs merge.
+        order.resize((pages + run_pages - 1) / run_pages);
+        for (uint32_t irun = 0; irun < order.size(); irun++) {
+                order[irun] = irun;
+        }
+        std::shuffle(order.begin(), order.end(), rng);
+        page_list.resize(pages);
+        for (uint32_t ipage = 0; ipage < pages; ipage++) {
+                page_list[ipage].pPhysicalAddr =
+                    (DMA_ADDR)order[ipage / run_pages] * (run_pages + 1) *
+                        CRONO_BENCH_PAGE_SIZE +
+                    (DMA_ADDR)(ipage % run_pages) * CRONO_BENCH_PAGE_SIZE;
+                page_list[ipage].dwBytes = CRONO_BENCH_PAGE_SIZE;
+        }
+        device.dwDeviceId = 1;
+        dma.id = 1;
+        dma.dwPages = pages;
+        dma.Page = page_list.data();
+        dma.pUserAddr = (void *)0x100000000000ULL;
+
+        start = std::chrono::steady_clock::now();
+        ret = crono_sg_index_add(&device, &dma);
+        if (CRONO_SUCCESS != ret) {
+                printf("Error indexing the buffer: %d\n", ret);
+                return ret;
+        }
+        printf("Pages <%u>, runs <%zu>, index build <%.1f> ms\n", pages,
+               order.size(), crono_bench_ns(start, 1000000));
+
+        phys.resize(lookups);
+        virt.resize(lookups);
+        for (uint32_t ilookup = 0; ilookup < lookups; ilookup++) {
+                uint32_t ipage = rng() % pages;
+                phys[ilookup] = page_list[ipage].pPhysicalAddr +
+                                rng() % CRONO_BENCH_PAGE_SIZE;
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (uint32_t ilookup = 0; ilookup < CRONO_BENCH_LINEAR_LOOKUPS &&
+                                   ilookup < lookups;
+             ilookup++) {
+                check += (uintptr_t)crono_bench_linear(&dma, phys[ilookup]);
+        }
+        printf("Linear scan:      <%10.1f> ns/lookup\n",
+               crono_bench_ns(start, lookups < CRONO_BENCH_LINEAR_LOOKUPS
+                                         ? lookups
+                                         : CRONO_BENCH_LINEAR_LOOKUPS));
+
+        start = std::chrono::steady_clock::now();
+        for (uint32_t ilookup = 0; ilookup < lookups; ilookup++) {
+                CRONO_KERNEL_DMASGPhysToVirt(&device, phys[ilookup],
+                                             &pUserAddr);
+                check += (uintptr_t)pUserAddr;
+        }
+        printf("PhysToVirt:       <%10.1f> ns/lookup\n",
+               crono_bench_ns(start, lookups));
+
+        start = std::chrono::steady_clock::now();
+        for (uint32_t ilookup = 0; ilookup < lookups; ilookup++) {
+                CRONO_KERNEL_DMASGVirtToPhys(
+                    &device,
+                    (uint8_t *)dma.pUserAddr +
+                        (phys[ilookup] % CRONO_BENCH_PAGE_SIZE) +
+                        (uint64_t)(ilookup % pages) * CRONO_BENCH_PAGE_SIZE,
+                    &physAddr);
+                check += physAddr;
+        }
+        printf("VirtToPhys:       <%10.1f> ns/lookup\n",
+               crono_bench_ns(start, lookups));
+
+        start = std::chrono::steady_clock::now();
+        CRONO_KERNEL_DMASGPhysToVirtBatch(&device, phys.data(), virt.data(),
+                                          lookups, &not_found);
+        printf("PhysToVirtBatch:  <%10.1f> ns/lookup\n",
+               crono_bench_ns(start, lookups));
+        if (0 != not_found) {
+                printf("Error: <%u> addresses not found\n", not_found);
+                return -ENOENT;
+        }
+
+        // Sequential addresses, as read from a descriptor ring
+        for (uint32_t ilookup = 0; ilookup < lookups; ilookup++) {
+                phys[ilookup] = page_list[ilookup % pages].pPhysicalAddr;
+        }
+        start = std::chrono::steady_clock::now();
+        CRONO_KERNEL_DMASGPhysToVirtBatch(&device, phys.data(), virt.data(),
+                                          lookups, &not_found);
+        printf("Batch sequential: <%10.1f> ns/lookup\n",
+               crono_bench_ns(start, lookups));
+
+        crono_sg_index_free(&device);
+        if (0 != not_found) {
+                printf("Error: <%u> addresses not found\n", not_found);
+                return -ENOENT;
+        }
+        return CRONO_SUCCESS;
+}
@@ -0,0 +1,176 @@
+/**
+ * @file crono_sysfs_bench.cpp
+ * @brief Measures `crono_read_config_batch` against the synchronous
+ * `crono_read_config` loop it replaces, without devices: generates a tree of
+ * `count` device directories, each with a 4 KiB `config` file, under
+ * `SYS_BUS_PCIDEVS_PATH`, set by the Makefile to a tmpfs directory, then reads
+ * the Vendor and Device IDs of all of them, as `CRONO_KERNEL_PciScanDevices`
+ * does.
+ *
+ * Usage: `crono_sysfs_bench [count] [reps]`, defaults to 4000 devices and 10
+ * repetitions. The tree is removed on exit.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_userspace.h"
+#include <chrono>
+#include <vector>
+
+#define CRONO_BENCH_CONFIG_SIZE 4096
+
+/**
+ * Slot of the `index`th generated device, functions of devices of buses of
+ * domain 0.
+ */
+static void crono_bench_slot(uint32_t index, CRONO_CONFIG_READ *read) {
+        read->domain = 0;
+        read->bus = (index >> 8) & 0xff;
+        read->dev = (index >> 3) & 0x1f;
+        read->func = index & 0x7;
+}
+
+/**
+ * Creates the `config` file of the device of `read`.
+ */
+static int crono_bench_create_device(const CRONO_CONFIG_READ *read,
+                                     const uint8_t *config) {
+        char path[PATH_MAX];
+        int fd;
+
+        CRONO_CONSTRUCT_CONFIG_FILE_PATH(path, read->domain, read->bus,
+                                         read->dev, read->func);
+        *strrchr(path, '/') = '\0';
+        if (0 != mkdir(path, 0755) && EEXIST != errno) {
+                return errno;
+        }
+        strcat(path, "/config");
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                return errno;
+        }
+        if (CRONO_BENCH_CONFIG_SIZE !=
+            write(fd, config, CRONO_BENCH_CONFIG_SIZE)) {
+                close(fd);
+                return EIO;
+        }
+        close(fd);
+        return CRONO_SUCCESS;
+}
+
+static void crono_bench_remove_tree(uint32_t count) {
+        CRONO_CONFIG_READ read;
+        char path[PATH_MAX];
+
+        for (uint32_t idev = 0; idev < count; idev++) {
+                crono_bench_slot(idev, &read);
+                CRONO_CONSTRUCT_CONFIG_FILE_PATH(path, read.domain, read.bus,
+                                                 read.dev, read.func);
+                unlink(path);
+                *strrchr(path, '/') = '\0';
+                rmdir(path);
+        }
+        rmdir(SYS_BUS_PCIDEVS_PATH);
+}
+
+static double crono_bench_us(std::chrono::steady_clock::time_point start) {
+        std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+        uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 4000;
+        uint32_t reps = argc > 2 ? strtoul(argv[2], NULL, 0) : 10;
+        uint8_t config[CRONO_BENCH_CONFIG_SIZE] = {0x13, 0x1a, 0x08, 0x00};
+        std::vector<CRONO_CONFIG_READ> reads;
+        std::vector<uint32_t> ids;
+        std::chrono::steady_clock::time_point start;
+        CRONO_URING_READ probe;
+        char probe_path[PATH_MAX];
+        double sync_us = 0, batch_us = 0;
+        uint32_t errors = 0;
+        int ret = CRONO_SUCCESS;
+
+        if (0 == count || count > 0x10000 || 0 == reps) {
+                printf("Usage: %s [count, up to 65536] [reps]\n", argv[0]);
+                return -EINVAL;
+        }
+
+        // ____________
+        // Create tree
+        //
+        if (0 != mkdir(SYS_BUS_PCIDEVS_PATH, 0755) && EEXIST != errno) {
+                printf("Error creating <%s>: %d\n", SYS_BUS_PCIDEVS_PATH,
+                       errno);
+                return errno;
+        }
+        reads.resize(count);
+        ids.resize(count);
+        for (uint32_t idev = 0; idev < count && CRONO_SUCCESS == ret; idev++) {
+                crono_bench_slot(idev, &reads[idev]);
+                ret = crono_bench_create_device(&reads[idev], config);
+        }
+        if (CRONO_SUCCESS != ret) {
+                printf("Error creating the device tree: %d\n", ret);
+                crono_bench_remove_tree(count);
+                return ret;
+        }
+
+        // The batch silently reads synchronously without io_uring
+        CRONO_CONSTRUCT_CONFIG_FILE_PATH(probe_path, 0, 0, 0, 0);
+        probe = {probe_path, &ids[0], 0, sizeof(uint32_t), 0};
+        printf("Devices <%u> under <%s>, io_uring <%s>\n", count,
+               SYS_BUS_PCIDEVS_PATH,
+               CRONO_SUCCESS == crono_uring_read_files(&probe, 1)
+                   ? "available"
+                   : "not available, batch reads synchronously");
+
+        // ____
+        // Read
+        //
+        for (uint32_t irep = 0; irep < reps; irep++) {
+                start = std::chrono::steady_clock::now();
+                for (uint32_t idev = 0; idev < count; idev++) {
+                        CRONO_CONFIG_READ *read = &reads[idev];
+                        if (CRONO_SUCCESS !=
+                            crono_read_config(read->domain, read->bus,
+                                              read->dev, read->func, &ids[idev],
+                                              0, sizeof(uint32_t),
+                                              &read->bytes_read)) {
+                                errors++;
+                        }
+                }
+                sync_us += crono_bench_us(start);
+
+                for (uint32_t idev = 0; idev < count; idev++) {
+                        reads[idev].data = &ids[idev];
+                        reads[idev].offset = 0;
+                        reads[idev].size = sizeof(uint32_t);
+                }
+                start = std::chrono::steady_clock::now();
+                crono_read_config_batch(reads.data(), count);
+                batch_us += crono_bench_us(start);
+                for (uint32_t idev = 0; idev < count; idev++) {
+                        if (CRONO_SUCCESS != reads[idev].err ||
+                            0x00081a13 != ids[idev]) {
+                                errors++;
+                        }
+                }
+        }
+        printf("%-24s <%9.1f> us, <%6.2f> us/device\n",
+               "crono_read_config loop:", sync_us / reps,
+               sync_us / reps / count);
+        printf("%-24s <%9.1f> us, <%6.2f> us/device\n",
+               "crono_read_config_batch:", batch_us / reps,
+               batch_us / reps / count);
+
+        crono_bench_remove_tree(count);
+        if (0 != errors) {
+                printf("Error: <%u> reads failed\n", errors);
+                return -EIO;
+        }
+        return CRONO_SUCCESS;
+}
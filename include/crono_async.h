@@ -0,0 +1,718 @@
+/**
+ * @file crono_async.h
+ * @brief Optional C++20 coroutine layer on top of the `CRONO_KERNEL_*` API.
+ *
+ * `crono_async::Executor` owns a thread pool and an epoll reactor thread.
+ * Calls that block in the kernel module (open, DMA lock/unlock) are run on the
+ * pool, while waits for registers, events and ring buffer data suspend the
+ * coroutine on the reactor and hold no thread, so a few threads can drive many
+ * devices.
+ *
+ * Usage:
+ * @code
+ * crono_async::Executor ex(2);
+ * auto acquire = [&](CRONO_KERNEL_DEVICE_HANDLE hDev)
+ *     -> crono_async::Task<uint32_t> {
+ *         co_return co_await crono_async::async_wait_register(
+ *             ex, hDev, 0x10, 0x1, 0x1, std::chrono::milliseconds(100));
+ * };
+ * uint32_t ret = crono_async::sync_wait(ex, acquire(hDev));
+ * @endcode
+ *
+ * The executor must outlive all tasks it runs.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_ASYNC_H_
+#define _CRONO_ASYNC_H_
+
+#if !defined(__cplusplus) || __cplusplus < 202002L
+#error "crono_async.h requires C++20"
+#endif
+
+#include "crono_kernel_interface.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace crono_async {
+
+class Executor;
+template <typename T = void> class Task;
+
+namespace detail {
+
+/**
+ * State of a coroutine suspended on the reactor. The reactor resumes it once,
+ * either when `fd` is readable or when the deadline expires.
+ */
+struct ReactorWait {
+        std::coroutine_handle<> handle;
+        int fd = -1;     // -1 for a timer only.
+        int result = 0;  // 1 readable, 0 timed out, or -errno.
+        bool timed = false;
+        std::multimap<uint64_t, ReactorWait *>::iterator timer;
+};
+
+inline uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+} // namespace detail
+
+/**
+ * Thread pool running ready coroutines, and an epoll reactor thread waking
+ * the suspended ones.
+ */
+class Executor {
+      public:
+        /**
+         * @brief Start `threads` pool threads, zero for one per CPU, and the
+         * reactor thread. Throws `std::system_error` if the epoll or eventfd
+         * file descriptors can't be created.
+         */
+        explicit Executor(unsigned threads = 0) {
+                epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+                if (epoll_fd_ < 0) {
+                        throw std::system_error(errno, std::generic_category(),
+                                                "epoll_create1");
+                }
+                wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if (wake_fd_ < 0) {
+                        int err = errno;
+                        close(epoll_fd_);
+                        throw std::system_error(err, std::generic_category(),
+                                                "eventfd");
+                }
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.ptr = nullptr; // The wake eventfd
+                epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+                if (0 == threads) {
+                        threads = std::max(1u,
+                                           std::thread::hardware_concurrency());
+                }
+                for (unsigned ithread = 0; ithread < threads; ithread++) {
+                        workers_.emplace_back([this] { worker_loop(); });
+                }
+                reactor_ = std::thread([this] { reactor_loop(); });
+        }
+
+        Executor(const Executor &) = delete;
+        Executor &operator=(const Executor &) = delete;
+
+        /**
+         * @brief Stop and join all threads. Coroutines still suspended on the
+         * reactor are not resumed.
+         */
+        ~Executor() {
+                {
+                        std::lock_guard<std::mutex> lock(pool_mutex_);
+                        stop_ = true;
+                }
+                pool_cv_.notify_all();
+                wake_reactor();
+                for (auto &worker : workers_) {
+                        worker.join();
+                }
+                reactor_.join();
+                close(wake_fd_);
+                close(epoll_fd_);
+        }
+
+        /**
+         * @brief Queue `fn` to run on a pool thread.
+         */
+        void post(std::function<void()> fn) {
+                {
+                        std::lock_guard<std::mutex> lock(pool_mutex_);
+                        queue_.push_back(std::move(fn));
+                }
+                pool_cv_.notify_one();
+        }
+
+        void post(std::coroutine_handle<> handle) {
+                post([handle] { handle.resume(); });
+        }
+
+        /**
+         * @brief Awaitable resuming the coroutine on a pool thread.
+         */
+        auto schedule() {
+                struct Awaiter {
+                        Executor *ex;
+                        bool await_ready() const noexcept { return false; }
+                        void await_suspend(std::coroutine_handle<> handle) {
+                                ex->post(handle);
+                        }
+                        void await_resume() const noexcept {}
+                };
+                return Awaiter{this};
+        }
+
+        /**
+         * @brief Awaitable suspending the coroutine until `fd` is readable or
+         * `timeout` expires, negative for no limit. Results in 1 if readable,
+         * 0 on timeout, or -errno, e.g. `-EEXIST` if `fd` is already awaited
+         * or `-EPERM` if `fd` doesn't support polling.
+         */
+        auto wait_readable(int fd, std::chrono::nanoseconds timeout) {
+                struct Awaiter {
+                        Executor *ex;
+                        std::chrono::nanoseconds timeout;
+                        detail::ReactorWait wait;
+                        bool await_ready() const noexcept { return false; }
+                        void await_suspend(std::coroutine_handle<> handle) {
+                                wait.handle = handle;
+                                ex->reactor_add(&wait, timeout);
+                        }
+                        int await_resume() const noexcept {
+                                return wait.result;
+                        }
+                };
+                Awaiter awaiter{this, timeout, {}};
+                awaiter.wait.fd = fd;
+                return awaiter;
+        }
+
+        /**
+         * @brief Awaitable suspending the coroutine for `duration`.
+         */
+        auto sleep_for(std::chrono::nanoseconds duration) {
+                return wait_readable(-1, duration);
+        }
+
+      private:
+        void worker_loop() {
+                for (;;) {
+                        std::function<void()> fn;
+                        {
+                                std::unique_lock<std::mutex> lock(pool_mutex_);
+                                pool_cv_.wait(lock, [this] {
+                                        return stop_ || !queue_.empty();
+                                });
+                                if (queue_.empty()) {
+                                        return;
+                                }
+                                fn = std::move(queue_.front());
+                                queue_.pop_front();
+                        }
+                        fn();
+                }
+        }
+
+        void wake_reactor() {
+                uint64_t one = 1;
+                ssize_t bytes = write(wake_fd_, &one, sizeof(one));
+                (void)bytes; // Counter overflow only, reactor wakes anyway
+        }
+
+        void reactor_add(detail::ReactorWait *wait,
+                         std::chrono::nanoseconds timeout) {
+                std::lock_guard<std::mutex> lock(reactor_mutex_);
+                if (timeout.count() >= 0) {
+                        wait->timer = timers_.emplace(
+                            detail::now_ns() + timeout.count(), wait);
+                        wait->timed = true;
+                }
+                if (wait->fd >= 0) {
+                        struct epoll_event ev = {};
+                        ev.events = EPOLLIN | EPOLLONESHOT;
+                        ev.data.ptr = wait;
+                        if (0 != epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wait->fd,
+                                           &ev)) {
+                                wait->result = -errno;
+                                if (wait->timed) {
+                                        timers_.erase(wait->timer);
+                                }
+                                post(wait->handle);
+                                return;
+                        }
+                }
+                if (wait->timed) {
+                        // The reactor may sleep past the new deadline
+                        wake_reactor();
+                }
+        }
+
+        /**
+         * Completes `wait` with `result`. `reactor_mutex_` must be held.
+         */
+        void reactor_complete(detail::ReactorWait *wait, int result,
+                              std::vector<std::coroutine_handle<>> &ready) {
+                if (wait->fd >= 0) {
+                        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, wait->fd, nullptr);
+                }
+                if (wait->timed) {
+                        timers_.erase(wait->timer);
+                }
+                wait->result = result;
+                ready.push_back(wait->handle);
+        }
+
+        void reactor_loop() {
+                struct epoll_event events[64];
+                std::vector<std::coroutine_handle<>> ready;
+
+                for (;;) {
+                        int timeout_ms = -1;
+                        {
+                                std::lock_guard<std::mutex> lock(
+                                    reactor_mutex_);
+                                if (!timers_.empty()) {
+                                        uint64_t now = detail::now_ns();
+                                        uint64_t first = timers_.begin()->first;
+                                        // Round up, not to wake early
+                                        timeout_ms =
+                                            first <= now
+                                                ? 0
+                                                : (int)std::min<uint64_t>(
+                                                      (first - now + 999999) /
+                                                          1000000,
+                                                      INT32_MAX);
+                                }
+                        }
+                        int count = epoll_wait(epoll_fd_, events, 64,
+                                               timeout_ms);
+                        if (count < 0 && errno != EINTR) {
+                                return;
+                        }
+
+                        std::unique_lock<std::mutex> lock(reactor_mutex_);
+                        for (int ievent = 0; ievent < count; ievent++) {
+                                auto *wait = (detail::ReactorWait *)
+                                                 events[ievent]
+                                                     .data.ptr;
+                                if (nullptr == wait) {
+                                        uint64_t value;
+                                        ssize_t bytes = read(wake_fd_, &value,
+                                                             sizeof(value));
+                                        (void)bytes;
+                                        continue;
+                                }
+                                // `EPOLLERR`/`EPOLLHUP` also complete the
+                                // wait, a following read reports the error
+                                reactor_complete(wait, 1, ready);
+                        }
+                        uint64_t now = detail::now_ns();
+                        while (!timers_.empty() &&
+                               timers_.begin()->first <= now) {
+                                reactor_complete(timers_.begin()->second, 0,
+                                                 ready);
+                        }
+                        lock.unlock();
+
+                        for (auto handle : ready) {
+                                post(handle);
+                        }
+                        ready.clear();
+
+                        std::lock_guard<std::mutex> pool_lock(pool_mutex_);
+                        if (stop_) {
+                                return;
+                        }
+                }
+        }
+
+        int epoll_fd_ = -1;
+        int wake_fd_ = -1;
+        std::thread reactor_;
+        std::mutex reactor_mutex_;
+        std::multimap<uint64_t, detail::ReactorWait *> timers_;
+
+        std::vector<std::thread> workers_;
+        std::mutex pool_mutex_;
+        std::condition_variable pool_cv_;
+        std::deque<std::function<void()>> queue_;
+        bool stop_ = false;
+};
+
+// ____
+// Task
+//
+namespace detail {
+
+struct PromiseBase {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr exception;
+
+        struct FinalAwaiter {
+                bool await_ready() const noexcept { return false; }
+                template <typename P>
+                std::coroutine_handle<>
+                await_suspend(std::coroutine_handle<P> handle) noexcept {
+                        return handle.promise().continuation;
+                }
+                void await_resume() const noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+        std::optional<T> value;
+
+        Task<T> get_return_object();
+        void return_value(T v) { value.emplace(std::move(v)); }
+        T result() {
+                if (exception) {
+                        std::rethrow_exception(exception);
+                }
+                return std::move(*value);
+        }
+};
+
+template <> struct Promise<void> : PromiseBase {
+        Task<void> get_return_object();
+        void return_void() {}
+        void result() {
+                if (exception) {
+                        std::rethrow_exception(exception);
+                }
+        }
+};
+
+} // namespace detail
+
+/**
+ * Lazily started coroutine, it runs when awaited and resumes the awaiting
+ * coroutine when done, on the same thread.
+ */
+template <typename T> class Task {
+      public:
+        using promise_type = detail::Promise<T>;
+
+        explicit Task(std::coroutine_handle<promise_type> handle)
+            : handle_(handle) {}
+        Task(Task &&other) noexcept
+            : handle_(std::exchange(other.handle_, {})) {}
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        ~Task() {
+                if (handle_) {
+                        handle_.destroy();
+                }
+        }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> continuation) noexcept {
+                handle_.promise().continuation = continuation;
+                return handle_;
+        }
+        T await_resume() { return handle_.promise().result(); }
+
+      private:
+        std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T> Task<T> Promise<T>::get_return_object() {
+        return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+        return Task<void>(
+            std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+/**
+ * Eagerly started coroutine owning its frame, used to run a `Task` from
+ * non-coroutine code.
+ */
+struct Detached {
+        struct promise_type {
+                Detached get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+        };
+};
+
+template <typename T>
+Detached run_detached(Executor &ex, Task<T> task, std::promise<T> *result) {
+        co_await ex.schedule();
+        try {
+                if constexpr (std::is_void_v<T>) {
+                        co_await task;
+                        if (result) {
+                                result->set_value();
+                        }
+                } else {
+                        T value = co_await task;
+                        if (result) {
+                                result->set_value(std::move(value));
+                        }
+                }
+        } catch (...) {
+                if (nullptr == result) {
+                        throw;
+                }
+                result->set_exception(std::current_exception());
+        }
+}
+
+} // namespace detail
+
+/**
+ * @brief Run `task` on the executor without waiting for it. An exception
+ * escaping the task terminates the program.
+ */
+template <typename T> void spawn(Executor &ex, Task<T> task) {
+        detail::run_detached<T>(ex, std::move(task), nullptr);
+}
+
+/**
+ * @brief Run `task` on the executor and block the calling thread until it is
+ * done. Must not be called from a pool thread.
+ */
+template <typename T> T sync_wait(Executor &ex, Task<T> task) {
+        std::promise<T> result;
+        auto future = result.get_future();
+        detail::run_detached<T>(ex, std::move(task), &result);
+        return future.get();
+}
+
+/**
+ * @brief Run the blocking call `fn` on a pool thread, the result of `fn` is
+ * the result of the task.
+ */
+template <typename F>
+Task<std::invoke_result_t<F>> offload(Executor &ex, F fn) {
+        co_await ex.schedule();
+        co_return fn();
+}
+
+// _________________
+// Device operations
+//
+/**
+ * @brief Open the device on a pool thread, see `CRONO_KERNEL_PciDeviceOpen`.
+ */
+inline Task<uint32_t>
+async_open(Executor &ex, CRONO_KERNEL_DEVICE_HANDLE *phDev,
+           const CRONO_KERNEL_PCI_CARD_INFO *pDeviceInfo) {
+        co_return co_await offload(ex, [=] {
+                return CRONO_KERNEL_PciDeviceOpen(phDev, pDeviceInfo);
+        });
+}
+
+/**
+ * @brief Lock an SG buffer on a pool thread, see `CRONO_KERNEL_DMASGBufLock`.
+ */
+inline Task<uint32_t> async_sg_lock(Executor &ex,
+                                    CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                    void *pBuf, uint32_t dwOptions,
+                                    uint32_t dwDMABufSize,
+                                    CRONO_KERNEL_DMA_SG **ppDma) {
+        co_return co_await offload(ex, [=] {
+                return CRONO_KERNEL_DMASGBufLock(hDev, pBuf, dwOptions,
+                                                 dwDMABufSize, ppDma);
+        });
+}
+
+/**
+ * @brief Unlock an SG buffer on a pool thread, see
+ * `CRONO_KERNEL_DMASGBufUnlock`.
+ */
+inline Task<uint32_t> async_sg_unlock(Executor &ex,
+                                      CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                      CRONO_KERNEL_DMA_SG *pDma) {
+        co_return co_await offload(ex, [=] {
+                return CRONO_KERNEL_DMASGBufUnlock(hDev, pDma);
+        });
+}
+
+namespace detail {
+
+/**
+ * Suspends until the device event file descriptor is readable, or for
+ * `duration`. `*pFd` is set to -1 when events are unusable, i.e. the file
+ * descriptor can't be polled, is awaited by another coroutine, or the kernel
+ * module doesn't support reading it, so later waits are plain sleeps.
+ */
+inline Task<void> wait_device(Executor &ex, CRONO_KERNEL_DEVICE_HANDLE hDev,
+                              int *pFd, std::chrono::nanoseconds duration) {
+        uint64_t count;
+
+        if (*pFd < 0) {
+                co_await ex.sleep_for(duration);
+                co_return;
+        }
+        int ready = co_await ex.wait_readable(*pFd, duration);
+        if (ready < 0 ||
+            (ready > 0 && CRONO_KERNEL_NOT_IMPLEMENTED ==
+                              CRONO_KERNEL_AckEvents(hDev, &count))) {
+                *pFd = -1;
+        }
+}
+
+inline int device_event_fd(CRONO_KERNEL_DEVICE_HANDLE hDev) {
+        int fd = -1;
+
+        if (CRONO_SUCCESS != CRONO_KERNEL_GetEventFd(hDev, &fd)) {
+                return -1;
+        }
+        return fd;
+}
+
+} // namespace detail
+
+/**
+ * @brief Wait until `(BAR0[offset] & mask) == value`. The register is checked
+ * on every device event, and at least every `period`.
+ *
+ * @return `CRONO_SUCCESS` when the condition is met,
+ * `CRONO_KERNEL_TIME_OUT_EXPIRED` on timeout, or the error of the register
+ * read.
+ */
+inline Task<uint32_t> async_wait_register(
+    Executor &ex, CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t offset,
+    uint32_t mask, uint32_t value, std::chrono::milliseconds timeout,
+    std::chrono::microseconds period = std::chrono::microseconds(100)) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        int fd = detail::device_event_fd(hDev);
+        uint32_t reg;
+        uint32_t ret;
+
+        for (;;) {
+                ret = CRONO_KERNEL_ReadAddr32(hDev, offset, &reg);
+                if (CRONO_SUCCESS != ret) {
+                        co_return ret;
+                }
+                if ((reg & mask) == value) {
+                        co_return CRONO_SUCCESS;
+                }
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline) {
+                        co_return CRONO_KERNEL_TIME_OUT_EXPIRED;
+                }
+                co_await detail::wait_device(
+                    ex, hDev, &fd,
+                    std::min<std::chrono::nanoseconds>(period, deadline - now));
+        }
+}
+
+/**
+ * Contiguous readable part of a ring buffer.
+ */
+struct Span {
+        const uint8_t *data;
+        size_t size;
+};
+
+/**
+ * Reads a ring buffer the device writes to, e.g. a locked SG buffer. The
+ * device publishes the byte offset it writes next in a BAR0 register, and
+ * optionally reads the byte offset consumed by the application from another.
+ * The buffer is empty when both offsets are equal.
+ */
+class RingReader {
+      public:
+        static constexpr uint32_t NO_REGISTER = 0xFFFFFFFF;
+
+        RingReader(Executor &ex, CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
+                   size_t size, uint32_t writeOffsetReg,
+                   uint32_t readOffsetReg = NO_REGISTER)
+            : ex_(ex), hDev_(hDev), buf_((const uint8_t *)pBuf), size_(size),
+              write_reg_(writeOffsetReg), read_reg_(readOffsetReg),
+              event_fd_(detail::device_event_fd(hDev)) {}
+
+        /**
+         * @brief Wait for data and set `*pSpan` to the readable bytes from the
+         * read offset up to the write offset or the end of the buffer. The
+         * span stays valid until `consume` is called.
+         *
+         * @return `CRONO_SUCCESS`, `CRONO_KERNEL_TIME_OUT_EXPIRED` on timeout,
+         * `CRONO_KERNEL_DATA_MISMATCH` if the device reports an offset out of
+         * the buffer, or the error of the register read.
+         */
+        Task<uint32_t>
+        next(Span *pSpan, std::chrono::milliseconds timeout,
+             std::chrono::microseconds period = std::chrono::microseconds(100)) {
+                auto deadline = std::chrono::steady_clock::now() + timeout;
+                uint32_t write_offset;
+                uint32_t ret;
+
+                pSpan->data = nullptr;
+                pSpan->size = 0;
+                for (;;) {
+                        ret = CRONO_KERNEL_ReadAddr32(hDev_, write_reg_,
+                                                      &write_offset);
+                        if (CRONO_SUCCESS != ret) {
+                                co_return ret;
+                        }
+                        if (write_offset >= size_) {
+                                co_return CRONO_KERNEL_DATA_MISMATCH;
+                        }
+                        if (write_offset != read_offset_) {
+                                break;
+                        }
+                        auto now = std::chrono::steady_clock::now();
+                        if (now >= deadline) {
+                                co_return CRONO_KERNEL_TIME_OUT_EXPIRED;
+                        }
+                        co_await detail::wait_device(
+                            ex_, hDev_, &event_fd_,
+                            std::min<std::chrono::nanoseconds>(period,
+                                                               deadline - now));
+                }
+                // Data written by the device before the offset register
+                std::atomic_thread_fence(std::memory_order_acquire);
+                pSpan->data = buf_ + read_offset_;
+                pSpan->size = (write_offset > read_offset_ ? write_offset
+                                                           : size_) -
+                              read_offset_;
+                co_return CRONO_SUCCESS;
+        }
+
+        /**
+         * @brief Release `bytes` of the last span to the device.
+         */
+        uint32_t consume(size_t bytes) {
+                read_offset_ = (read_offset_ + bytes) % size_;
+                if (NO_REGISTER == read_reg_) {
+                        return CRONO_SUCCESS;
+                }
+                return CRONO_KERNEL_WriteAddr32(hDev_, read_reg_,
+                                                (uint32_t)read_offset_);
+        }
+
+      private:
+        Executor &ex_;
+        CRONO_KERNEL_DEVICE_HANDLE hDev_;
+        const uint8_t *buf_;
+        size_t size_;
+        uint32_t write_reg_;
+        uint32_t read_reg_;
+        int event_fd_;
+        size_t read_offset_ = 0;
+};
+
+} // namespace crono_async
+
+#endif // #ifndef _CRONO_ASYNC_H_
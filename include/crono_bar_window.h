@@ -0,0 +1,145 @@
+/**
+ * @file crono_bar_window.h
+ * @brief Accesses a BAR at 64-bit offsets through a few windows mapped on
+ * demand, e.g. a BAR of several GiB of on-board memory, which is not mapped
+ * as a whole when the device is opened, see `CRONO_KERNEL_BAR_MAP_MAX_SIZE`.
+ *
+ * The BAR is split into windows of `windowSize` bytes, up to `windowCount` of
+ * them are mapped at once. Accessing an unmapped window maps it, unmapping the
+ * least recently used window if all are in use. Random access into a large BAR
+ * then costs at most one `mmap` per access, and repeated access within the
+ * mapped windows none.
+ *
+ * Usage:
+ * @code
+ * CRONO_KERNEL_BAR_WINDOW_CONFIG config = {2, 0, 0}; // BAR2, defaults
+ * CRONO_KERNEL_BAR_WINDOW *pWin;
+ * CRONO_KERNEL_BarWindowOpen(hDev, &config, &pWin);
+ * CRONO_KERNEL_BarWindowRead64(pWin, 0x180000000ULL, &val);
+ * CRONO_KERNEL_BarWindowReadBlock(pWin, offset, buffer, size);
+ * CRONO_KERNEL_BarWindowClose(pWin);
+ * @endcode
+ *
+ * A window mapper is used by one thread at a time. The device must stay open
+ * until the window mapper is closed.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_BAR_WINDOW_H_
+#define _CRONO_BAR_WINDOW_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define CRONO_KERNEL_BAR_WINDOW_MAX_COUNT 16
+
+/**
+ * Window mapper parameters.
+ */
+typedef struct {
+        uint32_t barNum;      // BAR number, 0 to 5, not the index.
+        uint64_t windowSize;  // Bytes, power of 2 multiple of page size, 0 for
+                              // 4 MiB.
+        uint32_t windowCount; // Windows mapped at once, up to
+                              // CRONO_KERNEL_BAR_WINDOW_MAX_COUNT, 0 for 4.
+} CRONO_KERNEL_BAR_WINDOW_CONFIG;
+
+typedef struct {
+        uint64_t hits;      // Accesses to a mapped window.
+        uint64_t maps;      // Windows mapped.
+        uint64_t evictions; // Windows unmapped to map another one.
+} CRONO_KERNEL_BAR_WINDOW_STATS;
+
+typedef struct CRONO_KERNEL_BAR_WINDOW CRONO_KERNEL_BAR_WINDOW;
+
+/**
+ * @brief Open a window mapper on a BAR of the device. No window is mapped
+ * until accessed.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param pConfig[in]: Window mapper parameters.
+ * @param ppWin[out]: The new window mapper.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if the device has no
+ * such BAR or a parameter is invalid, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowOpen(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                           const CRONO_KERNEL_BAR_WINDOW_CONFIG *pConfig,
+                           CRONO_KERNEL_BAR_WINDOW **ppWin);
+
+/* Read/write 8/16/32/64 bits at `offset` of the BAR, aligned to the access
+   size. `-EINVAL` is returned if `offset` is not aligned or exceeds the BAR. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead8(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint8_t *val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead16(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint16_t *val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead32(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint32_t *val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead64(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint64_t *val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite8(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint8_t val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite16(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint16_t val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite32(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint32_t val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite64(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint64_t val);
+
+/**
+ * @brief Copy `size` bytes from `offset` of the BAR, across windows as
+ * needed. Aligned ranges are copied using 64-bit or 32-bit accesses.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowReadBlock(CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset,
+                                void *pData, uint64_t size);
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowWriteBlock(CRONO_KERNEL_BAR_WINDOW *pWin,
+                                 uint64_t offset, const void *pData,
+                                 uint64_t size);
+
+/**
+ * @brief Get the address `offset` of the BAR is mapped at, e.g. to access a
+ * range in place.
+ *
+ * @param pWin[in]: The window mapper.
+ * @param offset[in]: Offset in the BAR.
+ * @param size[in]: Bytes to be accessed, within one window.
+ * @param ppAddr[out]: The address, valid until the next call on `pWin`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if the range
+ * exceeds the BAR or crosses a window boundary, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowGetAddress(CRONO_KERNEL_BAR_WINDOW *pWin,
+                                 uint64_t offset, uint64_t size,
+                                 void **ppAddr);
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowGetStats(CRONO_KERNEL_BAR_WINDOW *pWin,
+                               CRONO_KERNEL_BAR_WINDOW_STATS *pStats);
+
+/**
+ * @brief Unmap the windows and free the window mapper.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowClose(CRONO_KERNEL_BAR_WINDOW *pWin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_BAR_WINDOW_H_
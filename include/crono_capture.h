@@ -0,0 +1,209 @@
+/**
+ * @file crono_capture.h
+ * @brief Capture file format for streamed device data, and its writer and
+ * memory-mapped reader.
+ *
+ * File layout, all values little endian:
+ * | Part        | Size                                         |
+ * | ----------- | -------------------------------------------- |
+ * | File header | `CRONO_KERNEL_CAPTURE_HEADER_SIZE` bytes     |
+ * | Block 0..N-1| `blockSize` bytes each, block header + data  |
+ * | Index       | N * `CRONO_KERNEL_CAPTURE_INDEX_ENTRY`       |
+ * | Footer      | `CRONO_KERNEL_CAPTURE_FOOTER`                |
+ *
+ * Block `i` starts at `CRONO_KERNEL_CAPTURE_HEADER_SIZE + i * blockSize`, so
+ * the index only maps sequences and timestamps to block numbers. The index and
+ * footer are written on close, a file without them, e.g. of a crashed writer,
+ * is still readable, then the index is rebuilt from the block headers.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_CAPTURE_H_
+#define _CRONO_CAPTURE_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define CRONO_KERNEL_CAPTURE_VERSION 1
+#define CRONO_KERNEL_CAPTURE_HEADER_SIZE 4096
+#define CRONO_KERNEL_CAPTURE_FILE_MAGIC "CRNOCAPT"
+#define CRONO_KERNEL_CAPTURE_BLOCK_MAGIC 0x4B4C4243  // "CBLK"
+#define CRONO_KERNEL_CAPTURE_FOOTER_MAGIC 0x58444E49 // "INDX"
+
+/* `CRONO_KERNEL_CAPTURE_BLOCK_HEADER::flags` */
+enum {
+        CRONO_KERNEL_CAPTURE_BLOCK_GAP =
+            0x1, // Data was dropped before this block.
+};
+
+/**
+ * File header, padded with zeros to `CRONO_KERNEL_CAPTURE_HEADER_SIZE` bytes.
+ */
+typedef struct {
+        char magic[8];            // CRONO_KERNEL_CAPTURE_FILE_MAGIC.
+        uint32_t version;         // CRONO_KERNEL_CAPTURE_VERSION.
+        uint32_t headerSize;      // CRONO_KERNEL_CAPTURE_HEADER_SIZE.
+        uint32_t blockSize;       // Block size including its header.
+        uint32_t blockHeaderSize; // sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER).
+        CRONO_KERNEL_PCI_SLOT slot; // Device the data comes from.
+        uint64_t createdNs;       // CLOCK_REALTIME of file creation.
+} CRONO_KERNEL_CAPTURE_FILE_HEADER;
+
+/**
+ * Header at the start of every block, followed by the block data.
+ */
+typedef struct {
+        uint32_t magic;          // CRONO_KERNEL_CAPTURE_BLOCK_MAGIC.
+        uint32_t flags;          // CRONO_KERNEL_CAPTURE_BLOCK_XXX.
+        uint64_t sequence;       // Block sequence number, increments by one.
+        uint64_t timestampNs;    // CLOCK_REALTIME of the first data byte,
+                                 // never less than the previous block's.
+        uint64_t streamPosition; // Stream position of the first data byte.
+        uint32_t byteCount;      // Valid data bytes, less than the block
+                                 // capacity in the last block only.
+        CRONO_KERNEL_PCI_SLOT slot; // Device the data comes from.
+        uint8_t reserved[12];
+} CRONO_KERNEL_CAPTURE_BLOCK_HEADER;
+
+typedef struct {
+        uint64_t sequence;
+        uint64_t timestampNs;
+} CRONO_KERNEL_CAPTURE_INDEX_ENTRY;
+
+typedef struct {
+        uint32_t magic;      // CRONO_KERNEL_CAPTURE_FOOTER_MAGIC.
+        uint32_t version;    // CRONO_KERNEL_CAPTURE_VERSION.
+        uint64_t indexOffset; // File offset of the index.
+        uint64_t blockCount;  // Count of blocks and index entries.
+} CRONO_KERNEL_CAPTURE_FOOTER;
+
+// ______
+// Writer
+//
+typedef struct {
+        const char *path;       // File to create, truncated if it exists.
+        uint32_t blockSize;     // Multiple of 4096, 0 for 1 MiB.
+        uint64_t firstSequence; // Sequence of the first block, e.g. to
+                                // continue the sequence of a previous file.
+        CRONO_KERNEL_PCI_SLOT slot; // Device the data comes from.
+} CRONO_KERNEL_CAPTURE_CONFIG;
+
+typedef struct CRONO_KERNEL_CAPTURE_WRITER CRONO_KERNEL_CAPTURE_WRITER;
+
+/**
+ * @brief Create the capture file and write its header.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if the block size is
+ * invalid, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterOpen(const CRONO_KERNEL_CAPTURE_CONFIG *pConfig,
+                               CRONO_KERNEL_CAPTURE_WRITER **ppWriter);
+
+/**
+ * @brief Append stream data, full blocks are written to the file.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterWrite(CRONO_KERNEL_CAPTURE_WRITER *pWriter,
+                                const void *pData, size_t size);
+
+/**
+ * @brief Record that `bytes` of the stream were dropped, e.g. counted by the
+ * recorder. The current block is ended, and the next one is flagged with
+ * `CRONO_KERNEL_CAPTURE_BLOCK_GAP`.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterSkip(CRONO_KERNEL_CAPTURE_WRITER *pWriter,
+                               uint64_t bytes);
+
+/**
+ * @brief Write the last partial block, the index and the footer, then close
+ * the file and free the writer.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterClose(CRONO_KERNEL_CAPTURE_WRITER *pWriter);
+
+// ______
+// Reader
+//
+typedef struct {
+        CRONO_KERNEL_CAPTURE_FILE_HEADER header;
+        uint64_t blockCount;
+        uint64_t firstSequence;    // Zero if no blocks.
+        uint64_t lastSequence;
+        uint64_t firstTimestampNs;
+        uint64_t lastTimestampNs;
+        uint32_t indexRebuilt; // Non-zero if the file had no index.
+} CRONO_KERNEL_CAPTURE_INFO;
+
+/**
+ * Block of a memory-mapped capture file, valid until the reader is closed.
+ */
+typedef struct {
+        const CRONO_KERNEL_CAPTURE_BLOCK_HEADER *pHeader;
+        const void *pData; // `pHeader->byteCount` bytes.
+        uint64_t size;     // Same as `pHeader->byteCount`.
+} CRONO_KERNEL_CAPTURE_SPAN;
+
+typedef struct CRONO_KERNEL_CAPTURE_READER CRONO_KERNEL_CAPTURE_READER;
+
+/**
+ * @brief Map a capture file read-only, and load or rebuild its index.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `CRONO_KERNEL_DATA_MISMATCH`
+ * if the file is not a capture file, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderOpen(const char *path,
+                               CRONO_KERNEL_CAPTURE_READER **ppReader);
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderInfo(CRONO_KERNEL_CAPTURE_READER *pReader,
+                               CRONO_KERNEL_CAPTURE_INFO *pInfo);
+
+/**
+ * @brief Get block `blockIndex` without copying.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-ERANGE` if there is no
+ * such block.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderBlock(CRONO_KERNEL_CAPTURE_READER *pReader,
+                                uint64_t blockIndex,
+                                CRONO_KERNEL_CAPTURE_SPAN *pSpan);
+
+/**
+ * @brief Binary search the first block with a sequence not less than
+ * `sequence`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-ERANGE` if all blocks
+ * have lower sequences.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderFindSequence(CRONO_KERNEL_CAPTURE_READER *pReader,
+                                       uint64_t sequence,
+                                       uint64_t *pBlockIndex);
+
+/**
+ * @brief Binary search the first block with a timestamp not less than
+ * `timestampNs`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-ERANGE` if all blocks
+ * are older.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderFindTime(CRONO_KERNEL_CAPTURE_READER *pReader,
+                                   uint64_t timestampNs, uint64_t *pBlockIndex);
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderClose(CRONO_KERNEL_CAPTURE_READER *pReader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_CAPTURE_H_
@@ -0,0 +1,133 @@
+/**
+ * @file crono_cmd_buffer.h
+ * @brief Persistent command buffers, holding a sequence of 32-bit BAR0 register
+ * writes, e.g. the cleanup commands the driver executes when the device is
+ * closed, or an initialization sequence of the board.
+ *
+ * The commands are held in the layout passed to the driver, allocated once
+ * when the buffer is created. Changing a command increments the version of the
+ * buffer only if its value changes. Registering a buffer as the cleanup
+ * commands of a device sends it to the driver only if the device holds another
+ * buffer or version, so re-registering after each configuration change costs
+ * nothing unless a command changed. Executing a buffer writes its commands to
+ * the device from userspace, with one range check for the whole buffer.
+ *
+ * Usage:
+ * @code
+ * CRONO_KERNEL_CMD_BUFFER *pBuf;
+ * CRONO_KERNEL_CmdBufferCreate(16, &pBuf);
+ * CRONO_KERNEL_CmdBufferSetAll(pBuf, cmds, cmdCount, NULL);
+ * CRONO_KERNEL_CmdBufferRegisterCleanup(hDev, pBuf);
+ * // On each configuration change
+ * CRONO_KERNEL_CmdBufferSet(pBuf, 3, 0x40, threshold);
+ * CRONO_KERNEL_CmdBufferRegisterCleanup(hDev, pBuf); // Sent if changed
+ * @endcode
+ *
+ * A command buffer is used by one thread at a time, and may be registered to
+ * several devices. It must not be freed while registered to an open device,
+ * the driver keeps its own copy, but the device refers to the buffer to detect
+ * changes.
+ *
+ * The driver takes the cleanup commands as a whole, so a changed buffer is
+ * sent whole, not only its changed commands.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_CMD_BUFFER_H_
+#define _CRONO_CMD_BUFFER_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct CRONO_KERNEL_CMD_BUFFER CRONO_KERNEL_CMD_BUFFER;
+
+/**
+ * @brief Create a command buffer of up to `capacity` commands, holding none.
+ *
+ * @param capacity[in]: Commands the buffer may hold.
+ * @param ppBuf[out]: The new command buffer.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if a parameter is
+ * invalid, or `-ENOMEM`.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferCreate(
+    uint32_t capacity, CRONO_KERNEL_CMD_BUFFER **ppBuf);
+
+/**
+ * @brief Free the command buffer.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CmdBufferFree(CRONO_KERNEL_CMD_BUFFER *pBuf);
+
+/**
+ * @brief Replace the commands of the buffer by `Cmd`, comparing them to the
+ * commands held.
+ *
+ * @param pBuf[in]: The command buffer.
+ * @param Cmd[in]: The commands.
+ * @param dwCmdCount[in]: Count of commands, up to the buffer capacity.
+ * @param pChanged[out]: Count of commands changed, added or removed, ignored if
+ * NULL. The version is incremented if not 0.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-EINVAL` if `dwCmdCount`
+ * exceeds the capacity.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferSetAll(
+    CRONO_KERNEL_CMD_BUFFER *pBuf, const CRONO_KERNEL_CMD *Cmd,
+    uint32_t dwCmdCount, uint32_t *pChanged);
+
+/**
+ * @brief Set command `index` of the buffer, the version is incremented if it
+ * changes.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-EINVAL` if `index` is not
+ * less than the count of commands.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferSet(
+    CRONO_KERNEL_CMD_BUFFER *pBuf, uint32_t index, uint32_t addr,
+    uint32_t data);
+
+/**
+ * @brief Get the count of commands and the version of the buffer. Both are
+ * ignored if NULL.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferGetInfo(
+    const CRONO_KERNEL_CMD_BUFFER *pBuf, uint32_t *pCount,
+    uint64_t *pVersion);
+
+/**
+ * @brief Register the commands of the buffer as the cleanup commands of the
+ * device, as `CRONO_KERNEL_CardCleanupSetup`, unless the device holds this
+ * version of the buffer already.
+ *
+ * @param hDev[in]: A valid handle to the device, opened by
+ * `CRONO_KERNEL_PciDeviceOpen`.
+ * @param pBuf[in]: The command buffer.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the device is not
+ * opened, or as `ioctl`.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferRegisterCleanup(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const CRONO_KERNEL_CMD_BUFFER *pBuf);
+
+/**
+ * @brief Execute the commands of the buffer, in order, as
+ * `CRONO_KERNEL_WriteAddr32` to BAR0 of the device.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if the address of a
+ * command is not a multiple of 4, or `-ENOMEM` if a command exceeds BAR0, no
+ * command is executed then.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CmdBufferExecute(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                              const CRONO_KERNEL_CMD_BUFFER *pBuf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_CMD_BUFFER_H_
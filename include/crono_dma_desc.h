@@ -0,0 +1,127 @@
+/**
+ * @file crono_dma_desc.h
+ * @brief Builds device DMA descriptor tables from the page lists of buffers
+ * locked by `CRONO_KERNEL_DMASGBufLock`, into a contiguous buffer locked by
+ * `CRONO_KERNEL_DMAContigBufLock`.
+ *
+ * The descriptor layout is described by `CRONO_KERNEL_DESC_FORMAT`, so the
+ * same builder serves all devices. Physically contiguous pages are merged into
+ * one descriptor up to the maximum segment size.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_DMA_DESC_H_
+#define _CRONO_DMA_DESC_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * Maximum size of a single descriptor in bytes.
+ */
+#define CRONO_KERNEL_DESC_MAX_BYTES 64
+
+/* `CRONO_KERNEL_DESC_FORMAT::flags` */
+enum {
+        CRONO_KERNEL_DESC_LEN_MINUS_ONE = 0x1, // Length field holds length-1.
+        CRONO_KERNEL_DESC_HAS_EOC = 0x2, // Set `eocBit` in last descriptor.
+};
+
+/**
+ * Layout of a device DMA descriptor. Bit offsets are counted from bit 0 of the
+ * first byte, descriptor words are little endian.
+ */
+typedef struct {
+        uint32_t descBytes;     // Size of a descriptor, multiple of 4.
+        uint32_t addrBitOffset; // Bit offset of the address field.
+        uint32_t addrBits;      // Width of the address field, up to 64.
+        uint32_t addrShift;     // Address is stored shifted right by this.
+        uint32_t lenBitOffset;  // Bit offset of the length field.
+        uint32_t lenBits;       // Width of the length field, up to 32.
+        uint32_t lenShift;      // Length is stored shifted right by this.
+        uint32_t eocBit;        // Bit offset of the end-of-chain flag.
+        uint32_t flags;         // CRONO_KERNEL_DESC_XXX.
+        uint64_t maxSegmentSize; // Maximum bytes per descriptor, 0 for the
+                                 // maximum the length field can hold.
+} CRONO_KERNEL_DESC_FORMAT;
+
+/**
+ * State of an incremental descriptor table build. Members are internal, the
+ * object is initialized by `CRONO_KERNEL_DescBuilderInit`.
+ */
+typedef struct {
+        const CRONO_KERNEL_DMA_SG *pDma;
+        CRONO_KERNEL_DESC_FORMAT format;
+        uint64_t maxSegment;  // Effective maximum segment size.
+        uint32_t page;        // Index of the next page in `pDma->Page`.
+        uint32_t pageOffset;  // Bytes of `page` already described.
+        uint64_t descEmitted; // Descriptors emitted so far.
+} CRONO_KERNEL_DESC_BUILDER;
+
+/**
+ * @brief Validate `pFormat` and initialize `pBuilder` to describe `pDma` from
+ * its first page.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-EINVAL` if the format is
+ * invalid.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DescBuilderInit(CRONO_KERNEL_DESC_BUILDER *pBuilder,
+                             const CRONO_KERNEL_DMA_SG *pDma,
+                             const CRONO_KERNEL_DESC_FORMAT *pFormat);
+
+/**
+ * @brief Get the count of descriptors needed to describe the whole buffer.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DescBuilderCount(
+    const CRONO_KERNEL_DESC_BUILDER *pBuilder, uint64_t *pDescCount);
+
+/**
+ * @brief Emit up to `maxDescs` descriptors to `pOut`, continuing from the last
+ * call. The end-of-chain flag, if any, is set in the last descriptor of the
+ * buffer.
+ *
+ * @param pBuilder[in/out]: Initialized builder.
+ * @param pOut[out]: Destination, `maxDescs * descBytes` bytes at least.
+ * @param maxDescs[in]: Maximum count of descriptors to emit.
+ * @param pWritten[out]: Count of descriptors emitted.
+ * @param pDone[out]: Set to non-zero when the whole buffer is described.
+ * Ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-EINVAL` if a page address
+ * can't be represented in the format.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DescBuilderEmit(CRONO_KERNEL_DESC_BUILDER *pBuilder, void *pOut,
+                             uint32_t maxDescs, uint32_t *pWritten,
+                             uint32_t *pDone);
+
+/**
+ * @brief Build the full descriptor table of `pDma` in a contiguous DMA buffer.
+ * If `*ppTable` is NULL, a buffer of the needed size is allocated using
+ * `CRONO_KERNEL_DMAContigBufLock`, otherwise the passed buffer is used if large
+ * enough.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param pDma[in]: Buffer locked by `CRONO_KERNEL_DMASGBufLock`.
+ * @param pFormat[in]: The descriptor layout.
+ * @param ppTable[in/out]: The contiguous table buffer.
+ * @param pDescCount[out]: Count of descriptors in the table.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOSPC` if the passed table is
+ * too small, or an error code.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DescBuildTable(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const CRONO_KERNEL_DMA_SG *pDma,
+    const CRONO_KERNEL_DESC_FORMAT *pFormat, CRONO_KERNEL_DMA_CONTIG **ppTable,
+    uint64_t *pDescCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_DMA_DESC_H_
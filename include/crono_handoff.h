@@ -0,0 +1,131 @@
+/**
+ * @file crono_handoff.h
+ * @brief Hands an open device and its locked SG buffers over to another
+ * process, e.g. the successor of a restarting service, without closing the
+ * device or unlocking and locking the buffers again.
+ *
+ * The miscdev file descriptor and the memfds backing the buffers are passed
+ * over a connected `SOCK_STREAM` unix socket using `SCM_RIGHTS`, together with
+ * the device slot, its BAR descriptions, and the buffer ids and page lists.
+ * The kernel module keeps the buffers locked as long as any process holds the
+ * miscdev file. The successor maps the BARs and the buffers again, at
+ * addresses of its own.
+ *
+ * Only buffers backed by a memfd can be handed over, e.g. allocated with
+ * `CRONO_KERNEL_AllocMemfdBuffer`, or the ring of `crono_shm_ring.h`.
+ *
+ * Predecessor:
+ * @code
+ * CRONO_KERNEL_DeviceExport(hDev, sock, buffers, count);
+ * CRONO_KERNEL_DeviceExportRelease(hDev, buffers, count);
+ * @endcode
+ *
+ * Successor:
+ * @code
+ * CRONO_KERNEL_DeviceImport(sock, &hDev, buffers, maxCount, &count);
+ * // Use `buffers[i].pDma` as returned by `CRONO_KERNEL_DMASGBufLock`
+ * @endcode
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_HANDOFF_H_
+#define _CRONO_HANDOFF_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define CRONO_KERNEL_HANDOFF_VERSION 1
+#define CRONO_KERNEL_HANDOFF_MAX_BUFFERS 64
+
+/**
+ * A locked SG buffer and the memfd backing it.
+ */
+typedef struct {
+        CRONO_KERNEL_DMA_SG *pDma; // Page aligned `pUserAddr`.
+        int memfd;                 // memfd mapped at `pDma->pUserAddr`.
+        uint64_t memfdOffset;      // Offset of the buffer in the memfd, page
+                                   // aligned.
+} CRONO_KERNEL_HANDOFF_BUFFER;
+
+/**
+ * @brief Allocate a buffer backed by a memfd, that can be locked using
+ * `CRONO_KERNEL_DMASGBufLock` and handed over.
+ *
+ * @param name[in]: memfd name, shown in /proc/<pid>/fd.
+ * @param size[in]: Size of the buffer in bytes, rounded up to page size.
+ * @param ppBuf[out]: Will contain the address of the buffer.
+ * @param pMemfd[out]: Will contain the memfd.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_AllocMemfdBuffer(const char *name,
+                                                        size_t size,
+                                                        void **ppBuf,
+                                                        int *pMemfd);
+
+/**
+ * @brief Unmap a buffer allocated by `CRONO_KERNEL_AllocMemfdBuffer` and close
+ * its memfd.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_FreeMemfdBuffer(void *pBuf, size_t size,
+                                                       int memfd);
+
+/**
+ * @brief Send the device and the buffers over `sock`. The device and buffers
+ * are still usable by the caller afterwards.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param sock[in]: A connected `SOCK_STREAM` unix socket.
+ * @param pBuffers[in]: Buffers locked on the device to hand over.
+ * @param count[in]: Count of `pBuffers`, up to
+ * `CRONO_KERNEL_HANDOFF_MAX_BUFFERS`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if a buffer is not
+ * page aligned or exceeds its memfd, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DeviceExport(CRONO_KERNEL_DEVICE_HANDLE hDev, int sock,
+                          const CRONO_KERNEL_HANDOFF_BUFFER *pBuffers,
+                          uint32_t count);
+
+/**
+ * @brief Free the buffer structures without unlocking the buffers, then close
+ * the device. Used once the successor imported the device, the buffers stay
+ * locked for it. The buffer memory and memfds are left to the caller.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DeviceExportRelease(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                 const CRONO_KERNEL_HANDOFF_BUFFER *pBuffers,
+                                 uint32_t count);
+
+/**
+ * @brief Receive a device sent by `CRONO_KERNEL_DeviceExport`, map its BARs
+ * and buffers, and open it as `CRONO_KERNEL_PciDeviceOpen` does.
+ *
+ * @param sock[in]: A connected `SOCK_STREAM` unix socket.
+ * @param phDev[out]: Handle of the device, closed using
+ * `CRONO_KERNEL_PciDeviceClose`.
+ * @param pBuffers[out]: Received buffers, `pDma` is to be unlocked using
+ * `CRONO_KERNEL_DMASGBufUnlock`, `memfd` is owned by the caller.
+ * @param maxCount[in]: Count of `pBuffers` elements.
+ * @param pCount[out]: Count of buffers received.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `CRONO_KERNEL_DATA_MISMATCH`
+ * if the message is invalid or the BARs differ, `-ENOBUFS` if more than
+ * `maxCount` buffers were sent, `-EBUSY` if the device is already open in the
+ * process, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DeviceImport(int sock, CRONO_KERNEL_DEVICE_HANDLE *phDev,
+                          CRONO_KERNEL_HANDOFF_BUFFER *pBuffers,
+                          uint32_t maxCount, uint32_t *pCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_HANDOFF_H_
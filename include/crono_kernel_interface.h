@@ -159,6 +159,17 @@ typedef struct {
         // CRONO_KERNEL_CARD Card;           /* Card information */
 } CRONO_KERNEL_PCI_CARD_INFO;
 
+/**
+ * A capability found in the configuration space of a device.
+ */
+typedef struct {
+        uint16_t id;      // PCI_CAP_ID_XXX, or PCI_EXT_CAP_ID_XXX.
+        uint8_t extended; // 1 for an extended capability.
+        uint8_t version;  // Capability version, 0 for standard capabilities
+                          // other than PCI_CAP_ID_EXP.
+        uint32_t offset;  // Offset in the configuration space.
+} CRONO_KERNEL_PCI_CAP;
+
 typedef enum { EVENT_STATUS_OK = 0 } EVENT_STATUS;
 
 typedef enum {
@@ -282,6 +293,9 @@ CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciDriverVersion(
     Open/Close device
    ----------------------------------------------- */
 #if !defined(__KERNEL__)
+// Opening a slot already open in the process returns the same handle, sharing
+// the miscdev file and BAR mappings. Each open must be matched by a close, the
+// device is closed by the last one. Both are thread-safe.
 CRONO_KERNEL_API uint32_t
 CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
                            const CRONO_KERNEL_PCI_CARD_INFO *pDeviceInfo);
@@ -321,16 +335,113 @@ CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteAddr32(
 CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteAddr64(
     CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint64_t val);
 
-// Read 32-bit value from the BAR of `barNum`.
+// Read 32-bit value from the BAR at `barIndex` of the BAR descriptions, see
+// `CRONO_KERNEL_GetBarDescriptions`. `CRONO_KERNEL_ReadBar32` takes the BAR
+// number instead.
 CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadAddr(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                                 uint32_t dwOffset,
                                                 uint32_t *val, uint32_t barIndex);
 
-// Write 32-bit value from the BAR of `barNum`.
+// Write 32-bit value to the BAR at `barIndex` of the BAR descriptions.
 CRONO_KERNEL_API uint32_t
 CRONO_KERNEL_WriteAddr(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset,
                        uint32_t val, uint32_t barIndex);
 
+/* Read/write 8/16/32/64 bits, or a block, at `offset` of BAR `barNum` (0-5).
+   `-ENOMEM` is returned if the range exceeds the BAR, or the BAR is not
+   present or not mapped, see `CRONO_KERNEL_BAR_MAP_MAX_SIZE`, `-EINVAL` if
+   `offset` is not a multiple of the access size. Blocks are copied using the
+   widest accesses `offset`, `pData` and `size` are aligned to, up to 64
+   bits. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar8(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint8_t *val);
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar16(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint16_t *val);
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar32(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint32_t *val);
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar64(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint64_t *val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar8(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint8_t val);
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar16(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint16_t val);
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar32(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint32_t val);
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar64(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint64_t val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBarBlock(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    void *pData, uint64_t size);
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBarBlock(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    const void *pData, uint64_t size);
+
+/* -----------------------------------------------
+    Event notification
+   ----------------------------------------------- */
+/* Protocol: the event file descriptor of the device becomes readable
+   (`POLLIN`/`EPOLLIN`) when the device signals new data. Reading 8 bytes from
+   it returns the count of events since the last read as `uint64_t`, and resets
+   it, the same as an `eventfd`. The miscdev file descriptor is used by
+   default, an `eventfd` can be set instead, e.g. by a local stand-in of the
+   device. */
+
+/* `CRONO_KERNEL_EVENT_WAIT::flags` */
+enum {
+        CRONO_KERNEL_EVENT_WAIT_REG = 0x1, // Spin on BAR0 register condition.
+};
+
+/* Parameters of `CRONO_KERNEL_WaitForEvent` */
+typedef struct {
+        uint32_t spinUs;    // Time to busy-poll before blocking, 0 to block.
+        int32_t timeoutMs;  // Blocking time limit, -1 for no limit.
+        uint32_t flags;     // CRONO_KERNEL_EVENT_WAIT_XXX.
+        uint32_t regOffset; // BAR0 register checked while spinning, the wait
+        uint32_t regMask;   // ends when (value & regMask) == regValue.
+        uint32_t regValue;
+} CRONO_KERNEL_EVENT_WAIT;
+
+/* Get the file descriptor to be added to the application poll/epoll loop,
+   `POLLIN` is signaled on events. */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_GetEventFd(CRONO_KERNEL_DEVICE_HANDLE hDev, int *pFd);
+
+/* Set the file descriptor that signals device events, e.g. an `eventfd` of a
+   local stand-in. -1 restores the miscdev file descriptor. The file
+   descriptor is not owned nor closed by the library, it is set to
+   `O_NONBLOCK`, so a thread waiting for events never blocks in `read` when
+   another thread read them first. */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_SetEventFd(CRONO_KERNEL_DEVICE_HANDLE hDev, int fd);
+
+/* Read and reset the count of pending events without blocking, `*pCount` is
+   zero if none. */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_AckEvents(CRONO_KERNEL_DEVICE_HANDLE hDev, uint64_t *pCount);
+
+/* Spin for `pWait->spinUs` then block until an event is signaled or the
+   register condition is met. `*pCount` has the count of events read, zero if
+   the wait ended by the register condition. Returns
+   `CRONO_KERNEL_TIME_OUT_EXPIRED` on timeout,
+   `CRONO_KERNEL_NOT_IMPLEMENTED` if the kernel module doesn't support event
+   notification, and with `CRONO_KERNEL_EVENT_WAIT_REG`, `-EINVAL` if
+   `regOffset` is not a multiple of 4, or `-ENOMEM` if BAR0 is not mapped or
+   the register exceeds it. */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_WaitForEvent(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                          const CRONO_KERNEL_EVENT_WAIT *pWait,
+                          uint64_t *pCount);
+
 /* -----------------------------------------------
     Access PCI configuration space
    ----------------------------------------------- */
@@ -342,10 +453,67 @@ CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciReadCfg32(
 CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciWriteCfg32(
     CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint32_t val);
 
+/* Read/write `arr_size` 32-bit values from `dwOffset` on, using one read or
+   write of the configuration space. `-EINVAL` is returned if the range
+   exceeds the configuration space, nothing is written then. */
 CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciWriteCfg32Arr(
     CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint32_t *val,
     uint32_t arr_size);
 
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciReadCfg32Arr(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint32_t *val,
+    uint32_t arr_size);
+
+/* Write as `CRONO_KERNEL_PciWriteCfg32Arr`, then read the range back in one
+   read, and return `CRONO_KERNEL_DATA_MISMATCH` if it differs, e.g. for
+   read-only bits. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciWriteCfg32ArrVerify(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, const uint32_t *val,
+    uint32_t arr_size);
+
+/* 8/16-bit configuration space access. Reads are served from a shadow of the
+   configuration space read once on first access, except for registers the
+   device changes, e.g. status, link status and AER status registers, which
+   are always read from the device. Writes update the shadow. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciReadCfg8(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint8_t *val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciReadCfg16(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint16_t *val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciWriteCfg8(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint8_t val);
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciWriteCfg16(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset, uint16_t val);
+
+/* Drop the configuration space shadow, it is read again on next access, e.g.
+   after the device is reset or configured by another process. */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciConfigInvalidate(CRONO_KERNEL_DEVICE_HANDLE hDev);
+
+/* Read the configuration space shadow again now. */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciConfigRefresh(CRONO_KERNEL_DEVICE_HANDLE hDev);
+
+/* Capabilities are indexed when the configuration space shadow is read, lookups
+   do not access the device. `-ENOENT` is returned if the device has no such
+   capability. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciFindCap(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t capId, uint32_t *pOffset);
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciFindExtCap(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t extCapId,
+                           uint32_t *pOffset, uint32_t *pVersion);
+
+/* Get all capabilities, standard ones first, in list order. `*pCount` is set
+   to the count of capabilities, `-ENOBUFS` is returned if it exceeds
+   `maxCount`. */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciGetCapList(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                           CRONO_KERNEL_PCI_CAP *pCaps, uint32_t maxCount,
+                           uint32_t *pCount);
+
 /* -----------------------------------------------
     DMA (Direct Memory Access)
    ----------------------------------------------- */
@@ -358,7 +526,10 @@ CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMAContigBufLock(
     CRONO_KERNEL_DEVICE_HANDLE hDev, void **ppBuf, uint32_t dwOptions,
     uint32_t dwDMABufSize, CRONO_KERNEL_DMA_CONTIG **ppDma);
 
-/* Lock a Scatter/Gather DMA buffer */
+/* Lock a Scatter/Gather DMA buffer. Its pages are excluded from `fork()`
+   children, except the first and last pages if the buffer shares them with
+   other memory, e.g. when allocated by `malloc`; page-aligned buffers are
+   excluded as a whole. */
 // dwOptions are:	DMA_KERNEL_BUFFER_ALLOC, DMA_KBUF_BELOW_16M,
 //					DMA_LARGE_BUFFER, DMA_ALLOW_CACHE,
 // DMA_KERNEL_ONLY_MAP, 					DMA_FROM_DEVICE,
@@ -367,6 +538,93 @@ CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGBufLock(
     CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf, uint32_t dwOptions,
     uint32_t dwDMABufSize, CRONO_KERNEL_DMA_SG **ppDma);
 
+/* Prefault methods reported in `CRONO_KERNEL_PREFAULT_TIMING::method` */
+enum {
+        CRONO_KERNEL_PREFAULT_NONE = 0,     // Pages are not prefaulted.
+        CRONO_KERNEL_PREFAULT_POPULATE = 1, // madvise(MADV_POPULATE_WRITE).
+        CRONO_KERNEL_PREFAULT_TOUCH = 2,    // Pages written by threads.
+};
+
+/* Prefault options */
+enum {
+        CRONO_KERNEL_PREFAULT_HUGEPAGE = 0x1, // madvise(MADV_HUGEPAGE) first.
+        CRONO_KERNEL_PREFAULT_FORCE_TOUCH =
+            0x2, // Don't try MADV_POPULATE_WRITE, touch pages instead.
+};
+
+/* Time spent in each phase of `CRONO_KERNEL_DMASGBufPrefaultLock` */
+typedef struct {
+        uint64_t prefaultNs; // Time spent faulting in the buffer pages.
+        uint64_t lockNs;     // Time spent in the kernel module locking pages.
+        uint32_t method;     // CRONO_KERNEL_PREFAULT_XXX used.
+        uint32_t threads;    // Count of threads used to prefault.
+} CRONO_KERNEL_PREFAULT_TIMING;
+
+/* Fault in all pages of a user buffer in parallel, using threads running on
+   the CPUs local to the device. `dwThreads` zero selects the count
+   automatically. `pTiming` is optional. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PrefaultBuffer(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf, size_t size,
+    uint32_t dwPrefaultOptions, uint32_t dwThreads,
+    CRONO_KERNEL_PREFAULT_TIMING *pTiming);
+
+/* Prefault then lock a Scatter/Gather DMA buffer, same as calling
+   `CRONO_KERNEL_PrefaultBuffer` then `CRONO_KERNEL_DMASGBufLock`.
+   `pTiming` is optional. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGBufPrefaultLock(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf, uint32_t dwOptions,
+    uint32_t dwDMABufSize, CRONO_KERNEL_DMA_SG **ppDma,
+    uint32_t dwPrefaultOptions, CRONO_KERNEL_PREFAULT_TIMING *pTiming);
+
+/* Special values of `CRONO_KERNEL_SetPinnedMemLimit` `limitBytes` */
+#define CRONO_KERNEL_PINNED_LIMIT_NONE 0ULL // No check, the default
+#define CRONO_KERNEL_PINNED_LIMIT_RLIMIT                                       \
+        (~0ULL) // Use the process RLIMIT_MEMLOCK soft limit
+
+/* Memory pinned by `CRONO_KERNEL_DMASGBufLock` */
+typedef struct {
+        uint64_t devicePinnedBytes;  // Bytes locked on the device.
+        uint32_t deviceBuffers;      // Buffers locked on the device.
+        uint32_t processBuffers;     // Buffers locked on all devices.
+        uint64_t processPinnedBytes; // Bytes locked on all devices.
+        uint64_t processPeakBytes;   // Maximum of `processPinnedBytes`.
+        uint64_t limitBytes;         // Effective limit, zero if none.
+        uint64_t rejectedLocks;      // Locks refused as exceeding the limit.
+        uint64_t unprotectedBytes;   // Locked bytes not excluded from fork().
+} CRONO_KERNEL_PINNED_STATS;
+
+/* Set the limit of memory locked by the process on all devices, checked by
+   `CRONO_KERNEL_DMASGBufLock` before calling the kernel module, and by
+   `CRONO_KERNEL_DeviceImport`. A lock exceeding the limit fails with
+   `-ENOMEM`, concurrent locks are checked one after the other. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_SetPinnedMemLimit(uint64_t limitBytes);
+
+/* Get pinned memory accounting. `hDev` can be NULL to get the process
+   information only. `unprotectedBytes` counts the bytes of locked buffers on
+   pages shared with other memory, i.e. the partial first and last pages of
+   buffers not page aligned, which are left out of `MADV_DONTFORK`. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_GetPinnedMemStats(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, CRONO_KERNEL_PINNED_STATS *pStats);
+
+/* Translate a physical address inside any SG buffer locked on the device to
+   its user address. Returns `-ENOENT` if the address is not in a locked
+   buffer. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGPhysToVirt(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, DMA_ADDR physAddr, void **ppUserAddr);
+
+/* Translate a user address inside any SG buffer locked on the device to its
+   physical address. Returns `-ENOENT` if the address is not in a locked
+   buffer. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGVirtToPhys(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const void *pUserAddr,
+    DMA_ADDR *pPhysAddr);
+
+/* Translate `count` physical addresses to user addresses. Addresses not found
+   are set to NULL, and counted in `pNotFound` if not NULL. */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGPhysToVirtBatch(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const DMA_ADDR *physAddrs,
+    void **ppUserAddrs, uint32_t count, uint32_t *pNotFound);
+
 /* Unlock a DMA buffer */
 CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMAContigBufUnlock(
     CRONO_KERNEL_DEVICE_HANDLE hDev, CRONO_KERNEL_DMA_CONTIG *pDma);
@@ -385,12 +643,17 @@ typedef union {
 
 #define CRONO_KERNEL_BAR_FLAG_32_BIT
 
+/* BARs larger than this are not mapped when the device is opened, their
+   `userAddress` is 0, they are accessed through windows, see
+   `crono_bar_window.h`. */
+#define CRONO_KERNEL_BAR_MAP_MAX_SIZE (1ULL << 30)
+
 typedef struct {
         uint32_t barNum; // number of the BAR (BAR0-5) not the index
         uint32_t flags;
         uint64_t userAddress;
         uint64_t physicalAddress;
-        uint32_t length;
+        uint64_t length;
 } CRONO_KERNEL_BAR_DESC;
 
 /**
@@ -457,6 +720,68 @@ CRONO_KERNEL_API uint32_t CRONO_KERNEL_GetDeviceBARMem(
  */
 CRONO_KERNEL_API uint32_t CRONO_KERNEL_GetDeviceMiscName(
     CRONO_KERNEL_DEVICE_HANDLE hDev, char *pMiscName, int nBuffSize);
+
+/**
+ * Maximum size of `CRONO_KERNEL_NUMA_INFO::localCpuList` string.
+ */
+#define CRONO_KERNEL_CPULIST_MAX 256
+
+/**
+ * NUMA placement of a device, as reported by sysfs.
+ */
+typedef struct {
+        int32_t numaNode;       // NUMA node of the device, -1 if unknown.
+        uint32_t localCpuCount; // Count of CPUs local to the device.
+        char localCpuList[CRONO_KERNEL_CPULIST_MAX]; // e.g. "0-7,16-23"
+} CRONO_KERNEL_NUMA_INFO;
+
+/**
+ * @brief Get the NUMA node and the local CPUs of the device.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param pInfo[out]: Pointer to the structure to be filled.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_GetDeviceNumaInfo(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, CRONO_KERNEL_NUMA_INFO *pInfo);
+
+/**
+ * @brief Allocate a page-aligned buffer whose memory is bound to the NUMA node
+ * of the device, to be passed to `CRONO_KERNEL_DMASGBufLock`.
+ * Memory is allocated on any node if the device node is unknown.
+ * Buffer must be freed using `CRONO_KERNEL_FreeDeviceLocalBuffer`.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param size[in]: Size of the buffer in bytes, rounded up to page size.
+ * @param ppBuf[out]: Will contain the address of the allocated buffer.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_AllocDeviceLocalBuffer(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, size_t size, void **ppBuf);
+
+/**
+ * @brief Free a buffer allocated by `CRONO_KERNEL_AllocDeviceLocalBuffer`.
+ *
+ * @param pBuf[in]: The buffer address.
+ * @param size[in]: The size passed to `CRONO_KERNEL_AllocDeviceLocalBuffer`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_FreeDeviceLocalBuffer(void *pBuf,
+                                                             size_t size);
+
+/**
+ * @brief Pin the calling thread to the CPUs local to the device.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the local CPUs of
+ * the device are unknown, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_SetThreadDeviceAffinity(CRONO_KERNEL_DEVICE_HANDLE hDev);
 #endif // #ifdef __linux__
 #ifdef __cplusplus
 }
@@ -0,0 +1,233 @@
+/**
+ * @file crono_link.h
+ * @brief Reports the PCIe link of a device and its upstream port, and tunes the
+ * settings DMA throughput depends on: Max Read Request Size, relaxed ordering,
+ * and ASPM, instead of changing them with `setpci`.
+ *
+ * Registers are read from the PCI Express capability of the device and of the
+ * upstream port, found using the capability index of the configuration space.
+ * Max Payload Size is reported but not changed, it must be consistent across
+ * the whole hierarchy and is set by the kernel at enumeration.
+ *
+ * Usage:
+ * @code
+ * CRONO_KERNEL_PCIE_LINK_INFO info;
+ * // Show what the profile would change, then apply it
+ * CRONO_KERNEL_PcieApplyProfile(hDev, CRONO_KERNEL_PCIE_PROFILE_THROUGHPUT,
+ *                               CRONO_KERNEL_PCIE_TUNE_DRY_RUN, &info);
+ * CRONO_KERNEL_PcieApplyProfile(hDev, CRONO_KERNEL_PCIE_PROFILE_THROUGHPUT, 0,
+ *                               &info);
+ * @endcode
+ *
+ * Writing the configuration space requires root, or `CAP_SYS_ADMIN`. The
+ * kernel may set ASPM again according to its policy, e.g. on resume, see
+ * /sys/module/pcie_aspm/parameters/policy.
+ *
+ * A link monitor samples the link status and the AER status registers, and
+ * the AER counters of the kernel in sysfs when present, so a link retrained
+ * to a lower speed or accumulating errors is noticed before data is lost:
+ * @code
+ * CRONO_KERNEL_LINK_MONITOR *pMon;
+ * CRONO_KERNEL_LinkMonitorStart(hDev, 1000, 0, &pMon);
+ * CRONO_KERNEL_LinkMonitorSnapshot(pMon, &stats); // Any time, any thread
+ * CRONO_KERNEL_LinkMonitorStop(pMon);
+ * @endcode
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_LINK_H_
+#define _CRONO_LINK_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* ASPM states, `aspmSupported`, `aspmEnabled`, and
+ * `CRONO_KERNEL_PCIE_TUNING::aspm` */
+#define CRONO_KERNEL_PCIE_ASPM_L0S 0x1
+#define CRONO_KERNEL_PCIE_ASPM_L1 0x2
+
+/* `CRONO_KERNEL_PcieTune` options */
+#define CRONO_KERNEL_PCIE_TUNE_DRY_RUN 0x1 // Report the result, write nothing.
+
+/* `CRONO_KERNEL_PcieApplyProfile` profiles */
+enum {
+        /* Max Read Request Size of 4096 bytes, relaxed ordering enabled, ASPM
+           disabled. */
+        CRONO_KERNEL_PCIE_PROFILE_THROUGHPUT = 0,
+        /* Max Read Request Size equal to Max Payload Size, so requests do not
+           hold the link long, ASPM disabled, relaxed ordering unchanged. */
+        CRONO_KERNEL_PCIE_PROFILE_LATENCY = 1,
+};
+
+/**
+ * PCIe settings of one end of the link.
+ */
+typedef struct {
+        uint32_t linkSpeed;           // Negotiated speed in MT/s, e.g. 8000.
+        uint32_t linkWidth;           // Negotiated lanes.
+        uint32_t maxLinkSpeed;        // Supported speed in MT/s.
+        uint32_t maxLinkWidth;        // Supported lanes.
+        uint32_t maxPayloadSupported; // Bytes.
+        uint32_t maxPayload;          // Bytes.
+        uint32_t maxReadRequest;      // Bytes.
+        uint32_t relaxedOrdering;     // 1 if enabled.
+        uint32_t aspmSupported;       // CRONO_KERNEL_PCIE_ASPM_XXX.
+        uint32_t aspmEnabled;         // CRONO_KERNEL_PCIE_ASPM_XXX.
+} CRONO_KERNEL_PCIE_PORT_INFO;
+
+typedef struct {
+        CRONO_KERNEL_PCIE_PORT_INFO device;
+        uint32_t hasUpstream; // 0 if directly under the root complex.
+        CRONO_KERNEL_PCI_SLOT upstreamSlot;
+        CRONO_KERNEL_PCIE_PORT_INFO upstream;
+} CRONO_KERNEL_PCIE_LINK_INFO;
+
+/**
+ * Settings to change, fields set to keep are left as they are.
+ */
+typedef struct {
+        uint32_t maxReadRequest; // Bytes, power of 2 from 128 to 4096, or 0
+                                 // to keep.
+        int32_t relaxedOrdering; // 1 to enable, 0 to disable, -1 to keep.
+        int32_t aspm;            // CRONO_KERNEL_PCIE_ASPM_XXX states to
+                                 // enable on both ends, -1 to keep.
+} CRONO_KERNEL_PCIE_TUNING;
+
+/* `CRONO_KERNEL_LinkMonitorStart` options */
+enum {
+        /* Clear the AER status bits of the device, and the bandwidth status
+           bits of the upstream port, once counted, so errors occurring again
+           are counted again. Otherwise a status bit set is counted once until
+           cleared, e.g. by the kernel AER driver. */
+        CRONO_KERNEL_LINK_MONITOR_CLEAR_STATUS = 0x1,
+};
+
+/**
+ * Counters since the monitor started, and rates over the last sample period.
+ */
+typedef struct {
+        uint64_t samples;
+        uint64_t timestampNs; // CLOCK_MONOTONIC time of the last sample.
+
+        // Link
+        uint32_t linkSpeed;        // Negotiated speed in MT/s.
+        uint32_t linkWidth;        // Negotiated lanes.
+        uint32_t maxLinkSpeed;     // Supported speed in MT/s.
+        uint32_t maxLinkWidth;     // Supported lanes.
+        uint32_t linkDegraded;     // 1 if speed or width is below supported.
+        uint64_t linkChanges;      // Times speed or width changed.
+        uint64_t bandwidthChanges; // Link bandwidth management and autonomous
+                                   // bandwidth status of the upstream port
+                                   // set, i.e. link retrained.
+
+        // AER status registers, 0 if the device has no AER capability
+        uint32_t hasAer;
+        uint32_t corStatus;   // Last PCI_ERR_COR_STATUS.
+        uint32_t uncorStatus; // Last PCI_ERR_UNCOR_STATUS.
+        uint64_t corErrors;   // Correctable status bits seen set.
+        uint64_t uncorErrors; // Uncorrectable status bits seen set.
+
+        // Kernel AER counters, from sysfs aer_dev_correctable, aer_dev_nonfatal
+        // and aer_dev_fatal, 0 if the kernel does not provide them
+        uint32_t hasSysfsAer;
+        uint64_t sysfsCorErrors;
+        uint64_t sysfsNonFatalErrors;
+        uint64_t sysfsFatalErrors;
+
+        // Errors per second over the last sample period, from the kernel
+        // counters if provided, from the status registers otherwise
+        double corErrorRate;
+        double uncorErrorRate;
+} CRONO_KERNEL_LINK_STATS;
+
+typedef struct CRONO_KERNEL_LINK_MONITOR CRONO_KERNEL_LINK_MONITOR;
+
+/**
+ * @brief Get the negotiated link speed and width, and the payload, ordering
+ * and ASPM settings of the device and of its upstream port.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the device has no
+ * PCI Express capability, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PcieGetLinkInfo(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                             CRONO_KERNEL_PCIE_LINK_INFO *pInfo);
+
+/**
+ * @brief Change the settings of the device, and ASPM on both ends of the link.
+ * ASPM is disabled on the device before its upstream port, and enabled on the
+ * upstream port first.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param pTuning[in]: Settings to change.
+ * @param dwOptions[in]: CRONO_KERNEL_PCIE_TUNE_XXX.
+ * @param pResult[out]: Link information after the change, or as it would be
+ * for `CRONO_KERNEL_PCIE_TUNE_DRY_RUN`. Ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if a setting is
+ * invalid, `-EOPNOTSUPP` if an ASPM state is not supported by both ends or
+ * the upstream port is unknown, `-ENOENT` if the device has no PCI Express
+ * capability, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PcieTune(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                      const CRONO_KERNEL_PCIE_TUNING *pTuning,
+                      uint32_t dwOptions, CRONO_KERNEL_PCIE_LINK_INFO *pResult);
+
+/**
+ * @brief Tune the device for a CRONO_KERNEL_PCIE_PROFILE_XXX profile, see
+ * `CRONO_KERNEL_PcieTune`.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PcieApplyProfile(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                              uint32_t profile, uint32_t dwOptions,
+                              CRONO_KERNEL_PCIE_LINK_INFO *pResult);
+
+/**
+ * @brief Start monitoring the link of the device, and take the first sample.
+ * The device must stay open until the monitor is stopped.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param periodMs[in]: Sample period of the monitor thread in milliseconds, or
+ * 0 for no thread, samples are then taken using
+ * `CRONO_KERNEL_LinkMonitorSample`.
+ * @param dwOptions[in]: CRONO_KERNEL_LINK_MONITOR_XXX.
+ * @param ppMon[out]: The new monitor.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the device has no
+ * PCI Express capability, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorStart(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                              uint32_t periodMs, uint32_t dwOptions,
+                              CRONO_KERNEL_LINK_MONITOR **ppMon);
+
+/**
+ * @brief Take a sample now, e.g. before deciding on an alert.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorSample(CRONO_KERNEL_LINK_MONITOR *pMon);
+
+/**
+ * @brief Copy the statistics of the last sample, without accessing the
+ * device.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorSnapshot(CRONO_KERNEL_LINK_MONITOR *pMon,
+                                 CRONO_KERNEL_LINK_STATS *pStats);
+
+/**
+ * @brief Stop the monitor thread and free the monitor.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorStop(CRONO_KERNEL_LINK_MONITOR *pMon);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_LINK_H_
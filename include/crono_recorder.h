@@ -0,0 +1,146 @@
+/**
+ * @file crono_recorder.h
+ * @brief Records a DMA ring buffer, e.g. locked by `CRONO_KERNEL_DMASGBufLock`,
+ * to a file. Spans are written straight from the ring with `O_DIRECT`, several
+ * writes are kept in flight using io_uring, and the ring position released to
+ * the producer only advances once the data is on disk.
+ *
+ * Positions are counts of bytes since the start of the stream, the ring offset
+ * of a position is `position % ringSize`. The producer may write up to the
+ * released position plus `ringSize`.
+ *
+ * Usage:
+ * @code
+ * CRONO_KERNEL_RECORDER *pRec;
+ * CRONO_KERNEL_RecorderOpen(&config, &pRec);
+ * while (acquiring) {
+ *         // `produced` is read from the device
+ *         CRONO_KERNEL_RecorderPush(pRec, produced, &released);
+ *         // Publish `released` to the device as its read pointer
+ * }
+ * CRONO_KERNEL_RecorderClose(pRec, &stats);
+ * @endcode
+ *
+ * A recorder is used by one thread at a time.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_RECORDER_H_
+#define _CRONO_RECORDER_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * Alignment of the ring address, ring size, chunk size and file offsets
+ * required by `O_DIRECT`.
+ */
+#define CRONO_KERNEL_RECORDER_ALIGN 4096
+
+/* `CRONO_KERNEL_RECORDER_CONFIG::flags` */
+enum {
+        CRONO_KERNEL_RECORDER_REQUIRE_DIRECT =
+            0x1, // Fail if the file system doesn't support `O_DIRECT`.
+        CRONO_KERNEL_RECORDER_SYNC_ON_CLOSE = 0x2, // `fdatasync` on close.
+};
+
+/**
+ * Recorder parameters.
+ */
+typedef struct {
+        const char *path;      // File to create, truncated if it exists.
+        const void *pRing;     // Ring start, aligned.
+        uint64_t ringSize;     // Ring size in bytes, aligned.
+        uint32_t chunkSize;    // Bytes per write, aligned, 0 for 4 MiB.
+        uint32_t queueDepth;   // Writes in flight, 0 for 8.
+        uint64_t preallocSize; // Bytes allocated on disk upfront, 0 for none.
+        uint32_t flags;        // CRONO_KERNEL_RECORDER_XXX.
+} CRONO_KERNEL_RECORDER_CONFIG;
+
+/**
+ * Recorder counters.
+ */
+typedef struct {
+        uint64_t producedBytes; // Last position passed by the producer.
+        uint64_t releasedBytes; // Position released to the producer.
+        uint64_t writtenBytes;  // Bytes written to the file.
+        uint64_t droppedBytes;  // Bytes lost by overruns or failed writes.
+        uint64_t overruns;      // Times the producer overwrote unwritten data.
+        uint64_t writes;        // Completed writes.
+        uint64_t writeErrors;   // Failed writes.
+        uint32_t inFlight;      // Writes currently in flight.
+        uint32_t maxInFlight;   // Maximum of `inFlight`.
+        uint32_t direct;        // Non-zero if `O_DIRECT` is used.
+        uint32_t uring;         // Non-zero if io_uring is used.
+        int32_t lastError;      // errno of the last failed write, 0 if none.
+        uint64_t elapsedNs;     // Time since the first write.
+        double sustainedMBps;   // `writtenBytes` over `elapsedNs`, in MB/s.
+} CRONO_KERNEL_RECORDER_STATS;
+
+typedef struct CRONO_KERNEL_RECORDER CRONO_KERNEL_RECORDER;
+
+/**
+ * @brief Create the file and the recorder. If io_uring is not available,
+ * writes are done synchronously.
+ *
+ * @param pConfig[in]: Recorder parameters.
+ * @param ppRec[out]: The new recorder.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if the ring or chunk
+ * is not aligned, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_RecorderOpen(const CRONO_KERNEL_RECORDER_CONFIG *pConfig,
+                          CRONO_KERNEL_RECORDER **ppRec);
+
+/**
+ * @brief Collect completed writes and queue writes of all whole chunks up to
+ * `producedBytes`, without blocking. If the producer is more than `ringSize`
+ * ahead of the released position, the overwritten data is counted as dropped
+ * and skipped.
+ *
+ * @param pRec[in]: The recorder.
+ * @param producedBytes[in]: Position the producer has written up to.
+ * @param pReleasedBytes[out]: Position up to which data is written, or
+ * dropped. Ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or an error code.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_RecorderPush(CRONO_KERNEL_RECORDER *pRec, uint64_t producedBytes,
+                          uint64_t *pReleasedBytes);
+
+/**
+ * @brief Block until at least one write in flight completes, then collect
+ * completed writes. Returns immediately if no write is in flight.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RecorderWait(
+    CRONO_KERNEL_RECORDER *pRec, uint64_t *pReleasedBytes);
+
+/**
+ * @brief Get the recorder counters.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RecorderGetStats(
+    CRONO_KERNEL_RECORDER *pRec, CRONO_KERNEL_RECORDER_STATS *pStats);
+
+/**
+ * @brief Write the data produced but not written yet, wait for all writes,
+ * truncate the file to the written size, and free the recorder.
+ *
+ * @param pRec[in]: The recorder.
+ * @param pStats[out]: Final counters. Ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or an error code.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RecorderClose(
+    CRONO_KERNEL_RECORDER *pRec, CRONO_KERNEL_RECORDER_STATS *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_RECORDER_H_
@@ -0,0 +1,118 @@
+/**
+ * @file crono_reg_shadow.h
+ * @brief Keeps a copy in host memory of selected BAR register ranges, e.g.
+ * control and configuration registers of the board, which only change when
+ * written by the host.
+ *
+ * Reads of shadowed registers are served from the copy, without a PCIe round
+ * trip. Writes go to the device and update the copy, and writes of values the
+ * registers hold already can be skipped. Write-only registers, which read back
+ * other values than written, are shadowed from the values written.
+ *
+ * Shadowed are the accesses of `CRONO_KERNEL_ReadAddrXX`,
+ * `CRONO_KERNEL_WriteAddrXX`, `CRONO_KERNEL_ReadAddr`,
+ * `CRONO_KERNEL_WriteAddr`, `CRONO_KERNEL_ReadBarXX`,
+ * `CRONO_KERNEL_WriteBarXX`, and the block variants. Accesses through the
+ * window mappers of `crono_bar_window.h`, or the pointers of `crono_regmap.h`,
+ * bypass the shadow, and must not write shadowed registers. Reads served from
+ * the shadow and elided writes are not traced, see `crono_trace.h`.
+ *
+ * Usage:
+ * @code
+ * // Control registers, 0x00 to 0x3f of BAR0
+ * CRONO_KERNEL_RegShadowAdd(hDev, 0, 0x00, 0x40,
+ *                           CRONO_KERNEL_REG_SHADOW_ELIDE);
+ * // Write-only trigger thresholds
+ * CRONO_KERNEL_RegShadowAdd(hDev, 0, 0x100, 0x20,
+ *                           CRONO_KERNEL_REG_SHADOW_WRITE_ONLY |
+ *                               CRONO_KERNEL_REG_SHADOW_ELIDE);
+ * // After a reset of the board
+ * CRONO_KERNEL_RegShadowResync(hDev, CRONO_KERNEL_REG_SHADOW_RESTORE);
+ * @endcode
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_REG_SHADOW_H_
+#define _CRONO_REG_SHADOW_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* `dwFlags` of `CRONO_KERNEL_RegShadowAdd` */
+/* The registers are never read from the device, the shadow holds the values
+   written. Reading a register not written yet returns `-ENODATA`. */
+#define CRONO_KERNEL_REG_SHADOW_WRITE_ONLY 0x1
+/* Writes of the values the registers hold already are skipped. */
+#define CRONO_KERNEL_REG_SHADOW_ELIDE 0x2
+
+/* `dwOptions` of `CRONO_KERNEL_RegShadowResync` */
+/* Write the known values of write-only ranges back to the device, instead of
+   forgetting them. */
+#define CRONO_KERNEL_REG_SHADOW_RESTORE 0x1
+
+typedef struct {
+        uint64_t readsServed;  // Reads served from the shadow.
+        uint64_t readsDevice;  // Reads of shadowed registers from the device.
+        uint64_t writesElided; // Writes skipped as unchanged.
+        uint64_t writesDevice; // Writes of shadowed registers to the device.
+} CRONO_KERNEL_REG_SHADOW_STATS;
+
+/**
+ * @brief Shadow `size` bytes at `offset` of BAR `barNum`. Ranges not
+ * write-only are read from the device once, now.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param barNum[in]: The BAR number.
+ * @param offset[in]: Offset of the range in the BAR.
+ * @param size[in]: Size of the range in bytes.
+ * @param dwFlags[in]: `CRONO_KERNEL_REG_SHADOW_XXX` flags.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOMEM` if the BAR is not
+ * mapped, the range exceeds it, or allocation failed, or `-EINVAL` if `size`
+ * is 0 or the range overlaps a shadowed range.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RegShadowAdd(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint64_t size, uint32_t dwFlags);
+
+/**
+ * @brief Stop shadowing the range added at `offset` of BAR `barNum`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-ENOENT` if no range starts
+ * there.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RegShadowRemove(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset);
+
+/**
+ * @brief Read the shadowed ranges from the device again, e.g. after the board
+ * was reset or written through other means. The values of write-only ranges
+ * are forgotten, or written back to the device with
+ * `CRONO_KERNEL_REG_SHADOW_RESTORE`. No other thread may access the shadowed
+ * registers meanwhile.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param dwOptions[in]: `CRONO_KERNEL_REG_SHADOW_RESTORE`, or 0.
+ *
+ * @return `CRONO_SUCCESS` in case of no error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_RegShadowResync(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                             uint32_t dwOptions);
+
+/**
+ * @brief Get the counters of shadowed accesses since the first range was
+ * added.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RegShadowGetStats(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, CRONO_KERNEL_REG_SHADOW_STATS *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_REG_SHADOW_H_
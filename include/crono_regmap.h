@@ -0,0 +1,270 @@
+/**
+ * @file crono_regmap.h
+ * @brief Optional C++17 layer declaring the registers of a board as types,
+ * instead of offsets and masks passed to `CRONO_KERNEL_ReadAddr32` and
+ * `CRONO_KERNEL_WriteAddr32`.
+ *
+ * A register is declared with its offset, width and access mode, a field with
+ * its register, position, width and value type. Offsets and masks are
+ * compile-time constants, so reading a field compiles to one volatile load, a
+ * shift and a mask. Writing fields of the same register together is one
+ * volatile store, or one load and one store to keep the other fields. Writing
+ * a read-only register, or reading a write-only one, does not compile.
+ *
+ * Usage:
+ * @code
+ * namespace regs {
+ * using Ctrl = crono_regmap::Register<0x00, uint32_t>;
+ * using CtrlEnable = crono_regmap::Field<Ctrl, 0, 1, bool>;
+ * using CtrlMode = crono_regmap::Field<Ctrl, 4, 2, Mode>; // enum class Mode
+ * using Status = crono_regmap::Register<0x04, uint32_t,
+ *                                       crono_regmap::Access::ReadOnly>;
+ * using StatusReady = crono_regmap::Field<Status, 0, 1, bool>;
+ * using Map = crono_regmap::RegisterMap<Ctrl, Status>;
+ * } // namespace regs
+ *
+ * crono_regmap::Bar<regs::Map> bar;
+ * bar.attach(hDev, 0); // BAR0
+ * if (bar.get<regs::StatusReady>()) {
+ *         // One load, one store
+ *         bar.modify(regs::CtrlEnable{true}, regs::CtrlMode{Mode::Fast});
+ * }
+ * bar.write(regs::StatusReady{true}); // Does not compile
+ * @endcode
+ *
+ * The device must stay open while a `Bar` is used.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_REGMAP_H_
+#define _CRONO_REGMAP_H_
+
+#if !defined(__cplusplus) || __cplusplus < 201703L
+#error "crono_regmap.h requires C++17"
+#endif
+
+#include "crono_kernel_interface.h"
+#include <algorithm>
+#include <cerrno>
+#include <type_traits>
+
+namespace crono_regmap {
+
+enum class Access { ReadWrite, ReadOnly, WriteOnly };
+
+/**
+ * A register of `T`, an unsigned integer of 8 to 64 bits, at `Offset` of the
+ * BAR, aligned to its size.
+ */
+template <uint32_t Offset, typename T, Access A = Access::ReadWrite>
+struct Register {
+        static_assert(std::is_unsigned_v<T> && !std::is_same_v<T, bool> &&
+                          sizeof(T) <= sizeof(uint64_t),
+                      "register type must be an unsigned integer of 8 to "
+                      "64 bits");
+        static_assert(0 == Offset % sizeof(T),
+                      "register offset must be aligned to its size");
+
+        using value_type = T;
+        static constexpr uint32_t offset = Offset;
+        static constexpr Access access = A;
+        static constexpr bool readable = A != Access::WriteOnly;
+        static constexpr bool writable = A != Access::ReadOnly;
+};
+
+/**
+ * `Width` bits of register `Reg` from bit `Lsb`, holding a `V`, e.g. an
+ * unsigned integer, `bool`, or an enumeration. An instance holds a value of
+ * the field, to be written.
+ */
+template <typename Reg, unsigned Lsb, unsigned Width,
+          typename V = typename Reg::value_type>
+struct Field {
+        using reg = Reg;
+        using raw_type = typename Reg::value_type;
+        using value_type = V;
+
+        static_assert(Width > 0 && Lsb + Width <= sizeof(raw_type) * 8,
+                      "field exceeds its register");
+
+        static constexpr unsigned lsb = Lsb;
+        static constexpr unsigned width = Width;
+        static constexpr raw_type mask =
+            (Width == sizeof(raw_type) * 8)
+                ? (raw_type)~raw_type(0)
+                : (raw_type)(((raw_type(1) << Width) - 1) << Lsb);
+
+        static constexpr raw_type encode(V value) {
+                return (raw_type)(((raw_type)value << Lsb) & mask);
+        }
+
+        static constexpr V decode(raw_type raw) {
+                return (V)((raw & mask) >> Lsb);
+        }
+
+        V value;
+};
+
+namespace detail {
+
+template <typename T, typename = void> struct is_field : std::false_type {};
+
+template <typename T>
+struct is_field<T, std::void_t<typename T::reg, decltype(T::mask)>>
+    : std::true_type {};
+
+} // namespace detail
+
+/**
+ * A value of register `Reg`, held in memory, e.g. to change several fields
+ * before one write.
+ */
+template <typename Reg> struct Value {
+        typename Reg::value_type raw = 0;
+
+        template <typename F> constexpr typename F::value_type get() const {
+                static_assert(std::is_same_v<typename F::reg, Reg>,
+                              "field is not of this register");
+                return F::decode(raw);
+        }
+
+        template <typename F> constexpr Value &set(F field) {
+                static_assert(std::is_same_v<typename F::reg, Reg>,
+                              "field is not of this register");
+                raw = (raw & ~F::mask) | F::encode(field.value);
+                return *this;
+        }
+};
+
+/**
+ * The registers of a BAR. `size` is the BAR length the registers need.
+ */
+template <typename... Regs> struct RegisterMap {
+        static_assert(sizeof...(Regs) > 0, "register map is empty");
+
+        static constexpr uint64_t size =
+            std::max({(uint64_t)Regs::offset +
+                      sizeof(typename Regs::value_type)...});
+
+        template <typename Reg>
+        static constexpr bool contains = (std::is_same_v<Reg, Regs> || ...);
+};
+
+/**
+ * Accesses the registers of `Map` in a mapped BAR. The BAR is checked once
+ * when attached, accesses are not checked at run time.
+ */
+template <typename Map> class Bar {
+      public:
+        /**
+         * @brief Attach to BAR `barNum` of the device.
+         *
+         * @return `CRONO_SUCCESS` in case of no error, `-ENOMEM` if the BAR
+         * is not present, not mapped, or shorter than `Map::size`, or as
+         * `CRONO_KERNEL_GetBarDescriptions`.
+         */
+        uint32_t attach(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum) {
+                CRONO_KERNEL_BAR_DESC descs[6];
+                uint32_t count = 0;
+                uint32_t ret;
+
+                ret = CRONO_KERNEL_GetBarDescriptions(hDev, &count, descs);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                for (uint32_t ibar = 0; ibar < count && ibar < 6; ibar++) {
+                        if (descs[ibar].barNum == barNum) {
+                                return attach_memory(
+                                    (void *)(uintptr_t)descs[ibar].userAddress,
+                                    descs[ibar].length);
+                        }
+                }
+                return -ENOMEM;
+        }
+
+        /**
+         * @brief Attach to `length` bytes mapped at `base`, e.g. a window of
+         * `crono_bar_window.h`, or memory standing for the BAR.
+         */
+        uint32_t attach_memory(void *base, uint64_t length) {
+                if (nullptr == base || length < Map::size) {
+                        return -ENOMEM;
+                }
+                base_ = (uint8_t *)base;
+                return CRONO_SUCCESS;
+        }
+
+        bool attached() const { return nullptr != base_; }
+
+        /**
+         * @brief Read the register, one load.
+         */
+        template <typename Reg> Value<Reg> read() const {
+                check<Reg>();
+                static_assert(Reg::readable, "register is write-only");
+                return Value<Reg>{*reg<Reg>()};
+        }
+
+        /**
+         * @brief Write the register, one store.
+         */
+        template <typename Reg> void write(Value<Reg> value) const {
+                check<Reg>();
+                static_assert(Reg::writable, "register is read-only");
+                *reg<Reg>() = value.raw;
+        }
+
+        /**
+         * @brief Read a field, one load.
+         */
+        template <typename F> typename F::value_type get() const {
+                return read<typename F::reg>().template get<F>();
+        }
+
+        /**
+         * @brief Write fields of one register, the other bits are written as
+         * zeros, one store.
+         */
+        template <typename F, typename... Fs,
+                  typename = std::enable_if_t<detail::is_field<F>::value>>
+        void write(F field, Fs... fields) const {
+                write(merge(Value<typename F::reg>{}, field, fields...));
+        }
+
+        /**
+         * @brief Write fields of one register, the other bits are kept, one
+         * load and one store.
+         */
+        template <typename F, typename... Fs> void modify(F field,
+                                                          Fs... fields) const {
+                write(merge(read<typename F::reg>(), field, fields...));
+        }
+
+      private:
+        template <typename Reg> static constexpr void check() {
+                static_assert(Map::template contains<Reg>,
+                              "register is not in the register map");
+        }
+
+        template <typename Reg>
+        volatile typename Reg::value_type *reg() const {
+                return (volatile typename Reg::value_type *)(base_ +
+                                                             Reg::offset);
+        }
+
+        template <typename Reg, typename... Fs>
+        static constexpr Value<Reg> merge(Value<Reg> value, Fs... fields) {
+                static_assert((std::is_same_v<typename Fs::reg, Reg> && ...),
+                              "fields written together must be of one "
+                              "register");
+                (value.set(fields), ...);
+                return value;
+        }
+
+        uint8_t *base_ = nullptr;
+};
+
+} // namespace crono_regmap
+
+#endif // #ifndef _CRONO_REGMAP_H_
@@ -0,0 +1,242 @@
+/**
+ * @file crono_shm_ring.h
+ * @brief Shares a DMA ring buffer with consumer processes without copying.
+ *
+ * The ring is allocated from a memfd, preceded in the same file by a control
+ * block holding the producer write position and one read cursor per consumer.
+ * The producer process locks the ring with `CRONO_KERNEL_DMASGBufLock`, and
+ * passes the memfd to consumer processes, e.g. over a unix socket, which map
+ * it and read the spans in place.
+ *
+ * Positions are counts of bytes since the start of the stream, the ring offset
+ * of a position is `position % ringSize`. Consumers map the ring twice back to
+ * back, so a span crossing the end of the ring is still contiguous.
+ *
+ * The producer never waits long for a consumer: a consumer more than
+ * `lagLimit` bytes behind the write position is marked slow and no longer
+ * holds back the released position, so the producer always has at least
+ * `ringSize - lagLimit` bytes to write to. The consumer is told so on its next
+ * call, and resumes at the current write position using
+ * `CRONO_KERNEL_ShmRingResync`.
+ *
+ * Producer:
+ * @code
+ * CRONO_KERNEL_ShmRingCreate(hDev, &config, &pRing);
+ * CRONO_KERNEL_ShmRingGetInfo(pRing, &info); // Send `info.fd` to consumers
+ * while (acquiring) {
+ *         CRONO_KERNEL_ShmRingPublish(pRing, produced, &released);
+ *         // Publish `released` to the device as its read pointer
+ * }
+ * CRONO_KERNEL_ShmRingClose(pRing);
+ * @endcode
+ *
+ * Consumer:
+ * @code
+ * CRONO_KERNEL_ShmRingAttach(fd, &pConsumer);
+ * while (consuming) {
+ *         if (CRONO_SUCCESS != CRONO_KERNEL_ShmRingWait(pConsumer, 100)) {
+ *                 continue;
+ *         }
+ *         ret = CRONO_KERNEL_ShmRingPeek(pConsumer, &span);
+ *         if ((uint32_t)-EOVERFLOW == ret) {
+ *                 CRONO_KERNEL_ShmRingResync(pConsumer, &dropped);
+ *                 continue;
+ *         }
+ *         // Process `span.pData`
+ *         CRONO_KERNEL_ShmRingConsume(pConsumer, span.size);
+ * }
+ * CRONO_KERNEL_ShmRingDetach(pConsumer);
+ * @endcode
+ *
+ * A ring or a consumer is used by one thread at a time.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_SHM_RING_H_
+#define _CRONO_SHM_RING_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define CRONO_KERNEL_SHM_RING_VERSION 1
+#define CRONO_KERNEL_SHM_RING_MAX_CONSUMERS 64
+
+/* `CRONO_KERNEL_SHM_RING_STATS::consumers[]::state` */
+enum {
+        CRONO_KERNEL_SHM_CONSUMER_FREE = 0,   // Slot not used.
+        CRONO_KERNEL_SHM_CONSUMER_ACTIVE = 1, // Holds back the producer.
+        CRONO_KERNEL_SHM_CONSUMER_SLOW = 2,   // Fell behind, data was lost.
+};
+
+/**
+ * Ring parameters.
+ */
+typedef struct {
+        const char *name;      // memfd name, shown in /proc/<pid>/fd.
+        uint32_t ringSize;     // Ring size in bytes, multiple of page size.
+        uint32_t maxConsumers; // Up to CRONO_KERNEL_SHM_RING_MAX_CONSUMERS.
+        uint32_t lagLimit;     // Bytes a consumer may lag, less than
+                               // `ringSize`, 0 for half of it.
+        uint32_t dwOptions;    // `CRONO_KERNEL_DMASGBufLock` options.
+} CRONO_KERNEL_SHM_RING_CONFIG;
+
+/**
+ * Producer view of the ring.
+ */
+typedef struct {
+        int fd;                    // The memfd, to be passed to consumers.
+        void *pRing;               // Ring start in the producer process.
+        uint32_t ringSize;         // Ring size in bytes.
+        uint64_t ringOffset;       // Offset of the ring in the memfd.
+        CRONO_KERNEL_DMA_SG *pDma; // The locked ring, NULL if no device.
+} CRONO_KERNEL_SHM_RING_INFO;
+
+typedef struct {
+        uint32_t state;        // CRONO_KERNEL_SHM_CONSUMER_XXX.
+        int32_t pid;           // Process of the consumer.
+        uint64_t cursor;       // Position read up to.
+        uint64_t lagBytes;     // Write position minus `cursor`.
+        uint64_t overruns;     // Times marked slow.
+        uint64_t droppedBytes; // Bytes skipped by `CRONO_KERNEL_ShmRingResync`.
+} CRONO_KERNEL_SHM_CONSUMER_STATS;
+
+typedef struct {
+        uint64_t writePosition;    // Last position published.
+        uint64_t releasedPosition; // Last position released to the producer.
+        uint32_t consumerCount;    // Consumers not free.
+        CRONO_KERNEL_SHM_CONSUMER_STATS
+        consumers[CRONO_KERNEL_SHM_RING_MAX_CONSUMERS];
+} CRONO_KERNEL_SHM_RING_STATS;
+
+/**
+ * Span of the ring readable by a consumer, valid until it is consumed.
+ */
+typedef struct {
+        const void *pData;
+        uint64_t position; // Stream position of `pData`.
+        uint64_t size;     // Bytes readable, at most `ringSize`.
+} CRONO_KERNEL_SHM_SPAN;
+
+typedef struct CRONO_KERNEL_SHM_RING CRONO_KERNEL_SHM_RING;
+typedef struct CRONO_KERNEL_SHM_CONSUMER CRONO_KERNEL_SHM_CONSUMER;
+
+// ________
+// Producer
+//
+/**
+ * @brief Create the memfd and the ring, and lock the ring on the device.
+ *
+ * @param hDev[in]: Device to lock the ring on, or NULL to only create it.
+ * @param pConfig[in]: Ring parameters.
+ * @param ppRing[out]: The new ring.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if a parameter is
+ * invalid, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingCreate(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                           const CRONO_KERNEL_SHM_RING_CONFIG *pConfig,
+                           CRONO_KERNEL_SHM_RING **ppRing);
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingGetInfo(CRONO_KERNEL_SHM_RING *pRing,
+                            CRONO_KERNEL_SHM_RING_INFO *pInfo);
+
+/**
+ * @brief Publish data written up to `producedBytes`, wake waiting consumers,
+ * and mark consumers lagging more than `lagLimit` as slow, without blocking.
+ *
+ * @param pRing[in]: The ring.
+ * @param producedBytes[in]: Position the producer has written up to.
+ * @param pReleasedBytes[out]: Position read by all active consumers, the
+ * producer may write up to it plus `ringSize`. Ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-EINVAL` if
+ * `producedBytes` is less than the last position published.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingPublish(CRONO_KERNEL_SHM_RING *pRing,
+                            uint64_t producedBytes, uint64_t *pReleasedBytes);
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingGetStats(CRONO_KERNEL_SHM_RING *pRing,
+                             CRONO_KERNEL_SHM_RING_STATS *pStats);
+
+/**
+ * @brief Unlock the ring, and close the producer memfd and mapping. Consumers
+ * attached keep their mappings.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingClose(CRONO_KERNEL_SHM_RING *pRing);
+
+// ________
+// Consumer
+//
+/**
+ * @brief Map the ring from its memfd and take a consumer slot, starting at the
+ * current write position. `fd` can be closed afterwards.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `CRONO_KERNEL_DATA_MISMATCH`
+ * if `fd` is not a ring, `-EBUSY` if all slots are taken, or `errno` in case
+ * of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingAttach(int fd, CRONO_KERNEL_SHM_CONSUMER **ppConsumer);
+
+/**
+ * @brief Get the span from the consumer cursor up to the write position.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, even if `pSpan->size` is zero,
+ * or `-EOVERFLOW` if the consumer was marked slow.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingPeek(CRONO_KERNEL_SHM_CONSUMER *pConsumer,
+                         CRONO_KERNEL_SHM_SPAN *pSpan);
+
+/**
+ * @brief Advance the consumer cursor by `bytes`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if `bytes` exceeds
+ * the data published, or `-EOVERFLOW` if the consumer was marked slow, then
+ * the data peeked may have been overwritten while being read.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingConsume(CRONO_KERNEL_SHM_CONSUMER *pConsumer,
+                            uint64_t bytes);
+
+/**
+ * @brief Resume a slow consumer at the current write position.
+ *
+ * @param pDroppedBytes[out]: Bytes skipped. Ignored if NULL.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingResync(CRONO_KERNEL_SHM_CONSUMER *pConsumer,
+                           uint64_t *pDroppedBytes);
+
+/**
+ * @brief Wait until data is published past the consumer cursor.
+ *
+ * @param pConsumer[in]: The consumer.
+ * @param timeoutMs[in]: Timeout in milliseconds, negative to wait forever.
+ *
+ * @return `CRONO_SUCCESS` if data is available or the consumer is slow,
+ * `-ETIMEDOUT` on timeout, or `-errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingWait(CRONO_KERNEL_SHM_CONSUMER *pConsumer, int timeoutMs);
+
+/**
+ * @brief Free the consumer slot and unmap the ring.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingDetach(CRONO_KERNEL_SHM_CONSUMER *pConsumer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_SHM_RING_H_
@@ -0,0 +1,123 @@
+/**
+ * @file crono_snapshot.h
+ * @brief Saves the state of a device, i.e. its configuration space and
+ * selected BAR register ranges, to a snapshot in memory, and restores it,
+ * e.g. after the board was reset or the driver reloaded, instead of running
+ * the initialization sequence again.
+ *
+ * Restoring writes only the registers differing from the snapshot:
+ * - Of the configuration space, the registers the kernel restores after a
+ *   reset, i.e. the PCI Express Device and Link Control registers, then the
+ *   header from its end, with the Command register last. The BAR and
+ *   expansion ROM addresses are not restored, they are assigned by the kernel.
+ * - Of each BAR range, the 32-bit registers differing from the snapshot,
+ *   adjacent ones written in one pass of 32-bit writes.
+ * Then the configuration space and each range are read back with one bulk
+ * read, and compared to the snapshot.
+ *
+ * Usage:
+ * @code
+ * CRONO_KERNEL_SNAPSHOT_RANGE ranges[] = {{0, 0, 0x0, 0x400}};
+ * uint64_t size = 0;
+ * CRONO_KERNEL_SnapshotSave(hDev, ranges, 1, NULL, &size); // -ENOSPC
+ * void *pBlob = malloc(size);
+ * CRONO_KERNEL_SnapshotSave(hDev, ranges, 1, pBlob, &size);
+ * // After a reset of the board
+ * CRONO_KERNEL_SnapshotRestore(hDev, pBlob, size, NULL);
+ * @endcode
+ *
+ * Snapshot format, in host byte order: a `CRONO_KERNEL_SNAPSHOT_HEADER`, then
+ * `configSize` bytes of the configuration space, then for each range a
+ * `CRONO_KERNEL_SNAPSHOT_RANGE` followed by `size` bytes of the range. The
+ * configuration space and the ranges are padded to a multiple of 8 bytes.
+ *
+ * The configuration space is saved as far as the process may read it, the
+ * sysfs `config` file is readable as a whole by root only. Restoring it needs
+ * write access to the file. Registers of shadowed ranges are read again after
+ * restoring, see `CRONO_KERNEL_RegShadowResync`.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_SNAPSHOT_H_
+#define _CRONO_SNAPSHOT_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define CRONO_KERNEL_SNAPSHOT_MAGIC 0x50414e53 // "SNAP"
+#define CRONO_KERNEL_SNAPSHOT_VERSION 1
+
+/* `CRONO_KERNEL_SNAPSHOT_RANGE::flags` */
+/* The range is written whole and not read back, e.g. registers reading back
+   other values than written. */
+#define CRONO_KERNEL_SNAPSHOT_RANGE_WRITE_ALL 0x1
+
+typedef struct {
+        uint32_t magic;   // CRONO_KERNEL_SNAPSHOT_MAGIC.
+        uint32_t version; // CRONO_KERNEL_SNAPSHOT_VERSION.
+        uint32_t vendorId;
+        uint32_t deviceId;
+        uint32_t configSize; // Bytes of configuration space following.
+        uint32_t rangeCount; // Ranges following the configuration space.
+} CRONO_KERNEL_SNAPSHOT_HEADER;
+
+typedef struct {
+        uint32_t barNum; // BAR number, 0 to 5, not the index.
+        uint32_t flags;  // CRONO_KERNEL_SNAPSHOT_RANGE_XXX.
+        uint64_t offset; // Offset in the BAR, multiple of 4.
+        uint64_t size;   // Bytes, multiple of 4.
+} CRONO_KERNEL_SNAPSHOT_RANGE;
+
+typedef struct {
+        uint32_t configWrites; // Configuration registers written.
+        uint32_t barWrites;    // Runs of adjacent registers written.
+        uint64_t barBytes;     // Bytes written to the BAR ranges.
+        uint32_t mismatches;   // Registers not reading back as restored.
+} CRONO_KERNEL_SNAPSHOT_STATS;
+
+/**
+ * @brief Save the configuration space and BAR ranges of the device to a
+ * snapshot.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param pRanges[in]: BAR ranges to save, ignored if `rangeCount` is 0.
+ * @param rangeCount[in]: Count of ranges.
+ * @param pBlob[out]: The snapshot, ignored if `*pSize` is too small.
+ * @param pSize[in/out]: Size of `pBlob` in bytes, set to the size of the
+ * snapshot.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOSPC` if `*pSize` is too
+ * small, `-ENOMEM` if a range is not mapped or exceeds its BAR, `-EINVAL` if a
+ * range is not aligned, or as `CRONO_KERNEL_PciReadCfg32`.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_SnapshotSave(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const CRONO_KERNEL_SNAPSHOT_RANGE *pRanges,
+    uint32_t rangeCount, void *pBlob, uint64_t *pSize);
+
+/**
+ * @brief Restore the device to a snapshot saved from a device of the same
+ * type. No other thread may access the device meanwhile.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param pBlob[in]: The snapshot.
+ * @param size[in]: Size of the snapshot in bytes.
+ * @param pStats[out]: Writes done, ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if `pBlob` is not a
+ * snapshot of this device type or is truncated, `-ENOMEM` if a range exceeds
+ * its BAR, `CRONO_KERNEL_DATA_MISMATCH` if a register does not read back as
+ * restored, or as `CRONO_KERNEL_PciWriteCfg32`.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_SnapshotRestore(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const void *pBlob, uint64_t size,
+    CRONO_KERNEL_SNAPSHOT_STATS *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_SNAPSHOT_H_
@@ -0,0 +1,169 @@
+/**
+ * @file crono_trace.h
+ * @brief Records the accesses of the library to a device, i.e. BAR reads and
+ * writes, configuration space reads and writes, and DMA buffer locks, with
+ * their values and timing, to a trace file. A trace is replayed against a
+ * mock device, without the hardware.
+ *
+ * A trace taken while a board is initialized, e.g. at a customer site,
+ * reproduces the sequence offline: replaying executes each access through the
+ * same library code against memory standing for the BARs, and a copy of the
+ * configuration space taken when tracing started. The time of each step is
+ * reported as recorded and as replayed, so the overhead of the library is
+ * measured per step, and compared across library versions.
+ *
+ * Usage:
+ * @code
+ * CRONO_KERNEL_TraceStart(hDev, "init.trace");
+ * // Initialize the board
+ * CRONO_KERNEL_TraceStop(hDev, NULL);
+ * // Later, anywhere
+ * CRONO_KERNEL_TRACE_REPLAY_STATS stats;
+ * CRONO_KERNEL_TraceReplay("init.trace", NULL, NULL, &stats);
+ * @endcode
+ *
+ * Trace file format, in host byte order: a `CRONO_KERNEL_TRACE_HEADER`, then
+ * `configSize` bytes of the configuration space, then the records. A record is
+ * a `CRONO_KERNEL_TRACE_RECORD`, followed by `size` bytes of data padded to a
+ * multiple of 8 bytes if `size` is more than 8. Data of up to 8 bytes is held
+ * in `value`.
+ *
+ * The mock device answers reads with the recorded values. Configuration
+ * registers cached by the library are answered from the cache, as on the
+ * device, so a value differing from the recorded one is reported as a
+ * divergence. DMA buffer locks need the driver, and are reported but not
+ * replayed.
+ *
+ * BAR reads served from the register shadow of `crono_reg_shadow.h`, and
+ * writes it skips, do not access the device, and are not recorded.
+ *
+ * Tracing adds two clock reads and a buffered write to each access, and one
+ * atomic load to each access when not tracing.
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef _CRONO_TRACE_H_
+#define _CRONO_TRACE_H_
+
+#include "crono_kernel_interface.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define CRONO_KERNEL_TRACE_MAGIC 0x52544e43 // "CNTR"
+#define CRONO_KERNEL_TRACE_VERSION 1
+
+/* `CRONO_KERNEL_TRACE_RECORD::bar` of records not accessing a BAR */
+#define CRONO_KERNEL_TRACE_NO_BAR 0xff
+
+/* `CRONO_KERNEL_TRACE_RECORD::op` */
+enum {
+        CRONO_KERNEL_TRACE_BAR_READ = 1,
+        CRONO_KERNEL_TRACE_BAR_WRITE = 2,
+        CRONO_KERNEL_TRACE_CONFIG_READ = 3,
+        CRONO_KERNEL_TRACE_CONFIG_WRITE = 4,
+        /* `offset` is the user address for SG buffers, `size` the buffer
+           size, and `value` the driver buffer id */
+        CRONO_KERNEL_TRACE_DMA_SG_LOCK = 5,
+        CRONO_KERNEL_TRACE_DMA_SG_UNLOCK = 6,
+        CRONO_KERNEL_TRACE_DMA_CONTIG_LOCK = 7,
+        CRONO_KERNEL_TRACE_DMA_CONTIG_UNLOCK = 8,
+};
+
+typedef struct {
+        uint32_t magic;   // CRONO_KERNEL_TRACE_MAGIC.
+        uint32_t version; // CRONO_KERNEL_TRACE_VERSION.
+        uint32_t vendorId;
+        uint32_t deviceId;
+        CRONO_KERNEL_PCI_SLOT slot;
+        uint32_t configSize;   // Bytes of configuration space following.
+        uint32_t reserved;
+        uint64_t barLength[6]; // By BAR number, 0 if not present.
+} CRONO_KERNEL_TRACE_HEADER;
+
+typedef struct {
+        uint64_t timestampNs; // Start of the access since tracing started.
+        uint64_t offset;      // Offset in the BAR or configuration space.
+        uint64_t value;       // Value read or written, if `size` is up to 8.
+        uint32_t size;        // Bytes read or written.
+        uint32_t durationNs;
+        int32_t status; // Returned by the access, BAR accesses failing
+                        // validation are not recorded.
+        uint8_t op;     // CRONO_KERNEL_TRACE_XXX.
+        uint8_t bar;    // BAR number, or CRONO_KERNEL_TRACE_NO_BAR.
+        uint16_t reserved;
+} CRONO_KERNEL_TRACE_RECORD;
+
+typedef struct {
+        uint64_t records;     // Records in the trace.
+        uint64_t replayed;    // Records executed against the mock device.
+        uint64_t skipped;     // DMA records, not replayed.
+        uint64_t divergences; // Replayed records with a value or status
+                              // differing from the recorded one.
+        uint64_t firstDivergence; // Index of the first one, UINT64_MAX if
+                                  // none.
+        uint64_t recordedNs; // Sum of the recorded durations of the replayed
+                             // records.
+        uint64_t replayedNs; // Sum of their replayed durations.
+} CRONO_KERNEL_TRACE_REPLAY_STATS;
+
+/**
+ * Called for each replayed record, with the value read or written, the
+ * status, and the duration of the replayed access.
+ */
+typedef void (*CRONO_KERNEL_TRACE_STEP_CALLBACK)(
+    void *pContext, uint64_t index, const CRONO_KERNEL_TRACE_RECORD *pRecord,
+    uint64_t replayValue, int32_t replayStatus, uint32_t replayNs);
+
+/**
+ * @brief Start recording the accesses to the device, from all handles of the
+ * device, including those of the window mappers of `crono_bar_window.h`.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param path[in]: Trace file to create, truncated if it exists.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EBUSY` if the device is
+ * already traced, or `errno` in case of error.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_TraceStart(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const char *path);
+
+/**
+ * @brief Stop recording, and close the trace file once the accesses in
+ * progress on other threads are recorded. Closing the device also stops
+ * recording.
+ *
+ * @param hDev[in]: A valid handle to the device.
+ * @param pRecords[out]: Records written, ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the device is not
+ * traced, or `errno` if writing the trace failed.
+ */
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_TraceStop(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint64_t *pRecords);
+
+/**
+ * @brief Replay a trace against a mock device created from the trace.
+ *
+ * @param path[in]: The trace file.
+ * @param callback[in]: Called for each replayed record, ignored if NULL.
+ * @param pContext[in]: Passed to `callback`.
+ * @param pStats[out]: Replay statistics.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, even if the replay diverges,
+ * `-EINVAL` if the file is not a trace or is truncated, or `errno` in case of
+ * error.
+ */
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_TraceReplay(const char *path,
+                         CRONO_KERNEL_TRACE_STEP_CALLBACK callback,
+                         void *pContext,
+                         CRONO_KERNEL_TRACE_REPLAY_STATS *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _CRONO_TRACE_H_
@@ -30,7 +30,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifndef SYS_BUS_PCIDEVS_PATH // Set by benchmarks to a generated tree
 #define SYS_BUS_PCIDEVS_PATH "/sys/bus/pci/devices"
+#endif
 #define PAGE_SIZE sysconf(_SC_PAGE_SIZE)
 
 /**
@@ -95,6 +97,36 @@ int crono_read_vendor_device(unsigned domain, unsigned bus, unsigned dev,
                              unsigned func, uint16_t *pVendor,
                              uint16_t *pDevice);
 
+/**
+ * A configuration space read of a `crono_read_config_batch` batch.
+ */
+typedef struct {
+        unsigned domain; // The domain number of the device.
+        unsigned bus;    // The bus number of the device.
+        unsigned dev;    // The device number of the device.
+        unsigned func;   // The function number of the device.
+        void *data;      // Buffer of `size` bytes at least.
+        pciaddr_t offset;     // Offset in bytes in configuration space.
+        pciaddr_t size;       // The size of the data to be read in bytes.
+        pciaddr_t bytes_read; // [out] Bytes read successfully.
+        int err;              // [out] `CRONO_SUCCESS` or `errno`.
+} CRONO_CONFIG_READ;
+
+/**
+ * Reads data from the configuration space of many devices using sysfs, same
+ * as calling `crono_read_config` for each entry. For large batches io_uring is
+ * used when available, so all files are opened, read and closed in a couple of
+ * system calls, otherwise the entries are read synchronously one by one.
+ *
+ * @param reads[in/out]: The entries to read, `bytes_read` and `err` of each
+ * entry are set.
+ * @param count[in]: Count of entries in `reads`.
+ *
+ * @return `CRONO_SUCCESS` if all entries are processed, check `err` of each
+ * entry, or `-EINVAL` if `reads` is NULL.
+ */
+int crono_read_config_batch(CRONO_CONFIG_READ *reads, size_t count);
+
 /**
  * Writes data to devices configuration space using sysfs.
  *
@@ -148,6 +180,77 @@ int crono_get_sys_devices_directory_path(unsigned domain, unsigned bus,
                                          unsigned dev, unsigned func,
                                          char *pPath);
 
+/**
+ * Gets the upstream port of the device, i.e. the bridge its /sys/devices
+ * directory is found under, e.g. 0000:00:1c.7 for
+ * /sys/devices/pci0000:00/0000:00:1c.7/0000:03:00.0
+ *
+ * @param domain[in]: The domain number of the device, 2 bytes value.
+ * @param bus[in]: The bus number of the device, 1 byte value.
+ * @param dev[in]: The device number of the device, 1 byte value.
+ * @param func[in]: The function number of the device, 4-bits value.
+ * @param pUpstream[out]: A valid pointer to the slot that will contain the
+ * upstream port.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the device is
+ * directly under a host bridge, or `errno` in case of error.
+ */
+int crono_get_upstream_port(unsigned domain, unsigned bus, unsigned dev,
+                            unsigned func, CRONO_KERNEL_PCI_SLOT *pUpstream);
+
+/**
+ * Reads a text attribute file found under the device /sys/devices directory,
+ * e.g. `numa_node` or `local_cpulist`. The trailing new line is removed.
+ *
+ * @param domain[in]: The domain number of the device, 2 bytes value.
+ * @param bus[in]: The bus number of the device, 1 byte value.
+ * @param dev[in]: The device number of the device, 1 byte value.
+ * @param func[in]: The function number of the device, 4-bits value.
+ * @param attr_name[in]: The attribute file name, relative to the device
+ * directory.
+ * @param pValue[out]: A valid pointer to the buffer that will contain the
+ * null-terminated attribute value.
+ * @param value_size[in]: Size of `pValue` buffer in bytes.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+int crono_read_sys_device_attr(unsigned domain, unsigned bus, unsigned dev,
+                               unsigned func, const char *attr_name,
+                               char *pValue, size_t value_size);
+
+/**
+ * Gets the NUMA node the device is attached to using sysfs `numa_node`.
+ *
+ * @param domain[in]: The domain number of the device, 2 bytes value.
+ * @param bus[in]: The bus number of the device, 1 byte value.
+ * @param dev[in]: The device number of the device, 1 byte value.
+ * @param func[in]: The function number of the device, 4-bits value.
+ * @param pNode[out]: A valid pointer to the variable that will contain the
+ * node, -1 if the platform doesn't report it.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+int crono_get_device_numa_node(unsigned domain, unsigned bus, unsigned dev,
+                               unsigned func, int *pNode);
+
+/**
+ * Gets the list of CPUs local to the device using sysfs `local_cpulist`, e.g.
+ * "0-7,16-23".
+ *
+ * @param domain[in]: The domain number of the device, 2 bytes value.
+ * @param bus[in]: The bus number of the device, 1 byte value.
+ * @param dev[in]: The device number of the device, 1 byte value.
+ * @param func[in]: The function number of the device, 4-bits value.
+ * @param pList[out]: A valid pointer to the buffer that will contain the
+ * null-terminated list.
+ * @param list_size[in]: Size of `pList` buffer in bytes.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+int crono_get_device_local_cpulist(unsigned domain, unsigned bus, unsigned dev,
+                                   unsigned func, char *pList,
+                                   size_t list_size);
+
 /**
  * Memory is read-write pointer.
  * Caller should call munmap() to delete the mappings after finalizing the task.
@@ -0,0 +1,342 @@
+#include "crono_bar_window.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_trace.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <new>
+
+#define CRONO_BAR_WINDOW_DEFAULT_SIZE (4ULL << 20)
+#define CRONO_BAR_WINDOW_DEFAULT_COUNT 4
+
+typedef struct {
+        uint64_t base;     // Offset of the window in the BAR.
+        uint64_t size;     // Bytes mapped, less than the window size for the
+                           // last window of the BAR.
+        uint8_t *addr;     // NULL if not mapped.
+        uint64_t last_use; // `clock` at the last access.
+} CRONO_BAR_WINDOW_SLOT;
+
+struct CRONO_KERNEL_BAR_WINDOW {
+        PCRONO_KERNEL_DEVICE device; // Accesses are traced with the device.
+        uint32_t bar_num;
+        int fd; // The BAR `resourceN` file.
+        uint64_t bar_length;
+        uint64_t window_size;
+        uint32_t window_count;
+        CRONO_BAR_WINDOW_SLOT windows[CRONO_KERNEL_BAR_WINDOW_MAX_COUNT];
+        uint32_t last_window; // Checked first, accesses are mostly local.
+        uint64_t clock;
+        CRONO_KERNEL_BAR_WINDOW_STATS stats;
+};
+
+/**
+ * Gets the window mapping `offset`, mapping it if needed. `offset` is less
+ * than `bar_length`.
+ */
+static int crono_bar_window_get(CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset,
+                                CRONO_BAR_WINDOW_SLOT **ppWindow) {
+        uint64_t base = offset & ~(pWin->window_size - 1);
+        CRONO_BAR_WINDOW_SLOT *window = &pWin->windows[pWin->last_window];
+        uint32_t ivictim = 0;
+        void *addr;
+
+        pWin->clock++;
+        if (window->addr != NULL && window->base == base) {
+                window->last_use = pWin->clock;
+                pWin->stats.hits++;
+                *ppWindow = window;
+                return CRONO_SUCCESS;
+        }
+
+        // Find the window, or the least recently used one, unmapped first
+        for (uint32_t iwindow = 0; iwindow < pWin->window_count; iwindow++) {
+                window = &pWin->windows[iwindow];
+                if (window->addr != NULL && window->base == base) {
+                        window->last_use = pWin->clock;
+                        pWin->last_window = iwindow;
+                        pWin->stats.hits++;
+                        *ppWindow = window;
+                        return CRONO_SUCCESS;
+                }
+                if (window->last_use < pWin->windows[ivictim].last_use) {
+                        ivictim = iwindow;
+                }
+        }
+
+        // Map the window in place of the victim
+        window = &pWin->windows[ivictim];
+        if (window->addr != NULL) {
+                munmap(window->addr, window->size);
+                window->addr = NULL;
+                pWin->stats.evictions++;
+        }
+        window->base = base;
+        window->size = std::min(pWin->window_size, pWin->bar_length - base);
+        addr = mmap(NULL, window->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    pWin->fd, base);
+        if (MAP_FAILED == addr) {
+                int err = errno;
+                printf("Failed to map BAR window at <0x%" PRIx64 ">: <%d> "
+                       "<%s>\n",
+                       base, err, strerror(err));
+                window->last_use = 0;
+                return err;
+        }
+        window->addr = (uint8_t *)addr;
+        window->last_use = pWin->clock;
+        pWin->last_window = ivictim;
+        pWin->stats.maps++;
+        *ppWindow = window;
+        return CRONO_SUCCESS;
+}
+
+template <typename T>
+static uint32_t crono_bar_window_read(CRONO_KERNEL_BAR_WINDOW *pWin,
+                                      uint64_t offset, T *val) {
+        CRONO_BAR_WINDOW_SLOT *window;
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pWin);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
+        if ((offset % sizeof(T)) || offset + sizeof(T) > pWin->bar_length) {
+                return -EINVAL;
+        }
+        CRONO_TRACE_BEGIN(pWin->device);
+        ret = crono_bar_window_get(pWin, offset, &window);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        *val = *(volatile T *)(window->addr + (offset - window->base));
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_READ, pWin->bar_num, offset,
+                        sizeof(T), *val, NULL, CRONO_SUCCESS);
+        return CRONO_SUCCESS;
+}
+
+template <typename T>
+static uint32_t crono_bar_window_write(CRONO_KERNEL_BAR_WINDOW *pWin,
+                                       uint64_t offset, T val) {
+        CRONO_BAR_WINDOW_SLOT *window;
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pWin);
+        if ((offset % sizeof(T)) || offset + sizeof(T) > pWin->bar_length) {
+                return -EINVAL;
+        }
+        CRONO_TRACE_BEGIN(pWin->device);
+        ret = crono_bar_window_get(pWin, offset, &window);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        *(volatile T *)(window->addr + (offset - window->base)) = val;
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_WRITE, pWin->bar_num, offset,
+                        sizeof(T), val, NULL, CRONO_SUCCESS);
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Copies `size` bytes at `offset` of the BAR from or to `pData`, window by
+ * window.
+ */
+static uint32_t crono_bar_window_block(CRONO_KERNEL_BAR_WINDOW *pWin,
+                                       uint64_t offset, uint8_t *pData,
+                                       uint64_t size, bool write) {
+        CRONO_BAR_WINDOW_SLOT *window;
+        uint64_t chunk;
+        uint8_t *addr;
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pWin);
+        CRONO_RET_INV_PARAM_IF_NULL(pData);
+        if (offset > pWin->bar_length || size > pWin->bar_length - offset) {
+                return -EINVAL;
+        }
+        CRONO_TRACE_BEGIN(pWin->device);
+        const uint64_t trace_offset = offset;
+        const uint64_t trace_size = size;
+        const uint8_t *trace_data = pData;
+        while (size > 0) {
+                ret = crono_bar_window_get(pWin, offset, &window);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                addr = window->addr + (offset - window->base);
+                chunk = std::min(size, window->size - (offset - window->base));
+                if (write) {
+                        crono_mmio_copy(addr, pData, chunk);
+                } else {
+                        crono_mmio_copy(pData, addr, chunk);
+                }
+                offset += chunk;
+                pData += chunk;
+                size -= chunk;
+        }
+        CRONO_TRACE_END(write ? CRONO_KERNEL_TRACE_BAR_WRITE
+                              : CRONO_KERNEL_TRACE_BAR_READ,
+                        pWin->bar_num, trace_offset, trace_size, 0, trace_data,
+                        CRONO_SUCCESS);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowOpen(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                           const CRONO_KERNEL_BAR_WINDOW_CONFIG *pConfig,
+                           CRONO_KERNEL_BAR_WINDOW **ppWin) {
+        char sys_dev_dir_path[PATH_MAX - 11]; // 11 for "/resourceN"
+        char bar_resource_file_path[PATH_MAX];
+        CRONO_KERNEL_BAR_WINDOW *pWin;
+        const CRONO_KERNEL_BAR_DESC *bar_desc = NULL;
+        uint64_t window_size;
+        uint32_t window_count;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pConfig);
+        CRONO_RET_INV_PARAM_IF_NULL(ppWin);
+        window_size = pConfig->windowSize ? pConfig->windowSize
+                                          : CRONO_BAR_WINDOW_DEFAULT_SIZE;
+        window_count = pConfig->windowCount ? pConfig->windowCount
+                                            : CRONO_BAR_WINDOW_DEFAULT_COUNT;
+        if ((window_size & (window_size - 1)) ||
+            window_size % PAGE_SIZE ||
+            window_count > CRONO_KERNEL_BAR_WINDOW_MAX_COUNT) {
+                return -EINVAL;
+        }
+        for (uint32_t ibar = 0; ibar < pDevice->bar_count; ibar++) {
+                if (pDevice->bar_descs[ibar].barNum == pConfig->barNum) {
+                        bar_desc = &pDevice->bar_descs[ibar];
+                }
+        }
+        CRONO_RET_INV_PARAM_IF_NULL(bar_desc);
+
+        // Open the BAR resource file, mapped window by window
+        ret = crono_get_sys_devices_directory_path(
+            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction,
+            sys_dev_dir_path);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        snprintf(bar_resource_file_path, sizeof(bar_resource_file_path),
+                 "%s/resource%u", sys_dev_dir_path, pConfig->barNum);
+        pWin = new (std::nothrow) CRONO_KERNEL_BAR_WINDOW();
+        CRONO_RET_ERR_CODE_IF_NULL(pWin, -ENOMEM);
+        pWin->fd = open(bar_resource_file_path, O_RDWR | O_SYNC | O_CLOEXEC);
+        if (pWin->fd < 0) {
+                ret = errno;
+                printf("Error opening resource file <%s>: <%d> <%s>\n",
+                       bar_resource_file_path, ret, strerror(ret));
+                delete pWin;
+                return ret;
+        }
+        pWin->device = pDevice;
+        pWin->bar_num = pConfig->barNum;
+        pWin->bar_length = bar_desc->length;
+        pWin->window_size = window_size;
+        pWin->window_count = window_count;
+        *ppWin = pWin;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead8(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint8_t *val) {
+        return crono_bar_window_read(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead16(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint16_t *val) {
+        return crono_bar_window_read(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead32(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint32_t *val) {
+        return crono_bar_window_read(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowRead64(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint64_t *val) {
+        return crono_bar_window_read(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite8(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint8_t val) {
+        return crono_bar_window_write(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite16(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint16_t val) {
+        return crono_bar_window_write(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite32(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint32_t val) {
+        return crono_bar_window_write(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_BarWindowWrite64(
+    CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset, uint64_t val) {
+        return crono_bar_window_write(pWin, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowReadBlock(CRONO_KERNEL_BAR_WINDOW *pWin, uint64_t offset,
+                                void *pData, uint64_t size) {
+        return crono_bar_window_block(pWin, offset, (uint8_t *)pData, size,
+                                      false);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowWriteBlock(CRONO_KERNEL_BAR_WINDOW *pWin,
+                                 uint64_t offset, const void *pData,
+                                 uint64_t size) {
+        return crono_bar_window_block(pWin, offset, (uint8_t *)pData, size,
+                                      true);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowGetAddress(CRONO_KERNEL_BAR_WINDOW *pWin,
+                                 uint64_t offset, uint64_t size,
+                                 void **ppAddr) {
+        CRONO_BAR_WINDOW_SLOT *window;
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pWin);
+        CRONO_RET_INV_PARAM_IF_NULL(ppAddr);
+        if (offset >= pWin->bar_length || size > pWin->bar_length - offset ||
+            (offset & ~(pWin->window_size - 1)) !=
+                ((offset + std::max<uint64_t>(size, 1) - 1) &
+                 ~(pWin->window_size - 1))) {
+                return -EINVAL;
+        }
+        ret = crono_bar_window_get(pWin, offset, &window);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        *ppAddr = window->addr + (offset - window->base);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowGetStats(CRONO_KERNEL_BAR_WINDOW *pWin,
+                               CRONO_KERNEL_BAR_WINDOW_STATS *pStats) {
+        CRONO_RET_INV_PARAM_IF_NULL(pWin);
+        CRONO_RET_INV_PARAM_IF_NULL(pStats);
+        *pStats = pWin->stats;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_BarWindowClose(CRONO_KERNEL_BAR_WINDOW *pWin) {
+        CRONO_RET_INV_PARAM_IF_NULL(pWin);
+        for (uint32_t iwindow = 0; iwindow < pWin->window_count; iwindow++) {
+                if (pWin->windows[iwindow].addr != NULL) {
+                        munmap(pWin->windows[iwindow].addr,
+                               pWin->windows[iwindow].size);
+                }
+        }
+        close(pWin->fd);
+        delete pWin;
+        return CRONO_SUCCESS;
+}
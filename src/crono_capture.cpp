@@ -0,0 +1,514 @@
+#include "crono_capture.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <new>
+#include <time.h>
+#include <vector>
+
+#define CRONO_CAPTURE_DEFAULT_BLOCK_SIZE (1024 * 1024)
+
+static_assert(sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER) == 64,
+              "Capture block header layout changed");
+static_assert(sizeof(CRONO_KERNEL_CAPTURE_FILE_HEADER) <=
+                  CRONO_KERNEL_CAPTURE_HEADER_SIZE,
+              "Capture file header exceeds its size");
+
+struct CRONO_KERNEL_CAPTURE_WRITER {
+        int fd;
+        uint32_t block_size;
+        CRONO_KERNEL_PCI_SLOT slot;
+        uint8_t *block; // Current block, header included.
+        uint32_t fill;  // Data bytes in the current block.
+        uint32_t flags; // Flags of the current block.
+        uint64_t sequence;
+        uint64_t position;  // Stream position of the next byte.
+        uint64_t last_timestamp_ns;
+        std::vector<CRONO_KERNEL_CAPTURE_INDEX_ENTRY> index;
+};
+
+struct CRONO_KERNEL_CAPTURE_READER {
+        const uint8_t *map;
+        size_t map_size;
+        const CRONO_KERNEL_CAPTURE_FILE_HEADER *header;
+        uint64_t block_count;
+        // Points to the file index, or to `rebuilt_index`
+        const CRONO_KERNEL_CAPTURE_INDEX_ENTRY *index;
+        std::vector<CRONO_KERNEL_CAPTURE_INDEX_ENTRY> rebuilt_index;
+};
+
+static uint64_t crono_capture_realtime_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int crono_capture_pwrite(int fd, const void *data, size_t size,
+                                uint64_t offset) {
+        const uint8_t *bytes = (const uint8_t *)data;
+        size_t done = 0;
+
+        while (done < size) {
+                ssize_t written =
+                    pwrite64(fd, bytes + done, size - done, offset + done);
+                if (written < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return errno;
+                }
+                done += written;
+        }
+        return CRONO_SUCCESS;
+}
+
+// ______
+// Writer
+//
+static CRONO_KERNEL_CAPTURE_BLOCK_HEADER *
+crono_capture_block_header(CRONO_KERNEL_CAPTURE_WRITER *pWriter) {
+        return (CRONO_KERNEL_CAPTURE_BLOCK_HEADER *)pWriter->block;
+}
+
+/**
+ * Starts a new block at the current stream position.
+ */
+static void crono_capture_begin_block(CRONO_KERNEL_CAPTURE_WRITER *pWriter) {
+        CRONO_KERNEL_CAPTURE_BLOCK_HEADER *header =
+            crono_capture_block_header(pWriter);
+
+        // Keep timestamps monotonic for the binary search, even if the
+        // realtime clock is set back
+        pWriter->last_timestamp_ns =
+            std::max(pWriter->last_timestamp_ns, crono_capture_realtime_ns());
+
+        memset(header, 0, sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER));
+        header->magic = CRONO_KERNEL_CAPTURE_BLOCK_MAGIC;
+        header->flags = pWriter->flags;
+        header->sequence = pWriter->sequence;
+        header->timestampNs = pWriter->last_timestamp_ns;
+        header->streamPosition = pWriter->position;
+        header->slot = pWriter->slot;
+}
+
+/**
+ * Writes the current block if it has data, the unused part is zeroed.
+ */
+static uint32_t crono_capture_end_block(CRONO_KERNEL_CAPTURE_WRITER *pWriter) {
+        CRONO_KERNEL_CAPTURE_BLOCK_HEADER *header =
+            crono_capture_block_header(pWriter);
+        uint64_t offset;
+        int ret;
+
+        if (0 == pWriter->fill) {
+                return CRONO_SUCCESS;
+        }
+        header->byteCount = pWriter->fill;
+        memset(pWriter->block + sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER) +
+                   pWriter->fill,
+               0,
+               pWriter->block_size - sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER) -
+                   pWriter->fill);
+        offset = CRONO_KERNEL_CAPTURE_HEADER_SIZE +
+                 pWriter->index.size() * (uint64_t)pWriter->block_size;
+        ret = crono_capture_pwrite(pWriter->fd, pWriter->block,
+                                   pWriter->block_size, offset);
+        if (CRONO_SUCCESS != ret) {
+                printf("Error writing capture block <%lu>: <%d> <%s>\n",
+                       header->sequence, ret, strerror(ret));
+                return ret;
+        }
+        try {
+                pWriter->index.push_back(
+                    {header->sequence, header->timestampNs});
+        } catch (const std::bad_alloc &) {
+                return -ENOMEM;
+        }
+        pWriter->sequence++;
+        pWriter->fill = 0;
+        pWriter->flags = 0;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterOpen(const CRONO_KERNEL_CAPTURE_CONFIG *pConfig,
+                               CRONO_KERNEL_CAPTURE_WRITER **ppWriter) {
+        CRONO_KERNEL_CAPTURE_WRITER *pWriter;
+        CRONO_KERNEL_CAPTURE_FILE_HEADER *header;
+        uint8_t *file_header;
+        uint32_t block_size;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(pConfig);
+        CRONO_RET_INV_PARAM_IF_NULL(pConfig->path);
+        CRONO_RET_INV_PARAM_IF_NULL(ppWriter);
+        *ppWriter = NULL;
+        block_size = pConfig->blockSize ? pConfig->blockSize
+                                        : CRONO_CAPTURE_DEFAULT_BLOCK_SIZE;
+        if (block_size % 4096) {
+                return -EINVAL;
+        }
+
+        pWriter = new (std::nothrow) CRONO_KERNEL_CAPTURE_WRITER();
+        CRONO_RET_ERR_CODE_IF_NULL(pWriter, -ENOMEM);
+        pWriter->block_size = block_size;
+        pWriter->slot = pConfig->slot;
+        pWriter->sequence = pConfig->firstSequence;
+        pWriter->block = (uint8_t *)aligned_alloc(4096, block_size);
+        file_header = (uint8_t *)calloc(1, CRONO_KERNEL_CAPTURE_HEADER_SIZE);
+        if (NULL == pWriter->block || NULL == file_header) {
+                free(pWriter->block);
+                free(file_header);
+                delete pWriter;
+                return -ENOMEM;
+        }
+
+        pWriter->fd = open(pConfig->path, O_WRONLY | O_CREAT | O_TRUNC |
+                                              O_CLOEXEC,
+                           0644);
+        if (pWriter->fd < 0) {
+                ret = errno;
+                printf("Error creating capture file <%s>: <%d> <%s>\n",
+                       pConfig->path, ret, strerror(ret));
+                free(pWriter->block);
+                free(file_header);
+                delete pWriter;
+                return ret;
+        }
+
+        header = (CRONO_KERNEL_CAPTURE_FILE_HEADER *)file_header;
+        memcpy(header->magic, CRONO_KERNEL_CAPTURE_FILE_MAGIC,
+               sizeof(header->magic));
+        header->version = CRONO_KERNEL_CAPTURE_VERSION;
+        header->headerSize = CRONO_KERNEL_CAPTURE_HEADER_SIZE;
+        header->blockSize = block_size;
+        header->blockHeaderSize = sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER);
+        header->slot = pConfig->slot;
+        header->createdNs = crono_capture_realtime_ns();
+        ret = crono_capture_pwrite(pWriter->fd, file_header,
+                                   CRONO_KERNEL_CAPTURE_HEADER_SIZE, 0);
+        free(file_header);
+        if (CRONO_SUCCESS != ret) {
+                close(pWriter->fd);
+                free(pWriter->block);
+                delete pWriter;
+                return ret;
+        }
+
+        *ppWriter = pWriter;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterWrite(CRONO_KERNEL_CAPTURE_WRITER *pWriter,
+                                const void *pData, size_t size) {
+        const uint8_t *data = (const uint8_t *)pData;
+        uint32_t capacity;
+        uint32_t length;
+        uint32_t ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pWriter);
+        CRONO_RET_INV_PARAM_IF_NULL(pData);
+        capacity =
+            pWriter->block_size - sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER);
+
+        while (size > 0) {
+                if (0 == pWriter->fill) {
+                        crono_capture_begin_block(pWriter);
+                }
+                length = (uint32_t)std::min<size_t>(size,
+                                                    capacity - pWriter->fill);
+                memcpy(pWriter->block +
+                           sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER) +
+                           pWriter->fill,
+                       data, length);
+                pWriter->fill += length;
+                pWriter->position += length;
+                data += length;
+                size -= length;
+                if (pWriter->fill == capacity) {
+                        ret = crono_capture_end_block(pWriter);
+                        if (CRONO_SUCCESS != ret) {
+                                return ret;
+                        }
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterSkip(CRONO_KERNEL_CAPTURE_WRITER *pWriter,
+                               uint64_t bytes) {
+        uint32_t ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pWriter);
+        if (0 == bytes) {
+                return CRONO_SUCCESS;
+        }
+        ret = crono_capture_end_block(pWriter);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        pWriter->position += bytes;
+        pWriter->flags |= CRONO_KERNEL_CAPTURE_BLOCK_GAP;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureWriterClose(CRONO_KERNEL_CAPTURE_WRITER *pWriter) {
+        CRONO_KERNEL_CAPTURE_FOOTER footer;
+        uint32_t ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pWriter);
+
+        ret = crono_capture_end_block(pWriter);
+        if (CRONO_SUCCESS == ret) {
+                memset(&footer, 0, sizeof(footer));
+                footer.magic = CRONO_KERNEL_CAPTURE_FOOTER_MAGIC;
+                footer.version = CRONO_KERNEL_CAPTURE_VERSION;
+                footer.blockCount = pWriter->index.size();
+                footer.indexOffset =
+                    CRONO_KERNEL_CAPTURE_HEADER_SIZE +
+                    footer.blockCount * (uint64_t)pWriter->block_size;
+                ret = crono_capture_pwrite(
+                    pWriter->fd, pWriter->index.data(),
+                    footer.blockCount *
+                        sizeof(CRONO_KERNEL_CAPTURE_INDEX_ENTRY),
+                    footer.indexOffset);
+        }
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_capture_pwrite(
+                    pWriter->fd, &footer, sizeof(footer),
+                    footer.indexOffset +
+                        footer.blockCount *
+                            sizeof(CRONO_KERNEL_CAPTURE_INDEX_ENTRY));
+        }
+        close(pWriter->fd);
+        free(pWriter->block);
+        delete pWriter;
+        return ret;
+}
+
+// ______
+// Reader
+//
+/**
+ * Uses the index of the file if its footer is valid, otherwise rebuilds it
+ * from the block headers, up to the first invalid one.
+ */
+static uint32_t crono_capture_load_index(CRONO_KERNEL_CAPTURE_READER *pReader) {
+        const CRONO_KERNEL_CAPTURE_FOOTER *footer;
+        uint64_t block_size = pReader->header->blockSize;
+        uint64_t max_blocks;
+
+        if (pReader->map_size >= CRONO_KERNEL_CAPTURE_HEADER_SIZE +
+                                     sizeof(CRONO_KERNEL_CAPTURE_FOOTER)) {
+                footer = (const CRONO_KERNEL_CAPTURE_FOOTER
+                              *)(pReader->map + pReader->map_size -
+                                 sizeof(CRONO_KERNEL_CAPTURE_FOOTER));
+                if (CRONO_KERNEL_CAPTURE_FOOTER_MAGIC == footer->magic &&
+                    footer->indexOffset ==
+                        CRONO_KERNEL_CAPTURE_HEADER_SIZE +
+                            footer->blockCount * block_size &&
+                    footer->indexOffset +
+                            footer->blockCount *
+                                sizeof(CRONO_KERNEL_CAPTURE_INDEX_ENTRY) +
+                            sizeof(CRONO_KERNEL_CAPTURE_FOOTER) ==
+                        pReader->map_size) {
+                        pReader->block_count = footer->blockCount;
+                        pReader->index =
+                            (const CRONO_KERNEL_CAPTURE_INDEX_ENTRY
+                                 *)(pReader->map + footer->indexOffset);
+                        return CRONO_SUCCESS;
+                }
+        }
+
+        max_blocks =
+            (pReader->map_size - CRONO_KERNEL_CAPTURE_HEADER_SIZE) / block_size;
+        try {
+                for (uint64_t iblock = 0; iblock < max_blocks; iblock++) {
+                        const CRONO_KERNEL_CAPTURE_BLOCK_HEADER *header =
+                            (const CRONO_KERNEL_CAPTURE_BLOCK_HEADER
+                                 *)(pReader->map +
+                                    CRONO_KERNEL_CAPTURE_HEADER_SIZE +
+                                    iblock * block_size);
+                        if (CRONO_KERNEL_CAPTURE_BLOCK_MAGIC != header->magic) {
+                                break;
+                        }
+                        pReader->rebuilt_index.push_back(
+                            {header->sequence, header->timestampNs});
+                }
+        } catch (const std::bad_alloc &) {
+                return -ENOMEM;
+        }
+        CRONO_DEBUG("Rebuilt capture index of <%lu> blocks\n",
+                    pReader->rebuilt_index.size());
+        pReader->block_count = pReader->rebuilt_index.size();
+        pReader->index = pReader->rebuilt_index.data();
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderOpen(const char *path,
+                               CRONO_KERNEL_CAPTURE_READER **ppReader) {
+        CRONO_KERNEL_CAPTURE_READER *pReader;
+        struct stat st;
+        void *map;
+        uint32_t ret;
+        int fd;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(path);
+        CRONO_RET_INV_PARAM_IF_NULL(ppReader);
+        *ppReader = NULL;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return errno;
+        }
+        if (0 != fstat(fd, &st)) {
+                ret = errno;
+                close(fd);
+                return ret;
+        }
+        if ((uint64_t)st.st_size < CRONO_KERNEL_CAPTURE_HEADER_SIZE) {
+                close(fd);
+                return CRONO_KERNEL_DATA_MISMATCH;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ret = errno;
+        // The mapping keeps the file referenced
+        close(fd);
+        if (MAP_FAILED == map) {
+                return ret;
+        }
+
+        pReader = new (std::nothrow) CRONO_KERNEL_CAPTURE_READER();
+        if (NULL == pReader) {
+                munmap(map, st.st_size);
+                return -ENOMEM;
+        }
+        pReader->map = (const uint8_t *)map;
+        pReader->map_size = st.st_size;
+        pReader->header = (const CRONO_KERNEL_CAPTURE_FILE_HEADER *)map;
+        if (0 != memcmp(pReader->header->magic,
+                        CRONO_KERNEL_CAPTURE_FILE_MAGIC,
+                        sizeof(pReader->header->magic)) ||
+            CRONO_KERNEL_CAPTURE_VERSION != pReader->header->version ||
+            CRONO_KERNEL_CAPTURE_HEADER_SIZE != pReader->header->headerSize ||
+            0 == pReader->header->blockSize ||
+            pReader->header->blockSize <=
+                sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER)) {
+                printf("Error: <%s> is not a capture file of version <%d>\n",
+                       path, CRONO_KERNEL_CAPTURE_VERSION);
+                CRONO_KERNEL_CaptureReaderClose(pReader);
+                return CRONO_KERNEL_DATA_MISMATCH;
+        }
+        ret = crono_capture_load_index(pReader);
+        if (CRONO_SUCCESS != ret) {
+                CRONO_KERNEL_CaptureReaderClose(pReader);
+                return ret;
+        }
+
+        *ppReader = pReader;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderInfo(CRONO_KERNEL_CAPTURE_READER *pReader,
+                               CRONO_KERNEL_CAPTURE_INFO *pInfo) {
+        CRONO_RET_INV_PARAM_IF_NULL(pReader);
+        CRONO_RET_INV_PARAM_IF_NULL(pInfo);
+
+        memset(pInfo, 0, sizeof(CRONO_KERNEL_CAPTURE_INFO));
+        pInfo->header = *pReader->header;
+        pInfo->blockCount = pReader->block_count;
+        pInfo->indexRebuilt = (pReader->index != NULL &&
+                               pReader->index == pReader->rebuilt_index.data());
+        if (pReader->block_count > 0) {
+                pInfo->firstSequence = pReader->index[0].sequence;
+                pInfo->lastSequence =
+                    pReader->index[pReader->block_count - 1].sequence;
+                pInfo->firstTimestampNs = pReader->index[0].timestampNs;
+                pInfo->lastTimestampNs =
+                    pReader->index[pReader->block_count - 1].timestampNs;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderBlock(CRONO_KERNEL_CAPTURE_READER *pReader,
+                                uint64_t blockIndex,
+                                CRONO_KERNEL_CAPTURE_SPAN *pSpan) {
+        const uint8_t *block;
+        uint32_t capacity;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pReader);
+        CRONO_RET_INV_PARAM_IF_NULL(pSpan);
+        if (blockIndex >= pReader->block_count) {
+                return -ERANGE;
+        }
+
+        block = pReader->map + CRONO_KERNEL_CAPTURE_HEADER_SIZE +
+                blockIndex * pReader->header->blockSize;
+        capacity = pReader->header->blockSize -
+                   sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER);
+        pSpan->pHeader = (const CRONO_KERNEL_CAPTURE_BLOCK_HEADER *)block;
+        pSpan->pData = block + sizeof(CRONO_KERNEL_CAPTURE_BLOCK_HEADER);
+        // Don't trust a corrupt count beyond the block
+        pSpan->size = std::min(pSpan->pHeader->byteCount, capacity);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderFindSequence(CRONO_KERNEL_CAPTURE_READER *pReader,
+                                       uint64_t sequence,
+                                       uint64_t *pBlockIndex) {
+        const CRONO_KERNEL_CAPTURE_INDEX_ENTRY *found;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pReader);
+        CRONO_RET_INV_PARAM_IF_NULL(pBlockIndex);
+
+        found = std::lower_bound(
+            pReader->index, pReader->index + pReader->block_count, sequence,
+            [](const CRONO_KERNEL_CAPTURE_INDEX_ENTRY &entry, uint64_t value) {
+                    return entry.sequence < value;
+            });
+        if (found == pReader->index + pReader->block_count) {
+                return -ERANGE;
+        }
+        *pBlockIndex = found - pReader->index;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderFindTime(CRONO_KERNEL_CAPTURE_READER *pReader,
+                                   uint64_t timestampNs,
+                                   uint64_t *pBlockIndex) {
+        const CRONO_KERNEL_CAPTURE_INDEX_ENTRY *found;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pReader);
+        CRONO_RET_INV_PARAM_IF_NULL(pBlockIndex);
+
+        found = std::lower_bound(
+            pReader->index, pReader->index + pReader->block_count, timestampNs,
+            [](const CRONO_KERNEL_CAPTURE_INDEX_ENTRY &entry, uint64_t value) {
+                    return entry.timestampNs < value;
+            });
+        if (found == pReader->index + pReader->block_count) {
+                return -ERANGE;
+        }
+        *pBlockIndex = found - pReader->index;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CaptureReaderClose(CRONO_KERNEL_CAPTURE_READER *pReader) {
+        CRONO_RET_INV_PARAM_IF_NULL(pReader);
+        munmap((void *)pReader->map, pReader->map_size);
+        delete pReader;
+        return CRONO_SUCCESS;
+}
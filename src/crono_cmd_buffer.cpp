@@ -0,0 +1,199 @@
+#include "crono_cmd_buffer.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <mutex>
+#include <new>
+
+struct CRONO_KERNEL_CMD_BUFFER {
+        uint64_t id; // Unique in the process, never 0.
+        uint64_t version;
+        uint32_t capacity;
+        uint32_t count;
+        CRONO_KERNEL_CMD *cmds; // `capacity` commands, in the driver layout.
+};
+
+static uint64_t crono_cmd_buffer_next_id = 1;
+
+/**
+ * Serializes the registration of cleanup commands, so the id and version
+ * recorded by a device are those the driver holds.
+ */
+static std::mutex crono_cmd_buffer_mutex;
+
+int crono_cmd_buffer_cleanup_setup(PCRONO_KERNEL_DEVICE pDevice,
+                                   CRONO_KERNEL_CMD *cmds, uint32_t count,
+                                   uint64_t buffer_id, uint64_t version) {
+        std::lock_guard<std::mutex> lock(crono_cmd_buffer_mutex);
+        CRONO_KERNEL_CMDS_INFO cmds_info;
+        int ret;
+
+        if (pDevice->miscdev_fd <= 0) {
+                printf("Error: CRONO_KERNEL_PciDeviceOpen must be called "
+                       "before calling "
+                       "CRONO_KERNEL_CardCleanupSetup()\n");
+                return -ENOENT;
+        }
+        if (0 != buffer_id && pDevice->cleanup_buffer_id == buffer_id &&
+            pDevice->cleanup_version == version) {
+                // The driver holds these commands already
+                return CRONO_SUCCESS;
+        }
+
+        cmds_info.cmds = cmds;
+        cmds_info.ucmds = (uint64_t)cmds;
+        cmds_info.count = count;
+
+        // Call ioctl
+        ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_CLEANUP_SETUP, &cmds_info);
+        if (CRONO_SUCCESS != ret) {
+                // Unknown what the driver holds
+                pDevice->cleanup_buffer_id = 0;
+                return ret;
+        }
+        pDevice->cleanup_buffer_id = buffer_id;
+        pDevice->cleanup_version = version;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferCreate(
+    uint32_t capacity, CRONO_KERNEL_CMD_BUFFER **ppBuf) {
+        CRONO_KERNEL_CMD_BUFFER *pBuf;
+
+        // Validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(ppBuf);
+        CRONO_RET_INV_PARAM_IF_ZERO(capacity);
+
+        pBuf = new (std::nothrow) CRONO_KERNEL_CMD_BUFFER();
+        CRONO_RET_ERR_CODE_IF_NULL(pBuf, -ENOMEM);
+        pBuf->cmds =
+            (CRONO_KERNEL_CMD *)calloc(capacity, sizeof(CRONO_KERNEL_CMD));
+        if (NULL == pBuf->cmds) {
+                delete pBuf;
+                return -ENOMEM;
+        }
+        pBuf->id = __atomic_fetch_add(&crono_cmd_buffer_next_id, 1,
+                                      __ATOMIC_RELAXED);
+        pBuf->capacity = capacity;
+        *ppBuf = pBuf;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CmdBufferFree(CRONO_KERNEL_CMD_BUFFER *pBuf) {
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+
+        free(pBuf->cmds);
+        delete pBuf;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferSetAll(
+    CRONO_KERNEL_CMD_BUFFER *pBuf, const CRONO_KERNEL_CMD *Cmd,
+    uint32_t dwCmdCount, uint32_t *pChanged) {
+        uint32_t changed;
+
+        // Validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+        if (dwCmdCount > pBuf->capacity || (dwCmdCount > 0 && NULL == Cmd)) {
+                return -EINVAL;
+        }
+
+        // Commands added or removed are changed
+        changed = dwCmdCount > pBuf->count ? dwCmdCount - pBuf->count
+                                           : pBuf->count - dwCmdCount;
+        for (uint32_t i = 0; i < dwCmdCount; i++) {
+                if (i < pBuf->count && pBuf->cmds[i].addr == Cmd[i].addr &&
+                    pBuf->cmds[i].data == Cmd[i].data) {
+                        continue;
+                }
+                if (i < pBuf->count) {
+                        changed++;
+                }
+                pBuf->cmds[i] = Cmd[i];
+        }
+        pBuf->count = dwCmdCount;
+        if (0 != changed) {
+                pBuf->version++;
+        }
+        if (NULL != pChanged) {
+                *pChanged = changed;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferSet(
+    CRONO_KERNEL_CMD_BUFFER *pBuf, uint32_t index, uint32_t addr,
+    uint32_t data) {
+        // Validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+        if (index >= pBuf->count) {
+                return -EINVAL;
+        }
+
+        if (pBuf->cmds[index].addr != addr || pBuf->cmds[index].data != data) {
+                pBuf->cmds[index].addr = addr;
+                pBuf->cmds[index].data = data;
+                pBuf->version++;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferGetInfo(
+    const CRONO_KERNEL_CMD_BUFFER *pBuf, uint32_t *pCount,
+    uint64_t *pVersion) {
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+
+        if (NULL != pCount) {
+                *pCount = pBuf->count;
+        }
+        if (NULL != pVersion) {
+                *pVersion = pBuf->version;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_CmdBufferRegisterCleanup(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const CRONO_KERNEL_CMD_BUFFER *pBuf) {
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+
+        return crono_cmd_buffer_cleanup_setup(pDevice, pBuf->cmds, pBuf->count,
+                                              pBuf->id, pBuf->version);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_CmdBufferExecute(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                              const CRONO_KERNEL_CMD_BUFFER *pBuf) {
+        uint32_t max_addr = 0;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+        if (0 == pBuf->count) {
+                return CRONO_SUCCESS;
+        }
+
+        // Check the whole buffer first, so it is executed fully or not at all
+        for (uint32_t i = 0; i < pBuf->count; i++) {
+                if (0 != pBuf->cmds[i].addr % sizeof(uint32_t)) {
+                        return -EINVAL;
+                }
+                max_addr = std::max(max_addr, pBuf->cmds[i].addr);
+        }
+        if (0 == pDevice->bar_descs[0].userAddress ||
+            (uint64_t)max_addr + sizeof(uint32_t) >
+                pDevice->bar_descs[0].length) {
+                return -ENOMEM;
+        }
+
+        // Validated, so write without checking each command again
+        for (uint32_t i = 0; i < pBuf->count; i++) {
+                crono_bar0_write32(pDevice, pBuf->cmds[i].addr,
+                                   pBuf->cmds[i].data);
+        }
+        return CRONO_SUCCESS;
+}
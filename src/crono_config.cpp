@@ -0,0 +1,613 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_trace.h"
+#include "crono_userspace.h"
+#include <linux/pci_regs.h>
+#include <algorithm>
+#include <mutex>
+#include <new>
+
+#define CRONO_CONFIG_MAX_CAPS 64
+
+/**
+ * Shadow of the configuration space of a device, see `crono_config_read`.
+ */
+struct CRONO_CONFIG_SHADOW {
+        std::mutex mutex;
+
+        /**
+         * The sysfs `config` file, kept open. Read-only if the process may
+         * not write it, writes then fail.
+         */
+        int fd;
+        bool writable;
+
+        /**
+         * Size of the configuration space, 256 or 4096 bytes.
+         */
+        uint32_t space_size;
+
+        /**
+         * `data` is filled up to `size`, which is less than `space_size` if
+         * the process may not read the whole configuration space. False
+         * after `CRONO_KERNEL_PciConfigInvalidate`.
+         */
+        bool valid;
+        uint32_t size;
+        uint8_t data[PCI_CFG_SPACE_EXP_SIZE];
+
+        /**
+         * Bit per byte of `data`, set for bytes changed by the device, which
+         * are always read from the device.
+         */
+        uint8_t volatile_bits[PCI_CFG_SPACE_EXP_SIZE / 8];
+
+        /**
+         * Capabilities found in `data`, standard ones first, in list order.
+         */
+        CRONO_KERNEL_PCI_CAP caps[CRONO_CONFIG_MAX_CAPS];
+        uint32_t cap_count;
+};
+
+static void crono_config_mark_volatile(CRONO_CONFIG_SHADOW *shadow,
+                                       uint32_t offset, uint32_t size) {
+        for (uint32_t ibyte = offset;
+             ibyte < offset + size && ibyte < PCI_CFG_SPACE_EXP_SIZE;
+             ibyte++) {
+                shadow->volatile_bits[ibyte / 8] |= 1 << (ibyte % 8);
+        }
+}
+
+static bool crono_config_is_volatile(const CRONO_CONFIG_SHADOW *shadow,
+                                     uint32_t offset, uint32_t size) {
+        for (uint32_t ibyte = offset; ibyte < offset + size; ibyte++) {
+                if (shadow->volatile_bits[ibyte / 8] & (1 << (ibyte % 8))) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+static void crono_config_add_cap(CRONO_CONFIG_SHADOW *shadow, uint32_t id,
+                                 uint32_t extended, uint32_t version,
+                                 uint32_t offset) {
+        CRONO_KERNEL_PCI_CAP *cap;
+
+        if (shadow->cap_count >= CRONO_CONFIG_MAX_CAPS) {
+                return;
+        }
+        cap = &shadow->caps[shadow->cap_count++];
+        cap->id = id;
+        cap->extended = extended;
+        cap->version = version;
+        cap->offset = offset;
+}
+
+static uint16_t crono_config_shadow16(const CRONO_CONFIG_SHADOW *shadow,
+                                      uint32_t offset) {
+        uint16_t val;
+        memcpy(&val, &shadow->data[offset], sizeof(val));
+        return val;
+}
+
+static uint32_t crono_config_shadow32(const CRONO_CONFIG_SHADOW *shadow,
+                                      uint32_t offset) {
+        uint32_t val;
+        memcpy(&val, &shadow->data[offset], sizeof(val));
+        return val;
+}
+
+/**
+ * Walks the capability lists once, indexing the capabilities, and marks the
+ * registers updated by the device: status registers of the header and of the
+ * capabilities, registers the kernel changes at run time, the AER logs, and
+ * vendor-specific capabilities whose semantics are unknown. All other
+ * registers only change when written, which updates the shadow.
+ */
+static void crono_config_classify(CRONO_CONFIG_SHADOW *shadow) {
+        uint32_t cap;
+        uint32_t ext_cap;
+        uint32_t version;
+        int guard;
+
+        memset(shadow->volatile_bits, 0, sizeof(shadow->volatile_bits));
+        shadow->cap_count = 0;
+        crono_config_mark_volatile(shadow, PCI_STATUS, 2);
+        crono_config_mark_volatile(shadow, PCI_BIST, 1);
+
+        // Capabilities list
+        if (shadow->size <= PCI_CAPABILITY_LIST ||
+            !(crono_config_shadow16(shadow, PCI_STATUS) &
+              PCI_STATUS_CAP_LIST)) {
+                return;
+        }
+        cap = shadow->data[PCI_CAPABILITY_LIST] & ~3;
+        for (guard = 0; cap >= PCI_STD_HEADER_SIZEOF &&
+                        cap + PCI_CAP_LIST_NEXT < shadow->size && guard < 48;
+             guard++) {
+                // Standard capabilities have no version, except PCIe
+                version = 0;
+                if (PCI_CAP_ID_EXP == shadow->data[cap + PCI_CAP_LIST_ID] &&
+                    cap + PCI_EXP_FLAGS + 2 <= shadow->size) {
+                        version = crono_config_shadow16(shadow,
+                                                        cap + PCI_EXP_FLAGS) &
+                                  PCI_EXP_FLAGS_VERS;
+                }
+                crono_config_add_cap(shadow,
+                                     shadow->data[cap + PCI_CAP_LIST_ID], 0,
+                                     version, cap);
+                switch (shadow->data[cap + PCI_CAP_LIST_ID]) {
+                case PCI_CAP_ID_PM:
+                        crono_config_mark_volatile(shadow, cap + PCI_PM_CTRL,
+                                                   2);
+                        break;
+                case PCI_CAP_ID_MSI:
+                case PCI_CAP_ID_MSIX:
+                        crono_config_mark_volatile(shadow, cap + PCI_MSI_FLAGS,
+                                                   2);
+                        break;
+                case PCI_CAP_ID_EXP:
+                        crono_config_mark_volatile(shadow, cap + PCI_EXP_DEVSTA,
+                                                   2);
+                        crono_config_mark_volatile(shadow, cap + PCI_EXP_LNKSTA,
+                                                   2);
+                        crono_config_mark_volatile(shadow, cap + PCI_EXP_SLTSTA,
+                                                   2);
+                        crono_config_mark_volatile(shadow, cap + PCI_EXP_RTSTA,
+                                                   4);
+                        crono_config_mark_volatile(shadow,
+                                                   cap + PCI_EXP_DEVSTA2, 2);
+                        crono_config_mark_volatile(shadow,
+                                                   cap + PCI_EXP_LNKSTA2, 2);
+                        crono_config_mark_volatile(shadow,
+                                                   cap + PCI_EXP_SLTSTA2, 2);
+                        break;
+                case PCI_CAP_ID_VNDR:
+                        // Byte 2 is the capability length
+                        if (shadow->data[cap + PCI_CAP_FLAGS] >
+                            PCI_CAP_FLAGS) {
+                                crono_config_mark_volatile(
+                                    shadow, cap + PCI_CAP_FLAGS,
+                                    shadow->data[cap + PCI_CAP_FLAGS] -
+                                        PCI_CAP_FLAGS);
+                        }
+                        break;
+                }
+                cap = shadow->data[cap + PCI_CAP_LIST_NEXT] & ~3;
+        }
+
+        // Extended capabilities list
+        if (shadow->size < PCI_CFG_SPACE_EXP_SIZE) {
+                return;
+        }
+        ext_cap = PCI_CFG_SPACE_SIZE;
+        for (guard = 0; ext_cap >= PCI_CFG_SPACE_SIZE && guard < 480;
+             guard++) {
+                uint32_t header = crono_config_shadow32(shadow, ext_cap);
+
+                if (0 == header || 0xFFFFFFFF == header) {
+                        break;
+                }
+                crono_config_add_cap(shadow, PCI_EXT_CAP_ID(header), 1,
+                                     PCI_EXT_CAP_VER(header), ext_cap);
+                switch (PCI_EXT_CAP_ID(header)) {
+                case PCI_EXT_CAP_ID_ERR:
+                        crono_config_mark_volatile(
+                            shadow, ext_cap + PCI_ERR_UNCOR_STATUS, 4);
+                        crono_config_mark_volatile(
+                            shadow, ext_cap + PCI_ERR_COR_STATUS, 4);
+                        // First error pointer and header log
+                        crono_config_mark_volatile(shadow,
+                                                   ext_cap + PCI_ERR_CAP, 20);
+                        crono_config_mark_volatile(
+                            shadow, ext_cap + PCI_ERR_ROOT_STATUS, 8);
+                        break;
+                case PCI_EXT_CAP_ID_VNDR: {
+                        // The length includes the extended capability header
+                        uint32_t length = PCI_VNDR_HEADER_LEN(
+                            crono_config_shadow32(shadow,
+                                                  ext_cap + PCI_VNDR_HEADER));
+                        if (length > PCI_VNDR_HEADER) {
+                                crono_config_mark_volatile(
+                                    shadow, ext_cap + PCI_VNDR_HEADER,
+                                    length - PCI_VNDR_HEADER);
+                        }
+                        break;
+                }
+                }
+                ext_cap = PCI_EXT_CAP_NEXT(header);
+        }
+}
+
+/**
+ * Reads the whole configuration space into the shadow with one `pread`.
+ * `shadow->mutex` must be held.
+ */
+static int crono_config_snapshot(CRONO_CONFIG_SHADOW *shadow) {
+        ssize_t bytes;
+
+        do {
+                bytes =
+                    pread64(shadow->fd, shadow->data, shadow->space_size, 0);
+        } while (bytes < 0 && EINTR == errno);
+        if (bytes < 0) {
+                return errno;
+        }
+        shadow->size = (uint32_t)bytes;
+        crono_config_classify(shadow);
+        shadow->valid = true;
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Gets the device shadow, creating it on first use. Opening the `config` file
+ * is the only system call, the snapshot is taken on first read.
+ */
+static int crono_config_get(PCRONO_KERNEL_DEVICE pDevice,
+                            CRONO_CONFIG_SHADOW **ppShadow) {
+        char config_file_path[PATH_MAX];
+        CRONO_CONFIG_SHADOW *shadow;
+        CRONO_CONFIG_SHADOW *expected = NULL;
+        struct stat st;
+
+        shadow = __atomic_load_n(&pDevice->config_shadow, __ATOMIC_ACQUIRE);
+        if (NULL != shadow) {
+                *ppShadow = shadow;
+                return CRONO_SUCCESS;
+        }
+
+        shadow = new (std::nothrow) CRONO_CONFIG_SHADOW();
+        CRONO_RET_ERR_CODE_IF_NULL(shadow, -ENOMEM);
+        CRONO_CONSTRUCT_CONFIG_FILE_PATH(
+            config_file_path, pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction);
+        shadow->writable = true;
+        shadow->fd = open(config_file_path, O_RDWR | O_CLOEXEC);
+        if (shadow->fd < 0 && (EACCES == errno || EPERM == errno)) {
+                shadow->writable = false;
+                shadow->fd = open(config_file_path, O_RDONLY | O_CLOEXEC);
+        }
+        if (shadow->fd < 0 || 0 != fstat(shadow->fd, &st)) {
+                int err = errno;
+                printf("Error opening configuration file <%s>: <%d> <%s>\n",
+                       config_file_path, err, strerror(err));
+                if (shadow->fd >= 0) {
+                        close(shadow->fd);
+                }
+                delete shadow;
+                return err;
+        }
+        shadow->space_size =
+            st.st_size < PCI_CFG_SPACE_EXP_SIZE ? st.st_size
+                                                : PCI_CFG_SPACE_EXP_SIZE;
+
+        // Another thread may have created it meanwhile
+        if (!__atomic_compare_exchange_n(&pDevice->config_shadow, &expected,
+                                         shadow, false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+                close(shadow->fd);
+                delete shadow;
+                shadow = expected;
+        }
+        *ppShadow = shadow;
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Reads as `crono_config_read`, not traced.
+ */
+static int crono_config_read_range(PCRONO_KERNEL_DEVICE pDevice,
+                                   uint32_t offset, void *data,
+                                   uint32_t size) {
+        CRONO_CONFIG_SHADOW *shadow;
+        ssize_t bytes;
+        int ret;
+
+        ret = crono_config_get(pDevice, &shadow);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        if ((uint64_t)offset + size > shadow->space_size) {
+                return -EINVAL;
+        }
+
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        if (!shadow->valid) {
+                ret = crono_config_snapshot(shadow);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+        }
+        if (offset + size <= shadow->size &&
+            !crono_config_is_volatile(shadow, offset, size)) {
+                memcpy(data, &shadow->data[offset], size);
+                return CRONO_SUCCESS;
+        }
+
+        // Volatile, or not readable at snapshot time
+        do {
+                bytes = pread64(shadow->fd, data, size, offset);
+        } while (bytes < 0 && EINTR == errno);
+        if (bytes < 0) {
+                return errno;
+        }
+        if ((uint32_t)bytes != size) {
+                return -EIO;
+        }
+        if (offset + size <= shadow->size) {
+                memcpy(&shadow->data[offset], data, size);
+        }
+        return CRONO_SUCCESS;
+}
+
+int crono_config_read(PCRONO_KERNEL_DEVICE pDevice, uint32_t offset,
+                      void *data, uint32_t size) {
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pDevice);
+        CRONO_RET_INV_PARAM_IF_NULL(data);
+        CRONO_TRACE_BEGIN(pDevice);
+        ret = crono_config_read_range(pDevice, offset, data, size);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_CONFIG_READ,
+                        CRONO_KERNEL_TRACE_NO_BAR, offset, size, 0, data, ret);
+        return ret;
+}
+
+/**
+ * Writes `data` with one `pwrite`, then, if `verify` or the range is cached,
+ * reads the range back with one `pread`.
+ */
+static int crono_config_write_range(PCRONO_KERNEL_DEVICE pDevice,
+                                    uint32_t offset, const void *data,
+                                    uint32_t size, bool verify) {
+        CRONO_CONFIG_SHADOW *shadow;
+        uint8_t read_back[PCI_CFG_SPACE_EXP_SIZE];
+        bool cached;
+        ssize_t bytes;
+        int ret;
+
+        ret = crono_config_get(pDevice, &shadow);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        if ((uint64_t)offset + size > shadow->space_size) {
+                return -EINVAL;
+        }
+        if (!shadow->writable) {
+                return EACCES;
+        }
+
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        do {
+                bytes = pwrite64(shadow->fd, data, size, offset);
+        } while (bytes < 0 && EINTR == errno);
+        if (bytes < 0) {
+                return errno;
+        }
+        if ((uint32_t)bytes != size) {
+                return -EIO;
+        }
+
+        // Write-through. Bits of cached registers may not read back as
+        // written, e.g. BAR size bits, so those are read back
+        cached = shadow->valid && offset + size <= shadow->size;
+        if (!cached && !verify) {
+                return CRONO_SUCCESS;
+        }
+        do {
+                bytes = pread64(shadow->fd, read_back, size, offset);
+        } while (bytes < 0 && EINTR == errno);
+        if ((uint32_t)bytes != size) {
+                shadow->valid = false;
+                if (!verify) {
+                        return CRONO_SUCCESS;
+                }
+                return bytes < 0 ? errno : -EIO;
+        }
+        if (cached) {
+                memcpy(&shadow->data[offset], read_back, size);
+        }
+        if (verify && 0 != memcmp(read_back, data, size)) {
+                return CRONO_KERNEL_DATA_MISMATCH;
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Writes as `crono_config_write_range`, recording the write if the device is
+ * traced.
+ */
+static int crono_config_write_traced(PCRONO_KERNEL_DEVICE pDevice,
+                                     uint32_t offset, const void *data,
+                                     uint32_t size, bool verify) {
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pDevice);
+        CRONO_RET_INV_PARAM_IF_NULL(data);
+        CRONO_TRACE_BEGIN(pDevice);
+        ret = crono_config_write_range(pDevice, offset, data, size, verify);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_CONFIG_WRITE,
+                        CRONO_KERNEL_TRACE_NO_BAR, offset, size, 0, data, ret);
+        return ret;
+}
+
+int crono_config_write(PCRONO_KERNEL_DEVICE pDevice, uint32_t offset,
+                       const void *data, uint32_t size) {
+        return crono_config_write_traced(pDevice, offset, data, size, false);
+}
+
+int crono_config_write_verify(PCRONO_KERNEL_DEVICE pDevice, uint32_t offset,
+                              const void *data, uint32_t size) {
+        return crono_config_write_traced(pDevice, offset, data, size, true);
+}
+
+/**
+ * Locks the shadow of the device, taking the snapshot if not valid.
+ */
+static int crono_config_lock(PCRONO_KERNEL_DEVICE pDevice,
+                             CRONO_CONFIG_SHADOW **ppShadow,
+                             std::unique_lock<std::mutex> *pLock) {
+        int ret;
+
+        ret = crono_config_get(pDevice, ppShadow);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        *pLock = std::unique_lock<std::mutex>((*ppShadow)->mutex);
+        if (!(*ppShadow)->valid) {
+                return crono_config_snapshot(*ppShadow);
+        }
+        return CRONO_SUCCESS;
+}
+
+int crono_config_find_cap(PCRONO_KERNEL_DEVICE pDevice, uint32_t extended,
+                          uint32_t id, uint32_t *pOffset, uint32_t *pVersion) {
+        CRONO_CONFIG_SHADOW *shadow;
+        std::unique_lock<std::mutex> lock;
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pDevice);
+        CRONO_RET_INV_PARAM_IF_NULL(pOffset);
+        ret = crono_config_lock(pDevice, &shadow, &lock);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        for (uint32_t icap = 0; icap < shadow->cap_count; icap++) {
+                if (shadow->caps[icap].extended == extended &&
+                    shadow->caps[icap].id == id) {
+                        *pOffset = shadow->caps[icap].offset;
+                        if (NULL != pVersion) {
+                                *pVersion = shadow->caps[icap].version;
+                        }
+                        return CRONO_SUCCESS;
+                }
+        }
+        return -ENOENT;
+}
+
+int crono_config_attach(PCRONO_KERNEL_DEVICE pDevice, int fd, uint32_t size) {
+        CRONO_CONFIG_SHADOW *shadow;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pDevice);
+        if (NULL != pDevice->config_shadow) {
+                return -EBUSY;
+        }
+        shadow = new (std::nothrow) CRONO_CONFIG_SHADOW();
+        CRONO_RET_ERR_CODE_IF_NULL(shadow, -ENOMEM);
+        shadow->fd = fd;
+        shadow->writable = true;
+        shadow->space_size = std::min(size, (uint32_t)PCI_CFG_SPACE_EXP_SIZE);
+        pDevice->config_shadow = shadow;
+        return CRONO_SUCCESS;
+}
+
+void crono_config_free(PCRONO_KERNEL_DEVICE pDevice) {
+        CRONO_CONFIG_SHADOW *shadow = pDevice->config_shadow;
+
+        if (NULL == shadow) {
+                return;
+        }
+        close(shadow->fd);
+        delete shadow;
+        pDevice->config_shadow = NULL;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciReadCfg8(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset,
+                         uint8_t *val) {
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
+        return crono_config_read(pDevice, dwOffset, val, sizeof(*val));
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciReadCfg16(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset,
+                          uint16_t *val) {
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
+        return crono_config_read(pDevice, dwOffset, val, sizeof(*val));
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciWriteCfg8(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset,
+                          uint8_t val) {
+        CRONO_INIT_HDEV_FUNC(hDev);
+        return crono_config_write(pDevice, dwOffset, &val, sizeof(val));
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciWriteCfg16(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset,
+                           uint16_t val) {
+        CRONO_INIT_HDEV_FUNC(hDev);
+        return crono_config_write(pDevice, dwOffset, &val, sizeof(val));
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciConfigInvalidate(CRONO_KERNEL_DEVICE_HANDLE hDev) {
+        CRONO_CONFIG_SHADOW *shadow;
+
+        CRONO_INIT_HDEV_FUNC(hDev);
+        shadow = __atomic_load_n(&pDevice->config_shadow, __ATOMIC_ACQUIRE);
+        if (NULL == shadow) {
+                return CRONO_SUCCESS;
+        }
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        shadow->valid = false;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciConfigRefresh(CRONO_KERNEL_DEVICE_HANDLE hDev) {
+        CRONO_CONFIG_SHADOW *shadow;
+        int ret;
+
+        CRONO_INIT_HDEV_FUNC(hDev);
+        ret = crono_config_get(pDevice, &shadow);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        return crono_config_snapshot(shadow);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PciFindCap(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t capId, uint32_t *pOffset) {
+        CRONO_INIT_HDEV_FUNC(hDev);
+        return crono_config_find_cap(pDevice, 0, capId, pOffset, NULL);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciFindExtCap(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t extCapId,
+                           uint32_t *pOffset, uint32_t *pVersion) {
+        CRONO_INIT_HDEV_FUNC(hDev);
+        return crono_config_find_cap(pDevice, 1, extCapId, pOffset, pVersion);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PciGetCapList(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                           CRONO_KERNEL_PCI_CAP *pCaps, uint32_t maxCount,
+                           uint32_t *pCount) {
+        CRONO_CONFIG_SHADOW *shadow;
+        std::unique_lock<std::mutex> lock;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pCount);
+        if (maxCount > 0) {
+                CRONO_RET_INV_PARAM_IF_NULL(pCaps);
+        }
+        ret = crono_config_lock(pDevice, &shadow, &lock);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+
+        // Copy the index, `pCount` is the full count even if truncated
+        if (maxCount > 0) {
+                memcpy(pCaps, shadow->caps,
+                       std::min(maxCount, shadow->cap_count) * sizeof(*pCaps));
+        }
+        *pCount = shadow->cap_count;
+        return maxCount < shadow->cap_count ? -ENOBUFS : CRONO_SUCCESS;
+}
@@ -0,0 +1,333 @@
+#include "crono_dma_desc.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+
+/**
+ * Count of descriptors gathered before they are packed together.
+ */
+#define CRONO_DESC_BATCH 256
+
+/**
+ * Count of 32-bit words in the largest descriptor.
+ */
+#define CRONO_DESC_MAX_WORDS (CRONO_KERNEL_DESC_MAX_BYTES / 4)
+
+/**
+ * Placement of a field value in each 32-bit word of a descriptor:
+ * word = ((value >> rshift) << lshift) & mask. Words the field doesn't touch
+ * have a zero mask.
+ */
+typedef struct {
+        uint32_t rshift[CRONO_DESC_MAX_WORDS];
+        uint32_t lshift[CRONO_DESC_MAX_WORDS];
+        uint32_t mask[CRONO_DESC_MAX_WORDS];
+} CRONO_DESC_FIELD_PLAN;
+
+static void crono_desc_plan_field(CRONO_DESC_FIELD_PLAN *plan, uint32_t words,
+                                  uint32_t offset, uint32_t bits) {
+        memset(plan, 0, sizeof(CRONO_DESC_FIELD_PLAN));
+        for (uint32_t iword = 0; iword < words; iword++) {
+                uint32_t word_start = iword * 32;
+                uint32_t lo = std::max(offset, word_start);
+                uint32_t hi = std::min(offset + bits, word_start + 32);
+                if (lo >= hi) {
+                        continue;
+                }
+                // Bits [lo, hi) of the descriptor come from value bits
+                // [lo - offset, hi - offset)
+                plan->rshift[iword] = lo - offset;
+                plan->lshift[iword] = lo - word_start;
+                plan->mask[iword] = (hi - lo == 32)
+                                        ? 0xFFFFFFFFU
+                                        : (((1U << (hi - lo)) - 1)
+                                           << (lo - word_start));
+        }
+}
+
+static bool crono_desc_field_fits(uint32_t offset, uint32_t bits,
+                                  uint32_t desc_bits) {
+        return bits > 0 && offset < desc_bits && bits <= desc_bits - offset;
+}
+
+/**
+ * Gets the next segment of the buffer, starting at `*page`/`*offset`, and
+ * advances them. Returns false if the whole buffer is already described.
+ */
+static bool crono_desc_next_segment(const CRONO_KERNEL_DMA_SG *pDma,
+                                    uint64_t max_segment, uint32_t *page,
+                                    uint32_t *offset, DMA_ADDR *addr,
+                                    uint64_t *len) {
+        if (*page >= pDma->dwPages) {
+                return false;
+        }
+        *addr = pDma->Page[*page].pPhysicalAddr + *offset;
+        *len = 0;
+        while (*page < pDma->dwPages && *len < max_segment) {
+                const CRONO_KERNEL_DMA_PAGE *cur = &pDma->Page[*page];
+                uint64_t avail, take;
+
+                if (*len > 0 && cur->pPhysicalAddr + *offset != *addr + *len) {
+                        break; // Not physically contiguous
+                }
+                avail = cur->dwBytes - *offset;
+                take = std::min(avail, max_segment - *len);
+                *len += take;
+                if (take == avail) {
+                        (*page)++;
+                        *offset = 0;
+                } else {
+                        *offset += take;
+                }
+        }
+        return true;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DescBuilderInit(CRONO_KERNEL_DESC_BUILDER *pBuilder,
+                             const CRONO_KERNEL_DMA_SG *pDma,
+                             const CRONO_KERNEL_DESC_FORMAT *pFormat) {
+        uint32_t desc_bits;
+        uint64_t field_max;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(pBuilder);
+        CRONO_RET_INV_PARAM_IF_NULL(pDma);
+        CRONO_RET_INV_PARAM_IF_NULL(pFormat);
+        CRONO_RET_INV_PARAM_IF_NULL(pDma->Page);
+        memset(pBuilder, 0, sizeof(CRONO_KERNEL_DESC_BUILDER));
+
+        if (0 == pFormat->descBytes || (pFormat->descBytes % 4) != 0 ||
+            pFormat->descBytes > CRONO_KERNEL_DESC_MAX_BYTES) {
+                return -EINVAL;
+        }
+        desc_bits = pFormat->descBytes * 8;
+        if (pFormat->addrBits > 64 || pFormat->addrShift >= 64 ||
+            !crono_desc_field_fits(pFormat->addrBitOffset, pFormat->addrBits,
+                                   desc_bits)) {
+                return -EINVAL;
+        }
+        if (pFormat->lenBits > 32 || pFormat->lenShift >= 32 ||
+            !crono_desc_field_fits(pFormat->lenBitOffset, pFormat->lenBits,
+                                   desc_bits)) {
+                return -EINVAL;
+        }
+        if ((pFormat->flags & CRONO_KERNEL_DESC_HAS_EOC) &&
+            pFormat->eocBit >= desc_bits) {
+                return -EINVAL;
+        }
+
+        // Largest length the field can hold, in bytes, rounded down to the
+        // length unit
+        field_max = (1ULL << pFormat->lenBits) - 1;
+        if (pFormat->flags & CRONO_KERNEL_DESC_LEN_MINUS_ONE) {
+                field_max++;
+        }
+        field_max <<= pFormat->lenShift;
+        pBuilder->maxSegment = field_max;
+        if (pFormat->maxSegmentSize > 0 &&
+            pFormat->maxSegmentSize < field_max) {
+                pBuilder->maxSegment =
+                    (pFormat->maxSegmentSize >> pFormat->lenShift)
+                    << pFormat->lenShift;
+        }
+        if (0 == pBuilder->maxSegment) {
+                return -EINVAL;
+        }
+
+        pBuilder->pDma = pDma;
+        pBuilder->format = *pFormat;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DescBuilderCount(
+    const CRONO_KERNEL_DESC_BUILDER *pBuilder, uint64_t *pDescCount) {
+        uint32_t page = 0, offset = 0;
+        DMA_ADDR addr;
+        uint64_t len;
+        uint64_t count = 0;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pBuilder);
+        CRONO_RET_INV_PARAM_IF_NULL(pBuilder->pDma);
+        CRONO_RET_INV_PARAM_IF_NULL(pDescCount);
+
+        while (crono_desc_next_segment(pBuilder->pDma, pBuilder->maxSegment,
+                                       &page, &offset, &addr, &len)) {
+                count++;
+        }
+        *pDescCount = count;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DescBuilderEmit(CRONO_KERNEL_DESC_BUILDER *pBuilder, void *pOut,
+                             uint32_t maxDescs, uint32_t *pWritten,
+                             uint32_t *pDone) {
+        const CRONO_KERNEL_DESC_FORMAT *format;
+        CRONO_DESC_FIELD_PLAN addr_plan, len_plan;
+        uint64_t addrs[CRONO_DESC_BATCH];
+        uint64_t lens[CRONO_DESC_BATCH];
+        uint32_t words[CRONO_DESC_BATCH * CRONO_DESC_MAX_WORDS];
+        uint32_t words_per_desc;
+        uint64_t addr_unit, len_unit, addr_limit;
+        uint32_t len_minus_one;
+        uint32_t written = 0;
+        char *out = (char *)pOut;
+        bool done = false;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(pBuilder);
+        CRONO_RET_INV_PARAM_IF_NULL(pBuilder->pDma);
+        CRONO_RET_INV_PARAM_IF_NULL(pOut);
+        CRONO_RET_INV_PARAM_IF_NULL(pWritten);
+        *pWritten = 0;
+        format = &pBuilder->format;
+        words_per_desc = format->descBytes / 4;
+        addr_unit = 1ULL << format->addrShift;
+        len_unit = 1ULL << format->lenShift;
+        addr_limit = (format->addrBits == 64) ? ~0ULL
+                                              : ((1ULL << format->addrBits) - 1);
+        len_minus_one =
+            (format->flags & CRONO_KERNEL_DESC_LEN_MINUS_ONE) ? 1 : 0;
+        crono_desc_plan_field(&addr_plan, words_per_desc, format->addrBitOffset,
+                              format->addrBits);
+        crono_desc_plan_field(&len_plan, words_per_desc, format->lenBitOffset,
+                              format->lenBits);
+
+        while (written < maxDescs && !done) {
+                uint32_t batch = 0;
+                uint32_t batch_max =
+                    std::min<uint32_t>(CRONO_DESC_BATCH, maxDescs - written);
+
+                // ___________________________________________________
+                // Gather the segments, values are stored as in fields
+                //
+                while (batch < batch_max) {
+                        DMA_ADDR addr;
+                        uint64_t len;
+                        if (!crono_desc_next_segment(
+                                pBuilder->pDma, pBuilder->maxSegment,
+                                &pBuilder->page, &pBuilder->pageOffset, &addr,
+                                &len)) {
+                                done = true;
+                                break;
+                        }
+                        if ((addr & (addr_unit - 1)) ||
+                            ((addr >> format->addrShift) & ~addr_limit) ||
+                            (len & (len_unit - 1))) {
+                                printf("Error: DMA segment <0x%lx>, length "
+                                       "<%lu> can't be described\n",
+                                       addr, len);
+                                return -EINVAL;
+                        }
+                        addrs[batch] = addr >> format->addrShift;
+                        lens[batch] = (len >> format->lenShift) - len_minus_one;
+                        batch++;
+                }
+                if (!done &&
+                    pBuilder->page >= pBuilder->pDma->dwPages) {
+                        done = true;
+                }
+
+                // __________________________________________________
+                // Pack, branch free so the compiler can vectorize it
+                //
+                for (uint32_t iword = 0; iword < words_per_desc; iword++) {
+                        const uint32_t ar = addr_plan.rshift[iword];
+                        const uint32_t al = addr_plan.lshift[iword];
+                        const uint32_t am = addr_plan.mask[iword];
+                        const uint32_t lr = len_plan.rshift[iword];
+                        const uint32_t ll = len_plan.lshift[iword];
+                        const uint32_t lm = len_plan.mask[iword];
+                        for (uint32_t idesc = 0; idesc < batch; idesc++) {
+                                words[idesc * words_per_desc + iword] =
+                                    (((uint32_t)(addrs[idesc] >> ar) << al) &
+                                     am) |
+                                    (((uint32_t)(lens[idesc] >> lr) << ll) &
+                                     lm);
+                        }
+                }
+                if (done && batch > 0 &&
+                    (format->flags & CRONO_KERNEL_DESC_HAS_EOC)) {
+                        words[(batch - 1) * words_per_desc +
+                              format->eocBit / 32] |= 1U << (format->eocBit % 32);
+                }
+
+                memcpy(out, words, (size_t)batch * format->descBytes);
+                out += (size_t)batch * format->descBytes;
+                written += batch;
+        }
+
+        pBuilder->descEmitted += written;
+        *pWritten = written;
+        if (NULL != pDone) {
+                *pDone = done ? 1 : 0;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DescBuildTable(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const CRONO_KERNEL_DMA_SG *pDma,
+    const CRONO_KERNEL_DESC_FORMAT *pFormat, CRONO_KERNEL_DMA_CONTIG **ppTable,
+    uint64_t *pDescCount) {
+        CRONO_KERNEL_DESC_BUILDER builder;
+        uint64_t desc_count, table_size;
+        uint32_t written, done;
+        bool allocated = false;
+        uint32_t ret;
+
+        // ______________________________________
+        // Init variables and validate parameters
+        //
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(ppTable);
+        CRONO_RET_INV_PARAM_IF_NULL(pDescCount);
+        ret = CRONO_KERNEL_DescBuilderInit(&builder, pDma, pFormat);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        ret = CRONO_KERNEL_DescBuilderCount(&builder, &desc_count);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        table_size = desc_count * pFormat->descBytes;
+        if (table_size > UINT32_MAX || desc_count > UINT32_MAX) {
+                return -EINVAL;
+        }
+
+        // ____________________
+        // Get the table buffer
+        //
+        if (NULL == *ppTable) {
+                void *table_buf = NULL;
+                ret = CRONO_KERNEL_DMAContigBufLock(
+                    pDevice, &table_buf, DMA_TO_DEVICE, (uint32_t)table_size,
+                    ppTable);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                allocated = true;
+        } else if ((*ppTable)->dwBytes < table_size) {
+                return -ENOSPC;
+        }
+
+        // ___________
+        // Build table
+        //
+        ret = CRONO_KERNEL_DescBuilderEmit(&builder, (*ppTable)->pUserAddr,
+                                           (uint32_t)desc_count, &written,
+                                           &done);
+        if (CRONO_SUCCESS != ret) {
+                if (allocated) {
+                        CRONO_KERNEL_DMAContigBufUnlock(pDevice, *ppTable);
+                        *ppTable = NULL;
+                }
+                return ret;
+        }
+        CRONO_DEBUG("Built descriptor table: descriptors <%u>, size <%lu>\n",
+                    written, table_size);
+        *pDescCount = written;
+        return CRONO_SUCCESS;
+}
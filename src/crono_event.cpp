@@ -0,0 +1,206 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+/**
+ * Count of register checks between two checks of the event file descriptor
+ * while spinning, as the latter is a system call.
+ */
+#define CRONO_EVENT_SPIN_REG_CHECKS 64
+
+static uint64_t crono_event_now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int crono_event_fd_init(int fd) {
+        int flags;
+
+        flags = fcntl(fd, F_GETFL);
+        if (flags < 0) {
+                return errno;
+        }
+        if (flags & O_NONBLOCK) {
+                return CRONO_SUCCESS;
+        }
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+                return errno;
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Reads the events counter after the file descriptor is signaled readable.
+ * The file descriptor is non-blocking, see `crono_event_fd_init`.
+ */
+static uint32_t crono_event_read(PCRONO_KERNEL_DEVICE pDevice,
+                                 uint64_t *pCount) {
+        uint64_t count = 0;
+        ssize_t bytes;
+
+        bytes = read(pDevice->event_fd, &count, sizeof(count));
+        if (bytes == sizeof(count)) {
+                *pCount = count;
+                return CRONO_SUCCESS;
+        }
+        *pCount = 0;
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                // Consumed by another thread meanwhile
+                return CRONO_SUCCESS;
+        }
+        if (bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                // Kernel module has no `read`, so `poll` readiness is
+                // meaningless
+                return CRONO_KERNEL_NOT_IMPLEMENTED;
+        }
+        return bytes < 0 ? errno : CRONO_KERNEL_DATA_MISMATCH;
+}
+
+/**
+ * Polls the event file descriptor, `timeout_ms` as `poll()`.
+ * Returns 1 if readable, 0 on timeout, or -1 with `errno` set.
+ */
+static int crono_event_poll(PCRONO_KERNEL_DEVICE pDevice, int timeout_ms) {
+        struct pollfd pfd;
+        int ret;
+
+        pfd.fd = pDevice->event_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        do {
+                ret = poll(&pfd, 1, timeout_ms);
+        } while (ret < 0 && errno == EINTR);
+        if (ret > 0 && !(pfd.revents & POLLIN)) {
+                // `POLLERR` or `POLLHUP`
+                errno = EIO;
+                return -1;
+        }
+        return ret;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_GetEventFd(CRONO_KERNEL_DEVICE_HANDLE hDev, int *pFd) {
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pFd);
+
+        *pFd = pDevice->event_fd;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_SetEventFd(CRONO_KERNEL_DEVICE_HANDLE hDev, int fd) {
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        if (fd < -1) {
+                return -EINVAL;
+        }
+
+        if (fd == -1) {
+                fd = pDevice->miscdev_fd;
+        }
+        ret = crono_event_fd_init(fd);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        pDevice->event_fd = fd;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_AckEvents(CRONO_KERNEL_DEVICE_HANDLE hDev, uint64_t *pCount) {
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pCount);
+        *pCount = 0;
+
+        ret = crono_event_poll(pDevice, 0);
+        if (ret < 0) {
+                return errno;
+        }
+        if (0 == ret) {
+                return CRONO_SUCCESS;
+        }
+        return crono_event_read(pDevice, pCount);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_WaitForEvent(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                          const CRONO_KERNEL_EVENT_WAIT *pWait,
+                          uint64_t *pCount) {
+        volatile uint32_t *reg = NULL;
+        uint64_t spin_end_ns;
+        uint32_t ireg = 0;
+        int ret;
+
+        // ______________________________________
+        // Init variables and validate parameters
+        //
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pWait);
+        CRONO_RET_INV_PARAM_IF_NULL(pCount);
+        *pCount = 0;
+        if (pWait->flags & CRONO_KERNEL_EVENT_WAIT_REG) {
+                // Validate once, out of the spinning loop. BAR0 is looked up
+                // by number, as by `CRONO_KERNEL_ReadBar32`.
+                const CRONO_BAR_MAP *map = &pDevice->bar_map[0];
+
+                if (0 != pWait->regOffset % sizeof(uint32_t)) {
+                        return -EINVAL;
+                }
+                if (NULL == map->addr ||
+                    (uint64_t)pWait->regOffset + sizeof(uint32_t) >
+                        map->length) {
+                        return -ENOMEM;
+                }
+                reg = (volatile uint32_t *)(map->addr + pWait->regOffset);
+        }
+
+        // ____
+        // Spin
+        //
+        spin_end_ns = crono_event_now_ns() + (uint64_t)pWait->spinUs * 1000;
+        while (pWait->spinUs > 0) {
+                if (NULL != reg) {
+                        if ((*reg & pWait->regMask) == pWait->regValue) {
+                                return CRONO_SUCCESS;
+                        }
+                        if (++ireg % CRONO_EVENT_SPIN_REG_CHECKS != 0) {
+                                __builtin_ia32_pause();
+                                continue;
+                        }
+                }
+                ret = crono_event_poll(pDevice, 0);
+                if (ret < 0) {
+                        return errno;
+                }
+                if (ret > 0) {
+                        return crono_event_read(pDevice, pCount);
+                }
+                if (crono_event_now_ns() >= spin_end_ns) {
+                        break;
+                }
+                __builtin_ia32_pause();
+        }
+
+        // _____
+        // Block
+        //
+        ret = crono_event_poll(pDevice, pWait->timeoutMs);
+        if (ret < 0) {
+                return errno;
+        }
+        if (0 == ret) {
+                return CRONO_KERNEL_TIME_OUT_EXPIRED;
+        }
+        return crono_event_read(pDevice, pCount);
+}
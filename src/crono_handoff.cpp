@@ -0,0 +1,519 @@
+#include "crono_handoff.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <new>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define CRONO_HANDOFF_MAGIC "CRNOHAND"
+
+/**
+ * First message part, sent with the file descriptors: the miscdev fd, then
+ * the memfd of each buffer.
+ */
+typedef struct {
+        char magic[8]; // CRONO_HANDOFF_MAGIC.
+        uint32_t version;
+        uint32_t buffer_count;
+        CRONO_KERNEL_PCI_SLOT slot;
+        uint32_t vendor_id;
+        uint32_t device_id;
+        char miscdev_name[CRONO_DEV_NAME_MAX_SIZE];
+        CRONO_KERNEL_BAR_DESC bar_descs[6];
+        uint32_t bar_count;
+} CRONO_HANDOFF_HEADER;
+
+/**
+ * Sent for each buffer after the header, followed by its `pages` pages.
+ */
+typedef struct {
+        uint64_t memfd_offset;
+        int32_t id;
+        uint32_t pages;
+} CRONO_HANDOFF_BUFFER_RECORD;
+
+/**
+ * Control message buffer large enough for all file descriptors.
+ */
+typedef union {
+        char buf[CMSG_SPACE(sizeof(int) *
+                            (1 + CRONO_KERNEL_HANDOFF_MAX_BUFFERS))];
+        struct cmsghdr align;
+} CRONO_HANDOFF_CMSG;
+
+static int crono_handoff_send_all(int sock, const void *data, size_t size) {
+        const uint8_t *bytes = (const uint8_t *)data;
+
+        while (size > 0) {
+                ssize_t sent = send(sock, bytes, size, MSG_NOSIGNAL);
+                if (sent < 0) {
+                        if (EINTR == errno) {
+                                continue;
+                        }
+                        return errno;
+                }
+                bytes += sent;
+                size -= sent;
+        }
+        return CRONO_SUCCESS;
+}
+
+static int crono_handoff_recv_all(int sock, void *data, size_t size) {
+        uint8_t *bytes = (uint8_t *)data;
+
+        while (size > 0) {
+                ssize_t received = recv(sock, bytes, size, MSG_WAITALL);
+                if (received < 0) {
+                        if (EINTR == errno) {
+                                continue;
+                        }
+                        return errno;
+                }
+                if (0 == received) {
+                        return -ECONNRESET;
+                }
+                bytes += received;
+                size -= received;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_AllocMemfdBuffer(const char *name,
+                                                        size_t size,
+                                                        void **ppBuf,
+                                                        int *pMemfd) {
+        void *pBuf;
+        int memfd;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(ppBuf);
+        CRONO_RET_INV_PARAM_IF_NULL(pMemfd);
+        CRONO_RET_INV_PARAM_IF_ZERO(size);
+        *ppBuf = NULL;
+        *pMemfd = -1;
+        size = (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+        memfd = memfd_create(name ? name : "crono_buffer", MFD_CLOEXEC);
+        if (memfd < 0) {
+                return errno;
+        }
+        if (0 != ftruncate(memfd, size)) {
+                ret = errno;
+                close(memfd);
+                return ret;
+        }
+        pBuf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (MAP_FAILED == pBuf) {
+                ret = errno;
+                close(memfd);
+                return ret;
+        }
+
+        *ppBuf = pBuf;
+        *pMemfd = memfd;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_FreeMemfdBuffer(void *pBuf, size_t size,
+                                                       int memfd) {
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+
+        size = (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+        if (0 != munmap(pBuf, size)) {
+                return errno;
+        }
+        close(memfd);
+        return CRONO_SUCCESS;
+}
+
+// ___________
+// Predecessor
+//
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DeviceExport(CRONO_KERNEL_DEVICE_HANDLE hDev, int sock,
+                          const CRONO_KERNEL_HANDOFF_BUFFER *pBuffers,
+                          uint32_t count) {
+        CRONO_HANDOFF_HEADER header;
+        CRONO_HANDOFF_CMSG control;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        int fds[1 + CRONO_KERNEL_HANDOFF_MAX_BUFFERS];
+        ssize_t sent;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        if (count > CRONO_KERNEL_HANDOFF_MAX_BUFFERS ||
+            (count > 0 && NULL == pBuffers)) {
+                return -EINVAL;
+        }
+        if (pDevice->miscdev_fd <= 0) {
+                printf("Error: CRONO_KERNEL_PciDeviceOpen must be called "
+                       "before calling CRONO_KERNEL_DeviceExport()\n");
+                return -ENOENT;
+        }
+        for (uint32_t ibuf = 0; ibuf < count; ibuf++) {
+                const CRONO_KERNEL_HANDOFF_BUFFER *buffer = &pBuffers[ibuf];
+                struct stat st;
+
+                CRONO_RET_INV_PARAM_IF_NULL(buffer->pDma);
+                if ((uint64_t)buffer->pDma->pUserAddr % PAGE_SIZE ||
+                    buffer->memfdOffset % PAGE_SIZE) {
+                        return -EINVAL;
+                }
+                if (0 != fstat(buffer->memfd, &st)) {
+                        return errno;
+                }
+                if ((uint64_t)st.st_size <
+                    buffer->memfdOffset +
+                        (uint64_t)buffer->pDma->dwPages * PAGE_SIZE) {
+                        printf("Error: buffer <%u> exceeds its memfd\n", ibuf);
+                        return -EINVAL;
+                }
+                fds[1 + ibuf] = buffer->memfd;
+        }
+        fds[0] = pDevice->miscdev_fd;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CRONO_HANDOFF_MAGIC, sizeof(header.magic));
+        header.version = CRONO_KERNEL_HANDOFF_VERSION;
+        header.buffer_count = count;
+        header.slot = pDevice->pciSlot;
+        header.vendor_id = pDevice->dwVendorId;
+        header.device_id = pDevice->dwDeviceId;
+        memcpy(header.miscdev_name, pDevice->miscdev_name,
+               sizeof(header.miscdev_name));
+        memcpy(header.bar_descs, pDevice->bar_descs,
+               sizeof(header.bar_descs));
+        header.bar_count = pDevice->bar_count;
+
+        // Send the header with the file descriptors
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        iov.iov_base = &header;
+        iov.iov_len = sizeof(header);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (1 + count));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (1 + count));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (1 + count));
+        do {
+                sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (sent < 0 && EINTR == errno);
+        if (sent < 0) {
+                ret = errno;
+                printf("Error sending device <%s>: <%d> <%s>\n",
+                       pDevice->miscdev_name, ret, strerror(ret));
+                return ret;
+        }
+        ret = crono_handoff_send_all(sock, (uint8_t *)&header + sent,
+                                     sizeof(header) - sent);
+
+        // Send the buffer records and pages
+        for (uint32_t ibuf = 0; ibuf < count && CRONO_SUCCESS == ret;
+             ibuf++) {
+                const CRONO_KERNEL_DMA_SG *pDma = pBuffers[ibuf].pDma;
+                CRONO_HANDOFF_BUFFER_RECORD record;
+
+                memset(&record, 0, sizeof(record));
+                record.memfd_offset = pBuffers[ibuf].memfdOffset;
+                record.id = pDma->id;
+                record.pages = pDma->dwPages;
+                ret = crono_handoff_send_all(sock, &record, sizeof(record));
+                if (CRONO_SUCCESS == ret) {
+                        ret = crono_handoff_send_all(
+                            sock, pDma->Page,
+                            sizeof(CRONO_KERNEL_DMA_PAGE) * pDma->dwPages);
+                }
+        }
+        if (CRONO_SUCCESS != ret) {
+                printf("Error sending device <%s> buffers: <%d>\n",
+                       pDevice->miscdev_name, ret);
+                return ret;
+        }
+        CRONO_DEBUG("Device <%s> is exported with <%u> buffers.\n",
+                    pDevice->miscdev_name, count);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DeviceExportRelease(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                 const CRONO_KERNEL_HANDOFF_BUFFER *pBuffers,
+                                 uint32_t count) {
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        if (count > 0 && NULL == pBuffers) {
+                return -EINVAL;
+        }
+
+        // Forget the buffers as `CRONO_KERNEL_DMASGBufUnlock` does, without
+        // the ioctl
+        for (uint32_t ibuf = 0; ibuf < count; ibuf++) {
+                CRONO_KERNEL_DMA_SG *pDma = pBuffers[ibuf].pDma;
+
+                if (NULL == pDma) {
+                        continue;
+                }
+                crono_pinned_unregister(pDevice, pDma->pUserAddr);
+                crono_sg_index_remove(pDevice, pDma);
+                free(pDma->Page);
+                free(pDma);
+        }
+
+        // The successor holds the miscdev file, so the kernel module keeps
+        // the buffers locked
+        return CRONO_KERNEL_PciDeviceClose(hDev);
+}
+
+// _________
+// Successor
+//
+/**
+ * Unmaps the BARs and frees a device not added to the open devices.
+ */
+static void crono_handoff_free_device(PCRONO_KERNEL_DEVICE pDevice) {
+        for (uint32_t ibar = 0; ibar < pDevice->bar_count; ibar++) {
+                if (pDevice->bar_descs[ibar].userAddress) {
+                        munmap((void *)pDevice->bar_descs[ibar].userAddress,
+                               pDevice->bar_descs[ibar].length);
+                }
+        }
+        close(pDevice->miscdev_fd);
+        free(pDevice);
+}
+
+/**
+ * Receives a buffer record and its pages, and maps the buffer from `memfd`.
+ */
+static int crono_handoff_import_buffer(PCRONO_KERNEL_DEVICE pDevice, int sock,
+                                       int memfd,
+                                       CRONO_KERNEL_HANDOFF_BUFFER *pBuffer) {
+        CRONO_HANDOFF_BUFFER_RECORD record;
+        CRONO_KERNEL_DMA_SG *pDma;
+        size_t size;
+        int ret;
+
+        ret = crono_handoff_recv_all(sock, &record, sizeof(record));
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        pDma = (CRONO_KERNEL_DMA_SG *)calloc(1, sizeof(CRONO_KERNEL_DMA_SG));
+        CRONO_RET_ERR_CODE_IF_NULL(pDma, -ENOMEM);
+        pDma->id = record.id;
+        pDma->dwPages = record.pages;
+        pDma->Page = (CRONO_KERNEL_DMA_PAGE *)malloc(
+            sizeof(CRONO_KERNEL_DMA_PAGE) * record.pages);
+        if (NULL == pDma->Page) {
+                free(pDma);
+                return -ENOMEM;
+        }
+        ret = crono_handoff_recv_all(sock, pDma->Page,
+                                     sizeof(CRONO_KERNEL_DMA_PAGE) *
+                                         record.pages);
+        if (CRONO_SUCCESS != ret) {
+                free(pDma->Page);
+                free(pDma);
+                return ret;
+        }
+
+        size = (size_t)record.pages * PAGE_SIZE;
+        ret = crono_pinned_reserve(size);
+        if (CRONO_SUCCESS != ret) {
+                free(pDma->Page);
+                free(pDma);
+                return ret;
+        }
+        pDma->pUserAddr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                               memfd, record.memfd_offset);
+        if (MAP_FAILED == pDma->pUserAddr) {
+                ret = errno;
+                printf("Error mapping buffer id <%d>: <%d> <%s>\n", record.id,
+                       ret, strerror(ret));
+                crono_pinned_unreserve(size);
+                free(pDma->Page);
+                free(pDma);
+                return ret;
+        }
+        crono_pinned_register(pDevice, pDma->pUserAddr, size);
+        ret = crono_sg_index_add(pDevice, pDma);
+        if (CRONO_SUCCESS != ret) {
+                crono_pinned_unregister(pDevice, pDma->pUserAddr);
+                munmap(pDma->pUserAddr, size);
+                free(pDma->Page);
+                free(pDma);
+                return ret;
+        }
+
+        pBuffer->pDma = pDma;
+        pBuffer->memfd = memfd;
+        pBuffer->memfdOffset = record.memfd_offset;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_DeviceImport(int sock, CRONO_KERNEL_DEVICE_HANDLE *phDev,
+                          CRONO_KERNEL_HANDOFF_BUFFER *pBuffers,
+                          uint32_t maxCount, uint32_t *pCount) {
+        PCRONO_KERNEL_DEVICE pDevice = NULL;
+        CRONO_HANDOFF_HEADER header;
+        CRONO_HANDOFF_CMSG control;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        int fds[1 + CRONO_KERNEL_HANDOFF_MAX_BUFFERS];
+        uint32_t fd_count = 0;
+        uint32_t imported = 0;
+        ssize_t received;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(phDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pCount);
+        if (maxCount > 0 && NULL == pBuffers) {
+                return -EINVAL;
+        }
+        *phDev = NULL;
+        *pCount = 0;
+
+        // Receive the header with the file descriptors
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &header;
+        iov.iov_len = sizeof(header);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        do {
+                received = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        } while (received < 0 && EINTR == errno);
+        if (received < 0) {
+                return errno;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (SOL_SOCKET == cmsg->cmsg_level &&
+                    SCM_RIGHTS == cmsg->cmsg_type) {
+                        fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fd_count);
+                        break;
+                }
+        }
+        ret = 0 == received ? -ECONNRESET
+                            : crono_handoff_recv_all(
+                                  sock, (uint8_t *)&header + received,
+                                  sizeof(header) - received);
+        if (CRONO_SUCCESS != ret) {
+                goto fds_error;
+        }
+        if ((msg.msg_flags & MSG_CTRUNC) ||
+            0 != memcmp(header.magic, CRONO_HANDOFF_MAGIC,
+                        sizeof(header.magic)) ||
+            CRONO_KERNEL_HANDOFF_VERSION != header.version ||
+            header.buffer_count > CRONO_KERNEL_HANDOFF_MAX_BUFFERS ||
+            fd_count != 1 + header.buffer_count) {
+                printf("Error: invalid device hand-off message\n");
+                ret = CRONO_KERNEL_DATA_MISMATCH;
+                goto fds_error;
+        }
+        if (header.buffer_count > maxCount) {
+                ret = -ENOBUFS;
+                goto fds_error;
+        }
+
+        // Set up the device as `CRONO_KERNEL_PciDeviceOpen` does, on the
+        // received miscdev file
+        pDevice = (PCRONO_KERNEL_DEVICE)calloc(1, sizeof(CRONO_KERNEL_DEVICE));
+        if (NULL == pDevice) {
+                ret = -ENOMEM;
+                goto fds_error;
+        }
+        pDevice->pciSlot = header.slot;
+        pDevice->dwVendorId = header.vendor_id;
+        pDevice->dwDeviceId = header.device_id;
+        memcpy(pDevice->miscdev_name, header.miscdev_name,
+               sizeof(pDevice->miscdev_name));
+        pDevice->miscdev_name[sizeof(pDevice->miscdev_name) - 1] = '\0';
+        pDevice->miscdev_fd = fds[0];
+        pDevice->event_fd = fds[0];
+        ret = crono_event_fd_init(pDevice->event_fd);
+        if (CRONO_SUCCESS != ret) {
+                free(pDevice);
+                goto fds_error;
+        }
+        ret = fill_device_bar_descriptions(pDevice);
+        if (CRONO_SUCCESS != ret) {
+                free(pDevice);
+                goto fds_error;
+        }
+        // Mappings are per process, the BARs must still be the same
+        for (uint32_t ibar = 0; ibar < 6; ibar++) {
+                if (pDevice->bar_count != header.bar_count ||
+                    pDevice->bar_descs[ibar].barNum !=
+                        header.bar_descs[ibar].barNum ||
+                    pDevice->bar_descs[ibar].physicalAddress !=
+                        header.bar_descs[ibar].physicalAddress ||
+                    pDevice->bar_descs[ibar].length !=
+                        header.bar_descs[ibar].length) {
+                        printf("Error: BARs of device <%s> changed\n",
+                               pDevice->miscdev_name);
+                        crono_handoff_free_device(pDevice);
+                        fds[0] = -1;
+                        ret = CRONO_KERNEL_DATA_MISMATCH;
+                        goto fds_error;
+                }
+        }
+        fill_device_numa_info(pDevice);
+        ret = crono_add_open_device(pDevice);
+        if (CRONO_SUCCESS != ret) {
+                crono_handoff_free_device(pDevice);
+                fds[0] = -1;
+                goto fds_error;
+        }
+        fds[0] = -1; // Owned by the device
+
+        // Map the buffers, their memfds are owned by the caller
+        for (; imported < header.buffer_count; imported++) {
+                ret = crono_handoff_import_buffer(pDevice, sock,
+                                                  fds[1 + imported],
+                                                  &pBuffers[imported]);
+                if (CRONO_SUCCESS != ret) {
+                        goto buffers_error;
+                }
+                fds[1 + imported] = -1;
+        }
+
+        CRONO_DEBUG("Device <%s> is imported with <%u> buffers.\n",
+                    pDevice->miscdev_name, imported);
+        *phDev = pDevice;
+        *pCount = imported;
+        return CRONO_SUCCESS;
+
+buffers_error:
+        for (uint32_t ibuf = 0; ibuf < imported; ibuf++) {
+                CRONO_KERNEL_DMA_SG *pDma = pBuffers[ibuf].pDma;
+
+                crono_pinned_unregister(pDevice, pDma->pUserAddr);
+                crono_sg_index_remove(pDevice, pDma);
+                munmap(pDma->pUserAddr, (size_t)pDma->dwPages * PAGE_SIZE);
+                close(pBuffers[ibuf].memfd);
+                free(pDma->Page);
+                free(pDma);
+                pBuffers[ibuf].pDma = NULL;
+        }
+        CRONO_KERNEL_PciDeviceClose(pDevice);
+fds_error:
+        for (uint32_t ifd = 0; ifd < fd_count; ifd++) {
+                if (fds[ifd] >= 0) {
+                        close(fds[ifd]);
+                }
+        }
+        return ret;
+}
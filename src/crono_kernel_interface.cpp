@@ -1,19 +1,11 @@
 #include "crono_kernel_interface.h"
 #include "crono_kernel_private.h"
 #include "crono_linux_kernel.h"
+#include "crono_trace.h"
 #include "crono_userspace.h"
-
-/**
- * Defines `pDevice` and `pDev_handle`, and initialize them from `hDev`
- * Returns `EINVAL` if hDev is NULL
- */
-#define CRONO_INIT_HDEV_FUNC(hDev)                                             \
-        PCRONO_KERNEL_DEVICE pDevice;                                          \
-        CRONO_RET_ERR_CODE_IF_NULL(hDev, -EINVAL);                             \
-        pDevice = (PCRONO_KERNEL_DEVICE)hDev;                                  \
-        if (0 == pDevice->dwDeviceId) {                                        \
-                return -EINVAL;                                                \
-        }
+#include <linux/pci_regs.h>
+#include <mutex>
+#include <vector>
 
 /**
  * Validates that both `dwOffset` and `val` size are within the memory range.
@@ -21,13 +13,96 @@
  * Is part of the functions in this file, a prerequisite to have all used
  * variables defined and initialized in the functions. Applies only on BAR0
  */
-#define CRONO_VALIDATE_MEM_RANGE                                               \
-        if ((dwOffset + sizeof(val)) > pDevice->bar_descs[0].length) {         \
+#define CRONO_VALIDATE_MEM_RANGE(size)                                         \
+        if (0 == pDevice->bar_descs[0].userAddress ||                          \
+            (dwOffset + (size)) > pDevice->bar_descs[0].length) {              \
                 return -ENOMEM;                                                \
         }
 
 PCRONO_KERNEL_DEVICE devices[8];
-int iNewDev = 0; // New device index in `devices`
+int iNewDev = 0; // Count of used and freed slots in `devices`
+#define CRONO_MAX_OPEN_DEVICES (int)(sizeof(devices) / sizeof(devices[0]))
+
+/**
+ * Guards `devices`, `iNewDev`, and `CRONO_KERNEL_DEVICE::ref_count`, held for
+ * the whole open or close, so concurrent opens of a slot open it once.
+ */
+static std::mutex devices_mutex;
+
+/**
+ * Finds the open device of the slot in `devices`. `devices_mutex` must be held.
+ *
+ * @return The device, or NULL if the slot is not open.
+ */
+static PCRONO_KERNEL_DEVICE
+crono_find_open_device(const CRONO_KERNEL_PCI_SLOT *pSlot) {
+        for (int iDev = 0; iDev < iNewDev; iDev++) {
+                PCRONO_KERNEL_DEVICE pDevice = devices[iDev];
+
+                if (pDevice != nullptr && pDevice->ref_count > 0 &&
+                    pDevice->pciSlot.dwDomain == pSlot->dwDomain &&
+                    pDevice->pciSlot.dwBus == pSlot->dwBus &&
+                    pDevice->pciSlot.dwSlot == pSlot->dwSlot &&
+                    pDevice->pciSlot.dwFunction == pSlot->dwFunction) {
+                        return pDevice;
+                }
+        }
+        return nullptr;
+}
+
+/**
+ * Finds the first free slot in `devices`, so slots of closed devices are
+ * reused before `iNewDev` grows. `devices_mutex` must be held.
+ *
+ * @return The slot index, or -1 if all slots are in use.
+ */
+static int crono_find_free_slot() {
+        for (int iDev = 0; iDev < iNewDev; iDev++) {
+                if (devices[iDev] == nullptr) {
+                        return iDev;
+                }
+        }
+        if (iNewDev < CRONO_MAX_OPEN_DEVICES) {
+                return iNewDev;
+        }
+        return -1;
+}
+
+/**
+ * Sets slot `iDev` of `devices`, found by `crono_find_free_slot`, to
+ * `pDevice`, or frees it if `pDevice` is nullptr. `devices_mutex` must be
+ * held.
+ */
+static void crono_set_device_slot(int iDev, PCRONO_KERNEL_DEVICE pDevice) {
+        devices[iDev] = pDevice;
+        if (iDev == iNewDev) {
+                iNewDev++;
+        }
+        // Shrink array for null elements at the end if found
+        while (iNewDev > 0 && devices[iNewDev - 1] == nullptr) {
+                iNewDev--;
+        }
+}
+
+uint32_t crono_add_open_device(PCRONO_KERNEL_DEVICE pDevice) {
+        int iDev;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pDevice);
+
+        std::lock_guard<std::mutex> lock(devices_mutex);
+        if (crono_find_open_device(&pDevice->pciSlot) != nullptr) {
+                return -EBUSY;
+        }
+        iDev = crono_find_free_slot();
+        if (iDev < 0) {
+                printf("Error: more than <%d> devices are open\n",
+                       CRONO_MAX_OPEN_DEVICES);
+                return -ENOMEM;
+        }
+        pDevice->ref_count = 1;
+        crono_set_device_slot(iDev, pDevice);
+        return CRONO_SUCCESS;
+}
 
 uint32_t
 CRONO_KERNEL_PciScanDevices(uint32_t dwVendorId, uint32_t dwDeviceId,
@@ -38,6 +113,9 @@ CRONO_KERNEL_PciScanDevices(uint32_t dwVendorId, uint32_t dwDeviceId,
         unsigned domain, bus, dev, func;
         uint16_t vendor_id, device_id;
         int index_in_result = 0;
+        std::vector<CRONO_CONFIG_READ> reads;
+        std::vector<uint32_t> vendor_device_vals;
+        std::vector<std::string> names;
 
         // Don't freeDevicesMem() as devices may be counted again
         // while a device is already open for any reason.
@@ -64,14 +142,38 @@ CRONO_KERNEL_PciScanDevices(uint32_t dwVendorId, uint32_t dwDeviceId,
                 sscanf(en->d_name, "%x:%02x:%02x.%1u", &domain, &bus, &dev,
                        &func);
 
-                // Get Vendor ID and Device ID
-                int ret = crono_read_vendor_device(domain, bus, dev, func,
-                                                   &vendor_id, &device_id);
-                if (CRONO_SUCCESS != ret) {
+                // Vendor ID and Device ID are read for all devices at once
+                CRONO_CONFIG_READ read;
+                memset(&read, 0, sizeof(read));
+                read.domain = domain;
+                read.bus = bus;
+                read.dev = dev;
+                read.func = func;
+                read.offset = 0;
+                read.size = 4;
+                reads.push_back(read);
+                names.push_back(en->d_name);
+        }
+
+        // Clean up
+        closedir(dr);
+
+        // Get Vendor ID and Device ID together, offset:0, of 4-bytes length
+        vendor_device_vals.resize(reads.size());
+        for (size_t idev = 0; idev < reads.size(); idev++) {
+                reads[idev].data = &vendor_device_vals[idev];
+        }
+        crono_read_config_batch(reads.data(), reads.size());
+
+        pPciScanResult->dwNumDevices = 0;
+        for (size_t idev = 0; idev < reads.size(); idev++) {
+                if ((reads[idev].bytes_read != 4) || reads[idev].err) {
                         CRONO_DEBUG("Warning could not read vendor for %s\n",
-                                    en->d_name);
+                                    names[idev].c_str());
                         continue;
                 }
+                vendor_id = (uint16_t)(vendor_device_vals[idev] & 0xFFFF);
+                device_id = (uint16_t)(vendor_device_vals[idev] >> 16);
 
                 // Check values & fill pPciScanResult if device matches the
                 // Vendor/Device
@@ -79,28 +181,32 @@ CRONO_KERNEL_PciScanDevices(uint32_t dwVendorId, uint32_t dwDeviceId,
                      (((uint32_t)PCI_ANY_ID) == dwVendorId)) &&
                     ((device_id == dwDeviceId) ||
                      (((uint32_t)PCI_ANY_ID) == dwDeviceId))) {
+                        if (index_in_result >= CRONO_KERNEL_PCI_CARDS) {
+                                printf("Warning: more than <%d> devices "
+                                       "matched, ignoring <%s>\n",
+                                       CRONO_KERNEL_PCI_CARDS,
+                                       names[idev].c_str());
+                                continue;
+                        }
                         pPciScanResult->deviceId[index_in_result].dwDeviceId =
                             device_id;
                         pPciScanResult->deviceId[index_in_result].dwVendorId =
                             vendor_id;
                         pPciScanResult->deviceSlot[index_in_result].dwDomain =
-                            domain;
-                        pPciScanResult->deviceSlot[index_in_result].dwBus = bus;
+                            reads[idev].domain;
+                        pPciScanResult->deviceSlot[index_in_result].dwBus =
+                            reads[idev].bus;
                         pPciScanResult->deviceSlot[index_in_result].dwSlot =
-                            dev;
+                            reads[idev].dev;
                         pPciScanResult->deviceSlot[index_in_result].dwFunction =
-                            func;
+                            reads[idev].func;
                         index_in_result++;
                         pPciScanResult->dwNumDevices = index_in_result;
                         CRONO_DEBUG("Added matched device in index <%d>\n",
                                     index_in_result - 1);
-                } else {
                 }
         }
 
-        // Clean up
-        closedir(dr);
-
         // Successfully scanned
         return CRONO_SUCCESS;
 }
@@ -120,6 +226,7 @@ CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
         struct dirent *en;
         unsigned domain, bus, dev, func;
         int ret;
+        int iDev;
         PCRONO_KERNEL_DEVICE pDevice = nullptr;
 
         // Init variables and validate parameters
@@ -127,6 +234,23 @@ CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
         CRONO_RET_INV_PARAM_IF_NULL(pDeviceInfo);
         *phDev = NULL;
 
+        // Share the device if the slot is already open in the process
+        std::lock_guard<std::mutex> lock(devices_mutex);
+        pDevice = crono_find_open_device(&pDeviceInfo->pciSlot);
+        if (pDevice != nullptr) {
+                pDevice->ref_count++;
+                CRONO_DEBUG("Device <%s> is shared, references <%u>.\n",
+                            pDevice->miscdev_name, pDevice->ref_count);
+                *phDev = pDevice;
+                return CRONO_SUCCESS;
+        }
+        iDev = crono_find_free_slot();
+        if (iDev < 0) {
+                printf("Error: more than <%d> devices are open\n",
+                       CRONO_MAX_OPEN_DEVICES);
+                return -ENOMEM;
+        }
+
         dr = opendir(SYS_BUS_PCIDEVS_PATH); // open all or present directory
         if (!dr) {
                 perror("Error: opening PCI directory");
@@ -151,7 +275,7 @@ CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
                         pDevice = (PCRONO_KERNEL_DEVICE)malloc(
                             sizeof(CRONO_KERNEL_DEVICE));
                         // Save value if a later cleanup is needed
-                        devices[iNewDev++] = pDevice;
+                        crono_set_device_slot(iDev, pDevice);
 
                         // Initialize struct elements to zeros
                         memset(pDevice, 0, sizeof(CRONO_KERNEL_DEVICE));
@@ -194,7 +318,9 @@ CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
                         }
 
                         // Open the miscellanous driver file
-                        int miscdev_fd = open(miscdev_path, O_RDWR);
+                        // Non-blocking, as it is the event file descriptor
+                        int miscdev_fd =
+                            open(miscdev_path, O_RDWR | O_NONBLOCK);
                         if (miscdev_fd <= 0) {
                                 // Error opening the device
                                 switch (errno) {
@@ -222,6 +348,8 @@ CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
 
                         // Success
                         pDevice->miscdev_fd = miscdev_fd;
+                        pDevice->event_fd = miscdev_fd;
+                        pDevice->ref_count = 1;
                         CRONO_DEBUG("Device <%s> is opened as <%d>.\n",
                                     pDevice->miscdev_name, pDevice->miscdev_fd);
                         // Set phDev
@@ -236,6 +364,9 @@ CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
                                 goto device_error;
                         }
 
+                        // Set NUMA placement information, not fatal if missing
+                        fill_device_numa_info(pDevice);
+
                         break; // Device is found and set, no further search is
                                // needed
                 }
@@ -247,7 +378,7 @@ CRONO_KERNEL_PciDeviceOpen(CRONO_KERNEL_DEVICE_HANDLE *phDev,
         // Successfully scanned
         return CRONO_SUCCESS;
 
-// Called after `iNewDev` is incremented with the new device
+// Called after the new device is set to slot `iDev`
 device_error:
         if (dr) {
                 closedir(dr);
@@ -255,7 +386,7 @@ device_error:
         if (pDevice != nullptr) {
                 free(pDevice);
         }
-        iNewDev--; // Device freed, drop it from `devices`
+        crono_set_device_slot(iDev, nullptr); // Device freed, drop it
         return ret;
 }
 
@@ -264,6 +395,17 @@ uint32_t CRONO_KERNEL_PciDeviceClose(CRONO_KERNEL_DEVICE_HANDLE hDev) {
         int ret = CRONO_SUCCESS;
         CRONO_INIT_HDEV_FUNC(hDev);
 
+        // Keep the device open while other references exist
+        std::lock_guard<std::mutex> lock(devices_mutex);
+        if (0 == pDevice->ref_count) {
+                return -EINVAL;
+        }
+        if (--pDevice->ref_count > 0) {
+                CRONO_DEBUG("Device <%s> is still referenced <%u> times.\n",
+                            pDevice->miscdev_name, pDevice->ref_count);
+                return CRONO_SUCCESS;
+        }
+
         // Close the device
         if (-1 == close(pDevice->miscdev_fd)) {
                 // Error
@@ -290,119 +432,105 @@ Set card cleanup commands
 uint32_t CRONO_KERNEL_CardCleanupSetup(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                        CRONO_KERNEL_CMD *Cmd,
                                        uint32_t dwCmdCount) {
-        int ret = CRONO_SUCCESS;
-        CRONO_KERNEL_CMDS_INFO cmds_info;
-
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
-        if (pDevice->miscdev_fd <= 0) {
-                printf("Error: CRONO_KERNEL_PciDeviceOpen must be called "
-                       "before calling "
-                       "CRONO_KERNEL_CardCleanupSetup()\n");
-                return -ENOENT;
+        if (dwCmdCount > 0) {
+                CRONO_RET_INV_PARAM_IF_NULL(Cmd);
         }
 
-        cmds_info.cmds =
-            (CRONO_KERNEL_CMD *)calloc(dwCmdCount, sizeof(CRONO_KERNEL_CMD));
-        for (uint32_t i = 0; i < dwCmdCount; i++) {
-                cmds_info.cmds[i].addr = Cmd[i].addr;
-                cmds_info.cmds[i].data = Cmd[i].data;
-        }
-        cmds_info.ucmds = (uint64_t)cmds_info.cmds;
-        cmds_info.count = dwCmdCount;
-
-        // Call ioctl
-        ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_CLEANUP_SETUP, &cmds_info);
-
-        // Cleanup and return
-        free(cmds_info.cmds);
-        return ret;
+        // The driver copies the commands, they are passed as is
+        return crono_cmd_buffer_cleanup_setup(pDevice, Cmd, dwCmdCount, 0, 0);
 }
 
 uint32_t CRONO_KERNEL_PciReadCfg32(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                    uint32_t dwOffset, uint32_t *val) {
-        pciaddr_t bytes_read;
-        int ret = CRONO_SUCCESS;
-        pciaddr_t config_space_size = 0;
-
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
         CRONO_RET_INV_PARAM_IF_NULL(val);
 
-        // Validate offset and data size are within configuration spcae size
-        ret = crono_get_config_space_size(
-            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
-            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction,
-            &config_space_size);
-        if (CRONO_SUCCESS != ret) {
-                return ret;
-        }
-        if (config_space_size < (dwOffset + sizeof(*val))) {
-                return -EINVAL;
-        }
-
-        // Read the configurtion
-        ret = crono_read_config(pDevice->pciSlot.dwDomain,
-                                pDevice->pciSlot.dwBus, pDevice->pciSlot.dwSlot,
-                                pDevice->pciSlot.dwFunction, val, dwOffset,
-                                sizeof(*val), &bytes_read);
-        if ((bytes_read != 4) || ret) {
-                return ret;
-        }
-
-        // Success
-        return CRONO_SUCCESS;
+        // Read the configuration, from its shadow unless volatile
+        return crono_config_read(pDevice, dwOffset, val, sizeof(*val));
 }
 
 uint32_t CRONO_KERNEL_PciWriteCfg32(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                     uint32_t dwOffset, uint32_t val) {
-        pciaddr_t bytes_written;
-        int ret = CRONO_SUCCESS;
-        pciaddr_t config_space_size = 0;
-
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
 
-        // Validate offset and data size are within configuration spcae size
-        ret = crono_get_config_space_size(
-            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
-            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction,
-            &config_space_size);
-        if (CRONO_SUCCESS != ret) {
-                return ret;
+        // Write the configuration
+        return crono_config_write(pDevice, dwOffset, &val, sizeof(val));
+}
+
+/**
+ * Reads `*val` at `addr`, `offset` of BAR `barNum`, validated by the caller.
+ * Registers held by the register shadow are read from the shadow, without
+ * accessing the device, so such reads are not traced.
+ */
+template <typename T>
+static inline uint32_t crono_bar_load(PCRONO_KERNEL_DEVICE pDevice,
+                                      uint32_t barNum, uint64_t offset,
+                                      const uint8_t *addr, T *val) {
+        struct CRONO_REG_SHADOW *shadow =
+            __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+        int ret;
+
+        if (NULL != shadow) {
+                ret = crono_reg_shadow_read(shadow, barNum, offset, val,
+                                            sizeof(T));
+                if (-ENOENT != ret) {
+                        return ret;
+                }
         }
-        if (config_space_size < (dwOffset + sizeof(val))) {
-                return -EINVAL;
+        CRONO_TRACE_BEGIN(pDevice);
+        *val = *(const volatile T *)addr;
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_READ, barNum, offset, sizeof(T),
+                        *val, NULL, CRONO_SUCCESS);
+        if (NULL != shadow) {
+                crono_reg_shadow_fill(shadow, barNum, offset, val, sizeof(T));
         }
+        return CRONO_SUCCESS;
+}
 
-        // Write the configuration
-        ret = crono_write_config(
-            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
-            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction, &val,
-            dwOffset, sizeof(val), &bytes_written);
-        if ((bytes_written != 4) || ret) {
-                return ret;
+/**
+ * Writes `val` at `addr`, `offset` of BAR `barNum`, validated by the caller.
+ * Registers held by the register shadow are updated, and the write is elided
+ * if they already hold `val`. Elided writes are not traced.
+ */
+template <typename T>
+static inline uint32_t crono_bar_store(PCRONO_KERNEL_DEVICE pDevice,
+                                       uint32_t barNum, uint64_t offset,
+                                       uint8_t *addr, T val) {
+        struct CRONO_REG_SHADOW *shadow =
+            __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+
+        if (NULL != shadow && crono_reg_shadow_write(shadow, barNum, offset,
+                                                     &val, sizeof(T))) {
+                return CRONO_SUCCESS;
         }
-
-        // Success
+        CRONO_TRACE_BEGIN(pDevice);
+        *(volatile T *)addr = val;
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_WRITE, barNum, offset,
+                        sizeof(T), val, NULL, CRONO_SUCCESS);
         return CRONO_SUCCESS;
 }
 
+/**
+ * Address and number of BAR0 of the BAR descriptions, accessed by
+ * `CRONO_KERNEL_ReadAddrXX` and `CRONO_KERNEL_WriteAddrXX`.
+ */
+#define CRONO_BAR0_ADDR                                                        \
+        ((uint8_t *)(pDevice->bar_descs[0].userAddress) + dwOffset)
+#define CRONO_BAR0_NUM pDevice->bar_descs[0].barNum
+
 uint32_t CRONO_KERNEL_ReadAddr8(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                 uint32_t dwOffset, uint8_t *val) {
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
         CRONO_RET_ERR_CODE_IF_NULL(val, -ENOMEM);
-        CRONO_VALIDATE_MEM_RANGE;
-
-        // Copy memory
-        *val =
-            *((volatile unsigned char
-                   *)(((unsigned char *)(pDevice->bar_descs[0].userAddress)) +
-                      dwOffset));
+        CRONO_VALIDATE_MEM_RANGE(sizeof(*val));
 
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_load(pDevice, CRONO_BAR0_NUM, dwOffset,
+                              CRONO_BAR0_ADDR, val);
 }
 
 uint32_t CRONO_KERNEL_ReadAddr16(CRONO_KERNEL_DEVICE_HANDLE hDev,
@@ -410,16 +538,10 @@ uint32_t CRONO_KERNEL_ReadAddr16(CRONO_KERNEL_DEVICE_HANDLE hDev,
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
         CRONO_RET_ERR_CODE_IF_NULL(val, -ENOMEM);
-        CRONO_VALIDATE_MEM_RANGE;
-
-        // Copy memory
-        *val =
-            *((volatile unsigned short
-                   *)(((unsigned char *)(pDevice->bar_descs[0].userAddress)) +
-                      dwOffset));
+        CRONO_VALIDATE_MEM_RANGE(sizeof(*val));
 
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_load(pDevice, CRONO_BAR0_NUM, dwOffset,
+                              CRONO_BAR0_ADDR, val);
 }
 
 uint32_t CRONO_KERNEL_ReadAddr32(CRONO_KERNEL_DEVICE_HANDLE hDev,
@@ -427,14 +549,10 @@ uint32_t CRONO_KERNEL_ReadAddr32(CRONO_KERNEL_DEVICE_HANDLE hDev,
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
         CRONO_RET_ERR_CODE_IF_NULL(val, -ENOMEM);
-        CRONO_VALIDATE_MEM_RANGE;
+        CRONO_VALIDATE_MEM_RANGE(sizeof(*val));
 
-        *val = *((volatile uint32_t *)(((unsigned char *)(pDevice->bar_descs[0]
-                                                              .userAddress)) +
-                                       dwOffset));
-
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_load(pDevice, CRONO_BAR0_NUM, dwOffset,
+                              CRONO_BAR0_ADDR, val);
 }
 
 uint32_t CRONO_KERNEL_ReadAddr64(CRONO_KERNEL_DEVICE_HANDLE hDev,
@@ -442,75 +560,56 @@ uint32_t CRONO_KERNEL_ReadAddr64(CRONO_KERNEL_DEVICE_HANDLE hDev,
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
         CRONO_RET_ERR_CODE_IF_NULL(val, -ENOMEM);
-        CRONO_VALIDATE_MEM_RANGE;
+        CRONO_VALIDATE_MEM_RANGE(sizeof(*val));
 
-        // Copy memory
-        *val = *((volatile uint64_t *)(((unsigned char *)(pDevice->bar_descs[0]
-                                                              .userAddress)) +
-                                       dwOffset));
-
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_load(pDevice, CRONO_BAR0_NUM, dwOffset,
+                              CRONO_BAR0_ADDR, val);
 }
 
 uint32_t CRONO_KERNEL_WriteAddr8(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                  uint32_t dwOffset, unsigned char val) {
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
-        CRONO_VALIDATE_MEM_RANGE;
+        CRONO_VALIDATE_MEM_RANGE(sizeof(val));
 
-        // Copy memory
-        *((volatile unsigned char *)(((unsigned char *)(pDevice->bar_descs[0]
-                                                            .userAddress)) +
-                                     dwOffset)) = val;
-
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_store(pDevice, CRONO_BAR0_NUM, dwOffset,
+                               CRONO_BAR0_ADDR, val);
 }
 
 uint32_t CRONO_KERNEL_WriteAddr16(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                   uint32_t dwOffset, unsigned short val) {
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
-        CRONO_VALIDATE_MEM_RANGE;
+        CRONO_VALIDATE_MEM_RANGE(sizeof(val));
 
-        // Copy memory
-        *((volatile unsigned short *)(((unsigned char *)(pDevice->bar_descs[0]
-                                                             .userAddress)) +
-                                      dwOffset)) = val;
-
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_store(pDevice, CRONO_BAR0_NUM, dwOffset,
+                               CRONO_BAR0_ADDR, val);
 }
 
 uint32_t CRONO_KERNEL_WriteAddr32(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                   uint32_t dwOffset, uint32_t val) {
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
-        CRONO_VALIDATE_MEM_RANGE;
+        CRONO_VALIDATE_MEM_RANGE(sizeof(val));
 
-        // Copy memory
-        *((volatile uint32_t *)(((unsigned char *)(pDevice->bar_descs[0]
-                                                       .userAddress)) +
-                                dwOffset)) = val;
+        return crono_bar_store(pDevice, CRONO_BAR0_NUM, dwOffset,
+                               CRONO_BAR0_ADDR, val);
+}
 
-        // Success
-        return CRONO_SUCCESS;
+void crono_bar0_write32(PCRONO_KERNEL_DEVICE pDevice, uint32_t dwOffset,
+                        uint32_t val) {
+        crono_bar_store(pDevice, CRONO_BAR0_NUM, dwOffset, CRONO_BAR0_ADDR,
+                        val);
 }
 
 uint32_t CRONO_KERNEL_WriteAddr64(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                   uint32_t dwOffset, uint64_t val) {
         // Init variables and validate parameters
         CRONO_INIT_HDEV_FUNC(hDev);
-        CRONO_VALIDATE_MEM_RANGE;
+        CRONO_VALIDATE_MEM_RANGE(sizeof(val));
 
-        // Copy memory
-        *((volatile uint64_t *)(((unsigned char *)(pDevice->bar_descs[0]
-                                                       .userAddress)) +
-                                dwOffset)) = val;
-
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_store(pDevice, CRONO_BAR0_NUM, dwOffset,
+                               CRONO_BAR0_ADDR, val);
 }
 
 CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadAddr(CRONO_KERNEL_DEVICE_HANDLE hDev,
@@ -518,20 +617,20 @@ CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadAddr(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                                 uint32_t *val,
                                                 uint32_t barIndex) {
         CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
 
         // Validation
-        if ((dwOffset + sizeof(val)) > pDevice->bar_descs[barIndex].length) {
+        if (barIndex >= pDevice->bar_count ||
+            0 == pDevice->bar_descs[barIndex].userAddress ||
+            (dwOffset + sizeof(*val)) > pDevice->bar_descs[barIndex].length) {
                 return -ENOMEM;
         }
 
         // Read the value
-        *val = *((
-            volatile uint32_t *)(((unsigned char *)(pDevice->bar_descs[barIndex]
-                                                        .userAddress)) +
-                                 dwOffset));
-
-        // Success
-        return CRONO_SUCCESS;
+        return crono_bar_load(
+            pDevice, pDevice->bar_descs[barIndex].barNum, dwOffset,
+            (uint8_t *)pDevice->bar_descs[barIndex].userAddress + dwOffset,
+            val);
 }
 
 CRONO_KERNEL_API uint32_t
@@ -540,16 +639,198 @@ CRONO_KERNEL_WriteAddr(CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t dwOffset,
         CRONO_INIT_HDEV_FUNC(hDev);
 
         // Validation
-        if ((dwOffset + sizeof(val)) > pDevice->bar_descs[barIndex].length) {
+        if (barIndex >= pDevice->bar_count ||
+            0 == pDevice->bar_descs[barIndex].userAddress ||
+            (dwOffset + sizeof(val)) > pDevice->bar_descs[barIndex].length) {
                 return -ENOMEM;
         }
 
         // Write the value
-        *((volatile uint32_t *)(((unsigned char *)(pDevice->bar_descs[barIndex]
-                                                       .userAddress)) +
-                                dwOffset)) = val;
+        return crono_bar_store(
+            pDevice, pDevice->bar_descs[barIndex].barNum, dwOffset,
+            (uint8_t *)pDevice->bar_descs[barIndex].userAddress + dwOffset,
+            val);
+}
+
+void crono_mmio_copy(void *dst, const void *src, uint64_t size) {
+        uintptr_t align = (uintptr_t)dst | (uintptr_t)src | size;
+
+        if (0 == align % sizeof(uint64_t)) {
+                for (uint64_t i = 0; i < size / sizeof(uint64_t); i++) {
+                        ((volatile uint64_t *)dst)[i] =
+                            ((const volatile uint64_t *)src)[i];
+                }
+        } else if (0 == align % sizeof(uint32_t)) {
+                for (uint64_t i = 0; i < size / sizeof(uint32_t); i++) {
+                        ((volatile uint32_t *)dst)[i] =
+                            ((const volatile uint32_t *)src)[i];
+                }
+        } else {
+                for (uint64_t i = 0; i < size; i++) {
+                        ((volatile uint8_t *)dst)[i] =
+                            ((const volatile uint8_t *)src)[i];
+                }
+        }
+}
+
+/**
+ * Gets the address of `size` bytes at `offset` of BAR `barNum`, NULL if the
+ * range is not mapped. The BAR is looked up by number in `bar_map`, so the
+ * range check is the only one.
+ */
+static inline uint8_t *crono_bar_addr(PCRONO_KERNEL_DEVICE pDevice,
+                                      uint32_t barNum, uint64_t offset,
+                                      uint64_t size) {
+        const CRONO_BAR_MAP *map;
+
+        if (barNum >= 6) {
+                return NULL;
+        }
+        map = &pDevice->bar_map[barNum];
+        if (offset > map->length || size > map->length - offset) {
+                return NULL;
+        }
+        return map->addr + offset;
+}
+
+template <typename T>
+static inline uint32_t crono_read_bar(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                      uint32_t barNum, uint64_t offset,
+                                      T *val) {
+        uint8_t *addr;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
+        if (0 != offset % sizeof(T)) {
+                // Unaligned accesses may be split or rejected by the device
+                return -EINVAL;
+        }
+        addr = crono_bar_addr(pDevice, barNum, offset, sizeof(T));
+        CRONO_RET_ERR_CODE_IF_NULL(addr, -ENOMEM);
+
+        return crono_bar_load(pDevice, barNum, offset, addr, val);
+}
+
+template <typename T>
+static inline uint32_t crono_write_bar(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                       uint32_t barNum, uint64_t offset,
+                                       T val) {
+        uint8_t *addr;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        if (0 != offset % sizeof(T)) {
+                // Unaligned accesses may be split or rejected by the device
+                return -EINVAL;
+        }
+        addr = crono_bar_addr(pDevice, barNum, offset, sizeof(T));
+        CRONO_RET_ERR_CODE_IF_NULL(addr, -ENOMEM);
+
+        return crono_bar_store(pDevice, barNum, offset, addr, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar8(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                                uint32_t barNum,
+                                                uint64_t offset,
+                                                uint8_t *val) {
+        return crono_read_bar(hDev, barNum, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar16(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint16_t *val) {
+        return crono_read_bar(hDev, barNum, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar32(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint32_t *val) {
+        return crono_read_bar(hDev, barNum, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBar64(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint64_t *val) {
+        return crono_read_bar(hDev, barNum, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar8(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint8_t val) {
+        return crono_write_bar(hDev, barNum, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar16(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint16_t val) {
+        return crono_write_bar(hDev, barNum, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar32(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint32_t val) {
+        return crono_write_bar(hDev, barNum, offset, val);
+}
 
-        // Success
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBar64(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint64_t val) {
+        return crono_write_bar(hDev, barNum, offset, val);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_ReadBarBlock(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    void *pData, uint64_t size) {
+        struct CRONO_REG_SHADOW *shadow;
+        uint8_t *addr;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pData);
+        addr = crono_bar_addr(pDevice, barNum, offset, size);
+        CRONO_RET_ERR_CODE_IF_NULL(addr, -ENOMEM);
+        shadow = __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+        if (NULL != shadow) {
+                ret = crono_reg_shadow_read(shadow, barNum, offset, pData,
+                                            size);
+                if (-ENOENT != ret) {
+                        return ret;
+                }
+        }
+
+        CRONO_TRACE_BEGIN(pDevice);
+        crono_mmio_copy(pData, addr, size);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_READ, barNum, offset, size, 0,
+                        pData, CRONO_SUCCESS);
+        if (NULL != shadow) {
+                crono_reg_shadow_fill(shadow, barNum, offset, pData, size);
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_WriteBarBlock(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    const void *pData, uint64_t size) {
+        struct CRONO_REG_SHADOW *shadow;
+        uint8_t *addr;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pData);
+        addr = crono_bar_addr(pDevice, barNum, offset, size);
+        CRONO_RET_ERR_CODE_IF_NULL(addr, -ENOMEM);
+        shadow = __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+        if (NULL != shadow &&
+            crono_reg_shadow_write(shadow, barNum, offset, pData, size)) {
+                return CRONO_SUCCESS;
+        }
+
+        CRONO_TRACE_BEGIN(pDevice);
+        crono_mmio_copy(addr, pData, size);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_WRITE, barNum, offset, size, 0,
+                        pData, CRONO_SUCCESS);
         return CRONO_SUCCESS;
 }
 
@@ -592,6 +873,18 @@ uint32_t CRONO_KERNEL_DMASGBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
                        "before calling CRONO_KERNEL_DMASGBufLock()\n");
                 return -ENOENT;
         }
+        if (0 != (uintptr_t)pBuf % PAGE_SIZE ||
+            0 != dwDMABufSize % PAGE_SIZE) {
+                // Pages shared with other memory are not excluded from
+                // `fork()`, a child writing to them remaps them
+                CRONO_DEBUG("Buffer <%p> of size <%u> is not page aligned, "
+                            "its partial pages are not fork safe\n",
+                            pBuf, dwDMABufSize);
+        }
+        ret = crono_pinned_reserve(dwDMABufSize);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
 
         // Construct buff_info
         buff_info.addr = pBuf;
@@ -603,6 +896,7 @@ uint32_t CRONO_KERNEL_DMASGBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
         pDma = (CRONO_KERNEL_DMA_SG *)malloc(sizeof(CRONO_KERNEL_DMA_SG));
         if (NULL == pDma) {
                 printf("Error allocating DMA struct memory");
+                crono_pinned_unreserve(dwDMABufSize);
                 return -ENOMEM;
         }
         memset(pDma, 0, sizeof(CRONO_KERNEL_DMA_SG));
@@ -618,6 +912,7 @@ uint32_t CRONO_KERNEL_DMASGBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
         if (NULL == pDma->Page) {
                 printf("Error allocating Page memory");
                 free(pDma);
+                crono_pinned_unreserve(dwDMABufSize);
                 return -ENOMEM;
         }
         CRONO_DEBUG("Allocated `ppDma[0]->Page`: size <%ld>\n",
@@ -633,6 +928,7 @@ uint32_t CRONO_KERNEL_DMASGBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
                 printf("Error allocating Page memory");
                 free(pDma->Page);
                 free(pDma);
+                crono_pinned_unreserve(dwDMABufSize);
                 return -ENOMEM;
         }
         buff_info.upages = (DMA_ADDR)buff_info.pages;
@@ -644,13 +940,18 @@ uint32_t CRONO_KERNEL_DMASGBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
                     "pages count <%d>\n",
                     &buff_info, buff_info.size, buff_info.pages_count);
         // `pDevice->miscdev_fd` Must be already opened
+        CRONO_TRACE_BEGIN(pDevice);
         ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_LOCK_BUFFER, &buff_info);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_DMA_SG_LOCK,
+                        CRONO_KERNEL_TRACE_NO_BAR, (uintptr_t)pBuf,
+                        dwDMABufSize, (uint64_t)buff_info.id, NULL, ret);
         if (CRONO_SUCCESS != ret) {
                 printf("Driver module error %d\n", ret);
                 goto alloc_err;
         }
 
         pDma->id = buff_info.id;
+        crono_pinned_register(pDevice, pBuf, dwDMABufSize);
         CRONO_DEBUG("Copying locked addresses: ID <%d>, pages count <%d>\n",
                     pDma->id, buff_info.pages_count);
 
@@ -658,6 +959,17 @@ uint32_t CRONO_KERNEL_DMASGBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
                 pDma->Page[iPage].pPhysicalAddr = buff_info.pages[iPage];
                 pDma->Page[iPage].dwBytes = 4096;
         }
+        ret = crono_sg_index_add(pDevice, pDma);
+        if (CRONO_SUCCESS != ret) {
+                // Not usable untranslated, unlock it again
+                crono_pinned_unregister(pDevice, pBuf);
+                ioctl(pDevice->miscdev_fd, IOCTL_CRONO_UNLOCK_BUFFER,
+                      &pDma->id);
+                free(pDma->Page);
+                free(pDma);
+                free(buff_info.pages);
+                return ret;
+        }
 
 #ifdef CRONO_DEBUG_ENABLED
         for (unsigned int ipage = 0;
@@ -674,6 +986,7 @@ uint32_t CRONO_KERNEL_DMASGBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf,
         return ret;
 
 alloc_err:
+        crono_pinned_unreserve(dwDMABufSize);
         if (NULL != pDma) {
                 if (NULL != pDma->Page) {
                         free(pDma->Page);
@@ -719,13 +1032,19 @@ uint32_t CRONO_KERNEL_DMASGBufUnlock(CRONO_KERNEL_DEVICE_HANDLE hDev,
         //
         // Call ioctl() to unlock the buffer and cleanup
         // `pDevice->miscdev_fd` Must be already opened
-        if (CRONO_SUCCESS !=
-            (ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_UNLOCK_BUFFER,
-                         &pDma->id))) {
+        CRONO_TRACE_BEGIN(pDevice);
+        ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_UNLOCK_BUFFER, &pDma->id);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_DMA_SG_UNLOCK,
+                        CRONO_KERNEL_TRACE_NO_BAR, (uintptr_t)pDma->pUserAddr,
+                        pDma->dwPages * PAGE_SIZE, (uint64_t)pDma->id, NULL,
+                        ret);
+        if (CRONO_SUCCESS != ret) {
                 return ret;
         }
 
         CRONO_DEBUG("Done unlocking buffer id <%d>.\n", pDma->id);
+        crono_pinned_unregister(pDevice, pDma->pUserAddr);
+        crono_sg_index_remove(pDevice, pDma);
 
         // _______
         // Cleanup
@@ -798,9 +1117,50 @@ Identify device by handle */
 uint32_t CRONO_KERNEL_PciWriteCfg32Arr(CRONO_KERNEL_DEVICE_HANDLE hDev,
                                        uint32_t dwOffset, uint32_t *val,
                                        uint32_t arr_size) {
-        uint32_t code = CRONO_KERNEL_STATUS_SUCCESS;
-        // Not implemented
-        return code;
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
+        CRONO_RET_INV_PARAM_IF_ZERO(arr_size);
+        if (arr_size > PCI_CFG_SPACE_EXP_SIZE / sizeof(*val)) {
+                return -EINVAL;
+        }
+
+        // One write of the whole array
+        return crono_config_write(pDevice, dwOffset, val,
+                                  arr_size * sizeof(*val));
+}
+
+uint32_t CRONO_KERNEL_PciWriteCfg32ArrVerify(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                             uint32_t dwOffset,
+                                             const uint32_t *val,
+                                             uint32_t arr_size) {
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
+        CRONO_RET_INV_PARAM_IF_ZERO(arr_size);
+        if (arr_size > PCI_CFG_SPACE_EXP_SIZE / sizeof(*val)) {
+                return -EINVAL;
+        }
+
+        // One write of the whole array, then one read back
+        return crono_config_write_verify(pDevice, dwOffset, val,
+                                         arr_size * sizeof(*val));
+}
+
+uint32_t CRONO_KERNEL_PciReadCfg32Arr(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                                      uint32_t dwOffset, uint32_t *val,
+                                      uint32_t arr_size) {
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(val);
+        CRONO_RET_INV_PARAM_IF_ZERO(arr_size);
+        if (arr_size > PCI_CFG_SPACE_EXP_SIZE / sizeof(*val)) {
+                return -EINVAL;
+        }
+
+        // Read the configuration, from its shadow unless volatile
+        return crono_config_read(pDevice, dwOffset, val,
+                                 arr_size * sizeof(*val));
 }
 
 /**
@@ -869,8 +1229,12 @@ uint32_t CRONO_KERNEL_DMAContigBufLock(CRONO_KERNEL_DEVICE_HANDLE hDev,
 
         // Allocate memory
         // `pDevice->miscdev_fd` Must be already opened
+        CRONO_TRACE_BEGIN(pDevice);
         ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_LOCK_CONTIG_BUFFER,
                     &buff_info);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_DMA_CONTIG_LOCK,
+                        CRONO_KERNEL_TRACE_NO_BAR, 0, dwDMABufSize,
+                        (uint64_t)buff_info.id, NULL, ret);
         if (CRONO_SUCCESS != ret) {
                 printf("Driver module error %d\n", ret);
                 return ret;
@@ -939,9 +1303,13 @@ uint32_t CRONO_KERNEL_DMAContigBufUnlock(CRONO_KERNEL_DEVICE_HANDLE hDev,
         //
         // Call ioctl() to unlock the buffer and cleanup
         // `pDevice->miscdev_fd` Must be already opened
-        if (CRONO_SUCCESS !=
-            (ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_UNLOCK_CONTIG_BUFFER,
-                         &pDma->id))) {
+        CRONO_TRACE_BEGIN(pDevice);
+        ret = ioctl(pDevice->miscdev_fd, IOCTL_CRONO_UNLOCK_CONTIG_BUFFER,
+                    &pDma->id);
+        CRONO_TRACE_END(CRONO_KERNEL_TRACE_DMA_CONTIG_UNLOCK,
+                        CRONO_KERNEL_TRACE_NO_BAR, 0, pDma->dwBytes,
+                        (uint64_t)pDma->id, NULL, ret);
+        if (CRONO_SUCCESS != ret) {
                 printf("Driver module error %d\n", ret);
                 return ret;
         }
@@ -1064,6 +1432,17 @@ uint32_t fill_device_bar_descriptions(PCRONO_KERNEL_DEVICE pDevice) {
                 temp_bar_descs[bar_count].length = end_addr - start_addr + 1;
                 temp_bar_descs[bar_count].physicalAddress = start_addr;
 
+                // Large BARs, e.g. on-board memory, are mapped in windows on
+                // demand
+                if (temp_bar_descs[bar_count].length >
+                    CRONO_KERNEL_BAR_MAP_MAX_SIZE) {
+                        CRONO_DEBUG("BAR No. %d of <%" PRIu64 "> bytes is "
+                                    "not mapped\n",
+                                    ibar, temp_bar_descs[bar_count].length);
+                        bar_count++;
+                        continue;
+                }
+
                 // Open BAR resource file to map the memory
                 std::string bar_resource_file_path =
                     std::string(sys_dev_dir_path) + "/resource" +
@@ -1117,6 +1496,18 @@ uint32_t fill_device_bar_descriptions(PCRONO_KERNEL_DEVICE pDevice) {
         memcpy(pDevice->bar_descs, temp_bar_descs,
                sizeof(CRONO_KERNEL_BAR_DESC) * 6);
         pDevice->bar_count = bar_count;
+
+        // Index the mapped BARs by number
+        memset(pDevice->bar_map, 0, sizeof(pDevice->bar_map));
+        for (uint32_t ibar = 0; ibar < bar_count; ibar++) {
+                if (0 == temp_bar_descs[ibar].userAddress) {
+                        continue;
+                }
+                pDevice->bar_map[temp_bar_descs[ibar].barNum].addr =
+                    (uint8_t *)temp_bar_descs[ibar].userAddress;
+                pDevice->bar_map[temp_bar_descs[ibar].barNum].length =
+                    temp_bar_descs[ibar].length;
+        }
         return CRONO_SUCCESS;
 }
 
@@ -1139,11 +1530,16 @@ uint32_t freeDeviceMem(PCRONO_KERNEL_DEVICE pDevice) {
                         pDevice->bar_descs[ibar].userAddress = 0;
                 }
                 pDevice->bar_count = 0;
+                memset(pDevice->bar_map, 0, sizeof(pDevice->bar_map));
+                crono_sg_index_free(pDevice);
+                crono_config_free(pDevice);
+                crono_trace_free(pDevice);
+                crono_reg_shadow_free(pDevice);
                 free(devices[iDev]);
                 devices[iDev] = nullptr; // avoid double free
         }
         // Shrink array for null elements at the end if found
-        while (iNewDev > 0 && devices[iNewDev] == nullptr) {
+        while (iNewDev > 0 && devices[iNewDev - 1] == nullptr) {
                 // Last element in the array is empty, shrink it
                 iNewDev--;
         }
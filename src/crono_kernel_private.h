@@ -23,9 +23,18 @@ extern "C" {
 
 #include "crono_kernel_interface.h"
 #include "crono_linux_kernel.h"
+#include <sched.h>
 
 typedef uint64_t DMA_ADDR;
 
+/**
+ * Mapping of a BAR, looked up by BAR number.
+ */
+typedef struct {
+        uint8_t *addr;   // `userAddress` of the BAR.
+        uint64_t length; // 0 if the BAR is not present or not mapped.
+} CRONO_BAR_MAP;
+
 /* Device information struct */
 typedef struct CRONO_KERNEL_DEVICE {
         /**
@@ -50,6 +59,12 @@ typedef struct CRONO_KERNEL_DEVICE {
          */
         uint32_t bar_count;
 
+        /**
+         * `bar_descs` indexed by BAR number, set with `bar_descs`, so accesses
+         * only check the range.
+         */
+        CRONO_BAR_MAP bar_map[6];
+
         /**
          * The name of the corresponding `miscdev` file, found under /dev
          */
@@ -57,6 +72,77 @@ typedef struct CRONO_KERNEL_DEVICE {
 
         int miscdev_fd;
 
+        /**
+         * Count of `CRONO_KERNEL_PciDeviceOpen` calls of the slot not closed
+         * yet, the device is shared by all of them. Guarded by the devices
+         * mutex of `crono_kernel_interface.cpp`.
+         */
+        uint32_t ref_count;
+
+        /**
+         * File descriptor signaling device events, `miscdev_fd` unless set by
+         * `CRONO_KERNEL_SetEventFd`.
+         */
+        int event_fd;
+
+        /**
+         * NUMA node the device is attached to, as read from sysfs
+         * `numa_node`. -1 if unknown or the system is not NUMA.
+         */
+        int numa_node;
+
+        /**
+         * CPUs local to the device, as read from sysfs `local_cpulist`.
+         * Empty if unknown.
+         */
+        cpu_set_t local_cpus;
+
+        /**
+         * Bytes and count of SG buffers currently locked on the device.
+         * Maintained by `crono_pinned_register` and `crono_pinned_unregister`.
+         */
+        uint64_t pinned_bytes;
+        uint32_t pinned_buffers;
+
+        /**
+         * Physical/virtual address index of the SG buffers locked on the
+         * device, allocated on first lock, NULL before.
+         */
+        struct CRONO_SG_INDEX *sg_index;
+
+        /**
+         * Shadow of the configuration space, allocated on first access, NULL
+         * before.
+         */
+        struct CRONO_CONFIG_SHADOW *config_shadow;
+
+        /**
+         * Trace the accesses to the device are recorded to, NULL if not
+         * traced, see `crono_trace.h`.
+         */
+        struct CRONO_TRACE *trace;
+
+        /**
+         * Threads between `CRONO_TRACE_BEGIN` and the end of its scope with a
+         * trace, the trace is closed once none is left.
+         */
+        uint32_t trace_users;
+
+        /**
+         * Shadow of the BAR register ranges added by
+         * `CRONO_KERNEL_RegShadowAdd`, NULL before the first one, see
+         * `crono_reg_shadow.h`.
+         */
+        struct CRONO_REG_SHADOW *reg_shadow;
+
+        /**
+         * Id and version of the command buffer registered as the cleanup
+         * commands, see `crono_cmd_buffer.h`. Id 0 if the commands were not
+         * registered from a command buffer.
+         */
+        uint64_t cleanup_buffer_id;
+        uint64_t cleanup_version;
+
 } CRONO_KERNEL_DEVICE, *PCRONO_KERNEL_DEVICE;
 
 #define crono_sleep(x) usleep(1000 * x)
@@ -93,8 +179,44 @@ typedef struct CRONO_KERNEL_DEVICE {
                 return -EINVAL;                                                \
         }
 
+/**
+ * Defines `pDevice` and `pDev_handle`, and initialize them from `hDev`
+ * Returns `EINVAL` if hDev is NULL
+ */
+#define CRONO_INIT_HDEV_FUNC(hDev)                                             \
+        PCRONO_KERNEL_DEVICE pDevice;                                          \
+        CRONO_RET_ERR_CODE_IF_NULL(hDev, -EINVAL);                             \
+        pDevice = (PCRONO_KERNEL_DEVICE)hDev;                                  \
+        if (0 == pDevice->dwDeviceId) {                                        \
+                return -EINVAL;                                                \
+        }
+
 uint32_t freeDeviceMem(PCRONO_KERNEL_DEVICE pDevice);
 
+/**
+ * @brief Write `val` at `dwOffset` of BAR0 as `CRONO_KERNEL_WriteAddr32`,
+ * without validating the device and the offset, checked by the caller.
+ */
+void crono_bar0_write32(PCRONO_KERNEL_DEVICE pDevice, uint32_t dwOffset,
+                        uint32_t val);
+
+/**
+ * @brief Copy `size` bytes between memory and a BAR mapping using the widest
+ * accesses `dst`, `src` and `size` are aligned to, up to 64 bits, as `memcpy`
+ * may use accesses the device does not support.
+ */
+void crono_mmio_copy(void *dst, const void *src, uint64_t size);
+
+/**
+ * @brief Add a device opened other than by `CRONO_KERNEL_PciDeviceOpen`, e.g.
+ * imported, to the open devices with one reference, so it is shared and closed
+ * as any open device.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EBUSY` if the slot is
+ * already open, or `-ENOMEM` if too many devices are open.
+ */
+uint32_t crono_add_open_device(PCRONO_KERNEL_DEVICE pDevice);
+
 /**
  * @brief Fill `pDevice->bar_descs` if not filled before, also mmap the BARs and
  * set `pDevice->bar_count`. Returns immediately if previously done
@@ -108,6 +230,349 @@ uint32_t freeDeviceMem(PCRONO_KERNEL_DEVICE pDevice);
  */
 uint32_t fill_device_bar_descriptions(PCRONO_KERNEL_DEVICE pDevice);
 
+/**
+ * @brief Fill `pDevice->numa_node` and `pDevice->local_cpus` from the device
+ * sysfs directory. Missing attributes are not an error, `numa_node` is set to
+ * -1 and `local_cpus` is left empty in this case.
+ *
+ * @param pDevice
+ * pDevice->pciSlot should be already set.
+ * @return uint32_t
+ */
+uint32_t fill_device_numa_info(PCRONO_KERNEL_DEVICE pDevice);
+
+/**
+ * @brief Reserve the pages of a buffer of `size` bytes to be locked, unless it
+ * exceeds the pinned memory limit set by `CRONO_KERNEL_SetPinnedMemLimit`.
+ * The check and the reservation are atomic, so concurrent locks do not exceed
+ * the limit together.
+ *
+ * @return `CRONO_SUCCESS` if reserved, or `-ENOMEM` if the limit is exceeded.
+ */
+int crono_pinned_reserve(size_t size);
+
+/**
+ * @brief Give back the reservation of `crono_pinned_reserve`, e.g. when
+ * locking the buffer failed.
+ */
+void crono_pinned_unreserve(size_t size);
+
+/**
+ * @brief Account a locked SG buffer of `size` bytes, reserved by
+ * `crono_pinned_reserve`, to the device, and exclude its pages from `fork()`
+ * and core dumps using `madvise()`, so copy-on-write never remaps pages the
+ * device is writing to. Only the pages lying entirely inside the buffer are
+ * advised, pages shared with other memory are left as they are, and their
+ * bytes are counted as unprotected.
+ */
+void crono_pinned_register(PCRONO_KERNEL_DEVICE pDevice, void *addr,
+                           size_t size);
+
+/**
+ * @brief Undo `crono_pinned_register` and `crono_pinned_reserve` for the
+ * buffer at `addr` unlocked on `pDevice`. Pages shared with another buffer that
+ * is still locked keep their advice.
+ */
+void crono_pinned_unregister(PCRONO_KERNEL_DEVICE pDevice, void *addr);
+
+/**
+ * @brief Add the pages of a locked SG buffer to `pDevice->sg_index`, merging
+ * physically contiguous pages into runs.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-ENOMEM`.
+ */
+int crono_sg_index_add(PCRONO_KERNEL_DEVICE pDevice,
+                       const CRONO_KERNEL_DMA_SG *pDma);
+
+/**
+ * @brief Remove the runs of an SG buffer from `pDevice->sg_index`.
+ */
+void crono_sg_index_remove(PCRONO_KERNEL_DEVICE pDevice,
+                           const CRONO_KERNEL_DMA_SG *pDma);
+
+/**
+ * @brief Free `pDevice->sg_index`.
+ */
+void crono_sg_index_free(PCRONO_KERNEL_DEVICE pDevice);
+
+/**
+ * @brief Set `O_NONBLOCK` on the event file descriptor `fd`, so reading it
+ * after `poll` returns `EAGAIN` instead of blocking when another thread read
+ * the events meanwhile.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` of `fcntl`.
+ */
+int crono_event_fd_init(int fd);
+
+/**
+ * @brief Read the configuration space of the device through its shadow. The
+ * whole configuration space is read once, with one `pread`, then registers
+ * that only change when written are served from memory. Volatile registers,
+ * e.g. status, link status, and AER status, are always read from the device.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if the range exceeds
+ * the configuration space, `-EIO` on a short read, or `errno` in case of
+ * error.
+ */
+int crono_config_read(PCRONO_KERNEL_DEVICE pDevice, uint32_t offset,
+                      void *data, uint32_t size);
+
+/**
+ * @brief Write the configuration space of the device, and update its shadow.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EINVAL` if the range exceeds
+ * the configuration space, `-EIO` on a short write, or `errno` in case of
+ * error.
+ */
+int crono_config_write(PCRONO_KERNEL_DEVICE pDevice, uint32_t offset,
+                       const void *data, uint32_t size);
+
+/**
+ * @brief Find a capability in the index built from the configuration space
+ * shadow, without reading the device.
+ *
+ * @param extended[in]: 1 for an extended capability, 0 for a standard one.
+ * @param id[in]: `PCI_CAP_ID_XXX` or `PCI_EXT_CAP_ID_XXX`.
+ * @param pOffset[out]: Offset of the capability in the configuration space.
+ * @param pVersion[out]: Capability version. Ignored if NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the device has no
+ * such capability, or `errno` in case of error.
+ */
+int crono_config_find_cap(PCRONO_KERNEL_DEVICE pDevice, uint32_t extended,
+                          uint32_t id, uint32_t *pOffset, uint32_t *pVersion);
+
+/**
+ * @brief Write as `crono_config_write`, then read the range back with one
+ * `pread` and compare it to `data`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `CRONO_KERNEL_DATA_MISMATCH` if
+ * the range does not read back as written, or as `crono_config_write`.
+ */
+int crono_config_write_verify(PCRONO_KERNEL_DEVICE pDevice, uint32_t offset,
+                              const void *data, uint32_t size);
+
+/**
+ * @brief Close and free `pDevice->config_shadow`.
+ */
+void crono_config_free(PCRONO_KERNEL_DEVICE pDevice);
+
+/**
+ * @brief Create the configuration space shadow of the device on `fd`, a file
+ * holding `size` bytes of configuration space, instead of the sysfs `config`
+ * file, e.g. for a mock device. The shadow owns `fd`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-EBUSY` if the device has a
+ * shadow already, or `-ENOMEM`.
+ */
+int crono_config_attach(PCRONO_KERNEL_DEVICE pDevice, int fd, uint32_t size);
+
+struct CRONO_TRACE;
+
+/**
+ * @brief CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t crono_trace_now_ns();
+
+/**
+ * @brief Append a record to a trace, see `crono_trace.h`. `data` holds the
+ * `size` bytes accessed, or is NULL if `value` holds them.
+ */
+void crono_trace_record(struct CRONO_TRACE *trace, uint64_t begin_ns,
+                        uint32_t op, uint32_t bar, uint64_t offset,
+                        uint64_t size, uint64_t value, const void *data,
+                        int status);
+
+/**
+ * @brief Stop tracing the device, if traced.
+ */
+void crono_trace_free(PCRONO_KERNEL_DEVICE pDevice);
+
+/**
+ * @brief Get the trace of the device and count the calling thread as a user
+ * of it, NULL if not traced. One atomic load if not traced.
+ */
+static inline struct CRONO_TRACE *
+crono_trace_acquire(PCRONO_KERNEL_DEVICE pDevice) {
+        struct CRONO_TRACE *trace =
+            __atomic_load_n(&pDevice->trace, __ATOMIC_ACQUIRE);
+
+        if (NULL == trace) {
+                return NULL;
+        }
+        // Tracing may stop meanwhile, it waits for the users counted before
+        __atomic_add_fetch(&pDevice->trace_users, 1, __ATOMIC_SEQ_CST);
+        trace = __atomic_load_n(&pDevice->trace, __ATOMIC_SEQ_CST);
+        if (NULL == trace) {
+                __atomic_sub_fetch(&pDevice->trace_users, 1, __ATOMIC_RELEASE);
+        }
+        return trace;
+}
+
+/**
+ * Releases the trace acquired by `CRONO_TRACE_BEGIN` at the end of its scope,
+ * including early returns.
+ */
+struct CRONO_TRACE_REF {
+        PCRONO_KERNEL_DEVICE device;
+        struct CRONO_TRACE *trace;
+
+        ~CRONO_TRACE_REF() {
+                if (NULL != trace) {
+                        __atomic_sub_fetch(&device->trace_users, 1,
+                                           __ATOMIC_RELEASE);
+                }
+        }
+};
+
+/**
+ * Defines `trace`, the trace of `pDevice` or NULL, and `trace_begin_ns`, the
+ * time the access starts if traced. The access is recorded by
+ * `CRONO_TRACE_END`. The trace stays open until the end of the scope.
+ */
+#define CRONO_TRACE_BEGIN(pDevice)                                             \
+        struct CRONO_TRACE *trace = crono_trace_acquire(pDevice);              \
+        CRONO_TRACE_REF trace_ref = {(pDevice), trace};                        \
+        uint64_t trace_begin_ns = (NULL != trace) ? crono_trace_now_ns() : 0
+
+#define CRONO_TRACE_END(op, bar, offset, size, value, data, status)            \
+        if (NULL != trace) {                                                   \
+                crono_trace_record(trace, trace_begin_ns, (op), (bar),         \
+                                   (offset), (size), (value), (data),          \
+                                   (status));                                  \
+        }
+
+struct CRONO_REG_SHADOW;
+
+/**
+ * @brief Read `size` bytes at `offset` of BAR `bar` from the register shadow.
+ *
+ * @return `CRONO_SUCCESS` if read from the shadow, `-ENOENT` if the bytes are
+ * not all in one shadowed range, or not all known yet, so the caller reads the
+ * device, or `-ENODATA` if they are in a write-only range and not written yet.
+ */
+int crono_reg_shadow_read(struct CRONO_REG_SHADOW *shadow, uint32_t bar,
+                          uint64_t offset, void *data, uint64_t size);
+
+/**
+ * @brief Update the shadowed bytes of `size` bytes read from the device at
+ * `offset` of BAR `bar`.
+ */
+void crono_reg_shadow_fill(struct CRONO_REG_SHADOW *shadow, uint32_t bar,
+                           uint64_t offset, const void *data, uint64_t size);
+
+/**
+ * @brief Update the shadowed bytes of `size` bytes to be written at `offset`
+ * of BAR `bar`.
+ *
+ * @return true if the bytes are in one range eliding writes, and the shadow
+ * holds them already, so the caller does not write the device.
+ */
+bool crono_reg_shadow_write(struct CRONO_REG_SHADOW *shadow, uint32_t bar,
+                            uint64_t offset, const void *data, uint64_t size);
+
+/**
+ * @brief Free the register shadow of the device, if any.
+ */
+void crono_reg_shadow_free(PCRONO_KERNEL_DEVICE pDevice);
+
+/**
+ * @brief Register `count` commands as the cleanup commands of the device,
+ * from version `version` of command buffer `buffer_id`, or 0 if not from a
+ * command buffer. The driver reads `cmds` during the call only.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, `-ENOENT` if the device is not
+ * opened, or as `ioctl`.
+ */
+int crono_cmd_buffer_cleanup_setup(PCRONO_KERNEL_DEVICE pDevice,
+                                   CRONO_KERNEL_CMD *cmds, uint32_t count,
+                                   uint64_t buffer_id, uint64_t version);
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * Minimal io_uring instance mapped from the kernel, so no liburing dependency
+ * is needed. Not thread-safe, callers serialize access.
+ */
+typedef struct {
+        int fd;
+        pid_t pid;          // Process that set the ring up, mapping is shared.
+        unsigned tail;      // Local tail of queued entries.
+        unsigned submitted; // Tail of entries passed to the kernel.
+        unsigned entries;   // Count of submission queue entries.
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+        void *sq_ptr;
+        size_t sq_len;
+        void *cq_ptr;
+        size_t cq_len;
+        size_t sqes_len;
+} CRONO_URING;
+
+/**
+ * @brief Set up `ring` with at least `entries` submission entries.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-ENOSYS` if io_uring is not
+ * available, e.g. not supported or disabled by sysctl or seccomp.
+ */
+int crono_uring_init(CRONO_URING *ring, unsigned entries);
+
+/**
+ * @brief Unmap and close `ring`, it can be set up again afterwards.
+ */
+void crono_uring_free(CRONO_URING *ring);
+
+/**
+ * @brief Get the next submission entry, zeroed, or NULL if the submission
+ * queue is full.
+ */
+struct io_uring_sqe *crono_uring_get_sqe(CRONO_URING *ring);
+
+/**
+ * @brief Pass the queued entries to the kernel and wait for `wait_nr`
+ * completions, zero not to wait.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or -errno.
+ */
+int crono_uring_submit(CRONO_URING *ring, unsigned wait_nr);
+
+/**
+ * @brief Copy up to `max` available completions to `cqes` and release them.
+ *
+ * @return Count of completions copied.
+ */
+unsigned crono_uring_reap(CRONO_URING *ring, struct io_uring_cqe *cqes,
+                          unsigned max);
+
+/**
+ * A file read of a `crono_uring_read_files` batch.
+ */
+typedef struct {
+        const char *path; // File to open, read, then close.
+        void *data;       // Destination buffer of `size` bytes.
+        uint64_t offset;  // Offset in the file to read from.
+        uint64_t size;    // Bytes to read.
+        int64_t result;   // Bytes read, or -errno.
+} CRONO_URING_READ;
+
+/**
+ * @brief Open, read and close all files of `reads` using io_uring, with one
+ * submission for all opens, then one for all reads and closes.
+ *
+ * @return `CRONO_SUCCESS` when all entries have their `result` set, or
+ * `-ENOSYS` if io_uring is not available, then the caller falls back to
+ * synchronous calls.
+ */
+int crono_uring_read_files(CRONO_URING_READ *reads, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
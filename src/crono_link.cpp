@@ -0,0 +1,657 @@
+#include "crono_link.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <chrono>
+#include <condition_variable>
+#include <linux/pci_regs.h>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+
+/**
+ * Registers of the PCI Express capability of one end of the link.
+ */
+typedef struct {
+        uint32_t cap; // Offset of the capability.
+        uint32_t devcap;
+        uint16_t devctl;
+        uint32_t lnkcap;
+        uint16_t lnkctl;
+        uint16_t lnksta;
+} CRONO_LINK_REGS;
+
+/**
+ * Speeds in MT/s indexed by the link speed field of LNKCAP and LNKSTA.
+ */
+static const uint32_t crono_link_speeds[] = {0,     2500,  5000, 8000,
+                                             16000, 32000, 64000};
+
+static uint64_t crono_link_now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t crono_link_speed(uint32_t code) {
+        return code < sizeof(crono_link_speeds) / sizeof(crono_link_speeds[0])
+                   ? crono_link_speeds[code]
+                   : 0;
+}
+
+static int crono_link_read_regs(PCRONO_KERNEL_DEVICE pDevice,
+                                CRONO_LINK_REGS *pRegs) {
+        int ret;
+
+        ret = crono_config_find_cap(pDevice, 0, PCI_CAP_ID_EXP, &pRegs->cap,
+                                    NULL);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        ret = crono_config_read(pDevice, pRegs->cap + PCI_EXP_DEVCAP,
+                                &pRegs->devcap, sizeof(pRegs->devcap));
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_config_read(pDevice, pRegs->cap + PCI_EXP_DEVCTL,
+                                        &pRegs->devctl, sizeof(pRegs->devctl));
+        }
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_config_read(pDevice, pRegs->cap + PCI_EXP_LNKCAP,
+                                        &pRegs->lnkcap, sizeof(pRegs->lnkcap));
+        }
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_config_read(pDevice, pRegs->cap + PCI_EXP_LNKCTL,
+                                        &pRegs->lnkctl, sizeof(pRegs->lnkctl));
+        }
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_config_read(pDevice, pRegs->cap + PCI_EXP_LNKSTA,
+                                        &pRegs->lnksta, sizeof(pRegs->lnksta));
+        }
+        return ret;
+}
+
+static void crono_link_decode(const CRONO_LINK_REGS *pRegs,
+                              CRONO_KERNEL_PCIE_PORT_INFO *pInfo) {
+        pInfo->linkSpeed = crono_link_speed(pRegs->lnksta & PCI_EXP_LNKSTA_CLS);
+        pInfo->linkWidth =
+            (pRegs->lnksta & PCI_EXP_LNKSTA_NLW) >> PCI_EXP_LNKSTA_NLW_SHIFT;
+        pInfo->maxLinkSpeed =
+            crono_link_speed(pRegs->lnkcap & PCI_EXP_LNKCAP_SLS);
+        pInfo->maxLinkWidth = (pRegs->lnkcap & PCI_EXP_LNKCAP_MLW) >> 4;
+        pInfo->maxPayloadSupported =
+            128 << (pRegs->devcap & PCI_EXP_DEVCAP_PAYLOAD);
+        pInfo->maxPayload =
+            128 << ((pRegs->devctl & PCI_EXP_DEVCTL_PAYLOAD) >> 5);
+        pInfo->maxReadRequest =
+            128 << ((pRegs->devctl & PCI_EXP_DEVCTL_READRQ) >> 12);
+        pInfo->relaxedOrdering =
+            (pRegs->devctl & PCI_EXP_DEVCTL_RELAX_EN) ? 1 : 0;
+        pInfo->aspmSupported = (pRegs->lnkcap & PCI_EXP_LNKCAP_ASPMS) >> 10;
+        pInfo->aspmEnabled = pRegs->lnkctl & PCI_EXP_LNKCTL_ASPMC;
+}
+
+/**
+ * Reads the registers of the device, and of its upstream port into
+ * `pUpDevice` and `pUpRegs` if found. `pUpDevice` is to be freed using
+ * `crono_config_free`.
+ */
+static int crono_link_read(PCRONO_KERNEL_DEVICE pDevice,
+                           CRONO_LINK_REGS *pRegs,
+                           PCRONO_KERNEL_DEVICE pUpDevice,
+                           CRONO_LINK_REGS *pUpRegs, bool *pHasUpstream) {
+        int ret;
+
+        // The upstream port is not opened, its configuration space is only
+        // accessed through a shadow of its own
+        memset(pUpDevice, 0, sizeof(*pUpDevice));
+        *pHasUpstream = false;
+        ret = crono_link_read_regs(pDevice, pRegs);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        ret = crono_get_upstream_port(
+            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction,
+            &pUpDevice->pciSlot);
+        if (CRONO_SUCCESS != ret) {
+                // e.g. directly under the host bridge
+                return CRONO_SUCCESS;
+        }
+        ret = crono_link_read_regs(pUpDevice, pUpRegs);
+        if (CRONO_SUCCESS == ret) {
+                *pHasUpstream = true;
+        } else if (-ENOENT == ret) {
+                // e.g. a PCI bridge
+                ret = CRONO_SUCCESS;
+        }
+        return ret;
+}
+
+static void crono_link_fill_info(const CRONO_LINK_REGS *pRegs,
+                                 PCRONO_KERNEL_DEVICE pUpDevice,
+                                 const CRONO_LINK_REGS *pUpRegs,
+                                 bool hasUpstream,
+                                 CRONO_KERNEL_PCIE_LINK_INFO *pInfo) {
+        memset(pInfo, 0, sizeof(*pInfo));
+        crono_link_decode(pRegs, &pInfo->device);
+        if (hasUpstream) {
+                pInfo->hasUpstream = 1;
+                pInfo->upstreamSlot = pUpDevice->pciSlot;
+                crono_link_decode(pUpRegs, &pInfo->upstream);
+        }
+}
+
+static int crono_link_write16(PCRONO_KERNEL_DEVICE pDevice, uint32_t offset,
+                              uint16_t old_val, uint16_t new_val) {
+        if (old_val == new_val) {
+                return CRONO_SUCCESS;
+        }
+        CRONO_DEBUG("Writing 0x%04x to config 0x%x of %04x:%02x:%02x.%x\n",
+                    new_val, offset, pDevice->pciSlot.dwDomain,
+                    pDevice->pciSlot.dwBus, pDevice->pciSlot.dwSlot,
+                    pDevice->pciSlot.dwFunction);
+        return crono_config_write(pDevice, offset, &new_val, sizeof(new_val));
+}
+
+/**
+ * Computes the new registers, and writes them unless `dry_run`.
+ */
+static int crono_link_tune(PCRONO_KERNEL_DEVICE pDevice,
+                           const CRONO_KERNEL_PCIE_TUNING *pTuning,
+                           CRONO_LINK_REGS *pRegs,
+                           PCRONO_KERNEL_DEVICE pUpDevice,
+                           CRONO_LINK_REGS *pUpRegs, bool hasUpstream,
+                           bool dry_run) {
+        uint16_t devctl = pRegs->devctl;
+        uint16_t lnkctl = pRegs->lnkctl;
+        uint16_t up_lnkctl = pUpRegs->lnkctl;
+        uint32_t aspm;
+        int ret;
+
+        // Validate the settings before writing anything
+        if (0 != pTuning->maxReadRequest) {
+                uint32_t code = 0;
+
+                while ((128u << code) < pTuning->maxReadRequest && code < 5) {
+                        code++;
+                }
+                if ((128u << code) != pTuning->maxReadRequest) {
+                        return -EINVAL;
+                }
+                devctl = (devctl & ~PCI_EXP_DEVCTL_READRQ) | (code << 12);
+        }
+        if (1 == pTuning->relaxedOrdering) {
+                devctl |= PCI_EXP_DEVCTL_RELAX_EN;
+        } else if (0 == pTuning->relaxedOrdering) {
+                devctl &= ~PCI_EXP_DEVCTL_RELAX_EN;
+        } else if (-1 != pTuning->relaxedOrdering) {
+                return -EINVAL;
+        }
+        if (-1 != pTuning->aspm) {
+                aspm = (uint32_t)pTuning->aspm;
+                if (aspm & ~(CRONO_KERNEL_PCIE_ASPM_L0S |
+                             CRONO_KERNEL_PCIE_ASPM_L1)) {
+                        return -EINVAL;
+                }
+                // Both ends must support the states enabled, disabling them
+                // is always safe
+                if (0 != aspm &&
+                    (!hasUpstream ||
+                     (aspm & ~((pRegs->lnkcap & PCI_EXP_LNKCAP_ASPMS) >> 10)) ||
+                     (aspm &
+                      ~((pUpRegs->lnkcap & PCI_EXP_LNKCAP_ASPMS) >> 10)))) {
+                        return -EOPNOTSUPP;
+                }
+                lnkctl = (lnkctl & ~PCI_EXP_LNKCTL_ASPMC) | aspm;
+                if (hasUpstream) {
+                        up_lnkctl = (up_lnkctl & ~PCI_EXP_LNKCTL_ASPMC) | aspm;
+                }
+        }
+        if (dry_run) {
+                pRegs->devctl = devctl;
+                pRegs->lnkctl = lnkctl;
+                pUpRegs->lnkctl = up_lnkctl;
+                return CRONO_SUCCESS;
+        }
+
+        ret = crono_link_write16(pDevice, pRegs->cap + PCI_EXP_DEVCTL,
+                                 pRegs->devctl, devctl);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        pRegs->devctl = devctl;
+        if (lnkctl == pRegs->lnkctl && up_lnkctl == pUpRegs->lnkctl) {
+                return CRONO_SUCCESS;
+        }
+
+        // Disable states downstream first, then enable them upstream first
+        ret = crono_link_write16(pDevice, pRegs->cap + PCI_EXP_LNKCTL,
+                                 pRegs->lnkctl, pRegs->lnkctl & lnkctl);
+        if (CRONO_SUCCESS == ret) {
+                pRegs->lnkctl &= lnkctl;
+                ret = crono_link_write16(pUpDevice,
+                                         pUpRegs->cap + PCI_EXP_LNKCTL,
+                                         pUpRegs->lnkctl, up_lnkctl);
+        }
+        if (CRONO_SUCCESS == ret) {
+                pUpRegs->lnkctl = up_lnkctl;
+                ret = crono_link_write16(pDevice, pRegs->cap + PCI_EXP_LNKCTL,
+                                         pRegs->lnkctl, lnkctl);
+        }
+        if (CRONO_SUCCESS == ret) {
+                pRegs->lnkctl = lnkctl;
+        }
+        return ret;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PcieGetLinkInfo(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                             CRONO_KERNEL_PCIE_LINK_INFO *pInfo) {
+        CRONO_KERNEL_DEVICE up_device;
+        CRONO_LINK_REGS regs;
+        CRONO_LINK_REGS up_regs;
+        bool has_upstream;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pInfo);
+
+        ret = crono_link_read(pDevice, &regs, &up_device, &up_regs,
+                              &has_upstream);
+        if (CRONO_SUCCESS == ret) {
+                crono_link_fill_info(&regs, &up_device, &up_regs,
+                                     has_upstream, pInfo);
+        }
+        crono_config_free(&up_device);
+        return ret;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PcieTune(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const CRONO_KERNEL_PCIE_TUNING *pTuning,
+    uint32_t dwOptions, CRONO_KERNEL_PCIE_LINK_INFO *pResult) {
+        CRONO_KERNEL_DEVICE up_device;
+        CRONO_LINK_REGS regs;
+        CRONO_LINK_REGS up_regs;
+        bool has_upstream;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pTuning);
+
+        memset(&up_regs, 0, sizeof(up_regs));
+        ret = crono_link_read(pDevice, &regs, &up_device, &up_regs,
+                              &has_upstream);
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_link_tune(
+                    pDevice, pTuning, &regs, &up_device, &up_regs,
+                    has_upstream, dwOptions & CRONO_KERNEL_PCIE_TUNE_DRY_RUN);
+        }
+        if (CRONO_SUCCESS == ret && NULL != pResult) {
+                crono_link_fill_info(&regs, &up_device, &up_regs,
+                                     has_upstream, pResult);
+        }
+        crono_config_free(&up_device);
+        return ret;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_PcieApplyProfile(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                              uint32_t profile, uint32_t dwOptions,
+                              CRONO_KERNEL_PCIE_LINK_INFO *pResult) {
+        CRONO_KERNEL_PCIE_LINK_INFO info;
+        CRONO_KERNEL_PCIE_TUNING tuning;
+        uint32_t ret;
+
+        // Current settings
+        ret = CRONO_KERNEL_PcieGetLinkInfo(hDev, &info);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+
+        switch (profile) {
+        case CRONO_KERNEL_PCIE_PROFILE_THROUGHPUT:
+                tuning.maxReadRequest = 4096;
+                tuning.relaxedOrdering = 1;
+                break;
+        case CRONO_KERNEL_PCIE_PROFILE_LATENCY:
+                tuning.maxReadRequest = info.device.maxPayload;
+                tuning.relaxedOrdering = -1;
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        // Disable ASPM, exiting L0s or L1 delays the transfers
+        tuning.aspm = 0;
+        return CRONO_KERNEL_PcieTune(hDev, &tuning, dwOptions, pResult);
+}
+
+// ____________
+// Link monitor
+//
+struct CRONO_KERNEL_LINK_MONITOR {
+        PCRONO_KERNEL_DEVICE pDevice;
+        uint32_t options;
+        uint32_t exp_cap; // Offset of the PCI Express capability.
+        uint32_t aer_cap; // Offset of the AER capability, 0 if none.
+
+        // The upstream port, which reports link retraining
+        CRONO_KERNEL_DEVICE up_device;
+        bool has_upstream;
+        uint32_t up_exp_cap;
+        uint16_t up_bw_status; // Bandwidth status bits of the previous sample.
+
+        // Serializes samples, which run on the monitor thread and callers
+        std::mutex sample_mutex;
+        uint64_t cor_total;   // Errors counted at the previous sample, for
+        uint64_t uncor_total; // the rates.
+
+        // Guards `stats` only, so snapshots never wait for a sample
+        std::mutex stats_mutex;
+        CRONO_KERNEL_LINK_STATS stats;
+
+        std::thread thread;
+        std::mutex stop_mutex;
+        std::condition_variable stop_cond;
+        bool stop;
+};
+
+static uint32_t crono_link_popcount(uint32_t bits) {
+        return (uint32_t)__builtin_popcount(bits);
+}
+
+/**
+ * Reads the `TOTAL_ERR_XXX` line of a sysfs aer_dev_XXX file, e.g.
+ * `TOTAL_ERR_COR 2`.
+ */
+static int crono_link_read_sysfs_aer(PCRONO_KERNEL_DEVICE pDevice,
+                                     const char *attr_name,
+                                     const char *total_name,
+                                     uint64_t *pTotal) {
+        char value[2048];
+        const char *line;
+        size_t total_name_len = strlen(total_name);
+        int ret;
+
+        ret = crono_read_sys_device_attr(
+            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction, attr_name,
+            value, sizeof(value));
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        for (line = value; NULL != line && '\0' != *line;
+             line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+                if (0 == strncmp(line, total_name, total_name_len) &&
+                    ' ' == line[total_name_len]) {
+                        *pTotal = strtoull(&line[total_name_len + 1], NULL, 10);
+                        return CRONO_SUCCESS;
+                }
+        }
+        return -ENOENT;
+}
+
+static int crono_link_monitor_sample(CRONO_KERNEL_LINK_MONITOR *pMon) {
+        PCRONO_KERNEL_DEVICE pDevice = pMon->pDevice;
+        CRONO_KERNEL_LINK_STATS stats;
+        uint16_t lnksta;
+        uint16_t bw_status;
+        uint32_t cor_status = 0;
+        uint32_t uncor_status = 0;
+        uint64_t cor_total;
+        uint64_t uncor_total;
+        uint64_t now;
+        int ret;
+
+        std::lock_guard<std::mutex> sample_lock(pMon->sample_mutex);
+        {
+                std::lock_guard<std::mutex> lock(pMon->stats_mutex);
+                stats = pMon->stats;
+        }
+        now = crono_link_now_ns();
+
+        // Link status of the device
+        ret = crono_config_read(pDevice, pMon->exp_cap + PCI_EXP_LNKSTA,
+                                &lnksta, sizeof(lnksta));
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        if (stats.samples > 0 &&
+            (crono_link_speed(lnksta & PCI_EXP_LNKSTA_CLS) != stats.linkSpeed ||
+             ((lnksta & PCI_EXP_LNKSTA_NLW) >> PCI_EXP_LNKSTA_NLW_SHIFT) !=
+                 stats.linkWidth)) {
+                stats.linkChanges++;
+        }
+        stats.linkSpeed = crono_link_speed(lnksta & PCI_EXP_LNKSTA_CLS);
+        stats.linkWidth =
+            (lnksta & PCI_EXP_LNKSTA_NLW) >> PCI_EXP_LNKSTA_NLW_SHIFT;
+        stats.linkDegraded = (stats.linkSpeed < stats.maxLinkSpeed ||
+                              stats.linkWidth < stats.maxLinkWidth)
+                                 ? 1
+                                 : 0;
+
+        // The bandwidth status bits of the upstream port are set when the
+        // link retrains, and cleared by writing 1
+        if (pMon->has_upstream &&
+            CRONO_SUCCESS ==
+                crono_config_read(&pMon->up_device,
+                                  pMon->up_exp_cap + PCI_EXP_LNKSTA, &lnksta,
+                                  sizeof(lnksta))) {
+                bw_status =
+                    lnksta & (PCI_EXP_LNKSTA_LBMS | PCI_EXP_LNKSTA_LABS);
+                if (pMon->options & CRONO_KERNEL_LINK_MONITOR_CLEAR_STATUS) {
+                        stats.bandwidthChanges +=
+                            crono_link_popcount(bw_status);
+                        if (0 != bw_status) {
+                                crono_config_write(
+                                    &pMon->up_device,
+                                    pMon->up_exp_cap + PCI_EXP_LNKSTA,
+                                    &bw_status, sizeof(bw_status));
+                        }
+                } else {
+                        stats.bandwidthChanges += crono_link_popcount(
+                            bw_status & ~pMon->up_bw_status);
+                        pMon->up_bw_status = bw_status;
+                }
+        }
+
+        // AER status registers, a bit newly set is an error
+        if (0 != pMon->aer_cap) {
+                ret = crono_config_read(pDevice,
+                                        pMon->aer_cap + PCI_ERR_COR_STATUS,
+                                        &cor_status, sizeof(cor_status));
+                if (CRONO_SUCCESS == ret) {
+                        ret = crono_config_read(
+                            pDevice, pMon->aer_cap + PCI_ERR_UNCOR_STATUS,
+                            &uncor_status, sizeof(uncor_status));
+                }
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                if (pMon->options & CRONO_KERNEL_LINK_MONITOR_CLEAR_STATUS) {
+                        stats.corErrors += crono_link_popcount(cor_status);
+                        stats.uncorErrors += crono_link_popcount(uncor_status);
+                        if (0 != cor_status) {
+                                crono_config_write(
+                                    pDevice, pMon->aer_cap + PCI_ERR_COR_STATUS,
+                                    &cor_status, sizeof(cor_status));
+                        }
+                        if (0 != uncor_status) {
+                                crono_config_write(
+                                    pDevice,
+                                    pMon->aer_cap + PCI_ERR_UNCOR_STATUS,
+                                    &uncor_status, sizeof(uncor_status));
+                        }
+                } else {
+                        stats.corErrors +=
+                            crono_link_popcount(cor_status & ~stats.corStatus);
+                        stats.uncorErrors += crono_link_popcount(
+                            uncor_status & ~stats.uncorStatus);
+                }
+                stats.corStatus = cor_status;
+                stats.uncorStatus = uncor_status;
+        }
+
+        // Kernel AER counters, only if all are found
+        stats.hasSysfsAer =
+            CRONO_SUCCESS == crono_link_read_sysfs_aer(
+                                 pDevice, "aer_dev_correctable",
+                                 "TOTAL_ERR_COR", &stats.sysfsCorErrors) &&
+            CRONO_SUCCESS ==
+                crono_link_read_sysfs_aer(pDevice, "aer_dev_nonfatal",
+                                          "TOTAL_ERR_NONFATAL",
+                                          &stats.sysfsNonFatalErrors) &&
+            CRONO_SUCCESS == crono_link_read_sysfs_aer(
+                                 pDevice, "aer_dev_fatal", "TOTAL_ERR_FATAL",
+                                 &stats.sysfsFatalErrors);
+
+        // Rates over the period since the previous sample
+        if (stats.hasSysfsAer) {
+                cor_total = stats.sysfsCorErrors;
+                uncor_total =
+                    stats.sysfsNonFatalErrors + stats.sysfsFatalErrors;
+        } else {
+                cor_total = stats.corErrors;
+                uncor_total = stats.uncorErrors;
+        }
+        if (stats.samples > 0 && now > stats.timestampNs) {
+                double seconds = (now - stats.timestampNs) / 1e9;
+                stats.corErrorRate =
+                    cor_total >= pMon->cor_total
+                        ? (cor_total - pMon->cor_total) / seconds
+                        : 0;
+                stats.uncorErrorRate =
+                    uncor_total >= pMon->uncor_total
+                        ? (uncor_total - pMon->uncor_total) / seconds
+                        : 0;
+        }
+        pMon->cor_total = cor_total;
+        pMon->uncor_total = uncor_total;
+        stats.samples++;
+        stats.timestampNs = now;
+
+        std::lock_guard<std::mutex> lock(pMon->stats_mutex);
+        pMon->stats = stats;
+        return CRONO_SUCCESS;
+}
+
+static void crono_link_monitor_thread(CRONO_KERNEL_LINK_MONITOR *pMon,
+                                      uint32_t periodMs) {
+        std::unique_lock<std::mutex> lock(pMon->stop_mutex);
+
+        while (!pMon->stop_cond.wait_for(
+            lock, std::chrono::milliseconds(periodMs),
+            [pMon] { return pMon->stop; })) {
+                lock.unlock();
+                crono_link_monitor_sample(pMon);
+                lock.lock();
+        }
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorStart(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                              uint32_t periodMs, uint32_t dwOptions,
+                              CRONO_KERNEL_LINK_MONITOR **ppMon) {
+        CRONO_KERNEL_LINK_MONITOR *pMon;
+        uint32_t lnkcap;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(ppMon);
+
+        pMon = new (std::nothrow) CRONO_KERNEL_LINK_MONITOR();
+        CRONO_RET_ERR_CODE_IF_NULL(pMon, -ENOMEM);
+        pMon->pDevice = pDevice;
+        pMon->options = dwOptions;
+
+        // Registers are found once
+        ret = crono_config_find_cap(pDevice, 0, PCI_CAP_ID_EXP,
+                                    &pMon->exp_cap, NULL);
+        if (CRONO_SUCCESS == ret) {
+                ret = crono_config_read(pDevice,
+                                        pMon->exp_cap + PCI_EXP_LNKCAP,
+                                        &lnkcap, sizeof(lnkcap));
+        }
+        if (CRONO_SUCCESS != ret) {
+                delete pMon;
+                return ret;
+        }
+        pMon->stats.maxLinkSpeed =
+            crono_link_speed(lnkcap & PCI_EXP_LNKCAP_SLS);
+        pMon->stats.maxLinkWidth = (lnkcap & PCI_EXP_LNKCAP_MLW) >> 4;
+        if (CRONO_SUCCESS == crono_config_find_cap(pDevice, 1,
+                                                   PCI_EXT_CAP_ID_ERR,
+                                                   &pMon->aer_cap, NULL)) {
+                pMon->stats.hasAer = 1;
+        } else {
+                pMon->aer_cap = 0;
+        }
+        if (CRONO_SUCCESS ==
+                crono_get_upstream_port(
+                    pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+                    pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction,
+                    &pMon->up_device.pciSlot) &&
+            CRONO_SUCCESS == crono_config_find_cap(&pMon->up_device, 0,
+                                                   PCI_CAP_ID_EXP,
+                                                   &pMon->up_exp_cap, NULL)) {
+                pMon->has_upstream = true;
+        }
+
+        // First sample, errors already latched are counted
+        ret = crono_link_monitor_sample(pMon);
+        if (CRONO_SUCCESS != ret) {
+                crono_config_free(&pMon->up_device);
+                delete pMon;
+                return ret;
+        }
+        if (0 != periodMs) {
+                try {
+                        pMon->thread = std::thread(crono_link_monitor_thread,
+                                                   pMon, periodMs);
+                } catch (const std::system_error &e) {
+                        crono_config_free(&pMon->up_device);
+                        delete pMon;
+                        return e.code().value();
+                }
+        }
+        *ppMon = pMon;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorSample(CRONO_KERNEL_LINK_MONITOR *pMon) {
+        CRONO_RET_INV_PARAM_IF_NULL(pMon);
+        return crono_link_monitor_sample(pMon);
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorSnapshot(CRONO_KERNEL_LINK_MONITOR *pMon,
+                                 CRONO_KERNEL_LINK_STATS *pStats) {
+        CRONO_RET_INV_PARAM_IF_NULL(pMon);
+        CRONO_RET_INV_PARAM_IF_NULL(pStats);
+
+        std::lock_guard<std::mutex> lock(pMon->stats_mutex);
+        *pStats = pMon->stats;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_LinkMonitorStop(CRONO_KERNEL_LINK_MONITOR *pMon) {
+        CRONO_RET_INV_PARAM_IF_NULL(pMon);
+
+        if (pMon->thread.joinable()) {
+                {
+                        std::lock_guard<std::mutex> lock(pMon->stop_mutex);
+                        pMon->stop = true;
+                }
+                pMon->stop_cond.notify_one();
+                pMon->thread.join();
+        }
+        crono_config_free(&pMon->up_device);
+        delete pMon;
+        return CRONO_SUCCESS;
+}
@@ -0,0 +1,196 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+/**
+ * Parses a sysfs CPU list string (e.g. "0-7,16-23") into `pSet`.
+ *
+ * @param list[in]: The null-terminated CPU list.
+ * @param pSet[out]: The CPU set to be filled, it is cleared first.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `-EINVAL` if the list is
+ * malformed.
+ */
+static int crono_parse_cpulist(const char *list, cpu_set_t *pSet) {
+        const char *cursor = list;
+        char *end;
+
+        CPU_ZERO(pSet);
+        while (*cursor != '\0') {
+                unsigned long first, last;
+
+                first = strtoul(cursor, &end, 10);
+                if (end == cursor) {
+                        return -EINVAL;
+                }
+                last = first;
+                cursor = end;
+                if (*cursor == '-') {
+                        cursor++;
+                        last = strtoul(cursor, &end, 10);
+                        if (end == cursor || last < first) {
+                                return -EINVAL;
+                        }
+                        cursor = end;
+                }
+                for (unsigned long cpu = first;
+                     cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                        CPU_SET(cpu, pSet);
+                }
+                if (*cursor == ',') {
+                        cursor++;
+                } else if (*cursor != '\0') {
+                        return -EINVAL;
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+uint32_t fill_device_numa_info(PCRONO_KERNEL_DEVICE pDevice) {
+        char cpulist[CRONO_KERNEL_CPULIST_MAX];
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pDevice);
+        pDevice->numa_node = -1;
+        CPU_ZERO(&pDevice->local_cpus);
+
+        // Both attributes are optional, e.g. not found on some virtual
+        // machines, so their absence is not an error.
+        ret = crono_get_device_numa_node(
+            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction,
+            &pDevice->numa_node);
+        if (CRONO_SUCCESS != ret) {
+                CRONO_DEBUG("NUMA node is not found, error <%d>\n", ret);
+                pDevice->numa_node = -1;
+        }
+        ret = crono_get_device_local_cpulist(
+            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction, cpulist,
+            sizeof(cpulist));
+        if (CRONO_SUCCESS == ret) {
+                if (CRONO_SUCCESS !=
+                    crono_parse_cpulist(cpulist, &pDevice->local_cpus)) {
+                        CRONO_DEBUG("Invalid local CPU list <%s>\n", cpulist);
+                        CPU_ZERO(&pDevice->local_cpus);
+                }
+        }
+        CRONO_DEBUG("Device NUMA node <%d>, local CPUs count <%d>\n",
+                    pDevice->numa_node, CPU_COUNT(&pDevice->local_cpus));
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_GetDeviceNumaInfo(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, CRONO_KERNEL_NUMA_INFO *pInfo) {
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pInfo);
+        memset(pInfo, 0, sizeof(CRONO_KERNEL_NUMA_INFO));
+
+        pInfo->numaNode = pDevice->numa_node;
+        pInfo->localCpuCount = CPU_COUNT(&pDevice->local_cpus);
+
+        // Read the list text as is, it is not kept in `pDevice`
+        ret = crono_get_device_local_cpulist(
+            pDevice->pciSlot.dwDomain, pDevice->pciSlot.dwBus,
+            pDevice->pciSlot.dwSlot, pDevice->pciSlot.dwFunction,
+            pInfo->localCpuList, sizeof(pInfo->localCpuList));
+        if (CRONO_SUCCESS != ret) {
+                pInfo->localCpuList[0] = '\0';
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_AllocDeviceLocalBuffer(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, size_t size, void **ppBuf) {
+        size_t page_size = PAGE_SIZE;
+        size_t alloc_size;
+        void *buf;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(ppBuf);
+        CRONO_RET_INV_PARAM_IF_ZERO(size);
+        *ppBuf = NULL;
+
+        alloc_size = ((size + page_size - 1) / page_size) * page_size;
+        buf = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+                printf("Error allocating device local buffer of size <%lu>: "
+                       "<%d> <%s>\n",
+                       alloc_size, errno, strerror(errno));
+                return errno;
+        }
+
+        // Bind the pages to the device node before they are faulted in, so
+        // they are allocated there.
+        if (pDevice->numa_node >= 0) {
+                const size_t bits_per_long = 8 * sizeof(unsigned long);
+                unsigned long node_mask[(CPU_SETSIZE / bits_per_long) + 1];
+                unsigned long max_node = pDevice->numa_node + 1;
+
+                memset(node_mask, 0, sizeof(node_mask));
+                if ((unsigned long)pDevice->numa_node <
+                    sizeof(node_mask) * 8) {
+                        node_mask[pDevice->numa_node / bits_per_long] |=
+                            1UL << (pDevice->numa_node % bits_per_long);
+                        // `maxnode` is the count of bits plus one, as done by
+                        // libnuma.
+                        if (0 != syscall(SYS_mbind, buf, alloc_size,
+                                         MPOL_BIND, node_mask, max_node + 1,
+                                         MPOL_MF_MOVE)) {
+                                // Not fatal, e.g. kernel without NUMA support
+                                CRONO_DEBUG("mbind to node <%d> failed: <%d> "
+                                            "<%s>\n",
+                                            pDevice->numa_node, errno,
+                                            strerror(errno));
+                        }
+                }
+        }
+
+        *ppBuf = buf;
+        CRONO_DEBUG("Allocated device local buffer <%p>, size <%lu>, node "
+                    "<%d>\n",
+                    buf, alloc_size, pDevice->numa_node);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_FreeDeviceLocalBuffer(void *pBuf,
+                                                             size_t size) {
+        size_t page_size = PAGE_SIZE;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+        CRONO_RET_INV_PARAM_IF_ZERO(size);
+
+        if (munmap(pBuf, ((size + page_size - 1) / page_size) * page_size) ==
+            -1) {
+                printf("Failed to free device local buffer <%p>: <%d> <%s>\n",
+                       pBuf, errno, strerror(errno));
+                return errno;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_SetThreadDeviceAffinity(CRONO_KERNEL_DEVICE_HANDLE hDev) {
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        if (0 == CPU_COUNT(&pDevice->local_cpus)) {
+                return -ENOENT;
+        }
+
+        // Zero pid is the calling thread
+        if (0 != sched_setaffinity(0, sizeof(cpu_set_t),
+                                   &pDevice->local_cpus)) {
+                printf("Error setting thread affinity: <%d> <%s>\n", errno,
+                       strerror(errno));
+                return errno;
+        }
+        return CRONO_SUCCESS;
+}
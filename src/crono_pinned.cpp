@@ -0,0 +1,204 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <mutex>
+#include <sys/resource.h>
+#include <vector>
+
+/**
+ * A buffer at `addr` locked on `pDevice`, `bytes` accounted for it, and the
+ * range of the pages lying entirely inside it, [start, end), which are
+ * advised. `unprotected` bytes of the buffer lie outside the range.
+ */
+typedef struct {
+        PCRONO_KERNEL_DEVICE pDevice;
+        uintptr_t addr;
+        uint64_t bytes;
+        uintptr_t start;
+        uintptr_t end;
+        uint64_t unprotected;
+} CRONO_PINNED_RANGE;
+
+/**
+ * Process-wide pinned memory accounting, guarded by `pinned_mutex`.
+ */
+static std::mutex pinned_mutex;
+static std::vector<CRONO_PINNED_RANGE> pinned_ranges;
+static uint64_t pinned_bytes = 0;
+static uint64_t pinned_peak_bytes = 0;
+static uint64_t pinned_rejected = 0;
+static uint64_t pinned_unprotected_bytes = 0;
+static uint64_t pinned_limit = CRONO_KERNEL_PINNED_LIMIT_NONE;
+
+/**
+ * Returns the effective limit in bytes, zero if unlimited.
+ * `pinned_mutex` must be held.
+ */
+static uint64_t crono_pinned_effective_limit() {
+        struct rlimit rlim;
+
+        if (CRONO_KERNEL_PINNED_LIMIT_RLIMIT != pinned_limit) {
+                return pinned_limit;
+        }
+        if (0 != getrlimit(RLIMIT_MEMLOCK, &rlim) ||
+            RLIM_INFINITY == rlim.rlim_cur) {
+                return 0;
+        }
+        return rlim.rlim_cur;
+}
+
+/**
+ * Bytes accounted for a buffer of `size` bytes, whole pages.
+ */
+static uint64_t crono_pinned_bytes(size_t size) {
+        return ((uint64_t)size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+/**
+ * Gets the range of a buffer. Pages the buffer shares with other memory, e.g.
+ * heap memory around a `malloc`ed buffer, are left out, they would be missing
+ * in a child process otherwise.
+ */
+static CRONO_PINNED_RANGE crono_pinned_page_range(PCRONO_KERNEL_DEVICE pDevice,
+                                                  void *addr, size_t size) {
+        size_t page_size = PAGE_SIZE;
+        CRONO_PINNED_RANGE range;
+
+        range.pDevice = pDevice;
+        range.addr = (uintptr_t)addr;
+        range.bytes = crono_pinned_bytes(size);
+        range.start = ((uintptr_t)addr + page_size - 1) & ~(page_size - 1);
+        range.end = ((uintptr_t)addr + size) & ~(page_size - 1);
+        if (range.end < range.start) {
+                range.end = range.start;
+        }
+        range.unprotected = size - (range.end - range.start);
+        return range;
+}
+
+static void crono_pinned_advise(uintptr_t start, uintptr_t end, bool pinned) {
+        if (start >= end) {
+                return;
+        }
+        // Failure is not fatal, the buffer is locked anyway
+        if (0 != madvise((void *)start, end - start,
+                         pinned ? MADV_DONTFORK : MADV_DOFORK)) {
+                CRONO_DEBUG("madvise fork advice failed: <%d> <%s>\n", errno,
+                            strerror(errno));
+        }
+        madvise((void *)start, end - start,
+                pinned ? MADV_DONTDUMP : MADV_DODUMP);
+}
+
+int crono_pinned_reserve(size_t size) {
+        std::lock_guard<std::mutex> lock(pinned_mutex);
+        uint64_t limit = crono_pinned_effective_limit();
+        uint64_t bytes = crono_pinned_bytes(size);
+
+        if (0 != limit && pinned_bytes + bytes > limit) {
+                pinned_rejected++;
+                printf("Error: locking <%lu> bytes exceeds pinned memory "
+                       "limit <%lu>, <%lu> bytes are already locked\n",
+                       bytes, limit, pinned_bytes);
+                return -ENOMEM;
+        }
+        pinned_bytes += bytes;
+        pinned_peak_bytes = std::max(pinned_peak_bytes, pinned_bytes);
+        return CRONO_SUCCESS;
+}
+
+void crono_pinned_unreserve(size_t size) {
+        std::lock_guard<std::mutex> lock(pinned_mutex);
+
+        pinned_bytes -= std::min(pinned_bytes, crono_pinned_bytes(size));
+}
+
+void crono_pinned_register(PCRONO_KERNEL_DEVICE pDevice, void *addr,
+                           size_t size) {
+        std::lock_guard<std::mutex> lock(pinned_mutex);
+        CRONO_PINNED_RANGE range = crono_pinned_page_range(pDevice, addr, size);
+
+        crono_pinned_advise(range.start, range.end, true);
+        pinned_ranges.push_back(range);
+        pinned_unprotected_bytes += range.unprotected;
+
+        pDevice->pinned_bytes += range.bytes;
+        pDevice->pinned_buffers++;
+}
+
+void crono_pinned_unregister(PCRONO_KERNEL_DEVICE pDevice, void *addr) {
+        std::lock_guard<std::mutex> lock(pinned_mutex);
+        CRONO_PINNED_RANGE range;
+        std::vector<CRONO_PINNED_RANGE> others;
+        uintptr_t cursor;
+
+        // Drop the range of this buffer
+        auto found = std::find_if(pinned_ranges.begin(), pinned_ranges.end(),
+                                  [&](const CRONO_PINNED_RANGE &r) {
+                                          return r.pDevice == pDevice &&
+                                                 r.addr == (uintptr_t)addr;
+                                  });
+        if (found == pinned_ranges.end()) {
+                return;
+        }
+        range = *found;
+        pinned_ranges.erase(found);
+
+        // Restore the advice on the pages not used by other locked buffers
+        for (const auto &other : pinned_ranges) {
+                if (other.start < range.end && other.end > range.start) {
+                        others.push_back(other);
+                }
+        }
+        std::sort(others.begin(), others.end(),
+                  [](const CRONO_PINNED_RANGE &a, const CRONO_PINNED_RANGE &b) {
+                          return a.start < b.start;
+                  });
+        cursor = range.start;
+        for (const auto &other : others) {
+                crono_pinned_advise(cursor, std::min(other.start, range.end),
+                                    false);
+                cursor = std::max(cursor, other.end);
+        }
+        crono_pinned_advise(cursor, range.end, false);
+
+        pDevice->pinned_bytes -= std::min(pDevice->pinned_bytes, range.bytes);
+        if (pDevice->pinned_buffers > 0) {
+                pDevice->pinned_buffers--;
+        }
+        pinned_bytes -= std::min(pinned_bytes, range.bytes);
+        pinned_unprotected_bytes -=
+            std::min(pinned_unprotected_bytes, range.unprotected);
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_SetPinnedMemLimit(uint64_t limitBytes) {
+        std::lock_guard<std::mutex> lock(pinned_mutex);
+        pinned_limit = limitBytes;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_GetPinnedMemStats(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, CRONO_KERNEL_PINNED_STATS *pStats) {
+        PCRONO_KERNEL_DEVICE pDevice = (PCRONO_KERNEL_DEVICE)hDev;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pStats);
+        if (NULL != pDevice && 0 == pDevice->dwDeviceId) {
+                return -EINVAL;
+        }
+        memset(pStats, 0, sizeof(CRONO_KERNEL_PINNED_STATS));
+
+        std::lock_guard<std::mutex> lock(pinned_mutex);
+        if (NULL != pDevice) {
+                pStats->devicePinnedBytes = pDevice->pinned_bytes;
+                pStats->deviceBuffers = pDevice->pinned_buffers;
+        }
+        pStats->processBuffers = (uint32_t)pinned_ranges.size();
+        pStats->processPinnedBytes = pinned_bytes;
+        pStats->processPeakBytes = pinned_peak_bytes;
+        pStats->limitBytes = crono_pinned_effective_limit();
+        pStats->rejectedLocks = pinned_rejected;
+        pStats->unprotectedBytes = pinned_unprotected_bytes;
+        return CRONO_SUCCESS;
+}
@@ -0,0 +1,213 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // Linux 5.14
+#endif
+
+/**
+ * Maximum count of threads used to prefault a buffer when the count is
+ * selected automatically.
+ */
+#define CRONO_PREFAULT_MAX_AUTO_THREADS 16
+
+/**
+ * Minimum size of buffer chunk prefaulted by a single thread when the count
+ * of threads is selected automatically.
+ */
+#define CRONO_PREFAULT_MIN_CHUNK_SIZE (64UL * 1024 * 1024)
+
+/**
+ * Prefault work of a single thread.
+ */
+typedef struct {
+        char *start;     // Page-aligned start address.
+        size_t size;     // Size in bytes, multiple of page size.
+        bool populate;   // Try MADV_POPULATE_WRITE first.
+        cpu_set_t *cpus; // CPUs to run on, NULL to keep current affinity.
+        int err;         // [out] `CRONO_SUCCESS` or `errno`.
+        uint32_t method; // [out] CRONO_KERNEL_PREFAULT_XXX used.
+} CRONO_PREFAULT_CHUNK;
+
+static uint64_t crono_monotonic_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void crono_prefault_chunk(CRONO_PREFAULT_CHUNK *chunk) {
+        size_t page_size = PAGE_SIZE;
+
+        if (chunk->cpus != NULL) {
+                // Faulted pages are allocated on the node of the running CPU
+                // unless the buffer memory is bound, so run near the device.
+                sched_setaffinity(0, sizeof(cpu_set_t), chunk->cpus);
+        }
+
+        chunk->err = CRONO_SUCCESS;
+        if (chunk->populate) {
+                if (0 == madvise(chunk->start, chunk->size,
+                                 MADV_POPULATE_WRITE)) {
+                        chunk->method = CRONO_KERNEL_PREFAULT_POPULATE;
+                        return;
+                }
+                if (errno != EINVAL) {
+                        // Supported, but failed, e.g. `ENOMEM` or `EFAULT`
+                        chunk->err = errno;
+                        return;
+                }
+                // Kernel earlier than 5.14, fall back to touching the pages
+        }
+
+        // Atomic no-op write faults the page in writable without losing a
+        // value written concurrently by the application.
+        for (size_t offset = 0; offset < chunk->size; offset += page_size) {
+                __atomic_fetch_or(chunk->start + offset, (char)0,
+                                  __ATOMIC_RELAXED);
+        }
+        chunk->method = CRONO_KERNEL_PREFAULT_TOUCH;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_PrefaultBuffer(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf, size_t size,
+    uint32_t dwPrefaultOptions, uint32_t dwThreads,
+    CRONO_KERNEL_PREFAULT_TIMING *pTiming) {
+        size_t page_size = PAGE_SIZE;
+        uintptr_t start, end;
+        size_t pages_count, pages_per_thread;
+        uint64_t start_ns;
+        uint32_t method = CRONO_KERNEL_PREFAULT_NONE;
+        int ret = CRONO_SUCCESS;
+
+        // ______________________________________
+        // Init variables and validate parameters
+        //
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pBuf);
+        CRONO_RET_INV_PARAM_IF_ZERO(size);
+        start_ns = crono_monotonic_ns();
+
+        // `madvise` needs page-aligned ranges, cover all pages of the buffer
+        start = ((uintptr_t)pBuf) & ~(page_size - 1);
+        end = ((uintptr_t)pBuf + size + page_size - 1) & ~(page_size - 1);
+        pages_count = (end - start) / page_size;
+
+        if (dwPrefaultOptions & CRONO_KERNEL_PREFAULT_HUGEPAGE) {
+                // Only a hint, e.g. THP may be disabled
+                madvise((void *)start, end - start, MADV_HUGEPAGE);
+        }
+
+        if (0 == dwThreads) {
+                size_t by_size =
+                    (end - start + CRONO_PREFAULT_MIN_CHUNK_SIZE - 1) /
+                    CRONO_PREFAULT_MIN_CHUNK_SIZE;
+                size_t by_cpus = CPU_COUNT(&pDevice->local_cpus);
+                if (0 == by_cpus) {
+                        by_cpus = std::thread::hardware_concurrency();
+                }
+                dwThreads = (uint32_t)std::min(
+                    {by_size, by_cpus, (size_t)CRONO_PREFAULT_MAX_AUTO_THREADS});
+                if (0 == dwThreads) {
+                        dwThreads = 1;
+                }
+        }
+        if (dwThreads > pages_count) {
+                dwThreads = (uint32_t)pages_count;
+        }
+
+        // _______________________________
+        // Split the pages between threads
+        //
+        std::vector<CRONO_PREFAULT_CHUNK> chunks(dwThreads);
+        pages_per_thread = (pages_count + dwThreads - 1) / dwThreads;
+        for (uint32_t ithread = 0; ithread < dwThreads; ithread++) {
+                size_t first_page = ithread * pages_per_thread;
+                size_t last_page =
+                    std::min(first_page + pages_per_thread, pages_count);
+                chunks[ithread].start = (char *)start + first_page * page_size;
+                chunks[ithread].size =
+                    last_page > first_page
+                        ? (last_page - first_page) * page_size
+                        : 0;
+                chunks[ithread].populate =
+                    !(dwPrefaultOptions & CRONO_KERNEL_PREFAULT_FORCE_TOUCH);
+                chunks[ithread].cpus = CPU_COUNT(&pDevice->local_cpus)
+                                           ? &pDevice->local_cpus
+                                           : NULL;
+                chunks[ithread].err = CRONO_SUCCESS;
+                chunks[ithread].method = CRONO_KERNEL_PREFAULT_NONE;
+        }
+
+        // ________
+        // Prefault
+        //
+        if (1 == dwThreads) {
+                // Don't change the affinity of the calling thread
+                chunks[0].cpus = NULL;
+                crono_prefault_chunk(&chunks[0]);
+        } else {
+                std::vector<std::thread> threads;
+                threads.reserve(dwThreads);
+                for (uint32_t ithread = 0; ithread < dwThreads; ithread++) {
+                        if (0 == chunks[ithread].size) {
+                                continue;
+                        }
+                        threads.emplace_back(crono_prefault_chunk,
+                                             &chunks[ithread]);
+                }
+                for (auto &thread : threads) {
+                        thread.join();
+                }
+        }
+        for (const auto &chunk : chunks) {
+                if (CRONO_SUCCESS != chunk.err && CRONO_SUCCESS == ret) {
+                        ret = chunk.err;
+                }
+                if (chunk.method > method) {
+                        method = chunk.method;
+                }
+        }
+
+        CRONO_DEBUG("Prefaulted buffer <%p>, size <%lu>, threads <%u>, method "
+                    "<%u>, error <%d>\n",
+                    pBuf, size, dwThreads, method, ret);
+        if (NULL != pTiming) {
+                pTiming->prefaultNs = crono_monotonic_ns() - start_ns;
+                pTiming->method = method;
+                pTiming->threads = dwThreads;
+        }
+        return ret;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGBufPrefaultLock(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, void *pBuf, uint32_t dwOptions,
+    uint32_t dwDMABufSize, CRONO_KERNEL_DMA_SG **ppDma,
+    uint32_t dwPrefaultOptions, CRONO_KERNEL_PREFAULT_TIMING *pTiming) {
+        CRONO_KERNEL_PREFAULT_TIMING timing;
+        uint64_t start_ns;
+        uint32_t ret;
+
+        memset(&timing, 0, sizeof(timing));
+        ret = CRONO_KERNEL_PrefaultBuffer(hDev, pBuf, dwDMABufSize,
+                                          dwPrefaultOptions, 0, &timing);
+        if (CRONO_SUCCESS != ret) {
+                printf("Error prefaulting buffer <%p>: <%d>\n", pBuf, ret);
+                return ret;
+        }
+
+        start_ns = crono_monotonic_ns();
+        ret = CRONO_KERNEL_DMASGBufLock(hDev, pBuf, dwOptions, dwDMABufSize,
+                                        ppDma);
+        timing.lockNs = crono_monotonic_ns() - start_ns;
+
+        if (NULL != pTiming) {
+                *pTiming = timing;
+        }
+        return ret;
+}
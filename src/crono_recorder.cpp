@@ -0,0 +1,465 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_recorder.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <linux/io_uring.h>
+#include <new>
+#include <time.h>
+#include <vector>
+
+#define CRONO_RECORDER_DEFAULT_CHUNK (4 * 1024 * 1024)
+#define CRONO_RECORDER_DEFAULT_DEPTH 8
+#define CRONO_RECORDER_MAX_DEPTH 256
+
+/**
+ * A write in flight, or completed but behind one in flight.
+ */
+typedef struct {
+        const uint8_t *data; // Source in the ring.
+        uint64_t position;   // Stream position of the first byte.
+        uint64_t offset;     // File offset.
+        uint32_t length;     // Bytes to write.
+        bool done;
+} CRONO_RECORDER_WRITE;
+
+struct CRONO_KERNEL_RECORDER {
+        const uint8_t *ring;
+        uint64_t ring_size;
+        uint32_t chunk_size;
+        uint32_t depth;
+        uint32_t flags;
+        int fd;
+        bool uring_ok;     // `uring` is set up.
+        bool uring_writes; // New writes are queued to `uring`.
+        CRONO_URING uring;
+
+        // FIFO of writes in submission order, the released position is the
+        // one of the oldest write not done.
+        std::vector<CRONO_RECORDER_WRITE> writes;
+        uint32_t head;
+        uint32_t count;
+
+        uint64_t submitted;   // Stream position queued up to.
+        uint64_t file_offset; // File offset of the next write.
+        uint64_t start_ns;    // Time of the first write, 0 before.
+        CRONO_KERNEL_RECORDER_STATS stats;
+};
+
+static uint64_t crono_recorder_now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Writes synchronously, returns the bytes written or -errno.
+ */
+static int64_t crono_recorder_pwrite(int fd, const uint8_t *data,
+                                     uint64_t length, uint64_t offset) {
+        uint64_t done = 0;
+
+        while (done < length) {
+                ssize_t bytes =
+                    pwrite64(fd, data + done, length - done, offset + done);
+                if (bytes < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return done > 0 ? (int64_t)done : -errno;
+                }
+                if (0 == bytes) {
+                        break;
+                }
+                done += bytes;
+        }
+        return done;
+}
+
+/**
+ * Advances the released position over the writes done.
+ */
+static void crono_recorder_release(CRONO_KERNEL_RECORDER *pRec) {
+        while (pRec->count > 0 && pRec->writes[pRec->head].done) {
+                pRec->head = (pRec->head + 1) % pRec->depth;
+                pRec->count--;
+        }
+        pRec->stats.releasedBytes = pRec->count > 0
+                                        ? pRec->writes[pRec->head].position
+                                        : pRec->submitted;
+}
+
+static void crono_recorder_complete(CRONO_KERNEL_RECORDER *pRec,
+                                    uint32_t iwrite, int64_t result) {
+        CRONO_RECORDER_WRITE *write = &pRec->writes[iwrite];
+
+        if (-EINVAL == result && pRec->uring_writes) {
+                // Kernels before 5.6 don't know the write opcode, write
+                // synchronously from now on
+                pRec->uring_writes = false;
+                result = crono_recorder_pwrite(pRec->fd, write->data,
+                                               write->length, write->offset);
+        }
+        if (result == write->length) {
+                pRec->stats.writtenBytes += write->length;
+                pRec->stats.writes++;
+        } else {
+                // The file keeps a hole, later writes keep their offsets
+                pRec->stats.writeErrors++;
+                pRec->stats.lastError = result < 0 ? (int32_t)-result : EIO;
+                pRec->stats.writtenBytes += std::max<int64_t>(result, 0);
+                pRec->stats.droppedBytes +=
+                    write->length - std::max<int64_t>(result, 0);
+                printf("Error writing <%u> bytes at file offset <%lu>: <%d>\n",
+                       write->length, write->offset, pRec->stats.lastError);
+        }
+        write->done = true;
+        pRec->stats.inFlight--;
+}
+
+/**
+ * Collects the completed writes without blocking.
+ */
+static void crono_recorder_reap(CRONO_KERNEL_RECORDER *pRec) {
+        struct io_uring_cqe cqes[CRONO_RECORDER_MAX_DEPTH];
+        unsigned reaped;
+
+        if (pRec->uring_ok) {
+                reaped = crono_uring_reap(&pRec->uring, cqes,
+                                          CRONO_RECORDER_MAX_DEPTH);
+                for (unsigned icqe = 0; icqe < reaped; icqe++) {
+                        crono_recorder_complete(pRec,
+                                                (uint32_t)cqes[icqe].user_data,
+                                                cqes[icqe].res);
+                }
+        }
+        crono_recorder_release(pRec);
+}
+
+/**
+ * Queues a write of `length` bytes of `data` at stream `position`, a slot must
+ * be free.
+ */
+static void crono_recorder_queue(CRONO_KERNEL_RECORDER *pRec,
+                                 const uint8_t *data, uint64_t position,
+                                 uint32_t length) {
+        uint32_t iwrite = (pRec->head + pRec->count) % pRec->depth;
+        CRONO_RECORDER_WRITE *write = &pRec->writes[iwrite];
+        struct io_uring_sqe *sqe = NULL;
+
+        write->data = data;
+        write->position = position;
+        write->offset = pRec->file_offset;
+        write->length = length;
+        write->done = false;
+        pRec->count++;
+        pRec->submitted = position + length;
+        pRec->file_offset += length;
+        pRec->stats.inFlight++;
+        pRec->stats.maxInFlight =
+            std::max(pRec->stats.maxInFlight, pRec->stats.inFlight);
+        if (0 == pRec->start_ns) {
+                pRec->start_ns = crono_recorder_now_ns();
+        }
+
+        if (pRec->uring_writes) {
+                sqe = crono_uring_get_sqe(&pRec->uring);
+        }
+        if (NULL == sqe) {
+                crono_recorder_complete(pRec, iwrite,
+                                        crono_recorder_pwrite(pRec->fd, data,
+                                                              length,
+                                                              write->offset));
+                crono_recorder_release(pRec);
+                return;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = pRec->fd;
+        sqe->addr = (uint64_t)(uintptr_t)data;
+        sqe->len = length;
+        sqe->off = write->offset;
+        sqe->user_data = iwrite;
+}
+
+/**
+ * Queues writes of the ring from the submitted position, while slots are free
+ * and at least `min_length` bytes are produced.
+ */
+static uint32_t crono_recorder_fill(CRONO_KERNEL_RECORDER *pRec,
+                                    uint64_t min_length) {
+        uint64_t produced = pRec->stats.producedBytes;
+        uint64_t ring_offset;
+        uint64_t length;
+        uint32_t queued = 0;
+
+        while (pRec->count < pRec->depth) {
+                ring_offset = pRec->submitted % pRec->ring_size;
+                length = std::min<uint64_t>(pRec->chunk_size,
+                                            pRec->ring_size - ring_offset);
+                length = std::min(length, produced - pRec->submitted);
+                length -= length % CRONO_KERNEL_RECORDER_ALIGN;
+                if (0 == length || length < std::min(min_length,
+                                                     pRec->ring_size -
+                                                         ring_offset)) {
+                        break;
+                }
+                crono_recorder_queue(pRec, pRec->ring + ring_offset,
+                                     pRec->submitted, (uint32_t)length);
+                queued++;
+        }
+        if (queued > 0 && pRec->uring_writes) {
+                if (CRONO_SUCCESS != crono_uring_submit(&pRec->uring, 0)) {
+                        printf("Error submitting writes: <%d>\n", errno);
+                        return errno;
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Blocks until a write in flight completes.
+ */
+static uint32_t crono_recorder_wait_one(CRONO_KERNEL_RECORDER *pRec) {
+        int ret;
+
+        if (0 == pRec->stats.inFlight || !pRec->uring_ok) {
+                return CRONO_SUCCESS;
+        }
+        ret = crono_uring_submit(&pRec->uring, 1);
+        if (CRONO_SUCCESS != ret) {
+                return -ret;
+        }
+        crono_recorder_reap(pRec);
+        return CRONO_SUCCESS;
+}
+
+static void crono_recorder_fill_stats(CRONO_KERNEL_RECORDER *pRec,
+                                      CRONO_KERNEL_RECORDER_STATS *pStats) {
+        *pStats = pRec->stats;
+        pStats->uring = pRec->uring_writes;
+        pStats->elapsedNs =
+            pRec->start_ns ? crono_recorder_now_ns() - pRec->start_ns : 0;
+        pStats->sustainedMBps =
+            pStats->elapsedNs
+                ? (double)pStats->writtenBytes * 1000.0 / pStats->elapsedNs
+                : 0;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_RecorderOpen(const CRONO_KERNEL_RECORDER_CONFIG *pConfig,
+                          CRONO_KERNEL_RECORDER **ppRec) {
+        CRONO_KERNEL_RECORDER *pRec;
+        uint32_t chunk_size;
+        uint32_t depth;
+        int open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+        // ______________________________________
+        // Init variables and validate parameters
+        //
+        CRONO_RET_INV_PARAM_IF_NULL(pConfig);
+        CRONO_RET_INV_PARAM_IF_NULL(ppRec);
+        CRONO_RET_INV_PARAM_IF_NULL(pConfig->path);
+        CRONO_RET_INV_PARAM_IF_NULL(pConfig->pRing);
+        *ppRec = NULL;
+        chunk_size = pConfig->chunkSize ? pConfig->chunkSize
+                                        : CRONO_RECORDER_DEFAULT_CHUNK;
+        depth = pConfig->queueDepth ? pConfig->queueDepth
+                                    : CRONO_RECORDER_DEFAULT_DEPTH;
+        if (((uintptr_t)pConfig->pRing % CRONO_KERNEL_RECORDER_ALIGN) ||
+            0 == pConfig->ringSize ||
+            (pConfig->ringSize % CRONO_KERNEL_RECORDER_ALIGN) ||
+            (chunk_size % CRONO_KERNEL_RECORDER_ALIGN) ||
+            depth > CRONO_RECORDER_MAX_DEPTH) {
+                printf("Error: recorder ring <%p>, ring size <%lu>, and chunk "
+                       "size <%u> must be aligned to <%d>, queue depth <%u> "
+                       "can't exceed <%d>\n",
+                       pConfig->pRing, pConfig->ringSize, chunk_size,
+                       CRONO_KERNEL_RECORDER_ALIGN, depth,
+                       CRONO_RECORDER_MAX_DEPTH);
+                return -EINVAL;
+        }
+
+        pRec = new (std::nothrow) CRONO_KERNEL_RECORDER();
+        CRONO_RET_ERR_CODE_IF_NULL(pRec, -ENOMEM);
+        pRec->ring = (const uint8_t *)pConfig->pRing;
+        pRec->ring_size = pConfig->ringSize;
+        pRec->chunk_size = chunk_size;
+        pRec->depth = depth;
+        pRec->flags = pConfig->flags;
+        try {
+                pRec->writes.resize(depth);
+        } catch (const std::bad_alloc &) {
+                delete pRec;
+                return -ENOMEM;
+        }
+
+        // ___________
+        // Create file
+        //
+        pRec->fd = open(pConfig->path, open_flags | O_DIRECT, 0644);
+        if (pRec->fd < 0 && errno == EINVAL &&
+            !(pConfig->flags & CRONO_KERNEL_RECORDER_REQUIRE_DIRECT)) {
+                // e.g. tmpfs
+                CRONO_DEBUG("O_DIRECT is not supported for <%s>\n",
+                            pConfig->path);
+                pRec->fd = open(pConfig->path, open_flags, 0644);
+        } else {
+                pRec->stats.direct = 1;
+        }
+        if (pRec->fd < 0) {
+                int err = errno;
+                printf("Error opening recorder file <%s>: <%d> <%s>\n",
+                       pConfig->path, err, strerror(err));
+                delete pRec;
+                return err;
+        }
+        if (pConfig->preallocSize > 0 &&
+            0 != fallocate(pRec->fd, 0, 0, pConfig->preallocSize)) {
+                // Not fatal, the file grows as written
+                CRONO_DEBUG("Preallocating <%lu> bytes failed: <%d> <%s>\n",
+                            pConfig->preallocSize, errno, strerror(errno));
+        }
+
+        pRec->uring_ok =
+            (CRONO_SUCCESS == crono_uring_init(&pRec->uring, depth));
+        pRec->uring_writes = pRec->uring_ok;
+        *ppRec = pRec;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_RecorderPush(CRONO_KERNEL_RECORDER *pRec, uint64_t producedBytes,
+                          uint64_t *pReleasedBytes) {
+        uint64_t resume;
+        uint32_t ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pRec);
+        if (producedBytes < pRec->stats.producedBytes) {
+                return -EINVAL;
+        }
+        pRec->stats.producedBytes = producedBytes;
+        crono_recorder_reap(pRec);
+
+        // The producer overwrote data not queued yet, skip it. Data of writes
+        // in flight can't be recovered either, but is written anyway.
+        if (producedBytes - pRec->stats.releasedBytes > pRec->ring_size) {
+                resume = producedBytes - pRec->ring_size;
+                resume += (CRONO_KERNEL_RECORDER_ALIGN -
+                           resume % CRONO_KERNEL_RECORDER_ALIGN) %
+                          CRONO_KERNEL_RECORDER_ALIGN;
+                if (resume > pRec->submitted) {
+                        pRec->stats.overruns++;
+                        pRec->stats.droppedBytes += resume - pRec->submitted;
+                        pRec->submitted = resume;
+                        crono_recorder_release(pRec);
+                }
+        }
+
+        ret = crono_recorder_fill(pRec, pRec->chunk_size);
+        if (NULL != pReleasedBytes) {
+                *pReleasedBytes = pRec->stats.releasedBytes;
+        }
+        return ret;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RecorderWait(
+    CRONO_KERNEL_RECORDER *pRec, uint64_t *pReleasedBytes) {
+        uint32_t ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pRec);
+        ret = crono_recorder_wait_one(pRec);
+        if (NULL != pReleasedBytes) {
+                *pReleasedBytes = pRec->stats.releasedBytes;
+        }
+        return ret;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RecorderGetStats(
+    CRONO_KERNEL_RECORDER *pRec, CRONO_KERNEL_RECORDER_STATS *pStats) {
+        CRONO_RET_INV_PARAM_IF_NULL(pRec);
+        CRONO_RET_INV_PARAM_IF_NULL(pStats);
+        crono_recorder_fill_stats(pRec, pStats);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RecorderClose(
+    CRONO_KERNEL_RECORDER *pRec, CRONO_KERNEL_RECORDER_STATS *pStats) {
+        uint64_t produced;
+        uint64_t tail_length;
+        uint8_t *bounce;
+        int64_t result;
+        uint32_t ret = CRONO_SUCCESS;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pRec);
+        produced = pRec->stats.producedBytes;
+
+        // _______________________________________
+        // Write the aligned part of the remainder
+        //
+        while (CRONO_SUCCESS == ret &&
+               produced - pRec->submitted >= CRONO_KERNEL_RECORDER_ALIGN) {
+                if (pRec->count == pRec->depth) {
+                        ret = crono_recorder_wait_one(pRec);
+                }
+                ret = (CRONO_SUCCESS == ret) ? crono_recorder_fill(pRec, 0)
+                                             : ret;
+        }
+        while (CRONO_SUCCESS == ret && pRec->stats.inFlight > 0) {
+                ret = crono_recorder_wait_one(pRec);
+        }
+
+        // __________________________________________________________
+        // Write the unaligned tail padded, then truncate the padding
+        //
+        tail_length = produced - pRec->submitted;
+        if (CRONO_SUCCESS == ret && tail_length > 0) {
+                bounce = (uint8_t *)aligned_alloc(CRONO_KERNEL_RECORDER_ALIGN,
+                                                  CRONO_KERNEL_RECORDER_ALIGN);
+                if (NULL == bounce) {
+                        ret = -ENOMEM;
+                } else {
+                        memset(bounce, 0, CRONO_KERNEL_RECORDER_ALIGN);
+                        memcpy(bounce,
+                               pRec->ring +
+                                   pRec->submitted % pRec->ring_size,
+                               tail_length);
+                        result = crono_recorder_pwrite(
+                            pRec->fd, bounce, CRONO_KERNEL_RECORDER_ALIGN,
+                            pRec->file_offset);
+                        free(bounce);
+                        if (result >= (int64_t)tail_length) {
+                                pRec->stats.writtenBytes += tail_length;
+                                pRec->stats.writes++;
+                                pRec->file_offset += tail_length;
+                        } else {
+                                pRec->stats.writeErrors++;
+                                pRec->stats.droppedBytes += tail_length;
+                                ret = result < 0 ? (uint32_t)-result : EIO;
+                        }
+                        pRec->submitted = produced;
+                        crono_recorder_release(pRec);
+                }
+        }
+
+        // _____
+        // Close
+        //
+        if (0 != ftruncate(pRec->fd, pRec->file_offset) &&
+            CRONO_SUCCESS == ret) {
+                ret = errno;
+        }
+        if ((pRec->flags & CRONO_KERNEL_RECORDER_SYNC_ON_CLOSE) &&
+            0 != fdatasync(pRec->fd) && CRONO_SUCCESS == ret) {
+                ret = errno;
+        }
+        if (NULL != pStats) {
+                crono_recorder_fill_stats(pRec, pStats);
+        }
+        close(pRec->fd);
+        if (pRec->uring_ok) {
+                crono_uring_free(&pRec->uring);
+        }
+        delete pRec;
+        return ret;
+}
@@ -0,0 +1,319 @@
+#include "crono_reg_shadow.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/**
+ * A shadowed range of a BAR. `known` is a byte per byte of `data`, set once
+ * the byte is read from or written to the device, always set for ranges not
+ * write-only.
+ */
+struct CRONO_REG_RANGE {
+        uint32_t bar;
+        uint64_t offset;
+        uint64_t size;
+        uint32_t flags;
+        uint8_t *addr; // Mapped address of the range in the BAR.
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> known;
+};
+
+struct CRONO_REG_SHADOW {
+        std::mutex mutex;
+
+        /**
+         * Ranges sorted by BAR and offset, not overlapping.
+         */
+        std::vector<CRONO_REG_RANGE> ranges;
+        CRONO_KERNEL_REG_SHADOW_STATS stats;
+};
+
+static bool crono_reg_range_before(const CRONO_REG_RANGE &range, uint32_t bar,
+                                   uint64_t offset) {
+        return range.bar < bar ||
+               (range.bar == bar && range.offset + range.size <= offset);
+}
+
+/**
+ * Gets the first range of BAR `bar` ending after `offset`, i.e. the only range
+ * which may hold `offset`, or `ranges.end()`.
+ */
+static std::vector<CRONO_REG_RANGE>::iterator
+crono_reg_shadow_find(CRONO_REG_SHADOW *shadow, uint32_t bar,
+                      uint64_t offset) {
+        return std::lower_bound(
+            shadow->ranges.begin(), shadow->ranges.end(), offset,
+            [bar](const CRONO_REG_RANGE &range, uint64_t off) {
+                    return crono_reg_range_before(range, bar, off);
+            });
+}
+
+/**
+ * Calls `fn(range, range_offset, data_offset, size)` for each range
+ * overlapping `size` bytes at `offset` of BAR `bar`, with the overlapping
+ * bytes.
+ */
+template <typename F>
+static void crono_reg_shadow_overlaps(CRONO_REG_SHADOW *shadow, uint32_t bar,
+                                      uint64_t offset, uint64_t size, F fn) {
+        uint64_t begin, end;
+
+        for (auto it = crono_reg_shadow_find(shadow, bar, offset);
+             it != shadow->ranges.end() && it->bar == bar &&
+             it->offset < offset + size;
+             ++it) {
+                begin = std::max(it->offset, offset);
+                end = std::min(it->offset + it->size, offset + size);
+                fn(*it, begin - it->offset, begin - offset, end - begin);
+        }
+}
+
+int crono_reg_shadow_read(struct CRONO_REG_SHADOW *shadow, uint32_t bar,
+                          uint64_t offset, void *data, uint64_t size) {
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        std::vector<CRONO_REG_RANGE>::iterator it;
+        uint64_t begin;
+
+        it = crono_reg_shadow_find(shadow, bar, offset);
+        if (it == shadow->ranges.end() || it->bar != bar ||
+            it->offset > offset || it->offset + it->size < offset + size) {
+                return -ENOENT;
+        }
+        begin = offset - it->offset;
+        if (std::find(it->known.begin() + begin,
+                      it->known.begin() + begin + size,
+                      0) != it->known.begin() + begin + size) {
+                if (it->flags & CRONO_KERNEL_REG_SHADOW_WRITE_ONLY) {
+                        return -ENODATA;
+                }
+                return -ENOENT;
+        }
+        memcpy(data, it->data.data() + begin, size);
+        shadow->stats.readsServed++;
+        return CRONO_SUCCESS;
+}
+
+void crono_reg_shadow_fill(struct CRONO_REG_SHADOW *shadow, uint32_t bar,
+                           uint64_t offset, const void *data, uint64_t size) {
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        bool overlaps = false;
+
+        crono_reg_shadow_overlaps(
+            shadow, bar, offset, size,
+            [&](CRONO_REG_RANGE &range, uint64_t range_offset,
+                uint64_t data_offset, uint64_t count) {
+                    // Write-only registers read back other values
+                    if (range.flags & CRONO_KERNEL_REG_SHADOW_WRITE_ONLY) {
+                            return;
+                    }
+                    memcpy(range.data.data() + range_offset,
+                           (const uint8_t *)data + data_offset, count);
+                    overlaps = true;
+            });
+        if (overlaps) {
+                shadow->stats.readsDevice++;
+        }
+}
+
+bool crono_reg_shadow_write(struct CRONO_REG_SHADOW *shadow, uint32_t bar,
+                            uint64_t offset, const void *data, uint64_t size) {
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        bool overlaps = false;
+        bool elide = true;
+
+        crono_reg_shadow_overlaps(
+            shadow, bar, offset, size,
+            [&](CRONO_REG_RANGE &range, uint64_t range_offset,
+                uint64_t data_offset, uint64_t count) {
+                    const uint8_t *src = (const uint8_t *)data + data_offset;
+
+                    overlaps = true;
+                    if (!(range.flags & CRONO_KERNEL_REG_SHADOW_ELIDE) ||
+                        std::find(range.known.begin() + range_offset,
+                                  range.known.begin() + range_offset + count,
+                                  0) !=
+                            range.known.begin() + range_offset + count ||
+                        0 != memcmp(range.data.data() + range_offset, src,
+                                    count)) {
+                            elide = false;
+                    }
+                    memcpy(range.data.data() + range_offset, src, count);
+                    std::fill_n(range.known.begin() + range_offset, count, 1);
+            });
+        if (!overlaps) {
+                return false;
+        }
+
+        // Bytes of the write not shadowed are written to the device
+        if (elide) {
+                crono_reg_shadow_overlaps(
+                    shadow, bar, offset, size,
+                    [&](CRONO_REG_RANGE &, uint64_t, uint64_t,
+                        uint64_t count) { size -= count; });
+                elide = (0 == size);
+        }
+        if (elide) {
+                shadow->stats.writesElided++;
+        } else {
+                shadow->stats.writesDevice++;
+        }
+        return elide;
+}
+
+void crono_reg_shadow_free(PCRONO_KERNEL_DEVICE pDevice) {
+        delete pDevice->reg_shadow;
+        pDevice->reg_shadow = NULL;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RegShadowAdd(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset,
+    uint64_t size, uint32_t dwFlags) {
+        CRONO_REG_SHADOW *shadow;
+        CRONO_REG_SHADOW *expected = NULL;
+        CRONO_REG_RANGE range;
+        const CRONO_BAR_MAP *map;
+        std::vector<CRONO_REG_RANGE>::iterator it;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_ZERO(size);
+        if (barNum >= 6) {
+                return -ENOMEM;
+        }
+        map = &pDevice->bar_map[barNum];
+        if (NULL == map->addr || offset > map->length ||
+            size > map->length - offset) {
+                return -ENOMEM;
+        }
+
+        // Get the device shadow, creating it on first use
+        shadow = __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+        if (NULL == shadow) {
+                shadow = new (std::nothrow) CRONO_REG_SHADOW();
+                CRONO_RET_ERR_CODE_IF_NULL(shadow, -ENOMEM);
+                // Another thread may have created it meanwhile
+                if (!__atomic_compare_exchange_n(
+                        &pDevice->reg_shadow, &expected, shadow, false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        delete shadow;
+                        shadow = expected;
+                }
+        }
+
+        range.bar = barNum;
+        range.offset = offset;
+        range.size = size;
+        range.flags = dwFlags;
+        range.addr = map->addr + offset;
+        try {
+                range.data.resize(size);
+                range.known.resize(size);
+        } catch (const std::bad_alloc &) {
+                return -ENOMEM;
+        }
+        if (!(dwFlags & CRONO_KERNEL_REG_SHADOW_WRITE_ONLY)) {
+                crono_mmio_copy(range.data.data(), range.addr, size);
+                std::fill(range.known.begin(), range.known.end(), 1);
+        }
+
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        it = crono_reg_shadow_find(shadow, barNum, offset);
+        if (it != shadow->ranges.end() && it->bar == barNum &&
+            it->offset < offset + size) {
+                return -EINVAL;
+        }
+        try {
+                shadow->ranges.insert(it, std::move(range));
+        } catch (const std::bad_alloc &) {
+                return -ENOMEM;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RegShadowRemove(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint32_t barNum, uint64_t offset) {
+        CRONO_REG_SHADOW *shadow;
+        std::vector<CRONO_REG_RANGE>::iterator it;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        shadow = __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+        if (NULL == shadow) {
+                return -ENOENT;
+        }
+
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        it = crono_reg_shadow_find(shadow, barNum, offset);
+        if (it == shadow->ranges.end() || it->bar != barNum ||
+            it->offset != offset) {
+                return -ENOENT;
+        }
+        shadow->ranges.erase(it);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_RegShadowResync(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                             uint32_t dwOptions) {
+        CRONO_REG_SHADOW *shadow;
+        uint64_t begin, end;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        shadow = __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+        if (NULL == shadow) {
+                return CRONO_SUCCESS;
+        }
+
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        for (CRONO_REG_RANGE &range : shadow->ranges) {
+                if (!(range.flags & CRONO_KERNEL_REG_SHADOW_WRITE_ONLY)) {
+                        crono_mmio_copy(range.data.data(), range.addr,
+                                        range.size);
+                        continue;
+                }
+                if (!(dwOptions & CRONO_KERNEL_REG_SHADOW_RESTORE)) {
+                        std::fill(range.known.begin(), range.known.end(), 0);
+                        continue;
+                }
+
+                // Write back each run of known bytes
+                for (begin = 0; begin < range.size; begin = end) {
+                        for (; begin < range.size && !range.known[begin];
+                             begin++) {
+                        }
+                        for (end = begin; end < range.size && range.known[end];
+                             end++) {
+                        }
+                        if (end > begin) {
+                                crono_mmio_copy(range.addr + begin,
+                                                range.data.data() + begin,
+                                                end - begin);
+                                shadow->stats.writesDevice++;
+                        }
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_RegShadowGetStats(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, CRONO_KERNEL_REG_SHADOW_STATS *pStats) {
+        CRONO_REG_SHADOW *shadow;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pStats);
+        shadow = __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE);
+        if (NULL == shadow) {
+                memset(pStats, 0, sizeof(*pStats));
+                return CRONO_SUCCESS;
+        }
+
+        std::lock_guard<std::mutex> lock(shadow->mutex);
+        *pStats = shadow->stats;
+        return CRONO_SUCCESS;
+}
@@ -0,0 +1,287 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <vector>
+
+/**
+ * Physically and virtually contiguous pages of a locked SG buffer.
+ */
+typedef struct {
+        DMA_ADDR phys;   // Physical address of the first page.
+        uintptr_t virt;  // User address of the first page.
+        uint64_t length; // Size of the run in bytes.
+        int buffer_id;   // Kernel ID of the buffer the run belongs to.
+} CRONO_SG_RUN;
+
+/**
+ * Runs of all SG buffers locked on a device, sorted once by physical and once
+ * by user address, so both translations are a binary search.
+ */
+struct CRONO_SG_INDEX {
+        std::shared_mutex mutex;
+        std::vector<CRONO_SG_RUN> by_phys;
+        std::vector<CRONO_SG_RUN> by_virt;
+};
+
+static bool crono_sg_run_phys_less(const CRONO_SG_RUN &a,
+                                   const CRONO_SG_RUN &b) {
+        return a.phys < b.phys;
+}
+
+static bool crono_sg_run_virt_less(const CRONO_SG_RUN &a,
+                                   const CRONO_SG_RUN &b) {
+        return a.virt < b.virt;
+}
+
+/**
+ * Finds the run containing `phys`, NULL if not found. Shared lock of the index
+ * must be held.
+ */
+static const CRONO_SG_RUN *crono_sg_find_phys(const CRONO_SG_INDEX *index,
+                                              DMA_ADDR phys) {
+        // First run starting after `phys`, the candidate is the one before
+        auto it = std::upper_bound(
+            index->by_phys.begin(), index->by_phys.end(), phys,
+            [](DMA_ADDR value, const CRONO_SG_RUN &run) {
+                    return value < run.phys;
+            });
+        if (it == index->by_phys.begin()) {
+                return NULL;
+        }
+        --it;
+        if (phys - it->phys >= it->length) {
+                return NULL;
+        }
+        return &(*it);
+}
+
+static const CRONO_SG_RUN *crono_sg_find_virt(const CRONO_SG_INDEX *index,
+                                              uintptr_t virt) {
+        auto it = std::upper_bound(
+            index->by_virt.begin(), index->by_virt.end(), virt,
+            [](uintptr_t value, const CRONO_SG_RUN &run) {
+                    return value < run.virt;
+            });
+        if (it == index->by_virt.begin()) {
+                return NULL;
+        }
+        --it;
+        if (virt - it->virt >= it->length) {
+                return NULL;
+        }
+        return &(*it);
+}
+
+/**
+ * Sets `*ppIndex` to the index of the device, created if none yet.
+ */
+static int crono_sg_index_get(PCRONO_KERNEL_DEVICE pDevice,
+                              CRONO_SG_INDEX **ppIndex) {
+        CRONO_SG_INDEX *index;
+        CRONO_SG_INDEX *expected = NULL;
+
+        index = __atomic_load_n(&pDevice->sg_index, __ATOMIC_ACQUIRE);
+        if (NULL != index) {
+                *ppIndex = index;
+                return CRONO_SUCCESS;
+        }
+
+        index = new (std::nothrow) CRONO_SG_INDEX();
+        CRONO_RET_ERR_CODE_IF_NULL(index, -ENOMEM);
+
+        // Another thread may have created it meanwhile
+        if (!__atomic_compare_exchange_n(&pDevice->sg_index, &expected, index,
+                                         false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+                delete index;
+                index = expected;
+        }
+        *ppIndex = index;
+        return CRONO_SUCCESS;
+}
+
+int crono_sg_index_add(PCRONO_KERNEL_DEVICE pDevice,
+                       const CRONO_KERNEL_DMA_SG *pDma) {
+        size_t page_size = PAGE_SIZE;
+        std::vector<CRONO_SG_RUN> runs;
+        CRONO_SG_INDEX *index;
+        uintptr_t virt;
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pDevice);
+        CRONO_RET_INV_PARAM_IF_NULL(pDma);
+        if (0 == pDma->dwPages) {
+                return CRONO_SUCCESS;
+        }
+        ret = crono_sg_index_get(pDevice, &index);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+
+        try {
+                // Merge physically contiguous pages, the first page starts at
+                // the page boundary below `pUserAddr`.
+                virt = ((uintptr_t)pDma->pUserAddr) & ~(page_size - 1);
+                for (uint32_t ipage = 0; ipage < pDma->dwPages; ipage++) {
+                        const CRONO_KERNEL_DMA_PAGE *page = &pDma->Page[ipage];
+                        if (!runs.empty() &&
+                            runs.back().phys + runs.back().length ==
+                                page->pPhysicalAddr) {
+                                runs.back().length += page->dwBytes;
+                        } else {
+                                runs.push_back({page->pPhysicalAddr, virt,
+                                                page->dwBytes, pDma->id});
+                        }
+                        virt += page->dwBytes;
+                }
+
+                std::unique_lock<std::shared_mutex> lock(index->mutex);
+
+                // Reserve both first, so a failure leaves the index unchanged
+                index->by_virt.reserve(index->by_virt.size() + runs.size());
+                index->by_phys.reserve(index->by_phys.size() + runs.size());
+
+                // Runs are sorted by user address by construction
+                size_t old_size = index->by_virt.size();
+                index->by_virt.insert(index->by_virt.end(), runs.begin(),
+                                      runs.end());
+                std::inplace_merge(index->by_virt.begin(),
+                                   index->by_virt.begin() + old_size,
+                                   index->by_virt.end(),
+                                   crono_sg_run_virt_less);
+
+                std::sort(runs.begin(), runs.end(), crono_sg_run_phys_less);
+                old_size = index->by_phys.size();
+                index->by_phys.insert(index->by_phys.end(), runs.begin(),
+                                      runs.end());
+                std::inplace_merge(index->by_phys.begin(),
+                                   index->by_phys.begin() + old_size,
+                                   index->by_phys.end(),
+                                   crono_sg_run_phys_less);
+        } catch (const std::bad_alloc &) {
+                printf("Error allocating SG index memory for buffer id <%d>\n",
+                       pDma->id);
+                return -ENOMEM;
+        }
+        CRONO_DEBUG("Indexed buffer id <%d>: pages <%u>, runs <%lu>\n",
+                    pDma->id, pDma->dwPages, runs.size());
+        return CRONO_SUCCESS;
+}
+
+void crono_sg_index_remove(PCRONO_KERNEL_DEVICE pDevice,
+                           const CRONO_KERNEL_DMA_SG *pDma) {
+        CRONO_SG_INDEX *index;
+
+        if (NULL == pDevice || NULL == pDma) {
+                return;
+        }
+        index = __atomic_load_n(&pDevice->sg_index, __ATOMIC_ACQUIRE);
+        if (NULL == index) {
+                return;
+        }
+        std::unique_lock<std::shared_mutex> lock(index->mutex);
+        auto of_buffer = [pDma](const CRONO_SG_RUN &run) {
+                return run.buffer_id == pDma->id;
+        };
+        auto &by_phys = index->by_phys;
+        auto &by_virt = index->by_virt;
+        by_phys.erase(std::remove_if(by_phys.begin(), by_phys.end(), of_buffer),
+                      by_phys.end());
+        by_virt.erase(std::remove_if(by_virt.begin(), by_virt.end(), of_buffer),
+                      by_virt.end());
+}
+
+void crono_sg_index_free(PCRONO_KERNEL_DEVICE pDevice) {
+        if (NULL == pDevice) {
+                return;
+        }
+        delete pDevice->sg_index;
+        pDevice->sg_index = NULL;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGPhysToVirt(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, DMA_ADDR physAddr, void **ppUserAddr) {
+        const CRONO_SG_RUN *run;
+        CRONO_SG_INDEX *index;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(ppUserAddr);
+        *ppUserAddr = NULL;
+        index = __atomic_load_n(&pDevice->sg_index, __ATOMIC_ACQUIRE);
+        CRONO_RET_ERR_CODE_IF_NULL(index, -ENOENT);
+
+        std::shared_lock<std::shared_mutex> lock(index->mutex);
+        run = crono_sg_find_phys(index, physAddr);
+        CRONO_RET_ERR_CODE_IF_NULL(run, -ENOENT);
+        *ppUserAddr = (void *)(run->virt + (physAddr - run->phys));
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGVirtToPhys(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const void *pUserAddr,
+    DMA_ADDR *pPhysAddr) {
+        const CRONO_SG_RUN *run;
+        CRONO_SG_INDEX *index;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pPhysAddr);
+        *pPhysAddr = 0;
+        index = __atomic_load_n(&pDevice->sg_index, __ATOMIC_ACQUIRE);
+        CRONO_RET_ERR_CODE_IF_NULL(index, -ENOENT);
+
+        std::shared_lock<std::shared_mutex> lock(index->mutex);
+        run = crono_sg_find_virt(index, (uintptr_t)pUserAddr);
+        CRONO_RET_ERR_CODE_IF_NULL(run, -ENOENT);
+        *pPhysAddr = run->phys + ((uintptr_t)pUserAddr - run->virt);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_DMASGPhysToVirtBatch(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const DMA_ADDR *physAddrs,
+    void **ppUserAddrs, uint32_t count, uint32_t *pNotFound) {
+        const CRONO_SG_RUN *run = NULL;
+        uint32_t not_found = 0;
+        CRONO_SG_INDEX *index;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(physAddrs);
+        CRONO_RET_INV_PARAM_IF_NULL(ppUserAddrs);
+        index = __atomic_load_n(&pDevice->sg_index, __ATOMIC_ACQUIRE);
+        if (NULL == index) {
+                memset(ppUserAddrs, 0, sizeof(void *) * count);
+                if (NULL != pNotFound) {
+                        *pNotFound = count;
+                }
+                return CRONO_SUCCESS;
+        }
+
+        std::shared_lock<std::shared_mutex> lock(index->mutex);
+        for (uint32_t iaddr = 0; iaddr < count; iaddr++) {
+                DMA_ADDR phys = physAddrs[iaddr];
+
+                // Consecutive addresses mostly hit the same run, so check the
+                // last one before searching.
+                if (NULL == run || phys < run->phys ||
+                    phys - run->phys >= run->length) {
+                        run = crono_sg_find_phys(index, phys);
+                }
+                if (NULL == run) {
+                        ppUserAddrs[iaddr] = NULL;
+                        not_found++;
+                        continue;
+                }
+                ppUserAddrs[iaddr] = (void *)(run->virt + (phys - run->phys));
+        }
+        if (NULL != pNotFound) {
+                *pNotFound = not_found;
+        }
+        return CRONO_SUCCESS;
+}
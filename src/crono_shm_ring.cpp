@@ -0,0 +1,595 @@
+#include "crono_shm_ring.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <climits>
+#include <linux/futex.h>
+#include <new>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#define CRONO_SHM_RING_MAGIC "CRNOSHMR"
+#define CRONO_SHM_CACHE_LINE 64
+
+/**
+ * Slot state while a consumer initializes its cursor, not seen by the
+ * producer as active yet.
+ */
+#define CRONO_SHM_CONSUMER_CLAIMED 3
+
+/**
+ * Consumer slot in the control block, one cache line each, so consumers don't
+ * share lines with each other or with the producer.
+ * Fields are accessed with `__atomic` builtins as they are shared between
+ * processes.
+ */
+typedef struct {
+        uint32_t state; // CRONO_KERNEL_SHM_CONSUMER_XXX.
+        int32_t pid;
+        uint64_t cursor;
+        uint64_t overruns;
+        uint64_t dropped_bytes;
+} __attribute__((aligned(CRONO_SHM_CACHE_LINE))) CRONO_SHM_SLOT;
+
+/**
+ * Control block at the start of the memfd, followed by the ring at
+ * `data_offset`.
+ */
+typedef struct {
+        char magic[8]; // CRONO_SHM_RING_MAGIC.
+        uint32_t version;
+        uint32_t ring_size;
+        uint32_t max_consumers;
+        uint32_t lag_limit;
+        uint64_t data_offset;
+
+        // Written by the producer
+        uint64_t write_position __attribute__((
+            aligned(CRONO_SHM_CACHE_LINE)));
+        uint64_t released_position;
+        uint32_t publish_seq; // Futex consumers wait on.
+
+        // Written by consumers
+        uint32_t waiters __attribute__((aligned(CRONO_SHM_CACHE_LINE)));
+
+        CRONO_SHM_SLOT slots[CRONO_KERNEL_SHM_RING_MAX_CONSUMERS];
+} CRONO_SHM_CONTROL;
+
+struct CRONO_KERNEL_SHM_RING {
+        int fd;
+        uint8_t *map; // Control block and ring.
+        size_t map_size;
+        CRONO_SHM_CONTROL *control;
+        uint8_t *ring;
+        CRONO_KERNEL_DEVICE_HANDLE hDev;
+        CRONO_KERNEL_DMA_SG *pDma;
+};
+
+struct CRONO_KERNEL_SHM_CONSUMER {
+        CRONO_SHM_CONTROL *control;
+        size_t control_size;
+        uint8_t *ring; // Ring mapped twice back to back.
+        uint32_t ring_size;
+        CRONO_SHM_SLOT *slot;
+};
+
+static size_t crono_shm_control_size() {
+        return (sizeof(CRONO_SHM_CONTROL) + PAGE_SIZE - 1) / PAGE_SIZE *
+               PAGE_SIZE;
+}
+
+static long crono_shm_futex(uint32_t *uaddr, int op, uint32_t val,
+                            const struct timespec *timeout) {
+        // Not `FUTEX_PRIVATE_FLAG`, the word is shared between processes
+        return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+// ________
+// Producer
+//
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingCreate(CRONO_KERNEL_DEVICE_HANDLE hDev,
+                           const CRONO_KERNEL_SHM_RING_CONFIG *pConfig,
+                           CRONO_KERNEL_SHM_RING **ppRing) {
+        CRONO_KERNEL_SHM_RING *pRing;
+        CRONO_SHM_CONTROL *control;
+        size_t control_size = crono_shm_control_size();
+        uint32_t lag_limit;
+        uint32_t ret;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(pConfig);
+        CRONO_RET_INV_PARAM_IF_NULL(ppRing);
+        *ppRing = NULL;
+        lag_limit = pConfig->lagLimit ? pConfig->lagLimit
+                                      : pConfig->ringSize / 2;
+        if (0 == pConfig->ringSize || pConfig->ringSize % PAGE_SIZE ||
+            0 == pConfig->maxConsumers ||
+            pConfig->maxConsumers > CRONO_KERNEL_SHM_RING_MAX_CONSUMERS ||
+            0 == lag_limit || lag_limit >= pConfig->ringSize) {
+                return -EINVAL;
+        }
+
+        pRing = new (std::nothrow) CRONO_KERNEL_SHM_RING();
+        CRONO_RET_ERR_CODE_IF_NULL(pRing, -ENOMEM);
+        pRing->hDev = hDev;
+        pRing->map_size = control_size + pConfig->ringSize;
+
+        // Sealed against resizing, so a consumer can't make the producer
+        // mapping fault
+        pRing->fd = memfd_create(pConfig->name ? pConfig->name : "crono_ring",
+                                 MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (pRing->fd < 0) {
+                ret = errno;
+                printf("Error creating ring memfd: <%d> <%s>\n", ret,
+                       strerror(ret));
+                delete pRing;
+                return ret;
+        }
+        if (0 != ftruncate(pRing->fd, pRing->map_size) ||
+            0 != fcntl(pRing->fd, F_ADD_SEALS,
+                       F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+                ret = errno;
+                printf("Error sizing ring memfd: <%d> <%s>\n", ret,
+                       strerror(ret));
+                close(pRing->fd);
+                delete pRing;
+                return ret;
+        }
+        pRing->map =
+            (uint8_t *)mmap(NULL, pRing->map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, pRing->fd, 0);
+        if (MAP_FAILED == pRing->map) {
+                ret = errno;
+                printf("Error mapping ring memfd: <%d> <%s>\n", ret,
+                       strerror(ret));
+                close(pRing->fd);
+                delete pRing;
+                return ret;
+        }
+        pRing->ring = pRing->map + control_size;
+
+        // The file is zero filled, slots are free
+        control = pRing->control = (CRONO_SHM_CONTROL *)pRing->map;
+        control->version = CRONO_KERNEL_SHM_RING_VERSION;
+        control->ring_size = pConfig->ringSize;
+        control->max_consumers = pConfig->maxConsumers;
+        control->lag_limit = lag_limit;
+        control->data_offset = control_size;
+        // Consumers check the magic last
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(control->magic, CRONO_SHM_RING_MAGIC, sizeof(control->magic));
+
+        if (NULL != hDev) {
+                ret = CRONO_KERNEL_DMASGBufLock(hDev, pRing->ring,
+                                                pConfig->dwOptions,
+                                                pConfig->ringSize,
+                                                &pRing->pDma);
+                if (CRONO_SUCCESS != ret) {
+                        munmap(pRing->map, pRing->map_size);
+                        close(pRing->fd);
+                        delete pRing;
+                        return ret;
+                }
+        }
+
+        *ppRing = pRing;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingGetInfo(CRONO_KERNEL_SHM_RING *pRing,
+                            CRONO_KERNEL_SHM_RING_INFO *pInfo) {
+        CRONO_RET_INV_PARAM_IF_NULL(pRing);
+        CRONO_RET_INV_PARAM_IF_NULL(pInfo);
+
+        pInfo->fd = pRing->fd;
+        pInfo->pRing = pRing->ring;
+        pInfo->ringSize = pRing->control->ring_size;
+        pInfo->ringOffset = pRing->control->data_offset;
+        pInfo->pDma = pRing->pDma;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingPublish(CRONO_KERNEL_SHM_RING *pRing,
+                            uint64_t producedBytes, uint64_t *pReleasedBytes) {
+        CRONO_SHM_CONTROL *control;
+        uint64_t released;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pRing);
+        control = pRing->control;
+        if (producedBytes <
+            __atomic_load_n(&control->write_position, __ATOMIC_RELAXED)) {
+                return -EINVAL;
+        }
+
+        // Publish before reading the cursors. A consumer joining concurrently
+        // either is seen here, or sees this write position, see
+        // `crono_shm_start_at_write_position`
+        __atomic_store_n(&control->write_position, producedBytes,
+                         __ATOMIC_SEQ_CST);
+        released = producedBytes;
+        for (uint32_t islot = 0; islot < control->max_consumers; islot++) {
+                CRONO_SHM_SLOT *slot = &control->slots[islot];
+                uint64_t cursor;
+
+                if (CRONO_KERNEL_SHM_CONSUMER_ACTIVE !=
+                    __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST)) {
+                        continue;
+                }
+                cursor = __atomic_load_n(&slot->cursor, __ATOMIC_ACQUIRE);
+                if (producedBytes - cursor > control->lag_limit) {
+                        uint32_t expected = CRONO_KERNEL_SHM_CONSUMER_ACTIVE;
+
+                        // The consumer may have consumed meanwhile, it is
+                        // still too late, its data is about to be overwritten
+                        if (__atomic_compare_exchange_n(
+                                &slot->state, &expected,
+                                CRONO_KERNEL_SHM_CONSUMER_SLOW, false,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                                __atomic_fetch_add(&slot->overruns, 1,
+                                                   __ATOMIC_RELAXED);
+                                CRONO_DEBUG("Ring consumer <%u> of pid <%d> "
+                                            "is slow, lagging <%lu> bytes\n",
+                                            islot, slot->pid,
+                                            producedBytes - cursor);
+                        }
+                        continue;
+                }
+                if (cursor < released) {
+                        released = cursor;
+                }
+        }
+        // Never move back, e.g. if a consumer resumed at an older position
+        if (released <
+            __atomic_load_n(&control->released_position, __ATOMIC_RELAXED)) {
+                released = __atomic_load_n(&control->released_position,
+                                           __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&control->released_position, released,
+                         __ATOMIC_RELEASE);
+
+        __atomic_fetch_add(&control->publish_seq, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&control->waiters, __ATOMIC_SEQ_CST) > 0) {
+                crono_shm_futex(&control->publish_seq, FUTEX_WAKE, INT_MAX,
+                                NULL);
+        }
+
+        if (NULL != pReleasedBytes) {
+                *pReleasedBytes = released;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingGetStats(CRONO_KERNEL_SHM_RING *pRing,
+                             CRONO_KERNEL_SHM_RING_STATS *pStats) {
+        CRONO_SHM_CONTROL *control;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pRing);
+        CRONO_RET_INV_PARAM_IF_NULL(pStats);
+        control = pRing->control;
+
+        memset(pStats, 0, sizeof(CRONO_KERNEL_SHM_RING_STATS));
+        pStats->writePosition =
+            __atomic_load_n(&control->write_position, __ATOMIC_ACQUIRE);
+        pStats->releasedPosition =
+            __atomic_load_n(&control->released_position, __ATOMIC_ACQUIRE);
+        for (uint32_t islot = 0; islot < control->max_consumers; islot++) {
+                CRONO_SHM_SLOT *slot = &control->slots[islot];
+                CRONO_KERNEL_SHM_CONSUMER_STATS *consumer =
+                    &pStats->consumers[islot];
+
+                consumer->state =
+                    __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+                if (CRONO_KERNEL_SHM_CONSUMER_FREE == consumer->state) {
+                        continue;
+                }
+                if (CRONO_SHM_CONSUMER_CLAIMED == consumer->state) {
+                        consumer->state = CRONO_KERNEL_SHM_CONSUMER_ACTIVE;
+                }
+                pStats->consumerCount++;
+                consumer->pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+                consumer->cursor =
+                    __atomic_load_n(&slot->cursor, __ATOMIC_ACQUIRE);
+                consumer->lagBytes = pStats->writePosition > consumer->cursor
+                                         ? pStats->writePosition -
+                                               consumer->cursor
+                                         : 0;
+                consumer->overruns =
+                    __atomic_load_n(&slot->overruns, __ATOMIC_RELAXED);
+                consumer->droppedBytes =
+                    __atomic_load_n(&slot->dropped_bytes, __ATOMIC_RELAXED);
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingClose(CRONO_KERNEL_SHM_RING *pRing) {
+        uint32_t ret = CRONO_SUCCESS;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pRing);
+        if (NULL != pRing->pDma) {
+                ret = CRONO_KERNEL_DMASGBufUnlock(pRing->hDev, pRing->pDma);
+        }
+        munmap(pRing->map, pRing->map_size);
+        close(pRing->fd);
+        delete pRing;
+        return ret;
+}
+
+// ________
+// Consumer
+//
+/**
+ * Moves the slot cursor to the current write position and makes it active.
+ * The write position is read again once the slot is active: if the producer
+ * computed a released position without this slot, it published a write
+ * position not less than it before, so the cursor can't be behind data the
+ * producer may overwrite.
+ *
+ * @return The cursor.
+ */
+static uint64_t crono_shm_start_at_write_position(CRONO_SHM_CONTROL *control,
+                                                  CRONO_SHM_SLOT *slot) {
+        uint64_t cursor;
+
+        cursor = __atomic_load_n(&control->write_position, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&slot->cursor, cursor, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&slot->state, CRONO_KERNEL_SHM_CONSUMER_ACTIVE,
+                         __ATOMIC_SEQ_CST);
+        cursor = __atomic_load_n(&control->write_position, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&slot->cursor, cursor, __ATOMIC_SEQ_CST);
+        return cursor;
+}
+
+/**
+ * Claims a free slot, or the slot of a consumer whose process exited without
+ * detaching.
+ */
+static CRONO_SHM_SLOT *crono_shm_claim_slot(CRONO_SHM_CONTROL *control) {
+        for (int pass = 0; pass < 2; pass++) {
+                for (uint32_t islot = 0; islot < control->max_consumers;
+                     islot++) {
+                        CRONO_SHM_SLOT *slot = &control->slots[islot];
+                        uint32_t expected =
+                            __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+                        if (0 == pass) {
+                                if (CRONO_KERNEL_SHM_CONSUMER_FREE !=
+                                    expected) {
+                                        continue;
+                                }
+                        } else if (CRONO_KERNEL_SHM_CONSUMER_FREE ==
+                                       expected ||
+                                   0 == slot->pid ||
+                                   0 == kill(slot->pid, 0) ||
+                                   ESRCH != errno) {
+                                continue;
+                        }
+                        if (__atomic_compare_exchange_n(
+                                &slot->state, &expected,
+                                CRONO_SHM_CONSUMER_CLAIMED, false,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                                return slot;
+                        }
+                }
+        }
+        return NULL;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingAttach(int fd, CRONO_KERNEL_SHM_CONSUMER **ppConsumer) {
+        CRONO_KERNEL_SHM_CONSUMER *pConsumer;
+        CRONO_SHM_CONTROL *control;
+        size_t control_size = crono_shm_control_size();
+        struct stat st;
+        uint8_t *ring;
+        uint32_t ring_size;
+        uint32_t ret;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(ppConsumer);
+        *ppConsumer = NULL;
+        if (0 != fstat(fd, &st)) {
+                return errno;
+        }
+        if ((uint64_t)st.st_size <= control_size) {
+                return CRONO_KERNEL_DATA_MISMATCH;
+        }
+
+        control = (CRONO_SHM_CONTROL *)mmap(NULL, control_size,
+                                            PROT_READ | PROT_WRITE, MAP_SHARED,
+                                            fd, 0);
+        if (MAP_FAILED == control) {
+                return errno;
+        }
+        ring_size = control->ring_size;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (0 != memcmp(control->magic, CRONO_SHM_RING_MAGIC,
+                        sizeof(control->magic)) ||
+            CRONO_KERNEL_SHM_RING_VERSION != control->version ||
+            control_size != control->data_offset ||
+            (uint64_t)st.st_size != control_size + ring_size ||
+            control->max_consumers > CRONO_KERNEL_SHM_RING_MAX_CONSUMERS) {
+                printf("Error: fd <%d> is not a ring of version <%d>\n", fd,
+                       CRONO_KERNEL_SHM_RING_VERSION);
+                munmap(control, control_size);
+                return CRONO_KERNEL_DATA_MISMATCH;
+        }
+
+        // Reserve twice the ring size, then map the ring into both halves
+        ring = (uint8_t *)mmap(NULL, 2 * (size_t)ring_size, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == ring) {
+                ret = errno;
+                munmap(control, control_size);
+                return ret;
+        }
+        for (int half = 0; half < 2; half++) {
+                if (MAP_FAILED == mmap(ring + half * (size_t)ring_size,
+                                       ring_size, PROT_READ,
+                                       MAP_SHARED | MAP_FIXED, fd,
+                                       control_size)) {
+                        ret = errno;
+                        printf("Error mapping ring: <%d> <%s>\n", ret,
+                               strerror(ret));
+                        munmap(ring, 2 * (size_t)ring_size);
+                        munmap(control, control_size);
+                        return ret;
+                }
+        }
+
+        pConsumer = new (std::nothrow) CRONO_KERNEL_SHM_CONSUMER();
+        if (NULL == pConsumer) {
+                munmap(ring, 2 * (size_t)ring_size);
+                munmap(control, control_size);
+                return -ENOMEM;
+        }
+        pConsumer->control = control;
+        pConsumer->control_size = control_size;
+        pConsumer->ring = ring;
+        pConsumer->ring_size = ring_size;
+        pConsumer->slot = crono_shm_claim_slot(control);
+        if (NULL == pConsumer->slot) {
+                printf("Error: all <%u> ring consumer slots are taken\n",
+                       control->max_consumers);
+                munmap(ring, 2 * (size_t)ring_size);
+                munmap(control, control_size);
+                delete pConsumer;
+                return -EBUSY;
+        }
+        __atomic_store_n(&pConsumer->slot->pid, getpid(), __ATOMIC_RELAXED);
+        __atomic_store_n(&pConsumer->slot->overruns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&pConsumer->slot->dropped_bytes, 0,
+                         __ATOMIC_RELAXED);
+        crono_shm_start_at_write_position(control, pConsumer->slot);
+
+        *ppConsumer = pConsumer;
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingPeek(CRONO_KERNEL_SHM_CONSUMER *pConsumer,
+                         CRONO_KERNEL_SHM_SPAN *pSpan) {
+        uint64_t write_position;
+        uint64_t cursor;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pConsumer);
+        CRONO_RET_INV_PARAM_IF_NULL(pSpan);
+
+        if (CRONO_KERNEL_SHM_CONSUMER_SLOW ==
+            __atomic_load_n(&pConsumer->slot->state, __ATOMIC_ACQUIRE)) {
+                return -EOVERFLOW;
+        }
+        write_position = __atomic_load_n(&pConsumer->control->write_position,
+                                         __ATOMIC_ACQUIRE);
+        cursor = __atomic_load_n(&pConsumer->slot->cursor, __ATOMIC_RELAXED);
+        pSpan->position = cursor;
+        pSpan->pData = pConsumer->ring + cursor % pConsumer->ring_size;
+        // More than the ring if the consumer is marked slow meanwhile, the
+        // data is then overwritten anyway, see `CRONO_KERNEL_ShmRingConsume`
+        pSpan->size = std::min<uint64_t>(write_position - cursor,
+                                         pConsumer->ring_size);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingConsume(CRONO_KERNEL_SHM_CONSUMER *pConsumer,
+                            uint64_t bytes) {
+        uint64_t cursor;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pConsumer);
+
+        cursor = __atomic_load_n(&pConsumer->slot->cursor, __ATOMIC_RELAXED);
+        if (cursor + bytes >
+            __atomic_load_n(&pConsumer->control->write_position,
+                            __ATOMIC_ACQUIRE)) {
+                return -EINVAL;
+        }
+        // The producer marks the slot slow before releasing the data it
+        // overwrites, so the data read is valid if the slot is still active
+        if (CRONO_KERNEL_SHM_CONSUMER_SLOW ==
+            __atomic_load_n(&pConsumer->slot->state, __ATOMIC_ACQUIRE)) {
+                return -EOVERFLOW;
+        }
+        __atomic_store_n(&pConsumer->slot->cursor, cursor + bytes,
+                         __ATOMIC_RELEASE);
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingResync(CRONO_KERNEL_SHM_CONSUMER *pConsumer,
+                           uint64_t *pDroppedBytes) {
+        uint64_t old_cursor;
+        uint64_t dropped;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pConsumer);
+
+        old_cursor =
+            __atomic_load_n(&pConsumer->slot->cursor, __ATOMIC_RELAXED);
+        dropped = crono_shm_start_at_write_position(pConsumer->control,
+                                                    pConsumer->slot) -
+                  old_cursor;
+        __atomic_fetch_add(&pConsumer->slot->dropped_bytes, dropped,
+                           __ATOMIC_RELAXED);
+        if (NULL != pDroppedBytes) {
+                *pDroppedBytes = dropped;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingWait(CRONO_KERNEL_SHM_CONSUMER *pConsumer, int timeoutMs) {
+        CRONO_SHM_CONTROL *control;
+        struct timespec timeout;
+        uint32_t seq;
+        long ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pConsumer);
+        control = pConsumer->control;
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+
+        // Count as waiter before checking, so the producer either sees the
+        // waiter and wakes it, or the futex word has changed already
+        __atomic_fetch_add(&control->waiters, 1, __ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&control->publish_seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&control->write_position, __ATOMIC_SEQ_CST) >
+                __atomic_load_n(&pConsumer->slot->cursor, __ATOMIC_RELAXED) ||
+            CRONO_KERNEL_SHM_CONSUMER_SLOW ==
+                __atomic_load_n(&pConsumer->slot->state, __ATOMIC_ACQUIRE)) {
+                __atomic_fetch_sub(&control->waiters, 1, __ATOMIC_SEQ_CST);
+                return CRONO_SUCCESS;
+        }
+        ret = crono_shm_futex(&control->publish_seq, FUTEX_WAIT, seq,
+                              timeoutMs < 0 ? NULL : &timeout);
+        __atomic_fetch_sub(&control->waiters, 1, __ATOMIC_SEQ_CST);
+        if (ret < 0) {
+                if (ETIMEDOUT == errno) {
+                        return -ETIMEDOUT;
+                }
+                // Woken by a signal, or the sequence changed meanwhile
+                if (EINTR != errno && EAGAIN != errno) {
+                        return -errno;
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_ShmRingDetach(CRONO_KERNEL_SHM_CONSUMER *pConsumer) {
+        CRONO_RET_INV_PARAM_IF_NULL(pConsumer);
+
+        __atomic_store_n(&pConsumer->slot->pid, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&pConsumer->slot->state,
+                         CRONO_KERNEL_SHM_CONSUMER_FREE, __ATOMIC_RELEASE);
+        munmap(pConsumer->ring, 2 * (size_t)pConsumer->ring_size);
+        munmap(pConsumer->control, pConsumer->control_size);
+        delete pConsumer;
+        return CRONO_SUCCESS;
+}
@@ -0,0 +1,382 @@
+#include "crono_snapshot.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_reg_shadow.h"
+#include "crono_trace.h"
+#include "crono_userspace.h"
+#include <linux/pci_regs.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#define CRONO_SNAPSHOT_PAD(size) (((size) + 7) & ~(uint64_t)7)
+
+/**
+ * A configuration register restored from a snapshot.
+ */
+typedef struct {
+        uint32_t offset;
+        uint32_t size;
+} CRONO_SNAPSHOT_REG;
+
+/**
+ * Copies `size` bytes, a multiple of 4, between memory and a BAR mapping with
+ * 32-bit accesses, as the snapshot ranges are 32-bit registers.
+ */
+static void crono_snapshot_copy32(void *dst, const void *src, uint64_t size) {
+        volatile uint32_t *dst32 = (volatile uint32_t *)dst;
+        const volatile uint32_t *src32 = (const volatile uint32_t *)src;
+
+        for (uint64_t ireg = 0; ireg < size / 4; ireg++) {
+                dst32[ireg] = src32[ireg];
+        }
+}
+
+/**
+ * Gets the configuration registers to restore, in the order to write them,
+ * present in the `config_size` bytes saved. As `pci_restore_state` of the
+ * kernel: the PCI Express control registers, then the type 0 header from its
+ * end, the Command register last. The BAR and expansion ROM addresses are
+ * left to the kernel, which assigned them.
+ */
+static uint32_t crono_snapshot_config_regs(PCRONO_KERNEL_DEVICE pDevice,
+                                           const uint8_t *config,
+                                           uint32_t config_size,
+                                           CRONO_SNAPSHOT_REG *regs) {
+        uint32_t count = 0;
+        uint32_t kept = 0;
+        uint32_t cap, version;
+
+        if (CRONO_SUCCESS == crono_config_find_cap(pDevice, 0, PCI_CAP_ID_EXP,
+                                                   &cap, &version)) {
+                regs[count++] = {cap + PCI_EXP_DEVCTL, 2};
+                regs[count++] = {cap + PCI_EXP_LNKCTL, 2};
+                if (version >= 2) {
+                        regs[count++] = {cap + PCI_EXP_DEVCTL2, 2};
+                        regs[count++] = {cap + PCI_EXP_LNKCTL2, 2};
+                }
+        }
+        if (config_size >= PCI_STD_HEADER_SIZEOF &&
+            PCI_HEADER_TYPE_NORMAL == (config[PCI_HEADER_TYPE] & 0x7f)) {
+                regs[count++] = {PCI_INTERRUPT_LINE, 1};
+                regs[count++] = {PCI_LATENCY_TIMER, 1};
+                regs[count++] = {PCI_CACHE_LINE_SIZE, 1};
+        }
+        regs[count++] = {PCI_COMMAND, 2};
+
+        // Drop registers not saved
+        for (uint32_t ireg = 0; ireg < count; ireg++) {
+                if (regs[ireg].offset + regs[ireg].size <= config_size) {
+                        regs[kept++] = regs[ireg];
+                }
+        }
+        return kept;
+}
+
+/**
+ * Restores the configuration registers differing from `config`, then reads
+ * them back with one read of the configuration space.
+ */
+static int crono_snapshot_restore_config(PCRONO_KERNEL_DEVICE pDevice,
+                                         const uint8_t *config,
+                                         uint32_t config_size,
+                                         CRONO_KERNEL_SNAPSHOT_STATS *stats) {
+        CRONO_SNAPSHOT_REG regs[10];
+        uint8_t current[PCI_CFG_SPACE_EXP_SIZE];
+        uint32_t reg_count, read_size = 0;
+        int ret;
+
+        // The shadow predates the reset
+        CRONO_KERNEL_PciConfigInvalidate(pDevice);
+        reg_count = crono_snapshot_config_regs(pDevice, config, config_size,
+                                               regs);
+        for (uint32_t ireg = 0; ireg < reg_count; ireg++) {
+                read_size = std::max(read_size,
+                                     regs[ireg].offset + regs[ireg].size);
+        }
+        if (0 == read_size) {
+                return CRONO_SUCCESS;
+        }
+        ret = crono_config_read(pDevice, 0, current, read_size);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        for (uint32_t ireg = 0; ireg < reg_count; ireg++) {
+                const CRONO_SNAPSHOT_REG *reg = &regs[ireg];
+
+                if (0 == memcmp(&current[reg->offset], &config[reg->offset],
+                                reg->size)) {
+                        continue;
+                }
+                ret = crono_config_write(pDevice, reg->offset,
+                                         &config[reg->offset], reg->size);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                stats->configWrites++;
+        }
+        if (0 == stats->configWrites) {
+                return CRONO_SUCCESS;
+        }
+
+        // Read back from the device, not from the shadow the writes updated
+        CRONO_KERNEL_PciConfigInvalidate(pDevice);
+        ret = crono_config_read(pDevice, 0, current, read_size);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        for (uint32_t ireg = 0; ireg < reg_count; ireg++) {
+                if (0 != memcmp(&current[regs[ireg].offset],
+                                &config[regs[ireg].offset], regs[ireg].size)) {
+                        stats->mismatches++;
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Restores the 32-bit registers of `range` differing from `data`, adjacent
+ * ones traced as one write, then reads the range back in one pass.
+ * `current` holds `range->size` bytes.
+ */
+static void
+crono_snapshot_restore_range(PCRONO_KERNEL_DEVICE pDevice,
+                             const CRONO_KERNEL_SNAPSHOT_RANGE *range,
+                             const uint8_t *data, uint8_t *current,
+                             CRONO_KERNEL_SNAPSHOT_STATS *stats) {
+        uint8_t *addr = pDevice->bar_map[range->barNum].addr + range->offset;
+        uint64_t begin, end;
+
+        if (range->flags & CRONO_KERNEL_SNAPSHOT_RANGE_WRITE_ALL) {
+                CRONO_TRACE_BEGIN(pDevice);
+                crono_snapshot_copy32(addr, data, range->size);
+                CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_WRITE, range->barNum,
+                                range->offset, range->size, 0, data,
+                                CRONO_SUCCESS);
+                stats->barWrites++;
+                stats->barBytes += range->size;
+                return;
+        }
+
+        crono_snapshot_copy32(current, addr, range->size);
+        for (begin = 0; begin < range->size; begin = end) {
+                // Skip registers holding their value, then find the end of
+                // the differing ones
+                for (; begin < range->size &&
+                       0 == memcmp(&current[begin], &data[begin], 4);
+                     begin += 4) {
+                }
+                for (end = begin; end < range->size &&
+                                  0 != memcmp(&current[end], &data[end], 4);
+                     end += 4) {
+                }
+                if (end > begin) {
+                        CRONO_TRACE_BEGIN(pDevice);
+                        crono_snapshot_copy32(addr + begin, data + begin,
+                                              end - begin);
+                        CRONO_TRACE_END(CRONO_KERNEL_TRACE_BAR_WRITE,
+                                        range->barNum, range->offset + begin,
+                                        end - begin, 0, data + begin,
+                                        CRONO_SUCCESS);
+                        stats->barWrites++;
+                        stats->barBytes += end - begin;
+                }
+        }
+        if (0 == stats->barBytes) {
+                return;
+        }
+
+        crono_snapshot_copy32(current, addr, range->size);
+        for (begin = 0; begin < range->size; begin += 4) {
+                if (0 != memcmp(&current[begin], &data[begin], 4)) {
+                        stats->mismatches++;
+                }
+        }
+}
+
+/**
+ * Checks `range` is mapped and aligned.
+ */
+static int
+crono_snapshot_check_range(PCRONO_KERNEL_DEVICE pDevice,
+                           const CRONO_KERNEL_SNAPSHOT_RANGE *range) {
+        const CRONO_BAR_MAP *map;
+
+        if (0 == range->size || 0 != range->offset % 4 ||
+            0 != range->size % 4) {
+                return -EINVAL;
+        }
+        if (range->barNum >= 6) {
+                return -ENOMEM;
+        }
+        map = &pDevice->bar_map[range->barNum];
+        if (NULL == map->addr || range->offset > map->length ||
+            range->size > map->length - range->offset) {
+                return -ENOMEM;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_SnapshotSave(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const CRONO_KERNEL_SNAPSHOT_RANGE *pRanges,
+    uint32_t rangeCount, void *pBlob, uint64_t *pSize) {
+        static const uint32_t config_sizes[] = {
+            PCI_CFG_SPACE_EXP_SIZE, PCI_CFG_SPACE_SIZE, PCI_STD_HEADER_SIZEOF};
+        CRONO_KERNEL_SNAPSHOT_HEADER header;
+        uint8_t config[PCI_CFG_SPACE_EXP_SIZE];
+        uint8_t *blob = (uint8_t *)pBlob;
+        uint64_t size;
+        int ret = CRONO_SUCCESS;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pSize);
+        if (rangeCount > 0) {
+                CRONO_RET_INV_PARAM_IF_NULL(pRanges);
+        }
+        size = sizeof(header);
+        for (uint32_t irange = 0; irange < rangeCount; irange++) {
+                ret = crono_snapshot_check_range(pDevice, &pRanges[irange]);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                size += sizeof(CRONO_KERNEL_SNAPSHOT_RANGE) +
+                        CRONO_SNAPSHOT_PAD(pRanges[irange].size);
+        }
+
+        // As much of the configuration space as the process may read
+        memset(&header, 0, sizeof(header));
+        for (uint32_t isize = 0;
+             isize < sizeof(config_sizes) / sizeof(config_sizes[0]);
+             isize++) {
+                ret = crono_config_read(pDevice, 0, config,
+                                        config_sizes[isize]);
+                if (CRONO_SUCCESS == ret) {
+                        header.configSize = config_sizes[isize];
+                        break;
+                }
+        }
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        size += CRONO_SNAPSHOT_PAD(header.configSize);
+        if (NULL == blob || *pSize < size) {
+                *pSize = size;
+                return -ENOSPC;
+        }
+        *pSize = size;
+
+        header.magic = CRONO_KERNEL_SNAPSHOT_MAGIC;
+        header.version = CRONO_KERNEL_SNAPSHOT_VERSION;
+        header.vendorId = pDevice->dwVendorId;
+        header.deviceId = pDevice->dwDeviceId;
+        header.rangeCount = rangeCount;
+        memset(blob, 0, size);
+        memcpy(blob, &header, sizeof(header));
+        blob += sizeof(header);
+        memcpy(blob, config, header.configSize);
+        blob += CRONO_SNAPSHOT_PAD(header.configSize);
+        for (uint32_t irange = 0; irange < rangeCount; irange++) {
+                const CRONO_KERNEL_SNAPSHOT_RANGE *range = &pRanges[irange];
+
+                memcpy(blob, range, sizeof(*range));
+                blob += sizeof(*range);
+                crono_snapshot_copy32(blob,
+                                      pDevice->bar_map[range->barNum].addr +
+                                          range->offset,
+                                      range->size);
+                blob += CRONO_SNAPSHOT_PAD(range->size);
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_SnapshotRestore(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const void *pBlob, uint64_t size,
+    CRONO_KERNEL_SNAPSHOT_STATS *pStats) {
+        const uint8_t *blob = (const uint8_t *)pBlob;
+        const uint8_t *end = blob + size;
+        CRONO_KERNEL_SNAPSHOT_HEADER header;
+        CRONO_KERNEL_SNAPSHOT_RANGE range;
+        CRONO_KERNEL_SNAPSHOT_STATS stats;
+        const uint8_t *config;
+        const uint8_t *pos;
+        std::vector<uint8_t> current;
+        uint64_t max_size = 0;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(pBlob);
+        memset(&stats, 0, sizeof(stats));
+        if (size < sizeof(header)) {
+                return -EINVAL;
+        }
+        memcpy(&header, blob, sizeof(header));
+        if (CRONO_KERNEL_SNAPSHOT_MAGIC != header.magic ||
+            CRONO_KERNEL_SNAPSHOT_VERSION != header.version ||
+            header.vendorId != pDevice->dwVendorId ||
+            header.deviceId != pDevice->dwDeviceId ||
+            header.configSize > PCI_CFG_SPACE_EXP_SIZE) {
+                return -EINVAL;
+        }
+        blob += sizeof(header);
+        config = blob;
+        if ((uint64_t)(end - blob) < CRONO_SNAPSHOT_PAD(header.configSize)) {
+                return -EINVAL;
+        }
+        blob += CRONO_SNAPSHOT_PAD(header.configSize);
+
+        // Check all ranges before writing anything
+        pos = blob;
+        for (uint32_t irange = 0; irange < header.rangeCount; irange++) {
+                if ((uint64_t)(end - pos) < sizeof(range)) {
+                        return -EINVAL;
+                }
+                memcpy(&range, pos, sizeof(range));
+                pos += sizeof(range);
+                ret = crono_snapshot_check_range(pDevice, &range);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                if ((uint64_t)(end - pos) < CRONO_SNAPSHOT_PAD(range.size)) {
+                        return -EINVAL;
+                }
+                pos += CRONO_SNAPSHOT_PAD(range.size);
+                max_size = std::max(max_size, range.size);
+        }
+        try {
+                current.resize(max_size);
+        } catch (const std::bad_alloc &) {
+                return -ENOMEM;
+        }
+
+        // Configuration first, it enables the BARs
+        ret = crono_snapshot_restore_config(pDevice, config, header.configSize,
+                                            &stats);
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        for (uint32_t irange = 0; irange < header.rangeCount; irange++) {
+                CRONO_KERNEL_SNAPSHOT_STATS range_stats;
+
+                memcpy(&range, blob, sizeof(range));
+                blob += sizeof(range);
+                memset(&range_stats, 0, sizeof(range_stats));
+                crono_snapshot_restore_range(pDevice, &range, blob,
+                                             current.data(), &range_stats);
+                stats.barWrites += range_stats.barWrites;
+                stats.barBytes += range_stats.barBytes;
+                stats.mismatches += range_stats.mismatches;
+                blob += CRONO_SNAPSHOT_PAD(range.size);
+        }
+
+        // Shadowed registers may have changed
+        if (NULL != __atomic_load_n(&pDevice->reg_shadow, __ATOMIC_ACQUIRE)) {
+                CRONO_KERNEL_RegShadowResync(hDev, 0);
+        }
+        if (NULL != pStats) {
+                *pStats = stats;
+        }
+        return 0 == stats.mismatches ? CRONO_SUCCESS
+                                     : CRONO_KERNEL_DATA_MISMATCH;
+}
@@ -0,0 +1,541 @@
+#include "crono_trace.h"
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <linux/pci_regs.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#define CRONO_TRACE_BUFFER_SIZE (1 << 20)
+
+struct CRONO_TRACE {
+        std::mutex mutex;
+        FILE *file;
+        char *buffer; // Buffer of `file`, records are written when full.
+        uint64_t start_ns;
+        uint64_t records;
+        uint64_t dropped; // Blocks of more than 4 GiB, not recorded.
+        int error;        // First write error, nothing is written after.
+};
+
+static const uint8_t crono_trace_zeros[4096] = {0};
+
+uint64_t crono_trace_now_ns() {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool crono_trace_write(CRONO_TRACE *trace, const void *data,
+                              uint64_t size) {
+        if (0 == size || 1 == fwrite(data, size, 1, trace->file)) {
+                return true;
+        }
+        trace->error = errno ? errno : -EIO;
+        return false;
+}
+
+/**
+ * Writes `size` bytes of zeros, for the data of failed reads and padding.
+ */
+static bool crono_trace_write_zeros(CRONO_TRACE *trace, uint64_t size) {
+        uint64_t chunk;
+
+        while (size > 0) {
+                chunk = std::min(size, (uint64_t)sizeof(crono_trace_zeros));
+                if (!crono_trace_write(trace, crono_trace_zeros, chunk)) {
+                        return false;
+                }
+                size -= chunk;
+        }
+        return true;
+}
+
+void crono_trace_record(struct CRONO_TRACE *trace, uint64_t begin_ns,
+                        uint32_t op, uint32_t bar, uint64_t offset,
+                        uint64_t size, uint64_t value, const void *data,
+                        int status) {
+        CRONO_KERNEL_TRACE_RECORD record;
+        uint64_t end_ns = crono_trace_now_ns();
+
+        memset(&record, 0, sizeof(record));
+        record.timestampNs = begin_ns - trace->start_ns;
+        record.offset = offset;
+        record.size = (uint32_t)size;
+        record.durationNs =
+            (uint32_t)std::min(end_ns - begin_ns, (uint64_t)UINT32_MAX);
+        record.status = status;
+        record.op = op;
+        record.bar = bar;
+        record.value = value;
+
+        // Nothing was read by failed reads
+        if (CRONO_SUCCESS != status && (CRONO_KERNEL_TRACE_BAR_READ == op ||
+                                        CRONO_KERNEL_TRACE_CONFIG_READ == op)) {
+                data = NULL;
+                record.value = 0;
+        }
+        if (NULL != data && size <= sizeof(record.value)) {
+                memcpy(&record.value, data, size);
+        }
+
+        std::lock_guard<std::mutex> lock(trace->mutex);
+        if (size > UINT32_MAX) {
+                trace->dropped++;
+                return;
+        }
+        if (0 != trace->error ||
+            !crono_trace_write(trace, &record, sizeof(record))) {
+                return;
+        }
+        if (size > sizeof(record.value)) {
+                if (NULL != data) {
+                        crono_trace_write(trace, data, size);
+                } else {
+                        crono_trace_write_zeros(trace, size);
+                }
+                crono_trace_write_zeros(trace, (8 - size % 8) % 8);
+        }
+        trace->records++;
+}
+
+/**
+ * Flushes and closes the trace file, and frees the trace.
+ */
+static int crono_trace_close(CRONO_TRACE *trace, uint64_t *pRecords) {
+        int ret = trace->error;
+
+        if (0 != fclose(trace->file) && CRONO_SUCCESS == ret) {
+                ret = errno;
+        }
+        if (trace->dropped > 0) {
+                printf("Warning: <%" PRIu64 "> trace records of more than "
+                       "4 GiB were dropped\n",
+                       trace->dropped);
+        }
+        if (NULL != pRecords) {
+                *pRecords = trace->records;
+        }
+        free(trace->buffer);
+        delete trace;
+        return ret;
+}
+
+/**
+ * Stops tracing the device, and waits until no thread is recording to the
+ * trace, see `crono_trace_acquire`. Returns the trace, NULL if not traced.
+ */
+static CRONO_TRACE *crono_trace_detach(PCRONO_KERNEL_DEVICE pDevice) {
+        CRONO_TRACE *trace =
+            __atomic_exchange_n(&pDevice->trace, NULL, __ATOMIC_SEQ_CST);
+
+        if (NULL != trace) {
+                while (0 != __atomic_load_n(&pDevice->trace_users,
+                                            __ATOMIC_ACQUIRE)) {
+                        sched_yield();
+                }
+        }
+        return trace;
+}
+
+void crono_trace_free(PCRONO_KERNEL_DEVICE pDevice) {
+        CRONO_TRACE *trace = crono_trace_detach(pDevice);
+
+        if (NULL != trace) {
+                crono_trace_close(trace, NULL);
+        }
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_TraceStart(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, const char *path) {
+        static const uint32_t config_sizes[] = {
+            PCI_CFG_SPACE_EXP_SIZE, PCI_CFG_SPACE_SIZE, PCI_STD_HEADER_SIZEOF};
+        CRONO_KERNEL_TRACE_HEADER header;
+        uint8_t config[PCI_CFG_SPACE_EXP_SIZE];
+        CRONO_TRACE *trace;
+        CRONO_TRACE *expected = NULL;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        CRONO_RET_INV_PARAM_IF_NULL(path);
+        if (NULL != __atomic_load_n(&pDevice->trace, __ATOMIC_ACQUIRE)) {
+                return -EBUSY;
+        }
+        memset(&header, 0, sizeof(header));
+        header.magic = CRONO_KERNEL_TRACE_MAGIC;
+        header.version = CRONO_KERNEL_TRACE_VERSION;
+        header.vendorId = pDevice->dwVendorId;
+        header.deviceId = pDevice->dwDeviceId;
+        header.slot = pDevice->pciSlot;
+        for (uint32_t ibar = 0; ibar < pDevice->bar_count; ibar++) {
+                header.barLength[pDevice->bar_descs[ibar].barNum] =
+                    pDevice->bar_descs[ibar].length;
+        }
+
+        // The mock device starts from the configuration space as it is now,
+        // as much of it as the process may read
+        for (uint32_t isize = 0;
+             isize < sizeof(config_sizes) / sizeof(config_sizes[0]);
+             isize++) {
+                if (CRONO_SUCCESS == crono_config_read(pDevice, 0, config,
+                                                       config_sizes[isize])) {
+                        header.configSize = config_sizes[isize];
+                        break;
+                }
+        }
+
+        // Create the trace file
+        trace = new (std::nothrow) CRONO_TRACE();
+        CRONO_RET_ERR_CODE_IF_NULL(trace, -ENOMEM);
+        trace->buffer = (char *)malloc(CRONO_TRACE_BUFFER_SIZE);
+        if (NULL == trace->buffer) {
+                delete trace;
+                return -ENOMEM;
+        }
+        trace->file = fopen(path, "wbe");
+        if (NULL == trace->file) {
+                ret = errno;
+                printf("Error creating trace file <%s>: <%d> <%s>\n", path,
+                       ret, strerror(ret));
+                free(trace->buffer);
+                delete trace;
+                return ret;
+        }
+        setvbuf(trace->file, trace->buffer, _IOFBF, CRONO_TRACE_BUFFER_SIZE);
+        if (!crono_trace_write(trace, &header, sizeof(header)) ||
+            !crono_trace_write(trace, config, header.configSize) ||
+            0 != fflush(trace->file)) {
+                ret = trace->error ? trace->error : errno;
+                crono_trace_close(trace, NULL);
+                return ret;
+        }
+
+        // Start recording
+        trace->start_ns = crono_trace_now_ns();
+        if (!__atomic_compare_exchange_n(&pDevice->trace, &expected, trace,
+                                         false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+                crono_trace_close(trace, NULL);
+                return -EBUSY;
+        }
+        return CRONO_SUCCESS;
+}
+
+CRONO_KERNEL_API uint32_t CRONO_KERNEL_TraceStop(
+    CRONO_KERNEL_DEVICE_HANDLE hDev, uint64_t *pRecords) {
+        CRONO_TRACE *trace;
+
+        // Init variables and validate parameters
+        CRONO_INIT_HDEV_FUNC(hDev);
+        trace = crono_trace_detach(pDevice);
+        CRONO_RET_ERR_CODE_IF_NULL(trace, -ENOENT);
+
+        return crono_trace_close(trace, pRecords);
+}
+
+// ___________
+// Mock device
+//
+
+/**
+ * Mock device of a trace: anonymous memory stands for the BARs, and a memory
+ * file holding the configuration space of the trace for the sysfs `config`
+ * file, so accesses run through the same code as on the device.
+ */
+typedef struct {
+        PCRONO_KERNEL_DEVICE device;
+        int config_fd; // Owned by the configuration space shadow.
+        uint32_t config_size;
+} CRONO_TRACE_MOCK;
+
+static void crono_trace_mock_close(CRONO_TRACE_MOCK *mock) {
+        PCRONO_KERNEL_DEVICE pDevice = mock->device;
+
+        if (NULL == pDevice) {
+                return;
+        }
+        for (uint32_t ibar = 0; ibar < pDevice->bar_count; ibar++) {
+                munmap((void *)pDevice->bar_descs[ibar].userAddress,
+                       pDevice->bar_descs[ibar].length);
+        }
+        if (NULL != pDevice->config_shadow) {
+                crono_config_free(pDevice);
+        } else if (mock->config_fd >= 0) {
+                close(mock->config_fd);
+        }
+        free(pDevice);
+        mock->device = NULL;
+}
+
+static int crono_trace_mock_open(const CRONO_KERNEL_TRACE_HEADER *header,
+                                 const uint8_t *config,
+                                 CRONO_TRACE_MOCK *mock) {
+        PCRONO_KERNEL_DEVICE pDevice;
+        CRONO_KERNEL_BAR_DESC *bar_desc;
+        void *addr;
+        int ret;
+
+        mock->config_fd = -1;
+        mock->config_size = header->configSize;
+        mock->device = pDevice =
+            (PCRONO_KERNEL_DEVICE)calloc(1, sizeof(CRONO_KERNEL_DEVICE));
+        CRONO_RET_ERR_CODE_IF_NULL(pDevice, -ENOMEM);
+        pDevice->pciSlot = header->slot;
+        pDevice->dwVendorId = header->vendorId;
+        pDevice->dwDeviceId = header->deviceId;
+        pDevice->miscdev_fd = -1;
+        pDevice->event_fd = -1;
+        pDevice->numa_node = -1;
+
+        // BARs, pages are only allocated when accessed
+        for (uint32_t bar_num = 0; bar_num < 6; bar_num++) {
+                if (0 == header->barLength[bar_num]) {
+                        continue;
+                }
+                addr = mmap(NULL, header->barLength[bar_num],
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                            0);
+                if (MAP_FAILED == addr) {
+                        ret = errno;
+                        crono_trace_mock_close(mock);
+                        return ret;
+                }
+                bar_desc = &pDevice->bar_descs[pDevice->bar_count++];
+                bar_desc->barNum = bar_num;
+                bar_desc->userAddress = (uint64_t)addr;
+                bar_desc->length = header->barLength[bar_num];
+                pDevice->bar_map[bar_num].addr = (uint8_t *)addr;
+                pDevice->bar_map[bar_num].length = bar_desc->length;
+        }
+
+        // Configuration space
+        mock->config_fd = memfd_create("crono_trace_config", MFD_CLOEXEC);
+        if (mock->config_fd < 0 ||
+            pwrite64(mock->config_fd, config, header->configSize, 0) !=
+                (ssize_t)header->configSize) {
+                ret = errno;
+                crono_trace_mock_close(mock);
+                return ret;
+        }
+        ret = crono_config_attach(pDevice, mock->config_fd,
+                                  header->configSize);
+        if (CRONO_SUCCESS != ret) {
+                crono_trace_mock_close(mock);
+                return ret;
+        }
+
+        // Take the shadow snapshot now, it was taken before tracing started
+        if (header->configSize > 0) {
+                crono_config_read(pDevice, 0, (void *)config,
+                                  header->configSize);
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Makes the mock device return the recorded data to the read of `pRecord`:
+ * the data is stored where the read takes it from.
+ */
+static void crono_trace_mock_preload(CRONO_TRACE_MOCK *mock,
+                                     const CRONO_KERNEL_TRACE_RECORD *pRecord,
+                                     const uint8_t *data) {
+        const CRONO_BAR_MAP *map;
+
+        if (CRONO_KERNEL_TRACE_CONFIG_READ == pRecord->op) {
+                if (pRecord->offset + pRecord->size <= mock->config_size) {
+                        pwrite64(mock->config_fd, data, pRecord->size,
+                                 pRecord->offset);
+                }
+                return;
+        }
+        if (pRecord->bar >= 6) {
+                return;
+        }
+        map = &mock->device->bar_map[pRecord->bar];
+        if (pRecord->offset <= map->length &&
+            pRecord->size <= map->length - pRecord->offset) {
+                memcpy(map->addr + pRecord->offset, data, pRecord->size);
+        }
+}
+
+/**
+ * Executes the access of `pRecord` on the mock device, using the accessor of
+ * the access size. `data` holds the data written, `result` receives the data
+ * read.
+ */
+static int crono_trace_mock_access(CRONO_TRACE_MOCK *mock,
+                                   const CRONO_KERNEL_TRACE_RECORD *pRecord,
+                                   const uint8_t *data, uint8_t *result) {
+        CRONO_KERNEL_DEVICE_HANDLE hDev = mock->device;
+        uint32_t bar = pRecord->bar;
+        uint64_t offset = pRecord->offset;
+        uint64_t value = 0;
+
+        memcpy(&value, data, std::min(pRecord->size, (uint32_t)8));
+        switch (pRecord->op) {
+        case CRONO_KERNEL_TRACE_BAR_READ:
+                switch (pRecord->size) {
+                case 1:
+                        return CRONO_KERNEL_ReadBar8(hDev, bar, offset,
+                                                     (uint8_t *)result);
+                case 2:
+                        return CRONO_KERNEL_ReadBar16(hDev, bar, offset,
+                                                      (uint16_t *)result);
+                case 4:
+                        return CRONO_KERNEL_ReadBar32(hDev, bar, offset,
+                                                      (uint32_t *)result);
+                case 8:
+                        return CRONO_KERNEL_ReadBar64(hDev, bar, offset,
+                                                      (uint64_t *)result);
+                default:
+                        return CRONO_KERNEL_ReadBarBlock(hDev, bar, offset,
+                                                         result,
+                                                         pRecord->size);
+                }
+        case CRONO_KERNEL_TRACE_BAR_WRITE:
+                memcpy(result, data, pRecord->size);
+                switch (pRecord->size) {
+                case 1:
+                        return CRONO_KERNEL_WriteBar8(hDev, bar, offset,
+                                                      (uint8_t)value);
+                case 2:
+                        return CRONO_KERNEL_WriteBar16(hDev, bar, offset,
+                                                       (uint16_t)value);
+                case 4:
+                        return CRONO_KERNEL_WriteBar32(hDev, bar, offset,
+                                                       (uint32_t)value);
+                case 8:
+                        return CRONO_KERNEL_WriteBar64(hDev, bar, offset,
+                                                       value);
+                default:
+                        return CRONO_KERNEL_WriteBarBlock(hDev, bar, offset,
+                                                          data, pRecord->size);
+                }
+        case CRONO_KERNEL_TRACE_CONFIG_READ:
+                return crono_config_read(mock->device, (uint32_t)offset,
+                                         result, pRecord->size);
+        case CRONO_KERNEL_TRACE_CONFIG_WRITE:
+                memcpy(result, data, pRecord->size);
+                return crono_config_write(mock->device, (uint32_t)offset, data,
+                                          pRecord->size);
+        }
+        return -EINVAL;
+}
+
+CRONO_KERNEL_API uint32_t
+CRONO_KERNEL_TraceReplay(const char *path,
+                         CRONO_KERNEL_TRACE_STEP_CALLBACK callback,
+                         void *pContext,
+                         CRONO_KERNEL_TRACE_REPLAY_STATS *pStats) {
+        CRONO_KERNEL_TRACE_HEADER header;
+        CRONO_KERNEL_TRACE_RECORD record;
+        uint8_t config[PCI_CFG_SPACE_EXP_SIZE];
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> result;
+        CRONO_TRACE_MOCK mock;
+        uint64_t replay_value;
+        uint64_t begin_ns;
+        uint32_t replay_ns;
+        bool diverged;
+        bool truncated = false;
+        size_t bytes;
+        FILE *file;
+        int ret;
+
+        // Init variables and validate parameters
+        CRONO_RET_INV_PARAM_IF_NULL(path);
+        CRONO_RET_INV_PARAM_IF_NULL(pStats);
+        memset(pStats, 0, sizeof(*pStats));
+        pStats->firstDivergence = UINT64_MAX;
+
+        // Read the header, and create the mock device
+        file = fopen(path, "rbe");
+        if (NULL == file) {
+                ret = errno;
+                printf("Error opening trace file <%s>: <%d> <%s>\n", path, ret,
+                       strerror(ret));
+                return ret;
+        }
+        if (1 != fread(&header, sizeof(header), 1, file) ||
+            CRONO_KERNEL_TRACE_MAGIC != header.magic ||
+            CRONO_KERNEL_TRACE_VERSION != header.version ||
+            0 == header.deviceId || header.configSize > sizeof(config) ||
+            header.configSize != fread(config, 1, header.configSize, file)) {
+                fclose(file);
+                return -EINVAL;
+        }
+        ret = crono_trace_mock_open(&header, config, &mock);
+        if (CRONO_SUCCESS != ret) {
+                fclose(file);
+                return ret;
+        }
+
+        // Replay the records
+        while (sizeof(record) ==
+               (bytes = fread(&record, 1, sizeof(record), file))) {
+                // Data of the record
+                data.assign(std::max(record.size, (uint32_t)8), 0);
+                result.assign(data.size(), 0);
+                if (record.size > 8) {
+                        data.resize((record.size + 7) & ~7);
+                        if (1 != fread(data.data(), data.size(), 1, file)) {
+                                truncated = true;
+                                break;
+                        }
+                } else {
+                        memcpy(data.data(), &record.value, 8);
+                }
+                pStats->records++;
+                if (record.op < CRONO_KERNEL_TRACE_BAR_READ ||
+                    record.op > CRONO_KERNEL_TRACE_CONFIG_WRITE) {
+                        pStats->skipped++;
+                        continue;
+                }
+
+                // Access the mock device
+                if (CRONO_KERNEL_TRACE_BAR_READ == record.op ||
+                    CRONO_KERNEL_TRACE_CONFIG_READ == record.op) {
+                        crono_trace_mock_preload(&mock, &record, data.data());
+                }
+                begin_ns = crono_trace_now_ns();
+                ret = crono_trace_mock_access(&mock, &record, data.data(),
+                                              result.data());
+                replay_ns = (uint32_t)std::min(crono_trace_now_ns() - begin_ns,
+                                               (uint64_t)UINT32_MAX);
+
+                // Compare with the recorded access
+                diverged = ret != record.status ||
+                           (CRONO_SUCCESS == ret &&
+                            0 != memcmp(result.data(), data.data(),
+                                        record.size));
+                if (diverged) {
+                        if (0 == pStats->divergences) {
+                                pStats->firstDivergence = pStats->records - 1;
+                        }
+                        pStats->divergences++;
+                }
+                pStats->replayed++;
+                pStats->recordedNs += record.durationNs;
+                pStats->replayedNs += replay_ns;
+                if (NULL != callback) {
+                        replay_value = 0;
+                        memcpy(&replay_value, result.data(),
+                               std::min(record.size, (uint32_t)8));
+                        callback(pContext, pStats->records - 1, &record,
+                                 replay_value, ret, replay_ns);
+                }
+        }
+        ret = (truncated || 0 != bytes || ferror(file)) ? -EINVAL
+                                                        : CRONO_SUCCESS;
+
+        crono_trace_mock_close(&mock);
+        fclose(file);
+        return ret;
+}
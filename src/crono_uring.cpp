@@ -0,0 +1,326 @@
+#include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
+#include "crono_linux_kernel.h"
+#include "crono_userspace.h"
+#include <algorithm>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * Count of submission queue entries of the sysfs ring, each file takes two
+ * entries in the read round, so a batch is processed in chunks of half of it.
+ */
+#define CRONO_URING_ENTRIES 128
+#define CRONO_URING_CHUNK (CRONO_URING_ENTRIES / 2)
+
+/**
+ * Set in `user_data` of the close entries, to tell them from the reads.
+ */
+#define CRONO_URING_CLOSE_BIT (1ULL << 63)
+
+// __________
+// Ring setup
+//
+void crono_uring_free(CRONO_URING *ring) {
+        if (NULL != ring->sqes && MAP_FAILED != (void *)ring->sqes) {
+                munmap(ring->sqes, ring->sqes_len);
+        }
+        if (NULL != ring->cq_ptr && MAP_FAILED != ring->cq_ptr &&
+            ring->cq_ptr != ring->sq_ptr) {
+                munmap(ring->cq_ptr, ring->cq_len);
+        }
+        if (NULL != ring->sq_ptr && MAP_FAILED != ring->sq_ptr) {
+                munmap(ring->sq_ptr, ring->sq_len);
+        }
+        if (ring->fd >= 0) {
+                close(ring->fd);
+        }
+        memset(ring, 0, sizeof(CRONO_URING));
+        ring->fd = -1;
+}
+
+int crono_uring_init(CRONO_URING *ring, unsigned entries) {
+        struct io_uring_params params;
+        uint8_t *sq;
+        uint8_t *cq;
+
+        CRONO_RET_INV_PARAM_IF_NULL(ring);
+        memset(ring, 0, sizeof(CRONO_URING));
+        ring->pid = getpid();
+
+        memset(&params, 0, sizeof(params));
+        ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring->fd < 0) {
+                // ENOSYS, or EPERM if disabled by sysctl or seccomp
+                CRONO_DEBUG("io_uring is not available: <%d> <%s>\n", errno,
+                            strerror(errno));
+                ring->fd = -1;
+                return -ENOSYS;
+        }
+
+        ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(__u32);
+        ring->cq_len = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->sq_len = std::max(ring->sq_len, ring->cq_len);
+                ring->cq_len = ring->sq_len;
+        }
+        ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+        if (MAP_FAILED == ring->sq_ptr) {
+                crono_uring_free(ring);
+                return -ENOSYS;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ptr = ring->sq_ptr;
+        } else {
+                ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                                    IORING_OFF_CQ_RING);
+                if (MAP_FAILED == ring->cq_ptr) {
+                        crono_uring_free(ring);
+                        return -ENOSYS;
+                }
+        }
+        ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = (struct io_uring_sqe *)mmap(
+            NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (MAP_FAILED == (void *)ring->sqes) {
+                crono_uring_free(ring);
+                return -ENOSYS;
+        }
+
+        sq = (uint8_t *)ring->sq_ptr;
+        cq = (uint8_t *)ring->cq_ptr;
+        ring->entries = params.sq_entries;
+        ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+        ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+        ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+        ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        ring->tail = *ring->sq_tail;
+        ring->submitted = ring->tail;
+        return CRONO_SUCCESS;
+}
+
+// _________________________
+// Submission and completion
+//
+struct io_uring_sqe *crono_uring_get_sqe(CRONO_URING *ring) {
+        unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        unsigned index;
+        struct io_uring_sqe *sqe;
+
+        if (ring->tail - head >= ring->entries) {
+                return NULL;
+        }
+        index = ring->tail & ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        ring->sq_array[index] = index;
+        ring->tail++;
+        return sqe;
+}
+
+int crono_uring_submit(CRONO_URING *ring, unsigned wait_nr) {
+        unsigned to_submit;
+        int ret;
+
+        __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+        do {
+                to_submit = ring->tail - ring->submitted;
+                ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                                   wait_nr,
+                                   wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL,
+                                   0);
+                if (ret > 0) {
+                        ring->submitted += ret;
+                }
+        } while (ret < 0 && errno == EINTR);
+        return ret < 0 ? -errno : CRONO_SUCCESS;
+}
+
+unsigned crono_uring_reap(CRONO_URING *ring, struct io_uring_cqe *cqes,
+                          unsigned max) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+
+        for (; head != tail && count < max; head++, count++) {
+                cqes[count] = ring->cqes[head & ring->cq_mask];
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        return count;
+}
+
+// ________________
+// Batch file reads
+//
+/**
+ * Process-wide ring of sysfs batches, guarded by `uring_mutex`. `uring_state`
+ * is 0 if not set up yet, 1 if ready, or -1 if io_uring is not available.
+ */
+static std::mutex uring_mutex;
+static CRONO_URING uring;
+static int uring_state = 0;
+
+/**
+ * Sets the ring up if not done yet. `uring_mutex` must be held.
+ */
+static int crono_uring_setup() {
+        if (uring_state != 0 && uring.pid == getpid()) {
+                return uring_state > 0 ? CRONO_SUCCESS : -ENOSYS;
+        }
+        // If forked, the parent ring is shared, so leave it mapped and set a
+        // new one up
+        uring_state = -1;
+        if (CRONO_SUCCESS != crono_uring_init(&uring, CRONO_URING_ENTRIES)) {
+                uring.pid = getpid();
+                return -ENOSYS;
+        }
+        uring_state = 1;
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Submits the queued entries, and waits for `count` completions, calling
+ * `on_cqe` for each.
+ */
+template <typename F>
+static int crono_uring_wait_all(unsigned count, F on_cqe) {
+        struct io_uring_cqe cqes[CRONO_URING_ENTRIES];
+        unsigned completed = 0;
+        unsigned reaped;
+        int ret;
+
+        while (completed < count) {
+                ret = crono_uring_submit(&uring, count - completed);
+                if (CRONO_SUCCESS != ret) {
+                        return ret;
+                }
+                reaped = crono_uring_reap(&uring, cqes, CRONO_URING_ENTRIES);
+                for (unsigned icqe = 0; icqe < reaped; icqe++) {
+                        on_cqe(&cqes[icqe]);
+                }
+                completed += reaped;
+        }
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Processes up to `CRONO_URING_CHUNK` reads. `uring_mutex` must be held.
+ */
+static int crono_uring_read_chunk(CRONO_URING_READ *reads, size_t count) {
+        int fds[CRONO_URING_CHUNK];
+        unsigned opened = 0;
+        bool unsupported = false;
+        int ret;
+
+        // __________
+        // Open round
+        //
+        for (size_t iread = 0; iread < count; iread++) {
+                struct io_uring_sqe *sqe = crono_uring_get_sqe(&uring);
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uint64_t)(uintptr_t)reads[iread].path;
+                sqe->open_flags = O_RDONLY | O_CLOEXEC;
+                sqe->user_data = iread;
+                fds[iread] = -1;
+        }
+        ret = crono_uring_wait_all(count, [&](const struct io_uring_cqe *cqe) {
+                if (cqe->res >= 0) {
+                        fds[cqe->user_data] = cqe->res;
+                        opened++;
+                } else {
+                        reads[cqe->user_data].result = cqe->res;
+                        // Kernels before 5.6 don't know the opcode
+                        unsupported |= (cqe->res == -EINVAL);
+                }
+        });
+        if (CRONO_SUCCESS != ret || unsupported) {
+                for (size_t iread = 0; iread < count; iread++) {
+                        if (fds[iread] >= 0) {
+                                close(fds[iread]);
+                        }
+                }
+                return -ENOSYS;
+        }
+
+        // ____________________
+        // Read and close round
+        //
+        for (size_t iread = 0; iread < count; iread++) {
+                if (fds[iread] < 0) {
+                        continue;
+                }
+                struct io_uring_sqe *sqe = crono_uring_get_sqe(&uring);
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = fds[iread];
+                sqe->addr = (uint64_t)(uintptr_t)reads[iread].data;
+                sqe->len = (uint32_t)reads[iread].size;
+                sqe->off = reads[iread].offset;
+                // Close even if the read fails
+                sqe->flags = IOSQE_IO_HARDLINK;
+                sqe->user_data = iread;
+
+                sqe = crono_uring_get_sqe(&uring);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = fds[iread];
+                sqe->user_data = iread | CRONO_URING_CLOSE_BIT;
+        }
+        ret = crono_uring_wait_all(
+            opened * 2, [&](const struct io_uring_cqe *cqe) {
+                    size_t iread = cqe->user_data & ~CRONO_URING_CLOSE_BIT;
+                    if (0 == (cqe->user_data & CRONO_URING_CLOSE_BIT)) {
+                            reads[iread].result = cqe->res;
+                    } else if (cqe->res >= 0) {
+                            fds[iread] = -1;
+                    }
+            });
+        for (size_t iread = 0; iread < count; iread++) {
+                if (fds[iread] >= 0) {
+                        close(fds[iread]);
+                }
+        }
+        return CRONO_SUCCESS == ret ? CRONO_SUCCESS : -ENOSYS;
+}
+
+int crono_uring_read_files(CRONO_URING_READ *reads, size_t count) {
+        size_t done = 0;
+        int ret;
+
+        CRONO_RET_INV_PARAM_IF_NULL(reads);
+        for (size_t iread = 0; iread < count; iread++) {
+                if (reads[iread].size > UINT32_MAX) {
+                        return -EINVAL;
+                }
+        }
+
+        std::lock_guard<std::mutex> lock(uring_mutex);
+        ret = crono_uring_setup();
+        if (CRONO_SUCCESS != ret) {
+                return ret;
+        }
+        while (done < count) {
+                size_t chunk = std::min<size_t>(count - done, CRONO_URING_CHUNK);
+                ret = crono_uring_read_chunk(reads + done, chunk);
+                if (CRONO_SUCCESS != ret) {
+                        // Don't try again, all callers fall back to
+                        // synchronous calls from now on
+                        crono_uring_free(&uring);
+                        uring.pid = getpid();
+                        uring_state = -1;
+                        return -ENOSYS;
+                }
+                done += chunk;
+        }
+        return CRONO_SUCCESS;
+}
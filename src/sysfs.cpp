@@ -1,6 +1,14 @@
 #include "crono_kernel_interface.h"
+#include "crono_kernel_private.h"
 #include "crono_linux_kernel.h"
 #include "crono_userspace.h"
+#include <vector>
+
+/**
+ * Minimum count of reads worth an io_uring batch, fewer are faster read
+ * synchronously.
+ */
+#define CRONO_CONFIG_BATCH_URING_MIN 16
 
 int crono_read_config(unsigned domain, unsigned bus, unsigned dev,
                       unsigned func, void *data, pciaddr_t offset,
@@ -92,6 +100,55 @@ int crono_read_vendor_device(unsigned domain, unsigned bus, unsigned dev,
         return err;
 }
 
+int crono_read_config_batch(CRONO_CONFIG_READ *reads, size_t count) {
+        char config_file_path[PATH_MAX];
+        std::vector<std::string> paths;
+        std::vector<CRONO_URING_READ> uring_reads;
+        bool uring_done = false;
+
+        CRONO_RET_INV_PARAM_IF_NULL(reads);
+
+        if (count >= CRONO_CONFIG_BATCH_URING_MIN) {
+                paths.reserve(count);
+                uring_reads.resize(count);
+                for (size_t iread = 0; iread < count; iread++) {
+                        CRONO_CONSTRUCT_CONFIG_FILE_PATH(
+                            config_file_path, reads[iread].domain,
+                            reads[iread].bus, reads[iread].dev,
+                            reads[iread].func);
+                        paths.push_back(config_file_path);
+                        uring_reads[iread].path = paths[iread].c_str();
+                        uring_reads[iread].data = reads[iread].data;
+                        uring_reads[iread].offset = reads[iread].offset;
+                        uring_reads[iread].size = reads[iread].size;
+                        uring_reads[iread].result = 0;
+                }
+                uring_done = (CRONO_SUCCESS ==
+                              crono_uring_read_files(uring_reads.data(), count));
+        }
+
+        for (size_t iread = 0; iread < count; iread++) {
+                CRONO_CONFIG_READ *read = &reads[iread];
+                if (uring_done && uring_reads[iread].result < 0) {
+                        read->bytes_read = 0;
+                        read->err = (int)-uring_reads[iread].result;
+                        continue;
+                }
+                if (uring_done &&
+                    (pciaddr_t)uring_reads[iread].result == read->size) {
+                        read->bytes_read = read->size;
+                        read->err = CRONO_SUCCESS;
+                        continue;
+                }
+                // io_uring is not available, or a short read that the
+                // synchronous path retries until the end of the file
+                read->err = crono_read_config(
+                    read->domain, read->bus, read->dev, read->func, read->data,
+                    read->offset, read->size, &read->bytes_read);
+        }
+        return CRONO_SUCCESS;
+}
+
 int crono_get_config_space_size(unsigned domain, unsigned bus, unsigned dev,
                                 unsigned func, pciaddr_t *pSize) {
         struct stat st;
@@ -191,3 +248,103 @@ int crono_get_sys_devices_directory_path(unsigned domain, unsigned bus,
 
         return CRONO_SUCCESS;
 }
+
+int crono_get_upstream_port(unsigned domain, unsigned bus, unsigned dev,
+                            unsigned func, CRONO_KERNEL_PCI_SLOT *pUpstream) {
+        char sys_dev_dir_path[PATH_MAX];
+        char *parent_name;
+        char *sep;
+        int err;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pUpstream);
+        err = crono_get_sys_devices_directory_path(domain, bus, dev, func,
+                                                   sys_dev_dir_path);
+        if (CRONO_SUCCESS != err) {
+                return err;
+        }
+
+        // Remove the device directory, the parent is the upstream port, or
+        // the host bridge, e.g. `pci0000:00`
+        sep = strrchr(sys_dev_dir_path, '/');
+        if (NULL == sep) {
+                return -ENOENT;
+        }
+        *sep = '\0';
+        sep = strrchr(sys_dev_dir_path, '/');
+        parent_name = (NULL == sep) ? sys_dev_dir_path : sep + 1;
+        if (4 != sscanf(parent_name, "%x:%x:%x.%x", &pUpstream->dwDomain,
+                        &pUpstream->dwBus, &pUpstream->dwSlot,
+                        &pUpstream->dwFunction)) {
+                return -ENOENT;
+        }
+        return CRONO_SUCCESS;
+}
+
+int crono_read_sys_device_attr(unsigned domain, unsigned bus, unsigned dev,
+                               unsigned func, const char *attr_name,
+                               char *pValue, size_t value_size) {
+        char sys_dev_dir_path[PATH_MAX];
+        std::string attr_path;
+        int fd;
+        ssize_t bytes;
+        int err;
+
+        CRONO_RET_INV_PARAM_IF_NULL(attr_name);
+        CRONO_RET_INV_PARAM_IF_NULL(pValue);
+        if (0 == value_size) {
+                return -EINVAL;
+        }
+
+        err = crono_get_sys_devices_directory_path(domain, bus, dev, func,
+                                                   sys_dev_dir_path);
+        if (CRONO_SUCCESS != err) {
+                return err;
+        }
+        attr_path = std::string(sys_dev_dir_path) + "/" + attr_name;
+
+        fd = open(attr_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+                CRONO_DEBUG("Error opening attribute file <%s>\n",
+                            attr_path.c_str());
+                return errno;
+        }
+        bytes = read(fd, pValue, value_size - 1);
+        err = (bytes < 0) ? errno : CRONO_SUCCESS;
+        close(fd);
+        if (bytes < 0) {
+                pValue[0] = '\0';
+                return err;
+        }
+
+        // Terminate and drop the trailing new line
+        pValue[bytes] = '\0';
+        while (bytes > 0 &&
+               (pValue[bytes - 1] == '\n' || pValue[bytes - 1] == ' ')) {
+                pValue[--bytes] = '\0';
+        }
+        return CRONO_SUCCESS;
+}
+
+int crono_get_device_numa_node(unsigned domain, unsigned bus, unsigned dev,
+                               unsigned func, int *pNode) {
+        char value[32];
+        int err;
+
+        CRONO_RET_INV_PARAM_IF_NULL(pNode);
+        *pNode = -1;
+
+        err = crono_read_sys_device_attr(domain, bus, dev, func, "numa_node",
+                                         value, sizeof(value));
+        if (CRONO_SUCCESS != err) {
+                return err;
+        }
+        *pNode = (int)strtol(value, NULL, 10);
+        return CRONO_SUCCESS;
+}
+
+int crono_get_device_local_cpulist(unsigned domain, unsigned bus, unsigned dev,
+                                   unsigned func, char *pList,
+                                   size_t list_size) {
+        return crono_read_sys_device_attr(domain, bus, dev, func,
+                                          "local_cpulist", pList, list_size);
+}